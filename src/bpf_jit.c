@@ -0,0 +1,868 @@
+/*
+ *   This file is part of ubridge, a program to bridge network interfaces
+ *   to UDP tunnels.
+ *
+ *   Copyright (C) 2026 GNS3 Technologies Inc.
+ *
+ *   ubridge is free software: you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ubridge is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Translation of the classic BPF programs compiled by libpcap to native
+ * code, with the same semantics as pcap_offline_filter(): loads past the
+ * end of the packet and divisions by a zero X make the program return 0.
+ * Programs the translator doesn't handle keep using the interpreter.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "ubridge.h"
+#include "bpf_jit.h"
+
+#ifdef BPF_JIT_SUPPORTED
+
+/* Not defined by older libpcap versions */
+#ifndef BPF_MOD
+#define BPF_MOD   0x90
+#endif
+#ifndef BPF_XOR
+#define BPF_XOR   0xa0
+#endif
+
+#define JIT_RET0  -1          /* branch to the code returning 0 */
+
+struct jit_fixup {
+   size_t pos;                /* position of the branch to patch */
+   int target;                /* BPF instruction or JIT_RET0 */
+   int cond;                  /* conditional branch (aarch64) */
+};
+
+struct jit_state {
+   u_char *code;
+   size_t len;
+   size_t *addrs;             /* native address of each BPF instruction */
+   struct jit_fixup *fixups;
+   int nr_fixups;
+   int uses_mem;
+};
+
+static inline void emit_bytes(struct jit_state *s, const u_char *bytes, size_t len)
+{
+   memcpy(s->code + s->len, bytes, len);
+   s->len += len;
+}
+
+static inline void emit_u32(struct jit_state *s, u_int value)
+{
+   memcpy(s->code + s->len, &value, 4);
+   s->len += 4;
+}
+
+/* Check the program can be translated, the instructions are validated the way bpf_validate() does */
+static int jit_check_program(const struct bpf_insn *insns, u_int len, int *uses_mem)
+{
+   const struct bpf_insn *insn;
+   u_int i;
+
+   *uses_mem = FALSE;
+   if (len == 0)
+      return (-1);
+
+   for (i = 0; i < len; i++) {
+      insn = &insns[i];
+      switch (BPF_CLASS(insn->code)) {
+         case BPF_LD:
+         case BPF_LDX:
+            switch (BPF_MODE(insn->code)) {
+               case BPF_ABS:
+               case BPF_IND:
+                  if (BPF_CLASS(insn->code) == BPF_LDX || (BPF_SIZE(insn->code) != BPF_W && BPF_SIZE(insn->code) != BPF_H && BPF_SIZE(insn->code) != BPF_B))
+                     return (-1);
+                  break;
+               case BPF_MSH:
+                  if (insn->code != (BPF_LDX|BPF_MSH|BPF_B))
+                     return (-1);
+                  break;
+               case BPF_IMM:
+               case BPF_LEN:
+                  break;
+               case BPF_MEM:
+                  if (insn->k >= BPF_MEMWORDS)
+                     return (-1);
+                  *uses_mem = TRUE;
+                  break;
+               default:
+                  return (-1);
+            }
+            break;
+         case BPF_ST:
+         case BPF_STX:
+            if (insn->k >= BPF_MEMWORDS)
+               return (-1);
+            *uses_mem = TRUE;
+            break;
+         case BPF_ALU:
+            switch (BPF_OP(insn->code)) {
+               case BPF_ADD: case BPF_SUB: case BPF_MUL: case BPF_OR:
+               case BPF_AND: case BPF_XOR: case BPF_NEG:
+                  break;
+               case BPF_DIV:
+               case BPF_MOD:
+                  if (BPF_SRC(insn->code) == BPF_K && insn->k == 0)
+                     return (-1);
+                  break;
+               case BPF_LSH:
+               case BPF_RSH:
+                  if (BPF_SRC(insn->code) == BPF_K && insn->k >= 32)
+                     return (-1);
+                  break;
+               default:
+                  return (-1);
+            }
+            break;
+         case BPF_JMP:
+            /* jumps only go forward and must stay in the program */
+            if (BPF_OP(insn->code) == BPF_JA) {
+               if (insn->k >= len - i - 1)
+                  return (-1);
+            }
+            else if (BPF_OP(insn->code) == BPF_JEQ || BPF_OP(insn->code) == BPF_JGT ||
+                     BPF_OP(insn->code) == BPF_JGE || BPF_OP(insn->code) == BPF_JSET) {
+               if (insn->jt >= len - i - 1 || insn->jf >= len - i - 1)
+                  return (-1);
+            }
+            else
+               return (-1);
+            break;
+         case BPF_RET:
+            if (BPF_RVAL(insn->code) != BPF_K && BPF_RVAL(insn->code) != BPF_A)
+               return (-1);
+            break;
+         case BPF_MISC:
+            if (BPF_MISCOP(insn->code) != BPF_TAX && BPF_MISCOP(insn->code) != BPF_TXA)
+               return (-1);
+            break;
+      }
+   }
+
+   /* the last instruction can't fall through */
+   if (BPF_CLASS(insns[len - 1].code) != BPF_RET)
+      return (-1);
+   return (0);
+}
+
+static inline u_int load_size(u_short code)
+{
+   return (BPF_SIZE(code) == BPF_W ? 4 : BPF_SIZE(code) == BPF_H ? 2 : 1);
+}
+
+#if defined(__x86_64__)
+
+/*
+ * x86-64: the packet is in rdi and its length in esi, A is eax and X is
+ * ecx so it can be used as a shift count. The scratch memory lives in
+ * the red zone below rsp, edx and r8 to r9 are temporaries.
+ */
+
+#define X86_MEM(k)  ((u_char)(-64 + 4 * (k)))
+
+/* jcc rel32 or jmp rel32 (cc = 0), the target is patched later */
+static void x86_branch(struct jit_state *s, u_char cc, int target)
+{
+   if (cc) {
+      u_char op[] = { 0x0f, cc };
+      emit_bytes(s, op, 2);
+   }
+   else {
+      u_char op[] = { 0xe9 };
+      emit_bytes(s, op, 1);
+   }
+   s->fixups[s->nr_fixups].pos = s->len;
+   s->fixups[s->nr_fixups].target = target;
+   s->nr_fixups++;
+   emit_u32(s, 0);
+}
+
+#define X86_JB   0x82
+#define X86_JAE  0x83
+#define X86_JE   0x84
+#define X86_JNE  0x85
+#define X86_JA   0x87
+
+/* op imm32 */
+static void x86_op_imm(struct jit_state *s, u_char op, u_int imm)
+{
+   emit_bytes(s, &op, 1);
+   emit_u32(s, imm);
+}
+
+/* Return 0 if the packet is shorter than k + size, -1 if the load can never be done */
+static int x86_check_abs(struct jit_state *s, u_int k, u_int size)
+{
+   u_char cmp[] = { 0x81, 0xfe };           /* cmp esi, imm32 */
+
+   if (k > 0x7fffffff - size) {
+      x86_branch(s, 0, JIT_RET0);
+      return (-1);
+   }
+   emit_bytes(s, cmp, 2);
+   emit_u32(s, k + size);
+   x86_branch(s, X86_JB, JIT_RET0);
+   return (0);
+}
+
+static int x86_emit_insn(struct jit_state *s, const struct bpf_insn *insn, int pc)
+{
+   u_int k = insn->k, size;
+   int jt, jf;
+
+   switch (insn->code) {
+      case BPF_LD|BPF_W|BPF_ABS:
+      case BPF_LD|BPF_H|BPF_ABS:
+      case BPF_LD|BPF_B|BPF_ABS:
+         size = load_size(insn->code);
+         if (x86_check_abs(s, k, size) == -1)
+            break;
+         if (size == 4) {
+            u_char op[] = { 0x8b, 0x87 };                    /* mov eax, [rdi + disp32] */
+            u_char swap[] = { 0x0f, 0xc8 };                  /* bswap eax */
+            emit_bytes(s, op, 2); emit_u32(s, k); emit_bytes(s, swap, 2);
+         }
+         else if (size == 2) {
+            u_char op[] = { 0x0f, 0xb7, 0x87 };              /* movzx eax, word [rdi + disp32] */
+            u_char swap[] = { 0x66, 0xc1, 0xc0, 0x08 };      /* rol ax, 8 */
+            emit_bytes(s, op, 3); emit_u32(s, k); emit_bytes(s, swap, 4);
+         }
+         else {
+            u_char op[] = { 0x0f, 0xb6, 0x87 };              /* movzx eax, byte [rdi + disp32] */
+            emit_bytes(s, op, 3); emit_u32(s, k);
+         }
+         break;
+
+      case BPF_LD|BPF_W|BPF_IND:
+      case BPF_LD|BPF_H|BPF_IND:
+      case BPF_LD|BPF_B|BPF_IND: {
+         /* X + k + size <= len, computed on 64 bits so it can't wrap */
+         u_char idx[] = { 0x89, 0xca, 0x41, 0xb8 };           /* mov edx, ecx; mov r8d, imm32 */
+         u_char end[] = { 0x4c, 0x01, 0xc2,                   /* add rdx, r8 */
+                          0x4c, 0x8d, 0x4a, 0x00,             /* lea r9, [rdx + size] */
+                          0x49, 0x39, 0xf1 };                 /* cmp r9, rsi */
+         size = load_size(insn->code);
+         end[6] = size;
+         emit_bytes(s, idx, 4); emit_u32(s, k);
+         emit_bytes(s, end, sizeof(end));
+         x86_branch(s, X86_JA, JIT_RET0);
+         if (size == 4) {
+            u_char op[] = { 0x8b, 0x04, 0x17, 0x0f, 0xc8 };   /* mov eax, [rdi + rdx]; bswap eax */
+            emit_bytes(s, op, sizeof(op));
+         }
+         else if (size == 2) {
+            u_char op[] = { 0x0f, 0xb7, 0x04, 0x17, 0x66, 0xc1, 0xc0, 0x08 };
+            emit_bytes(s, op, sizeof(op));
+         }
+         else {
+            u_char op[] = { 0x0f, 0xb6, 0x04, 0x17 };
+            emit_bytes(s, op, sizeof(op));
+         }
+         break;
+      }
+
+      case BPF_LDX|BPF_MSH|BPF_B: {
+         u_char op[] = { 0x0f, 0xb6, 0x8f };                  /* movzx ecx, byte [rdi + disp32] */
+         u_char msh[] = { 0x83, 0xe1, 0x0f, 0xc1, 0xe1, 0x02 }; /* and ecx, 0xf; shl ecx, 2 */
+         if (x86_check_abs(s, k, 1) == -1)
+            break;
+         emit_bytes(s, op, 3); emit_u32(s, k);
+         emit_bytes(s, msh, sizeof(msh));
+         break;
+      }
+
+      case BPF_LD|BPF_W|BPF_LEN: {
+         u_char op[] = { 0x89, 0xf0 };                        /* mov eax, esi */
+         emit_bytes(s, op, 2);
+         break;
+      }
+      case BPF_LDX|BPF_W|BPF_LEN: {
+         u_char op[] = { 0x89, 0xf1 };                        /* mov ecx, esi */
+         emit_bytes(s, op, 2);
+         break;
+      }
+      case BPF_LD|BPF_IMM:
+         x86_op_imm(s, 0xb8, k);                              /* mov eax, imm32 */
+         break;
+      case BPF_LDX|BPF_IMM:
+         x86_op_imm(s, 0xb9, k);                              /* mov ecx, imm32 */
+         break;
+      case BPF_LD|BPF_MEM: {
+         u_char op[] = { 0x8b, 0x44, 0x24, X86_MEM(k) };      /* mov eax, [rsp + disp8] */
+         emit_bytes(s, op, 4);
+         break;
+      }
+      case BPF_LDX|BPF_MEM: {
+         u_char op[] = { 0x8b, 0x4c, 0x24, X86_MEM(k) };      /* mov ecx, [rsp + disp8] */
+         emit_bytes(s, op, 4);
+         break;
+      }
+      case BPF_ST: {
+         u_char op[] = { 0x89, 0x44, 0x24, X86_MEM(k) };      /* mov [rsp + disp8], eax */
+         emit_bytes(s, op, 4);
+         break;
+      }
+      case BPF_STX: {
+         u_char op[] = { 0x89, 0x4c, 0x24, X86_MEM(k) };      /* mov [rsp + disp8], ecx */
+         emit_bytes(s, op, 4);
+         break;
+      }
+
+      case BPF_ALU|BPF_ADD|BPF_K: x86_op_imm(s, 0x05, k); break;
+      case BPF_ALU|BPF_SUB|BPF_K: x86_op_imm(s, 0x2d, k); break;
+      case BPF_ALU|BPF_AND|BPF_K: x86_op_imm(s, 0x25, k); break;
+      case BPF_ALU|BPF_OR|BPF_K:  x86_op_imm(s, 0x0d, k); break;
+      case BPF_ALU|BPF_XOR|BPF_K: x86_op_imm(s, 0x35, k); break;
+      case BPF_ALU|BPF_MUL|BPF_K: {
+         u_char op[] = { 0x69, 0xc0 };                        /* imul eax, eax, imm32 */
+         emit_bytes(s, op, 2); emit_u32(s, k);
+         break;
+      }
+      case BPF_ALU|BPF_DIV|BPF_K:
+      case BPF_ALU|BPF_MOD|BPF_K: {
+         u_char op[] = { 0x31, 0xd2, 0x41, 0xb8 };            /* xor edx, edx; mov r8d, imm32 */
+         u_char div[] = { 0x41, 0xf7, 0xf0 };                 /* div r8d */
+         u_char mod[] = { 0x89, 0xd0 };                       /* mov eax, edx */
+         emit_bytes(s, op, 4); emit_u32(s, k);
+         emit_bytes(s, div, 3);
+         if (BPF_OP(insn->code) == BPF_MOD)
+            emit_bytes(s, mod, 2);
+         break;
+      }
+      case BPF_ALU|BPF_LSH|BPF_K: {
+         u_char op[] = { 0xc1, 0xe0, k };                     /* shl eax, imm8 */
+         emit_bytes(s, op, 3);
+         break;
+      }
+      case BPF_ALU|BPF_RSH|BPF_K: {
+         u_char op[] = { 0xc1, 0xe8, k };                     /* shr eax, imm8 */
+         emit_bytes(s, op, 3);
+         break;
+      }
+
+      case BPF_ALU|BPF_ADD|BPF_X: { u_char op[] = { 0x01, 0xc8 }; emit_bytes(s, op, 2); break; }
+      case BPF_ALU|BPF_SUB|BPF_X: { u_char op[] = { 0x29, 0xc8 }; emit_bytes(s, op, 2); break; }
+      case BPF_ALU|BPF_AND|BPF_X: { u_char op[] = { 0x21, 0xc8 }; emit_bytes(s, op, 2); break; }
+      case BPF_ALU|BPF_OR|BPF_X:  { u_char op[] = { 0x09, 0xc8 }; emit_bytes(s, op, 2); break; }
+      case BPF_ALU|BPF_XOR|BPF_X: { u_char op[] = { 0x31, 0xc8 }; emit_bytes(s, op, 2); break; }
+      case BPF_ALU|BPF_MUL|BPF_X: { u_char op[] = { 0x0f, 0xaf, 0xc1 }; emit_bytes(s, op, 3); break; }
+      case BPF_ALU|BPF_DIV|BPF_X:
+      case BPF_ALU|BPF_MOD|BPF_X: {
+         u_char test[] = { 0x85, 0xc9 };                      /* test ecx, ecx */
+         u_char div[] = { 0x31, 0xd2, 0xf7, 0xf1 };           /* xor edx, edx; div ecx */
+         u_char mod[] = { 0x89, 0xd0 };                       /* mov eax, edx */
+         emit_bytes(s, test, 2);
+         x86_branch(s, X86_JE, JIT_RET0);
+         emit_bytes(s, div, 4);
+         if (BPF_OP(insn->code) == BPF_MOD)
+            emit_bytes(s, mod, 2);
+         break;
+      }
+      case BPF_ALU|BPF_LSH|BPF_X:
+      case BPF_ALU|BPF_RSH|BPF_X: {
+         /* shifts by 32 or more give 0, x86 would mask the count */
+         u_char op[] = { 0x31, 0xd2,                          /* xor edx, edx */
+                         0x83, 0xf9, 0x20,                    /* cmp ecx, 32 */
+                         0x0f, 0x43, 0xc2,                    /* cmovae eax, edx */
+                         0xd3, 0xe0 };                        /* shl eax, cl */
+         if (BPF_OP(insn->code) == BPF_RSH)
+            op[9] = 0xe8;                                     /* shr eax, cl */
+         emit_bytes(s, op, sizeof(op));
+         break;
+      }
+      case BPF_ALU|BPF_NEG: {
+         u_char op[] = { 0xf7, 0xd8 };                        /* neg eax */
+         emit_bytes(s, op, 2);
+         break;
+      }
+
+      case BPF_MISC|BPF_TAX: { u_char op[] = { 0x89, 0xc1 }; emit_bytes(s, op, 2); break; }
+      case BPF_MISC|BPF_TXA: { u_char op[] = { 0x89, 0xc8 }; emit_bytes(s, op, 2); break; }
+
+      case BPF_RET|BPF_K: {
+         u_char ret[] = { 0xc3 };
+         x86_op_imm(s, 0xb8, k);
+         emit_bytes(s, ret, 1);
+         break;
+      }
+      case BPF_RET|BPF_A: {
+         u_char ret[] = { 0xc3 };
+         emit_bytes(s, ret, 1);
+         break;
+      }
+
+      case BPF_JMP|BPF_JA:
+         x86_branch(s, 0, pc + 1 + k);
+         break;
+
+      case BPF_JMP|BPF_JEQ|BPF_K:
+      case BPF_JMP|BPF_JGT|BPF_K:
+      case BPF_JMP|BPF_JGE|BPF_K:
+      case BPF_JMP|BPF_JSET|BPF_K:
+      case BPF_JMP|BPF_JEQ|BPF_X:
+      case BPF_JMP|BPF_JGT|BPF_X:
+      case BPF_JMP|BPF_JGE|BPF_X:
+      case BPF_JMP|BPF_JSET|BPF_X: {
+         u_char cc, ncc;
+
+         if (BPF_SRC(insn->code) == BPF_K)
+            x86_op_imm(s, BPF_OP(insn->code) == BPF_JSET ? 0xa9 : 0x3d, k);    /* test/cmp eax, imm32 */
+         else {
+            u_char op[] = { BPF_OP(insn->code) == BPF_JSET ? 0x85 : 0x39, 0xc8 }; /* test/cmp eax, ecx */
+            emit_bytes(s, op, 2);
+         }
+         switch (BPF_OP(insn->code)) {
+            case BPF_JEQ: cc = X86_JE; ncc = X86_JNE; break;
+            case BPF_JGT: cc = X86_JA; ncc = 0x86; break;     /* jbe */
+            case BPF_JGE: cc = X86_JAE; ncc = X86_JB; break;
+            default:      cc = X86_JNE; ncc = X86_JE; break;
+         }
+         jt = pc + 1 + insn->jt;
+         jf = pc + 1 + insn->jf;
+         if (insn->jt == 0)
+            x86_branch(s, ncc, jf);
+         else {
+            x86_branch(s, cc, jt);
+            if (insn->jf != 0)
+               x86_branch(s, 0, jf);
+         }
+         break;
+      }
+
+      default:
+         return (-1);
+   }
+   return (0);
+}
+
+static int jit_emit(struct jit_state *s, const struct bpf_insn *insns, u_int len)
+{
+   u_char prologue[] = { 0x89, 0xf6,                          /* mov esi, esi */
+                         0x31, 0xc0,                          /* xor eax, eax */
+                         0x31, 0xc9 };                        /* xor ecx, ecx */
+   u_char ret0[] = { 0x31, 0xc0, 0xc3 };                      /* xor eax, eax; ret */
+   size_t ret0_addr, target;
+   u_int i;
+   int n;
+
+   emit_bytes(s, prologue, sizeof(prologue));
+   if (s->uses_mem) {
+      u_char zero[] = { 0x31, 0xd2 };                         /* xor edx, edx */
+      emit_bytes(s, zero, 2);
+      for (i = 0; i < BPF_MEMWORDS / 2; i++) {
+         u_char op[] = { 0x48, 0x89, 0x54, 0x24, X86_MEM(2 * i) };  /* mov [rsp + disp8], rdx */
+         emit_bytes(s, op, 5);
+      }
+   }
+
+   for (i = 0; i < len; i++) {
+      s->addrs[i] = s->len;
+      if (x86_emit_insn(s, &insns[i], i) == -1)
+         return (-1);
+   }
+   ret0_addr = s->len;
+   emit_bytes(s, ret0, sizeof(ret0));
+
+   for (n = 0; n < s->nr_fixups; n++) {
+      int rel;
+
+      target = s->fixups[n].target == JIT_RET0 ? ret0_addr : s->addrs[s->fixups[n].target];
+      rel = (int)(target - (s->fixups[n].pos + 4));
+      memcpy(s->code + s->fixups[n].pos, &rel, 4);
+   }
+   return (0);
+}
+
+#elif defined(__aarch64__)
+
+/*
+ * aarch64: the packet is in x0 and its length in w1, A is w2 and X is w3,
+ * w4 to w6 are temporaries. The scratch memory is allocated on the stack
+ * when the program uses it.
+ */
+
+#define A64_A    2
+#define A64_X    3
+#define A64_T0   4
+#define A64_T1   5
+#define A64_T2   6
+#define A64_ZR   31
+#define A64_SP   31
+
+#define A64_EQ   0x0
+#define A64_NE   0x1
+#define A64_HS   0x2
+#define A64_LO   0x3
+#define A64_HI   0x8
+#define A64_LS   0x9
+#define A64_B    0x10             /* unconditional branch */
+#define A64_CBZ  0x11
+
+#define A64_MOV_W(d, m)        (0x2a0003e0 | (m) << 16 | (d))
+#define A64_ALU_W(op, d, n, m) ((op) | (m) << 16 | (n) << 5 | (d))
+#define A64_ADD_W              0x0b000000
+#define A64_SUB_W              0x4b000000
+#define A64_AND_W              0x0a000000
+#define A64_ORR_W              0x2a000000
+#define A64_EOR_W              0x4a000000
+#define A64_UDIV_W             0x1ac00800
+#define A64_LSLV_W             0x1ac02000
+#define A64_LSRV_W             0x1ac02400
+#define A64_MUL_W(d, n, m)     (0x1b007c00 | (m) << 16 | (n) << 5 | (d))
+#define A64_MSUB_W(d, n, m, a) (0x1b008000 | (m) << 16 | (a) << 10 | (n) << 5 | (d))
+#define A64_CMP_W(n, m)        (0x6b00001f | (m) << 16 | (n) << 5)
+#define A64_TST_W(n, m)        (0x6a00001f | (m) << 16 | (n) << 5)
+#define A64_CMP_X(n, m)        (0xeb00001f | (m) << 16 | (n) << 5)
+#define A64_CMP_IMM_W(n, imm)  (0x7100001f | (imm) << 10 | (n) << 5)
+#define A64_CSEL_W(d, n, m, c) (0x1a800000 | (m) << 16 | (c) << 12 | (n) << 5 | (d))
+#define A64_ADD_UXTW(d, n, m)  (0x8b204000 | (m) << 16 | (n) << 5 | (d))
+#define A64_ADD_IMM_X(d, n, i) (0x91000000 | (i) << 10 | (n) << 5 | (d))
+#define A64_LDR_W(t, n, m)     (0xb8606800 | (m) << 16 | (n) << 5 | (t))
+#define A64_LDRH_W(t, n, m)    (0x78606800 | (m) << 16 | (n) << 5 | (t))
+#define A64_LDRB_W(t, n, m)    (0x38606800 | (m) << 16 | (n) << 5 | (t))
+#define A64_LDR_SP(t, off)     (0xb94003e0 | ((off) / 4) << 10 | (t))
+#define A64_STR_SP(t, off)     (0xb90003e0 | ((off) / 4) << 10 | (t))
+#define A64_STP_ZR_SP(off)     (0xa9007fff | ((off) / 8) << 15)
+#define A64_REV_W(d, n)        (0x5ac00800 | (n) << 5 | (d))
+#define A64_REV16_W(d, n)      (0x5ac00400 | (n) << 5 | (d))
+#define A64_UBFM_W(d, n, r, s) (0x53000000 | (r) << 16 | (s) << 10 | (n) << 5 | (d))
+#define A64_SUB_SP_64          0xd10103ff
+#define A64_ADD_SP_64          0x910103ff
+#define A64_RET                0xd65f03c0
+
+static void a64_mov_imm(struct jit_state *s, int reg, u_int imm)
+{
+   emit_u32(s, 0x52800000 | (imm & 0xffff) << 5 | reg);                 /* movz wd, #lo */
+   if (imm >> 16)
+      emit_u32(s, 0x72a00000 | (imm >> 16) << 5 | reg);                 /* movk wd, #hi, lsl #16 */
+}
+
+/* b, b.cond or cbz w<reg>, the target is patched later */
+static void a64_branch(struct jit_state *s, int cond, int reg, int target)
+{
+   s->fixups[s->nr_fixups].pos = s->len;
+   s->fixups[s->nr_fixups].target = target;
+   s->fixups[s->nr_fixups].cond = cond;
+   s->nr_fixups++;
+   if (cond == A64_B)
+      emit_u32(s, 0x14000000);
+   else if (cond == A64_CBZ)
+      emit_u32(s, 0x34000000 | reg);
+   else
+      emit_u32(s, 0x54000000 | cond);
+}
+
+static void a64_ret(struct jit_state *s)
+{
+   if (s->uses_mem)
+      emit_u32(s, A64_ADD_SP_64);
+   emit_u32(s, A64_RET);
+}
+
+/* Return 0 if the packet is shorter than k + size, the offset is left in x5 */
+static int a64_check_abs(struct jit_state *s, u_int k, u_int size)
+{
+   if (k > 0xffffffff - size) {
+      a64_branch(s, A64_B, 0, JIT_RET0);
+      return (-1);
+   }
+   a64_mov_imm(s, A64_T0, k + size);
+   emit_u32(s, A64_CMP_W(1, A64_T0));
+   a64_branch(s, A64_LO, 0, JIT_RET0);
+   a64_mov_imm(s, A64_T1, k);
+   return (0);
+}
+
+static void a64_load(struct jit_state *s, u_int size)
+{
+   if (size == 4) {
+      emit_u32(s, A64_LDR_W(A64_A, 0, A64_T1));
+      emit_u32(s, A64_REV_W(A64_A, A64_A));
+   }
+   else if (size == 2) {
+      emit_u32(s, A64_LDRH_W(A64_A, 0, A64_T1));
+      emit_u32(s, A64_REV16_W(A64_A, A64_A));
+   }
+   else
+      emit_u32(s, A64_LDRB_W(A64_A, 0, A64_T1));
+}
+
+static int a64_emit_insn(struct jit_state *s, const struct bpf_insn *insn, int pc)
+{
+   u_int k = insn->k, size;
+
+   switch (insn->code) {
+      case BPF_LD|BPF_W|BPF_ABS:
+      case BPF_LD|BPF_H|BPF_ABS:
+      case BPF_LD|BPF_B|BPF_ABS:
+         size = load_size(insn->code);
+         if (a64_check_abs(s, k, size) == 0)
+            a64_load(s, size);
+         break;
+
+      case BPF_LD|BPF_W|BPF_IND:
+      case BPF_LD|BPF_H|BPF_IND:
+      case BPF_LD|BPF_B|BPF_IND:
+         /* X + k + size <= len, computed on 64 bits so it can't wrap */
+         size = load_size(insn->code);
+         a64_mov_imm(s, A64_T0, k);
+         emit_u32(s, A64_ADD_UXTW(A64_T1, A64_T0, A64_X));
+         emit_u32(s, A64_ADD_IMM_X(A64_T2, A64_T1, size));
+         emit_u32(s, A64_CMP_X(A64_T2, 1));
+         a64_branch(s, A64_HI, 0, JIT_RET0);
+         a64_load(s, size);
+         break;
+
+      case BPF_LDX|BPF_MSH|BPF_B:
+         if (a64_check_abs(s, k, 1) == 0) {
+            emit_u32(s, A64_LDRB_W(A64_T0, 0, A64_T1));
+            emit_u32(s, A64_UBFM_W(A64_X, A64_T0, 30, 3));                /* ubfiz w3, w4, #2, #4 */
+         }
+         break;
+
+      case BPF_LD|BPF_W|BPF_LEN:  emit_u32(s, A64_MOV_W(A64_A, 1)); break;
+      case BPF_LDX|BPF_W|BPF_LEN: emit_u32(s, A64_MOV_W(A64_X, 1)); break;
+      case BPF_LD|BPF_IMM:        a64_mov_imm(s, A64_A, k); break;
+      case BPF_LDX|BPF_IMM:       a64_mov_imm(s, A64_X, k); break;
+      case BPF_LD|BPF_MEM:        emit_u32(s, A64_LDR_SP(A64_A, 4 * k)); break;
+      case BPF_LDX|BPF_MEM:       emit_u32(s, A64_LDR_SP(A64_X, 4 * k)); break;
+      case BPF_ST:                emit_u32(s, A64_STR_SP(A64_A, 4 * k)); break;
+      case BPF_STX:               emit_u32(s, A64_STR_SP(A64_X, 4 * k)); break;
+
+      case BPF_ALU|BPF_ADD|BPF_K:
+      case BPF_ALU|BPF_SUB|BPF_K:
+      case BPF_ALU|BPF_AND|BPF_K:
+      case BPF_ALU|BPF_OR|BPF_K:
+      case BPF_ALU|BPF_XOR|BPF_K:
+      case BPF_ALU|BPF_MUL|BPF_K:
+      case BPF_ALU|BPF_DIV|BPF_K:
+      case BPF_ALU|BPF_MOD|BPF_K:
+      case BPF_ALU|BPF_ADD|BPF_X:
+      case BPF_ALU|BPF_SUB|BPF_X:
+      case BPF_ALU|BPF_AND|BPF_X:
+      case BPF_ALU|BPF_OR|BPF_X:
+      case BPF_ALU|BPF_XOR|BPF_X:
+      case BPF_ALU|BPF_MUL|BPF_X:
+      case BPF_ALU|BPF_DIV|BPF_X:
+      case BPF_ALU|BPF_MOD|BPF_X: {
+         int src = A64_X;
+
+         if (BPF_SRC(insn->code) == BPF_K) {
+            a64_mov_imm(s, A64_T0, k);
+            src = A64_T0;
+         }
+         else if (BPF_OP(insn->code) == BPF_DIV || BPF_OP(insn->code) == BPF_MOD)
+            a64_branch(s, A64_CBZ, A64_X, JIT_RET0);
+
+         switch (BPF_OP(insn->code)) {
+            case BPF_ADD: emit_u32(s, A64_ALU_W(A64_ADD_W, A64_A, A64_A, src)); break;
+            case BPF_SUB: emit_u32(s, A64_ALU_W(A64_SUB_W, A64_A, A64_A, src)); break;
+            case BPF_AND: emit_u32(s, A64_ALU_W(A64_AND_W, A64_A, A64_A, src)); break;
+            case BPF_OR:  emit_u32(s, A64_ALU_W(A64_ORR_W, A64_A, A64_A, src)); break;
+            case BPF_XOR: emit_u32(s, A64_ALU_W(A64_EOR_W, A64_A, A64_A, src)); break;
+            case BPF_MUL: emit_u32(s, A64_MUL_W(A64_A, A64_A, src)); break;
+            case BPF_DIV: emit_u32(s, A64_ALU_W(A64_UDIV_W, A64_A, A64_A, src)); break;
+            case BPF_MOD:
+               emit_u32(s, A64_ALU_W(A64_UDIV_W, A64_T1, A64_A, src));
+               emit_u32(s, A64_MSUB_W(A64_A, A64_T1, src, A64_A));
+               break;
+         }
+         break;
+      }
+      case BPF_ALU|BPF_LSH|BPF_K:
+         emit_u32(s, A64_UBFM_W(A64_A, A64_A, (32 - k) & 31, 31 - k));
+         break;
+      case BPF_ALU|BPF_RSH|BPF_K:
+         emit_u32(s, A64_UBFM_W(A64_A, A64_A, k, 31));
+         break;
+      case BPF_ALU|BPF_LSH|BPF_X:
+      case BPF_ALU|BPF_RSH|BPF_X:
+         /* shifts by 32 or more give 0, lslv and lsrv would mask the count */
+         emit_u32(s, A64_ALU_W(BPF_OP(insn->code) == BPF_LSH ? A64_LSLV_W : A64_LSRV_W, A64_T0, A64_A, A64_X));
+         emit_u32(s, A64_CMP_IMM_W(A64_X, 32));
+         emit_u32(s, A64_CSEL_W(A64_A, A64_T0, A64_ZR, A64_LO));
+         break;
+      case BPF_ALU|BPF_NEG:
+         emit_u32(s, A64_ALU_W(A64_SUB_W, A64_A, A64_ZR, A64_A));
+         break;
+
+      case BPF_MISC|BPF_TAX: emit_u32(s, A64_MOV_W(A64_X, A64_A)); break;
+      case BPF_MISC|BPF_TXA: emit_u32(s, A64_MOV_W(A64_A, A64_X)); break;
+
+      case BPF_RET|BPF_K:
+         a64_mov_imm(s, 0, k);
+         a64_ret(s);
+         break;
+      case BPF_RET|BPF_A:
+         emit_u32(s, A64_MOV_W(0, A64_A));
+         a64_ret(s);
+         break;
+
+      case BPF_JMP|BPF_JA:
+         a64_branch(s, A64_B, 0, pc + 1 + k);
+         break;
+
+      case BPF_JMP|BPF_JEQ|BPF_K:
+      case BPF_JMP|BPF_JGT|BPF_K:
+      case BPF_JMP|BPF_JGE|BPF_K:
+      case BPF_JMP|BPF_JSET|BPF_K:
+      case BPF_JMP|BPF_JEQ|BPF_X:
+      case BPF_JMP|BPF_JGT|BPF_X:
+      case BPF_JMP|BPF_JGE|BPF_X:
+      case BPF_JMP|BPF_JSET|BPF_X: {
+         int src = A64_X, cc, ncc;
+
+         if (BPF_SRC(insn->code) == BPF_K) {
+            a64_mov_imm(s, A64_T0, k);
+            src = A64_T0;
+         }
+         if (BPF_OP(insn->code) == BPF_JSET)
+            emit_u32(s, A64_TST_W(A64_A, src));
+         else
+            emit_u32(s, A64_CMP_W(A64_A, src));
+         switch (BPF_OP(insn->code)) {
+            case BPF_JEQ: cc = A64_EQ; ncc = A64_NE; break;
+            case BPF_JGT: cc = A64_HI; ncc = A64_LS; break;
+            case BPF_JGE: cc = A64_HS; ncc = A64_LO; break;
+            default:      cc = A64_NE; ncc = A64_EQ; break;
+         }
+         if (insn->jt == 0)
+            a64_branch(s, ncc, 0, pc + 1 + insn->jf);
+         else {
+            a64_branch(s, cc, 0, pc + 1 + insn->jt);
+            if (insn->jf != 0)
+               a64_branch(s, A64_B, 0, pc + 1 + insn->jf);
+         }
+         break;
+      }
+
+      default:
+         return (-1);
+   }
+   return (0);
+}
+
+static int jit_emit(struct jit_state *s, const struct bpf_insn *insns, u_int len)
+{
+   size_t ret0_addr, target;
+   u_int i, insn;
+   int n, rel;
+
+   emit_u32(s, A64_MOV_W(1, 1));              /* zero extend the length to x1 */
+   emit_u32(s, A64_MOV_W(A64_A, A64_ZR));
+   emit_u32(s, A64_MOV_W(A64_X, A64_ZR));
+   if (s->uses_mem) {
+      emit_u32(s, A64_SUB_SP_64);
+      for (i = 0; i < BPF_MEMWORDS * 4; i += 16)
+         emit_u32(s, A64_STP_ZR_SP(i));
+   }
+
+   for (i = 0; i < len; i++) {
+      s->addrs[i] = s->len;
+      if (a64_emit_insn(s, &insns[i], i) == -1)
+         return (-1);
+   }
+   ret0_addr = s->len;
+   emit_u32(s, A64_MOV_W(0, A64_ZR));
+   a64_ret(s);
+
+   for (n = 0; n < s->nr_fixups; n++) {
+      target = s->fixups[n].target == JIT_RET0 ? ret0_addr : s->addrs[s->fixups[n].target];
+      rel = (int)(target - s->fixups[n].pos) / 4;
+      memcpy(&insn, s->code + s->fixups[n].pos, 4);
+      if (s->fixups[n].cond == A64_B)
+         insn |= rel & 0x3ffffff;
+      else
+         insn |= (rel & 0x7ffff) << 5;
+      memcpy(s->code + s->fixups[n].pos, &insn, 4);
+   }
+   return (0);
+}
+
+#endif
+
+/* Translate a BPF program, NULL if it can't be translated */
+bpf_jit_t *bpf_jit_compile(const struct bpf_program *fp)
+{
+   struct jit_state state;
+   bpf_jit_t *jit = NULL;
+   size_t max_size, page_size;
+   void *code;
+
+   memset(&state, 0, sizeof(state));
+   if (jit_check_program(fp->bf_insns, fp->bf_len, &state.uses_mem) == -1)
+      return (NULL);
+
+   /* no instruction is translated to more than 64 bytes */
+   max_size = (fp->bf_len + 2) * 64 + BPF_MEMWORDS * 4;
+   if ((state.code = malloc(max_size)) == NULL ||
+       (state.addrs = malloc(fp->bf_len * sizeof(size_t))) == NULL ||
+       (state.fixups = malloc(3 * fp->bf_len * sizeof(struct jit_fixup))) == NULL)
+      goto out;
+
+   if (jit_emit(&state, fp->bf_insns, fp->bf_len) == -1)
+      goto out;
+
+   /* the code is never writable and executable at the same time */
+   page_size = sysconf(_SC_PAGESIZE);
+   max_size = (state.len + page_size - 1) & ~(page_size - 1);
+   code = mmap(NULL, max_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (code == MAP_FAILED)
+      goto out;
+   memcpy(code, state.code, state.len);
+   if (mprotect(code, max_size, PROT_READ | PROT_EXEC) == -1 || (jit = malloc(sizeof(*jit))) == NULL) {
+      munmap(code, max_size);
+      goto out;
+   }
+   __builtin___clear_cache(code, (char *)code + state.len);
+   jit->func = (bpf_jit_func_t)code;
+   jit->size = max_size;
+
+ out:
+   free(state.code);
+   free(state.addrs);
+   free(state.fixups);
+   return (jit);
+}
+
+void bpf_jit_free(bpf_jit_t *jit)
+{
+   if (jit != NULL) {
+      munmap((void *)jit->func, jit->size);
+      free(jit);
+   }
+}
+
+#else
+
+bpf_jit_t *bpf_jit_compile(const struct bpf_program *fp)
+{
+   return (NULL);
+}
+
+void bpf_jit_free(bpf_jit_t *jit)
+{
+}
+
+#endif
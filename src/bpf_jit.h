@@ -0,0 +1,42 @@
+/*
+ *   This file is part of ubridge, a program to bridge network interfaces
+ *   to UDP tunnels.
+ *
+ *   Copyright (C) 2026 GNS3 Technologies Inc.
+ *
+ *   ubridge is free software: you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ubridge is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BPF_JIT_H_
+#define BPF_JIT_H_
+
+#include <sys/types.h>
+#include <pcap.h>
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+#define BPF_JIT_SUPPORTED
+#endif
+
+/* Classic BPF program translated to native code, called with the packet and its length */
+typedef u_int (*bpf_jit_func_t)(const u_char *pkt, u_int len);
+
+typedef struct bpf_jit {
+   bpf_jit_func_t func;
+   size_t size;
+} bpf_jit_t;
+
+bpf_jit_t *bpf_jit_compile(const struct bpf_program *fp);
+void bpf_jit_free(bpf_jit_t *jit);
+
+#endif /* !BPF_JIT_H_ */
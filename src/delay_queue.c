@@ -0,0 +1,414 @@
+/*
+ *   This file is part of ubridge, a program to bridge network interfaces
+ *   to UDP tunnels.
+ *
+ *   Copyright (C) 2026 GNS3 Technologies Inc.
+ *
+ *   ubridge is free software: you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ubridge is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ubridge.h"
+#include "delay_queue.h"
+
+#define DELAY_WHEEL_L0_MASK   (DELAY_WHEEL_L0_SIZE - 1)
+#define DELAY_WHEEL_LN_MASK   (DELAY_WHEEL_LN_SIZE - 1)
+#define DELAY_WHEEL_L1_SHIFT  DELAY_WHEEL_L0_BITS
+#define DELAY_WHEEL_L2_SHIFT  (DELAY_WHEEL_L0_BITS + DELAY_WHEEL_LN_BITS)
+
+/* Packet held until its expiry tick */
+typedef struct delay_entry {
+   struct delay_entry *next;
+   delay_queue_t *queue;
+   void *ctx;
+   packet_buf_t *buf;
+   u_char *pkt;
+   size_t len;
+   u_long expires;
+} delay_entry_t;
+
+typedef struct {
+   delay_entry_t *head;
+   delay_entry_t **tail;
+} delay_slot_t;
+
+/*
+ * Hierarchical timer wheel shared by all the delay queues. The wheel is
+ * advanced by the delay thread, which sends the expired packets; send_lock
+ * is held while it sends so a queue is never flushed under its feet.
+ */
+static struct {
+   pthread_mutex_t lock;
+   pthread_mutex_t send_lock;
+   pthread_cond_t cond;
+   clockid_t cond_clock;
+   int started;
+   u_long tick;          /* last processed millisecond */
+   u_long next_wake;     /* tick the delay thread sleeps until */
+   u_int pending;
+   delay_slot_t l0[DELAY_WHEEL_L0_SIZE];
+   delay_slot_t l1[DELAY_WHEEL_LN_SIZE];
+   delay_slot_t l2[DELAY_WHEEL_LN_SIZE];
+   delay_entry_t *free_entries;
+} wheel = {
+   .lock = PTHREAD_MUTEX_INITIALIZER,
+   .send_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Monotonic time in nanoseconds, read through the vDSO on Linux */
+u_int64_t delay_queue_now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/* Current wheel tick */
+static u_long delay_now(void)
+{
+   return (delay_queue_now() / DELAY_QUEUE_TICK);
+}
+
+static inline void delay_slot_append(delay_slot_t *slot, delay_entry_t *entry)
+{
+   entry->next = NULL;
+   *slot->tail = entry;
+   slot->tail = &entry->next;
+}
+
+/* Put an entry in the slot of its expiry tick, called with the wheel locked */
+static void delay_wheel_insert(delay_entry_t *entry)
+{
+   u_long diff = entry->expires - wheel.tick;
+
+   if (diff < DELAY_WHEEL_L0_SIZE)
+      delay_slot_append(&wheel.l0[entry->expires & DELAY_WHEEL_L0_MASK], entry);
+   else if (diff < (1UL << DELAY_WHEEL_L2_SHIFT))
+      delay_slot_append(&wheel.l1[(entry->expires >> DELAY_WHEEL_L1_SHIFT) & DELAY_WHEEL_LN_MASK], entry);
+   else {
+      if (diff > DELAY_QUEUE_MAX_DELAY)
+         entry->expires = wheel.tick + DELAY_QUEUE_MAX_DELAY;
+      delay_slot_append(&wheel.l2[(entry->expires >> DELAY_WHEEL_L2_SHIFT) & DELAY_WHEEL_LN_MASK], entry);
+   }
+}
+
+/* Move the entries of a slot of an upper level down the wheel */
+static void delay_wheel_cascade(delay_slot_t *slot)
+{
+   delay_entry_t *entry, *next;
+
+   entry = slot->head;
+   slot->head = NULL;
+   slot->tail = &slot->head;
+   for (; entry != NULL; entry = next) {
+      next = entry->next;
+      delay_wheel_insert(entry);
+   }
+}
+
+/* Advance the wheel by one tick and append the expired entries to a list */
+static void delay_wheel_advance(delay_entry_t ***tail)
+{
+   delay_slot_t *slot;
+   delay_entry_t *entry;
+
+   wheel.tick++;
+   if (!(wheel.tick & DELAY_WHEEL_L0_MASK)) {
+      if (!((wheel.tick >> DELAY_WHEEL_L1_SHIFT) & DELAY_WHEEL_LN_MASK))
+         delay_wheel_cascade(&wheel.l2[(wheel.tick >> DELAY_WHEEL_L2_SHIFT) & DELAY_WHEEL_LN_MASK]);
+      delay_wheel_cascade(&wheel.l1[(wheel.tick >> DELAY_WHEEL_L1_SHIFT) & DELAY_WHEEL_LN_MASK]);
+   }
+
+   slot = &wheel.l0[wheel.tick & DELAY_WHEEL_L0_MASK];
+   if (slot->head == NULL)
+      return;
+   for (entry = slot->head; entry != NULL; entry = entry->next) {
+      entry->queue->pending--;
+      wheel.pending--;
+   }
+   **tail = slot->head;
+   *tail = slot->tail;
+   slot->head = NULL;
+   slot->tail = &slot->head;
+}
+
+/* Next tick with something to do: an expiry in the first level or a cascade */
+static u_long delay_wheel_next_tick(void)
+{
+   u_long tick;
+
+   for (tick = wheel.tick + 1; tick & DELAY_WHEEL_L0_MASK; tick++) {
+      if (wheel.l0[tick & DELAY_WHEEL_L0_MASK].head != NULL)
+         break;
+   }
+   return (tick);
+}
+
+/* Send expired entries, consecutive packets for the same destination go in one batch */
+static void delay_send_entries(delay_entry_t *entry)
+{
+   struct iovec pkts[NIO_MAX_BATCH];
+   delay_entry_t *first;
+   int i, count;
+
+   while (entry != NULL) {
+      first = entry;
+      count = 0;
+      do {
+         pkts[count].iov_base = entry->pkt;
+         pkts[count++].iov_len = entry->len;
+         entry = entry->next;
+      } while (entry != NULL && count < NIO_MAX_BATCH && entry->queue == first->queue && entry->ctx == first->ctx);
+
+      first->queue->send(first->queue->data, first->ctx, pkts, count);
+      for (i = 0; i < count; i++, first = first->next)
+         packet_buf_release(first->buf);
+   }
+}
+
+static void delay_free_entries(delay_entry_t *entry)
+{
+   delay_entry_t *next;
+
+   for (; entry != NULL; entry = next) {
+      next = entry->next;
+      entry->next = wheel.free_entries;
+      wheel.free_entries = entry;
+   }
+}
+
+/* Delay thread: release the packets when their delay expires */
+static void *delay_thread(void *arg)
+{
+   delay_entry_t *expired, **tail;
+   struct timespec ts;
+   u_long now, wait;
+
+   pthread_mutex_lock(&wheel.lock);
+   while (1) {
+      while (wheel.pending == 0) {
+         wheel.next_wake = (u_long)-1;
+         pthread_cond_wait(&wheel.cond, &wheel.lock);
+      }
+
+      expired = NULL;
+      tail = &expired;
+      now = delay_now();
+      while (wheel.tick < now)
+         delay_wheel_advance(&tail);
+
+      if (expired != NULL) {
+         /* taken before unlocking the wheel so a flush waits for these packets */
+         pthread_mutex_lock(&wheel.send_lock);
+         pthread_mutex_unlock(&wheel.lock);
+         delay_send_entries(expired);
+         pthread_mutex_unlock(&wheel.send_lock);
+         pthread_mutex_lock(&wheel.lock);
+         delay_free_entries(expired);
+         continue;
+      }
+
+      /* sleep until the next expiry or cascade, a new earlier packet wakes us up */
+      wheel.next_wake = delay_wheel_next_tick();
+      wait = wheel.next_wake - now;
+      clock_gettime(wheel.cond_clock, &ts);
+      ts.tv_sec += wait / 1000;
+      ts.tv_nsec += (wait % 1000) * 1000000;
+      if (ts.tv_nsec >= 1000000000) {
+         ts.tv_sec++;
+         ts.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&wheel.cond, &wheel.lock, &ts);
+   }
+   return (NULL);
+}
+
+/* Start the delay thread, called with the wheel locked */
+static int delay_wheel_start(void)
+{
+   pthread_condattr_t attr;
+   pthread_t tid;
+   int i, s;
+
+   for (i = 0; i < DELAY_WHEEL_L0_SIZE; i++)
+      wheel.l0[i].tail = &wheel.l0[i].head;
+   for (i = 0; i < DELAY_WHEEL_LN_SIZE; i++) {
+      wheel.l1[i].tail = &wheel.l1[i].head;
+      wheel.l2[i].tail = &wheel.l2[i].head;
+   }
+
+   pthread_condattr_init(&attr);
+   wheel.cond_clock = CLOCK_REALTIME;
+#ifdef __linux__
+   if (pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) == 0)
+      wheel.cond_clock = CLOCK_MONOTONIC;
+#endif
+   pthread_cond_init(&wheel.cond, &attr);
+   pthread_condattr_destroy(&attr);
+
+   wheel.tick = delay_now();
+   if ((s = pthread_create(&tid, NULL, &delay_thread, NULL)) != 0) {
+      errno = s;
+      perror("delay_wheel_start: pthread_create");
+      pthread_cond_destroy(&wheel.cond);
+      return (-1);
+   }
+   pthread_detach(tid);
+   wheel.started = TRUE;
+   return (0);
+}
+
+/*
+ * Create a delay queue, its packets are sent with the send function once
+ * their delay expires. The queue owns data, freed with free_data.
+ */
+delay_queue_t *delay_queue_create(delay_send_t send, void *data, void (*free_data)(void *data))
+{
+   delay_queue_t *queue;
+
+   pthread_mutex_lock(&wheel.lock);
+   if (!wheel.started && delay_wheel_start() == -1) {
+      pthread_mutex_unlock(&wheel.lock);
+      return (NULL);
+   }
+   pthread_mutex_unlock(&wheel.lock);
+
+   if (!(queue = malloc(sizeof(*queue))))
+      return (NULL);
+   memset(queue, 0, sizeof(*queue));
+   queue->send = send;
+   queue->data = data;
+   queue->free_data = free_data;
+   return (queue);
+}
+
+/*
+ * Hold a packet until departure (see delay_queue_now) before it is sent to
+ * ctx, it leaves with the first tick after that time. The packet keeps its
+ * buffer when buf, a pool buffer it lies in, is given, otherwise it is
+ * copied with the offload information in front of it.
+ */
+int delay_queue_add(delay_queue_t *queue, void *ctx, u_char *pkt, size_t len, packet_buf_t *buf, u_int64_t departure)
+{
+   delay_entry_t *entry;
+   packet_pool_t *pool;
+   u_long now;
+
+   if (buf != NULL)
+      packet_buf_hold(buf);
+   else {
+      if (!(pool = packet_pool_get(len <= 2048 ? 2048 : NIO_MAX_PKT_SIZE)) || !(buf = packet_buf_alloc(pool)))
+         return (-1);
+      memcpy(buf->data - sizeof(nio_offload_t), pkt - sizeof(nio_offload_t), len + sizeof(nio_offload_t));
+      pkt = buf->data;
+   }
+
+   pthread_mutex_lock(&wheel.lock);
+   if (queue->pending >= DELAY_QUEUE_MAX_PACKETS) {
+      pthread_mutex_unlock(&wheel.lock);
+      packet_buf_release(buf);
+      return (-1);
+   }
+
+   if ((entry = wheel.free_entries) != NULL)
+      wheel.free_entries = entry->next;
+   else if (!(entry = malloc(sizeof(*entry)))) {
+      pthread_mutex_unlock(&wheel.lock);
+      packet_buf_release(buf);
+      return (-1);
+   }
+
+   /* an idle wheel catches up with the time at once */
+   now = delay_now();
+   if (wheel.pending == 0)
+      wheel.tick = now;
+
+   entry->queue = queue;
+   entry->ctx = ctx;
+   entry->buf = buf;
+   entry->pkt = pkt;
+   entry->len = len;
+   entry->expires = m_max((departure + DELAY_QUEUE_TICK - 1) / DELAY_QUEUE_TICK, wheel.tick + 1);
+   delay_wheel_insert(entry);
+   queue->pending++;
+   wheel.pending++;
+
+   if (entry->expires < wheel.next_wake)
+      pthread_cond_signal(&wheel.cond);
+   pthread_mutex_unlock(&wheel.lock);
+   return (0);
+}
+
+/* Drop the packets of a slot held for a queue, or only those sent to ctx if it is not NULL */
+static void delay_slot_flush(delay_slot_t *slot, delay_queue_t *queue, void *ctx)
+{
+   delay_entry_t *entry, *next;
+
+   entry = slot->head;
+   slot->head = NULL;
+   slot->tail = &slot->head;
+   for (; entry != NULL; entry = next) {
+      next = entry->next;
+      if (entry->queue == queue && (ctx == NULL || entry->ctx == ctx)) {
+         packet_buf_release(entry->buf);
+         entry->next = wheel.free_entries;
+         wheel.free_entries = entry;
+         queue->pending--;
+         wheel.pending--;
+      }
+      else
+         delay_slot_append(slot, entry);
+   }
+}
+
+/*
+ * Drop the packets held for a queue, or only those sent to ctx if it is
+ * not NULL. Once it returns, the delay thread doesn't use ctx anymore.
+ */
+void delay_queue_flush(delay_queue_t *queue, void *ctx)
+{
+   int i;
+
+   pthread_mutex_lock(&wheel.lock);
+   if (queue->pending > 0) {
+      for (i = 0; i < DELAY_WHEEL_L0_SIZE; i++)
+         delay_slot_flush(&wheel.l0[i], queue, ctx);
+      for (i = 0; i < DELAY_WHEEL_LN_SIZE; i++) {
+         delay_slot_flush(&wheel.l1[i], queue, ctx);
+         delay_slot_flush(&wheel.l2[i], queue, ctx);
+      }
+   }
+   pthread_mutex_unlock(&wheel.lock);
+
+   /* wait for the packets being sent */
+   pthread_mutex_lock(&wheel.send_lock);
+   pthread_mutex_unlock(&wheel.send_lock);
+}
+
+void delay_queue_free(delay_queue_t *queue)
+{
+   if (queue != NULL) {
+      delay_queue_flush(queue, NULL);
+      if (queue->free_data != NULL)
+         queue->free_data(queue->data);
+      free(queue);
+   }
+}
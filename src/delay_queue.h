@@ -0,0 +1,58 @@
+/*
+ *   This file is part of ubridge, a program to bridge network interfaces
+ *   to UDP tunnels.
+ *
+ *   Copyright (C) 2026 GNS3 Technologies Inc.
+ *
+ *   ubridge is free software: you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ubridge is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DELAY_QUEUE_H_
+#define DELAY_QUEUE_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "packet_pool.h"
+
+/* Timer wheel: 256 slots of 1 ms, then two levels of 64 slots */
+#define DELAY_WHEEL_L0_BITS      8
+#define DELAY_WHEEL_LN_BITS      6
+#define DELAY_WHEEL_L0_SIZE      (1 << DELAY_WHEEL_L0_BITS)
+#define DELAY_WHEEL_LN_SIZE      (1 << DELAY_WHEEL_LN_BITS)
+
+/* Wheel tick in nanoseconds */
+#define DELAY_QUEUE_TICK         1000000ULL
+/* Longest delay in milliseconds (about 17 minutes) */
+#define DELAY_QUEUE_MAX_DELAY    ((1 << (DELAY_WHEEL_L0_BITS + 2 * DELAY_WHEEL_LN_BITS)) - 1)
+/* Packets held by a queue before new ones are dropped */
+#define DELAY_QUEUE_MAX_PACKETS  16384
+
+/* Send packets released by a delay queue, called from the delay thread with the data of the queue */
+typedef int (*delay_send_t)(void *data, void *ctx, struct iovec *pkts, int count);
+
+typedef struct delay_queue {
+    delay_send_t send;
+    void *data;                 /* state of the sender, only used by the delay thread */
+    void (*free_data)(void *data);
+    u_int pending;
+} delay_queue_t;
+
+u_int64_t delay_queue_now(void);
+delay_queue_t *delay_queue_create(delay_send_t send, void *data, void (*free_data)(void *data));
+int delay_queue_add(delay_queue_t *queue, void *ctx, u_char *pkt, size_t len, packet_buf_t *buf, u_int64_t departure);
+void delay_queue_flush(delay_queue_t *queue, void *ctx);
+void delay_queue_free(delay_queue_t *queue);
+
+#endif /* !DELAY_QUEUE_H_ */
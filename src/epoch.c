@@ -0,0 +1,131 @@
+/*
+ *   This file is part of ubridge, a program to bridge network interfaces
+ *   to UDP tunnels.
+ *
+ *   Copyright (C) 2026 GNS3 Technologies Inc.
+ *
+ *   ubridge is free software: you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ubridge is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+
+#include "ubridge.h"
+#include "epoch.h"
+
+/*
+ * Each reading thread announces the epoch it entered its read section in,
+ * epoch_synchronize() starts a new epoch and waits until no thread is in a
+ * section from an earlier one.
+ */
+typedef struct epoch_reader {
+   u_int64_t epoch;                 /* 0 outside of a read section */
+   int depth;                       /* of nested sections, only used by the owner */
+   int in_use;
+   struct epoch_reader *next;
+} epoch_reader_t;
+
+static u_int64_t global_epoch = 1;
+static epoch_reader_t *epoch_readers = NULL;
+static pthread_mutex_t epoch_readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t epoch_reader_once = PTHREAD_ONCE_INIT;
+static pthread_key_t epoch_reader_key;
+
+/* A thread that exits or is cancelled gives its slot back, without locking */
+static void epoch_reader_release(void *data)
+{
+   epoch_reader_t *reader = data;
+
+   reader->depth = 0;
+   __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+   __atomic_store_n(&reader->in_use, FALSE, __ATOMIC_RELEASE);
+}
+
+static void epoch_reader_init(void)
+{
+   pthread_key_create(&epoch_reader_key, epoch_reader_release);
+}
+
+static epoch_reader_t *epoch_reader_get(void)
+{
+   static __thread epoch_reader_t *reader = NULL;
+   epoch_reader_t *slot;
+   int unused = FALSE;
+
+   if (reader != NULL)
+      return (reader);
+
+   pthread_once(&epoch_reader_once, epoch_reader_init);
+   pthread_mutex_lock(&epoch_readers_lock);
+   /* slots are never freed, a slot left by a thread is reused */
+   for (slot = epoch_readers; slot != NULL; slot = slot->next) {
+      if (__atomic_compare_exchange_n(&slot->in_use, &unused, TRUE, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+         break;
+      unused = FALSE;
+   }
+   if (slot == NULL && (slot = malloc(sizeof(*slot))) != NULL) {
+      memset(slot, 0, sizeof(*slot));
+      slot->in_use = TRUE;
+      slot->next = epoch_readers;
+      __atomic_store_n(&epoch_readers, slot, __ATOMIC_RELEASE);
+   }
+   pthread_mutex_unlock(&epoch_readers_lock);
+
+   if (slot == NULL) {
+      fprintf(stderr, "epoch_reader_get: insufficient memory\n");
+      return (NULL);
+   }
+   pthread_setspecific(epoch_reader_key, slot);
+   reader = slot;
+   return (reader);
+}
+
+/* Enter a read section, returns -1 if the thread can't get a reader slot */
+int epoch_enter(void)
+{
+   epoch_reader_t *reader;
+
+   if ((reader = epoch_reader_get()) == NULL)
+      return (-1);
+
+   /* announce the epoch before reading the published objects */
+   if (reader->depth++ == 0)
+      __atomic_store_n(&reader->epoch, __atomic_load_n(&global_epoch, __ATOMIC_RELAXED), __ATOMIC_SEQ_CST);
+   return (0);
+}
+
+/* Leave a read section, only after a successful epoch_enter() */
+void epoch_exit(void)
+{
+   epoch_reader_t *reader = epoch_reader_get();
+
+   if (--reader->depth == 0)
+      __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* Wait until every read section entered before the call has been left */
+void epoch_synchronize(void)
+{
+   epoch_reader_t *reader;
+   u_int64_t epoch, seen;
+
+   epoch = __atomic_add_fetch(&global_epoch, 1, __ATOMIC_SEQ_CST);
+   pthread_mutex_lock(&epoch_readers_lock);
+   for (reader = epoch_readers; reader != NULL; reader = reader->next) {
+      while ((seen = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST)) != 0 && seen < epoch)
+         sched_yield();
+   }
+   pthread_mutex_unlock(&epoch_readers_lock);
+}
@@ -0,0 +1,33 @@
+/*
+ *   This file is part of ubridge, a program to bridge network interfaces
+ *   to UDP tunnels.
+ *
+ *   Copyright (C) 2026 GNS3 Technologies Inc.
+ *
+ *   ubridge is free software: you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ubridge is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EPOCH_H_
+#define EPOCH_H_
+
+/*
+ * Read sections protecting objects the data plane reads without locking.
+ * An object unpublished with an atomic pointer exchange can be freed once
+ * epoch_synchronize() returns: no thread still reads it. Sections nest.
+ */
+int epoch_enter(void);
+void epoch_exit(void);
+void epoch_synchronize(void);
+
+#endif /* !EPOCH_H_ */
@@ -29,6 +29,7 @@
 #include "nio_ethernet.h"
 #ifdef LINUX_RAW
 #include "nio_linux_raw.h"
+#include "nio_af_xdp.h"
 #endif
 #ifdef __APPLE__
 #include "nio_fusion_vmnet.h"
@@ -38,6 +39,9 @@
 #include "packet_filter.h"
 #include "pcap_capture.h"
 #include "pcap_filter.h"
+#ifdef LINUX_RAW
+#include "sock_filter.h"
+#endif
 
 
 static bridge_t *find_bridge(char *bridge_name)
@@ -96,18 +100,15 @@ static int cmd_delete_bridge(hypervisor_conn_t *conn, int argc, char *argv[])
           else
              prev->next = bridge->next;
 
-          if (bridge->running) {
-             pthread_cancel(bridge->source_tid);
-             pthread_join(bridge->source_tid, NULL);
-             pthread_cancel(bridge->destination_tid);
-             pthread_join(bridge->destination_tid, NULL);
-          }
+          if (bridge->running)
+             cancel_bridge_threads(bridge);
           if (bridge->name)
              free(bridge->name);
           free_nio(bridge->source_nio);
           free_nio(bridge->destination_nio);
           free_pcap_capture(bridge->capture);
-          free_packet_filters(bridge->packet_filters);
+          free_pcap_capture(bridge->recorder);
+          reset_packet_filters(&bridge->packet_filters, &bridge->filter_chain);
           free(bridge);
           hypervisor_send_reply(conn, HSC_INFO_OK, 1, "bridge '%s' deleted", argv[0]);
           return (0);
@@ -120,7 +121,6 @@ static int cmd_delete_bridge(hypervisor_conn_t *conn, int argc, char *argv[])
 static int cmd_start_bridge(hypervisor_conn_t *conn, int argc, char *argv[])
 {
    bridge_t *bridge;
-   int s;
 
    bridge = find_bridge(argv[0]);
    if (bridge == NULL) {
@@ -138,17 +138,8 @@ static int cmd_start_bridge(hypervisor_conn_t *conn, int argc, char *argv[])
       return (-1);
    }
 
-   s = pthread_create(&(bridge->source_tid), NULL, &source_nio_listener, bridge);
-   if (s != 0) {
-      handle_error_en(s, "pthread_create");
-      hypervisor_send_reply(conn, HSC_ERR_START, 1, "cannot create source NIO thread for bridge '%s'", argv[0]);
-      return (-1);
-   }
-
-   s = pthread_create(&(bridge->destination_tid), NULL, &destination_nio_listener, bridge);
-   if (s != 0) {
-      handle_error_en(s, "pthread_create");
-      hypervisor_send_reply(conn, HSC_ERR_START, 1, "cannot create destination NIO thread for bridge '%s'", argv[0]);
+   if (create_bridge_threads(bridge) == -1) {
+      hypervisor_send_reply(conn, HSC_ERR_START, 1, "cannot create NIO threads for bridge '%s'", argv[0]);
       return (-1);
    }
 
@@ -172,10 +163,7 @@ static int cmd_stop_bridge(hypervisor_conn_t *conn, int argc, char *argv[])
       return (-1);
    }
 
-   pthread_cancel(bridge->source_tid);
-   pthread_join(bridge->source_tid, NULL);
-   pthread_cancel(bridge->destination_tid);
-   pthread_join(bridge->destination_tid, NULL);
+   cancel_bridge_threads(bridge);
    bridge->running = FALSE;
    hypervisor_send_reply(conn, HSC_INFO_OK, 1, "bridge '%s' stopped", argv[0]);
    return (0);
@@ -266,6 +254,19 @@ static int cmd_show_bridge(hypervisor_conn_t *conn, int argc, char *argv[])
    return (0);
 }
 
+#ifdef LINUX_RAW
+/* Frames dropped by the RX rings of all the queues of a Linux RAW NIO */
+static u_long linux_raw_rx_dropped(nio_t *nio)
+{
+   u_long dropped = 0;
+   int i;
+
+   for (i = 0; i < nio->nr_queues; i++)
+      dropped += __atomic_load_n(&nio->queues[i]->u.nio_linux_raw.rx_dropped, __ATOMIC_RELAXED);
+   return (dropped);
+}
+#endif
+
 static int cmd_get_stats_bridge(hypervisor_conn_t *conn, int argc, char *argv[])
 {
    bridge_t *bridge;
@@ -283,6 +284,37 @@ static int cmd_get_stats_bridge(hypervisor_conn_t *conn, int argc, char *argv[])
       hypervisor_send_reply(conn, HSC_INFO_MSG, 0, "Destination NIO: IN: %zd packets (%zd bytes) OUT: %zd packets (%zd bytes)",
       bridge->destination_nio->packets_in, bridge->destination_nio->bytes_in,
       bridge->destination_nio->packets_out, bridge->destination_nio->bytes_out);
+#ifdef LINUX_RAW
+   if (bridge->source_nio && bridge->source_nio->type == NIO_TYPE_AF_XDP)
+      hypervisor_send_reply(conn, HSC_INFO_MSG, 0, "Source NIO:      %lu frames dropped on transmit",
+      __atomic_load_n(&bridge->source_nio->u.nio_af_xdp.tx_dropped, __ATOMIC_RELAXED));
+   if (bridge->destination_nio && bridge->destination_nio->type == NIO_TYPE_AF_XDP)
+      hypervisor_send_reply(conn, HSC_INFO_MSG, 0, "Destination NIO: %lu frames dropped on transmit",
+      __atomic_load_n(&bridge->destination_nio->u.nio_af_xdp.tx_dropped, __ATOMIC_RELAXED));
+   if (bridge->source_nio && bridge->source_nio->type == NIO_TYPE_LINUX_RAW && bridge->source_nio->u.nio_linux_raw.rx_ring)
+      hypervisor_send_reply(conn, HSC_INFO_MSG, 0, "Source NIO:      %lu frames dropped on receive", linux_raw_rx_dropped(bridge->source_nio));
+   if (bridge->destination_nio && bridge->destination_nio->type == NIO_TYPE_LINUX_RAW && bridge->destination_nio->u.nio_linux_raw.rx_ring)
+      hypervisor_send_reply(conn, HSC_INFO_MSG, 0, "Destination NIO: %lu frames dropped on receive", linux_raw_rx_dropped(bridge->destination_nio));
+#endif
+   if (bridge->source_nio && bridge->source_nio->full_dropped)
+      hypervisor_send_reply(conn, HSC_INFO_MSG, 0, "Source NIO:      %zd frames dropped (transmit queue full)",
+      bridge->source_nio->full_dropped);
+   if (bridge->destination_nio && bridge->destination_nio->full_dropped)
+      hypervisor_send_reply(conn, HSC_INFO_MSG, 0, "Destination NIO: %zd frames dropped (transmit queue full)",
+      bridge->destination_nio->full_dropped);
+   if (bridge->source_nio && bridge->source_nio->gso_dropped)
+      hypervisor_send_reply(conn, HSC_INFO_MSG, 0, "Source NIO:      %zd super-frames dropped (cannot be segmented)",
+      bridge->source_nio->gso_dropped);
+   if (bridge->destination_nio && bridge->destination_nio->gso_dropped)
+      hypervisor_send_reply(conn, HSC_INFO_MSG, 0, "Destination NIO: %zd super-frames dropped (cannot be segmented)",
+      bridge->destination_nio->gso_dropped);
+   if (bridge->capture)
+      hypervisor_send_reply(conn, HSC_INFO_MSG, 0, "Capture:         %llu frames written, %llu dropped",
+      (unsigned long long)bridge->capture->captured, (unsigned long long)bridge->capture->dropped);
+   if (bridge->recorder)
+      hypervisor_send_reply(conn, HSC_INFO_MSG, 0, "Flight recorder: %llu frames in history (%zu of %zu bytes), %llu recorded, %llu dropped",
+      (unsigned long long)bridge->recorder->history_frames, bridge->recorder->history_used, bridge->recorder->history_size,
+      (unsigned long long)bridge->recorder->captured, (unsigned long long)bridge->recorder->dropped);
 
    hypervisor_send_reply(conn, HSC_INFO_OK, 1, "OK");
    return (0);
@@ -300,10 +332,12 @@ static int cmd_reset_stats_bridge(hypervisor_conn_t *conn, int argc, char *argv[
    if (bridge->source_nio) {
       bridge->source_nio->packets_in = bridge->source_nio->bytes_in = 0;
       bridge->source_nio->packets_out = bridge->source_nio->bytes_out = 0;
+      bridge->source_nio->gso_dropped = bridge->source_nio->full_dropped = 0;
    }
    if (bridge->destination_nio) {
       bridge->destination_nio->packets_in = bridge->destination_nio->bytes_in = 0;
       bridge->destination_nio->packets_out = bridge->destination_nio->bytes_out = 0;
+      bridge->destination_nio->gso_dropped = bridge->destination_nio->full_dropped = 0;
    }
    hypervisor_send_reply(conn, HSC_INFO_OK, 1, "OK");
    return (0);
@@ -339,7 +373,7 @@ static int cmd_add_nio_udp(hypervisor_conn_t *conn, int argc, char *argv[])
       return (-1);
    }
 
-   nio = create_nio_udp(atoi(argv[1]), argv[2], atoi(argv[3]));
+   nio = create_nio_udp(atoi(argv[1]), argv[2], atoi(argv[3]), argc - 4, &argv[4]);
    if (!nio) {
       hypervisor_send_reply(conn, HSC_ERR_CREATE, 1, "unable to create NIO UDP for bridge '%s'", argv[0]);
       return (-1);
@@ -436,7 +470,7 @@ static int cmd_add_nio_tap(hypervisor_conn_t *conn, int argc, char *argv[])
       return (-1);
    }
 
-   nio = create_nio_tap(argv[1]);
+   nio = create_nio_tap(argv[1], argc - 2, &argv[2]);
    if (!nio) {
       hypervisor_send_reply(conn, HSC_ERR_CREATE, 1, "unable to create NIO TAP for bridge '%s'", argv[0]);
       return (-1);
@@ -492,7 +526,7 @@ static int cmd_add_nio_linux_raw(hypervisor_conn_t *conn, int argc, char *argv[]
       return (-1);
    }
 
-   nio = create_nio_linux_raw(argv[1]);
+   nio = create_nio_linux_raw(argv[1], argc - 2, &argv[2]);
    if (!nio) {
       hypervisor_send_reply(conn, HSC_ERR_CREATE, 1, "unable to create NIO Linux raw for bridge '%s'", argv[0]);
       return (-1);
@@ -508,6 +542,46 @@ static int cmd_add_nio_linux_raw(hypervisor_conn_t *conn, int argc, char *argv[]
    hypervisor_send_reply(conn, HSC_INFO_OK, 1, "NIO Linux raw added to bridge '%s'", argv[0]);
    return (0);
 }
+
+static int cmd_add_nio_af_xdp(hypervisor_conn_t *conn, int argc, char *argv[])
+{
+   nio_t *nio;
+   bridge_t *bridge;
+   char *end;
+   long value;
+   int queue = 0;
+
+   bridge = find_bridge(argv[0]);
+   if (bridge == NULL) {
+      hypervisor_send_reply(conn, HSC_ERR_NOT_FOUND, 1, "bridge '%s' doesn't exist", argv[0]);
+      return (-1);
+   }
+
+   if (argc == 3) {
+      value = strtol(argv[2], &end, 10);
+      if (end == argv[2] || *end != '\0' || value < 0 || value >= AF_XDP_MAX_QUEUES) {
+         hypervisor_send_reply(conn, HSC_ERR_INV_PARAM, 1, "invalid queue '%s'", argv[2]);
+         return (-1);
+      }
+      queue = value;
+   }
+
+   nio = create_nio_af_xdp(argv[1], queue);
+   if (!nio) {
+      hypervisor_send_reply(conn, HSC_ERR_CREATE, 1, "unable to create NIO AF_XDP for bridge '%s'", argv[0]);
+      return (-1);
+   }
+
+   if (add_nio_to_bridge(conn, bridge, nio) == -1) {
+     free_nio(nio);
+     return (-1);
+   }
+
+   add_nio_desc(nio, "%s queue %d", argv[1], queue);
+
+   hypervisor_send_reply(conn, HSC_INFO_OK, 1, "NIO AF_XDP added to bridge '%s'", argv[0]);
+   return (0);
+}
 #endif
 
 #ifdef __APPLE__
@@ -543,6 +617,9 @@ static int cmd_add_nio_fusion_vmnet(hypervisor_conn_t *conn, int argc, char *arg
 static int cmd_start_capture_bridge(hypervisor_conn_t *conn, int argc, char *argv[])
 {
    char *pcap_linktype = "EN10MB";
+   pcap_capture_options_t options;
+   pcap_capture_t *capture;
+   int first_option = 2;
    bridge_t *bridge;
 
    bridge = find_bridge(argv[0]);
@@ -556,13 +633,23 @@ static int cmd_start_capture_bridge(hypervisor_conn_t *conn, int argc, char *arg
       return (-1);
    }
 
-   if (argc == 3)
-     pcap_linktype = argv[2];
+   /* the link type is optional, options are name=value */
+   if (argc > 2 && !strchr(argv[2], '='))
+     pcap_linktype = argv[first_option++];
 
-   if (!(bridge->capture = create_pcap_capture(argv[1], pcap_linktype))) {
+   if (pcap_capture_parse_options(&options, argc - first_option, &argv[first_option]) == -1) {
+      hypervisor_send_reply(conn, HSC_ERR_INV_PARAM, 1, "invalid packet capture options");
+      return (-1);
+   }
+   /* interfaces in the order of the filter directions */
+   pcap_capture_add_nio_interface(&options, bridge->name, "source", bridge->source_nio);
+   pcap_capture_add_nio_interface(&options, bridge->name, "destination", bridge->destination_nio);
+
+   if (!(capture = create_pcap_capture(argv[1], pcap_linktype, &options))) {
       hypervisor_send_reply(conn, HSC_ERR_START, 1, "packet capture could not be started on bridge '%s'", argv[0]);
       return (-1);
    }
+   __atomic_store_n(&bridge->capture, capture, __ATOMIC_SEQ_CST);
 
    hypervisor_send_reply(conn, HSC_INFO_OK, 1, "packet capture started on bridge '%s'", argv[0]);
    return (0);
@@ -583,12 +670,113 @@ static int cmd_stop_capture_bridge(hypervisor_conn_t *conn, int argc, char *argv
       return (-1);
    }
 
-   free_pcap_capture(bridge->capture);
-   bridge->capture = NULL;
+   stop_pcap_capture(&bridge->capture);
    hypervisor_send_reply(conn, HSC_INFO_OK, 1, "packet capture stopped on bridge '%s'", argv[0]);
    return (0);
 }
 
+static int cmd_start_flight_recorder(hypervisor_conn_t *conn, int argc, char *argv[])
+{
+   char *pcap_linktype = "EN10MB";
+   pcap_capture_options_t options;
+   pcap_capture_t *recorder;
+   int first_option = 2;
+   bridge_t *bridge;
+   int size;
+
+   bridge = find_bridge(argv[0]);
+   if (bridge == NULL) {
+      hypervisor_send_reply(conn, HSC_ERR_NOT_FOUND, 1, "bridge '%s' doesn't exist", argv[0]);
+      return (-1);
+   }
+
+   if (bridge->recorder != NULL) {
+      hypervisor_send_reply(conn, HSC_ERR_START, 1, "flight recorder is already active on bridge '%s'", argv[0]);
+      return (-1);
+   }
+
+   /* history size in MB */
+   if ((size = atoi(argv[1])) <= 0) {
+      hypervisor_send_reply(conn, HSC_ERR_INV_PARAM, 1, "invalid flight recorder size '%s'", argv[1]);
+      return (-1);
+   }
+
+   /* the link type is optional, options are name=value */
+   if (argc > 2 && !strchr(argv[2], '='))
+     pcap_linktype = argv[first_option++];
+
+   if (pcap_capture_parse_options(&options, argc - first_option, &argv[first_option]) == -1) {
+      hypervisor_send_reply(conn, HSC_ERR_INV_PARAM, 1, "invalid flight recorder options");
+      return (-1);
+   }
+   pcap_capture_add_nio_interface(&options, bridge->name, "source", bridge->source_nio);
+   pcap_capture_add_nio_interface(&options, bridge->name, "destination", bridge->destination_nio);
+
+   if (!(recorder = create_flight_recorder((size_t)size << 20, pcap_linktype, &options))) {
+      hypervisor_send_reply(conn, HSC_ERR_START, 1, "flight recorder could not be started on bridge '%s'", argv[0]);
+      return (-1);
+   }
+   __atomic_store_n(&bridge->recorder, recorder, __ATOMIC_SEQ_CST);
+
+   hypervisor_send_reply(conn, HSC_INFO_OK, 1, "flight recorder started on bridge '%s'", argv[0]);
+   return (0);
+}
+
+static int cmd_dump_flight_recorder(hypervisor_conn_t *conn, int argc, char *argv[])
+{
+   bridge_t *bridge;
+
+   bridge = find_bridge(argv[0]);
+   if (bridge == NULL) {
+      hypervisor_send_reply(conn, HSC_ERR_NOT_FOUND, 1, "bridge '%s' doesn't exist", argv[0]);
+      return (-1);
+   }
+
+   if (bridge->recorder == NULL) {
+      hypervisor_send_reply(conn, HSC_ERR_START, 1, "no flight recorder active on bridge '%s'", argv[0]);
+      return (-1);
+   }
+
+   if (pcap_capture_dump(bridge->recorder, argv[1]) == -1) {
+      hypervisor_send_reply(conn, HSC_ERR_FILE, 1, "flight recorder of bridge '%s' could not be dumped to '%s'", argv[0], argv[1]);
+      return (-1);
+   }
+
+   hypervisor_send_reply(conn, HSC_INFO_OK, 1, "flight recorder of bridge '%s' dumped to '%s'", argv[0], argv[1]);
+   return (0);
+}
+
+static int cmd_stop_flight_recorder(hypervisor_conn_t *conn, int argc, char *argv[])
+{
+   bridge_t *bridge;
+
+   bridge = find_bridge(argv[0]);
+   if (bridge == NULL) {
+      hypervisor_send_reply(conn, HSC_ERR_NOT_FOUND, 1, "bridge '%s' doesn't exist", argv[0]);
+      return (-1);
+   }
+
+   if (bridge->recorder == NULL) {
+      hypervisor_send_reply(conn, HSC_ERR_START, 1, "no flight recorder active on bridge '%s'", argv[0]);
+      return (-1);
+   }
+
+   stop_pcap_capture(&bridge->recorder);
+   hypervisor_send_reply(conn, HSC_INFO_OK, 1, "flight recorder stopped on bridge '%s'", argv[0]);
+   return (0);
+}
+
+/* Run the leading drop filters of a bridge in the kernel again after a change */
+static void update_sock_filters(bridge_t *bridge)
+{
+#ifdef LINUX_RAW
+   if (bridge->source_nio != NULL)
+      sock_filter_update(bridge->source_nio, bridge->packet_filters);
+   if (bridge->destination_nio != NULL)
+      sock_filter_update(bridge->destination_nio, bridge->packet_filters);
+#endif
+}
+
 static int cmd_add_packet_filter(hypervisor_conn_t *conn, int argc, char *argv[])
 {
    bridge_t *bridge;
@@ -600,9 +788,11 @@ static int cmd_add_packet_filter(hypervisor_conn_t *conn, int argc, char *argv[]
       return (-1);
    }
 
-   res = add_packet_filter(&bridge->packet_filters, argv[1], argv[2], argc-3, &argv[3]);
-   if (!res)
+   res = add_packet_filter(&bridge->packet_filters, &bridge->filter_chain, argv[1], argv[2], argc-3, &argv[3]);
+   if (!res) {
+      update_sock_filters(bridge);
       hypervisor_send_reply(conn, HSC_INFO_OK, 1, "Filter '%s' type '%s' added to bridge '%s'", argv[1], argv[2], argv[0]);
+   }
    else
       hypervisor_send_reply(conn, HSC_ERR_CREATE, 1, "Failed to add filter '%s'", argv[1]);
    return (0);
@@ -619,9 +809,11 @@ static int cmd_delete_packet_filter(hypervisor_conn_t *conn, int argc, char *arg
       return (-1);
    }
 
-   res = delete_packet_filter(&bridge->packet_filters, argv[1]);
-   if (!res)
+   res = delete_packet_filter(&bridge->packet_filters, &bridge->filter_chain, argv[1]);
+   if (!res) {
+      update_sock_filters(bridge);
       hypervisor_send_reply(conn, HSC_INFO_OK, 1, "Filter '%s' delete from bridge '%s'", argv[1], argv[0]);
+   }
    else
       hypervisor_send_reply(conn, HSC_ERR_CREATE, 1, "Failed to delete filter '%s'", argv[1]);
    return (0);
@@ -637,8 +829,8 @@ static int cmd_reset_packet_filters(hypervisor_conn_t *conn, int argc, char *arg
       return (-1);
    }
 
-   free_packet_filters(bridge->packet_filters);
-   bridge->packet_filters = NULL;
+   reset_packet_filters(&bridge->packet_filters, &bridge->filter_chain);
+   update_sock_filters(bridge);
 
    hypervisor_send_reply(conn, HSC_INFO_OK, 1, "OK");
    return (0);
@@ -692,20 +884,24 @@ static hypervisor_cmd_t bridge_cmd_array[] = {
    { "get_stats", 1, 1, cmd_get_stats_bridge, NULL },
    { "reset_stats", 1, 1, cmd_reset_stats_bridge, NULL },
    { "rename", 2, 2, cmd_rename_bridge, NULL },
-   { "add_nio_udp", 4, 4, cmd_add_nio_udp, NULL },
+   { "add_nio_udp", 4, 6, cmd_add_nio_udp, NULL },
    { "remove_nio_udp", 4, 4, cmd_delete_nio_udp, NULL }, /* kept for compatibility */
    { "delete_nio_udp", 4, 4, cmd_delete_nio_udp, NULL },
    { "add_nio_unix", 3, 3, cmd_add_nio_unix, NULL },
-   { "add_nio_tap", 2, 2, cmd_add_nio_tap, NULL },
+   { "add_nio_tap", 2, 8, cmd_add_nio_tap, NULL },
    { "add_nio_ethernet", 2, 2, cmd_add_nio_ethernet, NULL },
 #ifdef LINUX_RAW
-   { "add_nio_linux_raw", 2, 2, cmd_add_nio_linux_raw, NULL },
+   { "add_nio_linux_raw", 2, 8, cmd_add_nio_linux_raw, NULL },
+   { "add_nio_af_xdp", 2, 3, cmd_add_nio_af_xdp, NULL },
 #endif
 #ifdef __APPLE__
    { "add_nio_fusion_vmnet", 2, 2, cmd_add_nio_fusion_vmnet, NULL },
 #endif
-   { "start_capture", 2, 3, cmd_start_capture_bridge, NULL },
+   { "start_capture", 2, 11, cmd_start_capture_bridge, NULL },
    { "stop_capture", 1, 1, cmd_stop_capture_bridge, NULL },
+   { "start_flight_recorder", 2, 10, cmd_start_flight_recorder, NULL },
+   { "dump_flight_recorder", 2, 2, cmd_dump_flight_recorder, NULL },
+   { "stop_flight_recorder", 1, 1, cmd_stop_flight_recorder, NULL },
    { "add_packet_filter", 2, 10, cmd_add_packet_filter, NULL },
    { "delete_packet_filter", 2, 2, cmd_delete_packet_filter, NULL },
    { "reset_packet_filters", 1, 1, cmd_reset_packet_filters, NULL },
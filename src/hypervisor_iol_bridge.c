@@ -33,6 +33,8 @@
 #include "hypervisor_iol_bridge.h"
 #include "pcap_capture.h"
 #include "packet_filter.h"
+#include "packet_pool.h"
+#include "delay_queue.h"
 
 iol_bridge_t *iol_bridge_list = NULL;
 
@@ -51,14 +53,78 @@ static iol_bridge_t *find_bridge(char *bridge_name)
    return (NULL);
 }
 
+/* Cleanup handler releasing the packet buffer of a listener */
+static void free_listener_buf(void *data)
+{
+   packet_buf_free(*(packet_buf_t **)data);
+}
+
+/* Take a packet buffer for a listener from the shared pool */
+static packet_buf_t *alloc_listener_buf(void)
+{
+   packet_pool_t *pool;
+   packet_buf_t *buf = NULL;
+
+   if ((pool = packet_pool_get(MAX_MTU)) != NULL)
+      buf = packet_buf_alloc(pool);
+   if (buf == NULL)
+      fprintf(stderr, "unable to allocate a packet buffer\n");
+   return (buf);
+}
+
+/* Send delayed packets to the IOL instance of a port, called from the delay thread */
+static int send_delayed_to_iol(void *data, void *ctx, struct iovec *pkts, int count)
+{
+   iol_nio_t *iol_nio = ctx;
+   unsigned char *hdr;
+   int i;
+
+   for (i = 0; i < count; i++) {
+      hdr = (unsigned char *)pkts[i].iov_base - IOL_HDR_SIZE;
+      memcpy(hdr, &(iol_nio->header), sizeof(iol_nio->header));
+      if (sendto(iol_nio->iol_bridge_sock, hdr, pkts[i].iov_len + IOL_HDR_SIZE, 0, (struct sockaddr *)&iol_nio->iol_sockaddr, sizeof(iol_nio->iol_sockaddr)) == -1)
+         perror("sendto");
+   }
+   return (count);
+}
+
+/* Send delayed packets from an IOL instance to the NIO of their port, called from the delay thread */
+static int send_delayed_to_nio(void *data, void *ctx, struct iovec *pkts, int count)
+{
+   iol_nio_t *iol_nio = ctx;
+   nio_t *nio = iol_nio->destination_nio;
+   ssize_t bytes_sent;
+   int i;
+
+   if (nio == NULL)
+      return (-1);
+
+   for (i = 0; i < count; i++) {
+      bytes_sent = nio->send(nio->dptr, pkts[i].iov_base, pkts[i].iov_len);
+      if (bytes_sent == -1) {
+         perror("send");
+         continue;
+      }
+      /* the IOL listener of the port updates the same counters */
+      __atomic_fetch_add(&nio->packets_out, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&nio->bytes_out, bytes_sent, __ATOMIC_RELAXED);
+   }
+   return (count);
+}
+
 void *iol_nio_listener(void *data)
 {
    iol_nio_t *iol_nio = data;
    iol_bridge_t *bridge;
    ssize_t bytes_received, bytes_sent;
-   unsigned char pkt[IOL_HDR_SIZE + MAX_MTU];
+   packet_buf_t *buf;
+   struct iovec pkt;
+   unsigned char *hdr;
    nio_t *nio = iol_nio->destination_nio;
    int drop_packet;
+   u_int64_t now, departure;
+   packet_filter_chain_t *chain;
+   packet_filter_entry_t *filter;
 
    printf("Listener thread for IOL instance %d on port %d/%d has started\n", iol_nio->iol_id, iol_nio->port.bay, iol_nio->port.unit);
    bridge = find_bridge(iol_nio->parent_bridge_name);
@@ -67,17 +133,29 @@ void *iol_nio_listener(void *data)
       pthread_exit(NULL);
    }
 
+   if ((buf = alloc_listener_buf()) == NULL)
+      pthread_exit(NULL);
+   pthread_cleanup_push(free_listener_buf, &buf);
+
    while (1)
      {
-        /* Put received bytes after the (absent) IOU header */
+        /* a buffer still shared with someone else is replaced by a new one */
+        if ((buf = packet_buf_reclaim(buf)) == NULL) {
+            fprintf(stderr, "unable to allocate a packet buffer\n");
+            exit(EXIT_FAILURE);
+        }
+
+        /* Receive the frame after the headroom, the IOU header is pushed in front of it */
         drop_packet = FALSE;
-        bytes_received = nio_recv(nio, &pkt[IOL_HDR_SIZE], MAX_MTU);
-        if (bytes_received == -1) {
+        pkt.iov_base = buf->data;
+        pkt.iov_len = MAX_MTU;
+        if (nio_recv_batch(nio, &pkt, 1) == -1) {
             perror("recv");
             if (errno == ECONNREFUSED || errno == ENETDOWN)
                continue;
             exit(EXIT_FAILURE);
         }
+        bytes_received = pkt.iov_len;
 
         if (bytes_received > MAX_MTU) {
             fprintf(stderr, "received frame is %zd bytes (maximum is %d bytes)\n", bytes_received, MAX_MTU);
@@ -90,41 +168,51 @@ void *iol_nio_listener(void *data)
         if (debug_level > 0) {
             printf("Received %zd bytes from destination NIO on IOL bridge '%s'\n", bytes_received, bridge->name);
             if (debug_level > 1)
-               dump_packet(stdout, &pkt[IOL_HDR_SIZE], bytes_received);
+               dump_packet(stdout, pkt.iov_base, bytes_received);
         }
 
         /* filter the packet if there is a filter configured */
-        if (iol_nio->packet_filters != NULL) {
-             packet_filter_t *filter = iol_nio->packet_filters;
-             packet_filter_t *next;
-             while (filter != NULL) {
-                 if (filter->handler(&pkt[IOL_HDR_SIZE], bytes_received, filter->data) == FILTER_ACTION_DROP) {
+        now = departure = 0;
+        if ((chain = packet_filter_chain_enter(&iol_nio->filter_chain)) != NULL) {
+             now = departure = delay_queue_now();
+             for (filter = chain->entries; filter != chain->entries + chain->count; filter++) {
+                 if (filter->handler(pkt.iov_base, bytes_received, filter->data) == FILTER_ACTION_DROP ||
+                     (filter->schedule != NULL && filter->schedule(pkt.iov_base, bytes_received, FILTER_DIRECTION_FORWARD, &departure, filter->data) == FILTER_ACTION_DROP)) {
                      if (debug_level > 0)
                         printf("Packet dropped by packet filter '%s' from destination NIO on IOL bridge '%s'\n", filter->name, bridge->name);
                      drop_packet = TRUE;
                      break;
                  }
-                 next = filter->next;
-                 filter = next;
              }
+             packet_filter_chain_exit();
          }
 
-        if (drop_packet == TRUE)
+        if (drop_packet == TRUE) {
+           pcap_capture_filtered(&iol_nio->capture, FILTER_DIRECTION_FORWARD, 1);
            continue;
+        }
 
         /* Dump the packet to a PCAP file if capture is activated */
-        pcap_capture_packet(iol_nio->capture, &pkt[IOL_HDR_SIZE], bytes_received);
+        pcap_capture_packet(&iol_nio->capture, FILTER_DIRECTION_FORWARD, pkt.iov_base, bytes_received);
+
+        /* Packets held by a filter are sent later by the delay thread */
+        if (departure > now) {
+            if (delay_queue_add(bridge->iol_delay_queue, iol_nio, pkt.iov_base, bytes_received, packet_buf_contains(buf, pkt.iov_base) ? buf : NULL, departure) == -1 && debug_level > 0)
+               printf("Packet dropped by the delay queue of IOL bridge '%s'\n", bridge->name);
+            continue;
+        }
 
         /* Add the length of the IOU header we'll be sending */
         bytes_received += IOL_HDR_SIZE;
 
 
        /* Send the packet to the IOU node(s) in our segment. For each
-        * node, we copy the pre-calculated IOU header into the
-        * beginning of the buffer before sending.
+        * node, the pre-calculated IOU header is pushed into the
+        * headroom in front of the frame before sending.
         */
-        memcpy(pkt, &(iol_nio->header), sizeof(iol_nio->header));
-        bytes_sent = sendto(iol_nio->iol_bridge_sock, pkt, bytes_received, 0, (struct sockaddr *)&iol_nio->iol_sockaddr, sizeof(iol_nio->iol_sockaddr));
+        hdr = (unsigned char *)pkt.iov_base - IOL_HDR_SIZE;
+        memcpy(hdr, &(iol_nio->header), sizeof(iol_nio->header));
+        bytes_sent = sendto(iol_nio->iol_bridge_sock, hdr, bytes_received, 0, (struct sockaddr *)&iol_nio->iol_sockaddr, sizeof(iol_nio->iol_sockaddr));
         if (bytes_sent == -1) {
            perror("sendto");
            if (errno == ECONNREFUSED || errno == ENETDOWN || errno == ENOENT)
@@ -133,6 +221,7 @@ void *iol_nio_listener(void *data)
         }
      }
 
+  pthread_cleanup_pop(1);
   printf("Listener thread for IOL instance %d on port %d/%d has stopped\n", iol_nio->iol_id, iol_nio->port.bay, iol_nio->port.unit);
   pthread_exit(NULL);
 }
@@ -142,15 +231,30 @@ void *iol_bridge_listener(void *data)
    iol_bridge_t *bridge = data;
    nio_t *nio;
    ssize_t bytes_received, bytes_sent;
-   unsigned char pkt[IOL_HDR_SIZE + MAX_MTU];
+   packet_buf_t *buf;
+   unsigned char *pkt;
    unsigned int port;
    int drop_packet;
+   u_int64_t now, departure;
+   packet_filter_chain_t *chain;
+   packet_filter_entry_t *filter;
 
    printf("IOL bridge listener thread for %s with ID %d has started\n", bridge->name, bridge->application_id);
+   if ((buf = alloc_listener_buf()) == NULL)
+      pthread_exit(NULL);
+   pthread_cleanup_push(free_listener_buf, &buf);
+
    while (1)
     {
-       /* This receives from an IOL instance */
+       /* a buffer still shared with someone else is replaced by a new one */
+       if ((buf = packet_buf_reclaim(buf)) == NULL) {
+           fprintf(stderr, "unable to allocate a packet buffer\n");
+           exit(EXIT_FAILURE);
+       }
+
+       /* This receives from an IOL instance, the IOL header goes into the headroom */
        drop_packet = FALSE;
+       pkt = packet_buf_push(buf, IOL_HDR_SIZE);
        bytes_received = read(bridge->iol_bridge_sock, pkt, IOL_HDR_SIZE + MAX_MTU);
        if (bytes_received == -1) {
            perror("recv");
@@ -172,38 +276,47 @@ void *iol_bridge_listener(void *data)
        port = pkt[IOL_DST_PORT];
 
        /* Send on the packet, minus the IOL header */
-       bytes_received -= IOL_HDR_SIZE;
+       buf->len = bytes_received;
+       pkt = packet_buf_pull(buf, IOL_HDR_SIZE);
+       bytes_received = buf->len;
        nio = bridge->port_table[port].destination_nio;
 
         /* filter the packet if there is a filter configured */
-       if (bridge->port_table[port].packet_filters != NULL) {
-            packet_filter_t *filter = bridge->port_table[port].packet_filters;
-            packet_filter_t *next;
-            while (filter != NULL) {
-                if (filter->handler(&pkt[IOL_HDR_SIZE], bytes_received, filter->data) == FILTER_ACTION_DROP) {
+       now = departure = 0;
+       if ((chain = packet_filter_chain_enter(&bridge->port_table[port].filter_chain)) != NULL) {
+            now = departure = delay_queue_now();
+            for (filter = chain->entries; filter != chain->entries + chain->count; filter++) {
+                if (filter->handler(pkt, bytes_received, filter->data) == FILTER_ACTION_DROP ||
+                    (filter->schedule != NULL && filter->schedule(pkt, bytes_received, FILTER_DIRECTION_REVERSE, &departure, filter->data) == FILTER_ACTION_DROP)) {
                     if (debug_level > 0)
                        printf("Packet dropped by packet filter '%s' from IOL instance on IOL bridge '%s'\n", filter->name, bridge->name);
                     drop_packet = TRUE;
                     break;
                 }
-                next = filter->next;
-                filter = next;
             }
+            packet_filter_chain_exit();
        }
 
-       if (drop_packet == TRUE)
+       if (drop_packet == TRUE) {
+          pcap_capture_filtered(&bridge->port_table[port].capture, FILTER_DIRECTION_REVERSE, 1);
           continue;
+       }
 
        /* Dump the packet to a PCAP file if capture is activated */
-       pcap_capture_packet(bridge->port_table[port].capture, &pkt[IOL_HDR_SIZE], bytes_received);
+       pcap_capture_packet(&bridge->port_table[port].capture, FILTER_DIRECTION_REVERSE, pkt, bytes_received);
 
        /* Destination NIO hasn't been created yet */
        if (nio == NULL)
           continue;
 
-       bytes_sent = nio->send(nio->dptr, &pkt[IOL_HDR_SIZE], bytes_received);
-       nio->packets_out++;
-       nio->bytes_out += bytes_sent;
+       /* Packets held by a filter are sent later by the delay thread */
+       if (departure > now) {
+          if (delay_queue_add(bridge->nio_delay_queue, &bridge->port_table[port], pkt, bytes_received, buf, departure) == -1 && debug_level > 0)
+             printf("Packet dropped by the delay queue of IOL bridge '%s'\n", bridge->name);
+          continue;
+       }
+
+       bytes_sent = nio->send(nio->dptr, pkt, bytes_received);
        if (bytes_sent == -1) {
           perror("send");
 
@@ -213,8 +326,12 @@ void *iol_bridge_listener(void *data)
 
           exit(EXIT_FAILURE);
        }
+       /* the delay thread updates the same counters */
+       __atomic_fetch_add(&nio->packets_out, 1, __ATOMIC_RELAXED);
+       __atomic_fetch_add(&nio->bytes_out, bytes_sent, __ATOMIC_RELAXED);
     }
 
+  pthread_cleanup_pop(1);
   printf("IOL bridge listener thread for %s with ID %d has stopped\n", bridge->name, bridge->application_id);
   pthread_exit(NULL);
 }
@@ -397,7 +514,11 @@ static int cmd_create_bridge(hypervisor_conn_t *conn, int argc, char *argv[])
    }
 
    if (!(new_bridge->port_table = calloc(MAX_PORTS, sizeof *(new_bridge->port_table))))
-      goto memory_error;
+      goto socket_error;
+   if (!(new_bridge->iol_delay_queue = delay_queue_create(send_delayed_to_iol, NULL, NULL)))
+      goto socket_error;
+   if (!(new_bridge->nio_delay_queue = delay_queue_create(send_delayed_to_nio, NULL, NULL)))
+      goto socket_error;
    for (i = 0; i < MAX_PORTS; i++)
    {
       new_bridge->port_table[i].iol_bridge_sock = new_bridge->iol_bridge_sock;
@@ -406,6 +527,7 @@ static int cmd_create_bridge(hypervisor_conn_t *conn, int argc, char *argv[])
       new_bridge->port_table[i].destination_nio = NULL;
       new_bridge->port_table[i].capture = NULL;
       new_bridge->port_table[i].packet_filters = NULL;
+      new_bridge->port_table[i].filter_chain = NULL;
    }
 
    new_bridge->next = *head;
@@ -413,7 +535,19 @@ static int cmd_create_bridge(hypervisor_conn_t *conn, int argc, char *argv[])
    hypervisor_send_reply(conn, HSC_INFO_OK, 1, "IOL bridge '%s' created", argv[0]);
    return (0);
 
+   socket_error:
+   close(new_bridge->iol_bridge_sock);
+   unlink(new_bridge->bridge_sockaddr.sun_path);
+   unlock_unix_socket(new_bridge->sock_lock, new_bridge->bridge_sockaddr.sun_path);
+
    memory_error:
+   if (new_bridge != NULL) {
+      delay_queue_free(new_bridge->iol_delay_queue);
+      delay_queue_free(new_bridge->nio_delay_queue);
+      free(new_bridge->port_table);
+      free(new_bridge->name);
+      free(new_bridge);
+   }
    hypervisor_send_reply(conn, HSC_ERR_CREATE, 1, "could not create IOL bridge '%s': insufficient memory", argv[0]);
    return (-1);
 }
@@ -448,13 +582,20 @@ static int cmd_delete_bridge(hypervisor_conn_t *conn, int argc, char *argv[])
                 if (bridge->port_table[i].destination_nio != NULL) {
                     pthread_cancel(bridge->port_table[i].tid);
                     pthread_join(bridge->port_table[i].tid, NULL);
+                    delay_queue_flush(bridge->nio_delay_queue, &bridge->port_table[i]);
                     free_pcap_capture(bridge->port_table[i].capture);
-                    free_packet_filters(bridge->port_table[i].packet_filters);
+                    reset_packet_filters(&bridge->port_table[i].packet_filters, &bridge->port_table[i].filter_chain);
                     free_nio(bridge->port_table[i].destination_nio);
                 }
              }
+             delay_queue_free(bridge->iol_delay_queue);
+             delay_queue_free(bridge->nio_delay_queue);
              free(bridge->port_table);
           }
+          else {
+             delay_queue_free(bridge->iol_delay_queue);
+             delay_queue_free(bridge->nio_delay_queue);
+          }
 
           free(bridge);
           hypervisor_send_reply(conn, HSC_INFO_OK, 1, "IOL bridge '%s' deleted", argv[0]);
@@ -528,6 +669,9 @@ static int cmd_stop_bridge(hypervisor_conn_t *conn, int argc, char *argv[])
           pthread_join(bridge->port_table[i].tid, NULL);
       }
    }
+   /* the packets held by delay filters are not sent anymore */
+   delay_queue_flush(bridge->iol_delay_queue, NULL);
+   delay_queue_flush(bridge->nio_delay_queue, NULL);
    bridge->running = FALSE;
    hypervisor_send_reply(conn, HSC_INFO_OK, 1, "IOL bridge '%s' stopped", argv[0]);
    return (0);
@@ -682,8 +826,11 @@ static int create_iol_port_entry(hypervisor_conn_t *conn, iol_bridge_t *bridge,
    if (iol_nio->destination_nio != NULL) {
       pthread_cancel(iol_nio->tid);
       pthread_join(iol_nio->tid, NULL);
-      free_pcap_capture(iol_nio->capture);
-      free_packet_filters(iol_nio->packet_filters);
+      delay_queue_flush(bridge->iol_delay_queue, iol_nio);
+      delay_queue_flush(bridge->nio_delay_queue, iol_nio);
+      /* the bridge thread may still be capturing to the port */
+      stop_pcap_capture(&iol_nio->capture);
+      reset_packet_filters(&iol_nio->packet_filters, &iol_nio->filter_chain);
       free_nio(iol_nio->destination_nio);
    }
 
@@ -715,7 +862,7 @@ static int cmd_add_nio_udp(hypervisor_conn_t *conn, int argc, char *argv[])
       return (-1);
    }
 
-   nio = create_nio_udp(atoi(argv[4]), argv[5], atoi(argv[6]));
+   nio = create_nio_udp(atoi(argv[4]), argv[5], atoi(argv[6]), 0, NULL);
    if (!nio) {
       hypervisor_send_reply(conn, HSC_ERR_CREATE, 1, "unable to create NIO UDP for IOL bridge '%s'", argv[0]);
       return (-1);
@@ -760,8 +907,11 @@ static int cmd_delete_nio_udp(hypervisor_conn_t *conn, int argc, char *argv[])
    if (iol_nio->destination_nio != NULL) {
       pthread_cancel(iol_nio->tid);
       pthread_join(iol_nio->tid, NULL);
-      free_pcap_capture(iol_nio->capture);
-      free_packet_filters(iol_nio->packet_filters);
+      delay_queue_flush(bridge->iol_delay_queue, iol_nio);
+      delay_queue_flush(bridge->nio_delay_queue, iol_nio);
+      /* the bridge thread may still be capturing to the port */
+      stop_pcap_capture(&iol_nio->capture);
+      reset_packet_filters(&iol_nio->packet_filters, &iol_nio->filter_chain);
       free_nio(iol_nio->destination_nio);
    }
 
@@ -773,6 +923,10 @@ static int cmd_delete_nio_udp(hypervisor_conn_t *conn, int argc, char *argv[])
 static int cmd_start_capture_bridge(hypervisor_conn_t *conn, int argc, char *argv[])
 {
    char *pcap_linktype = "EN10MB";
+   pcap_capture_options_t options;
+   pcap_capture_t *capture;
+   int first_option = 4;
+   char port_name[64];
    iol_nio_t *iol_nio;
    iol_bridge_t *bridge;
    unsigned char port_bay;
@@ -804,13 +958,24 @@ static int cmd_start_capture_bridge(hypervisor_conn_t *conn, int argc, char *arg
       return (-1);
    }
 
-   if (argc == 5)
-      pcap_linktype = argv[4];
+   /* the link type is optional, options are name=value */
+   if (argc > 4 && !strchr(argv[4], '='))
+      pcap_linktype = argv[first_option++];
+
+   if (pcap_capture_parse_options(&options, argc - first_option, &argv[first_option]) == -1) {
+      hypervisor_send_reply(conn, HSC_ERR_INV_PARAM, 1, "invalid packet capture options");
+      return (-1);
+   }
+   /* interfaces in the order of the filter directions */
+   snprintf(port_name, sizeof(port_name), "%s %d/%d", bridge->name, port_bay, port_unit);
+   pcap_capture_add_nio_interface(&options, port_name, "NIO", iol_nio->destination_nio);
+   pcap_capture_add_nio_interface(&options, port_name, "IOL", NULL);
 
-   if (!(iol_nio->capture = create_pcap_capture(argv[3], pcap_linktype))) {
+   if (!(capture = create_pcap_capture(argv[3], pcap_linktype, &options))) {
       hypervisor_send_reply(conn, HSC_ERR_START, 1, "packet capture could not be started on bridge '%s'", argv[0]);
       return (-1);
    }
+   __atomic_store_n(&iol_nio->capture, capture, __ATOMIC_SEQ_CST);
 
    hypervisor_send_reply(conn, HSC_INFO_OK, 1, "packet capture started on port %d/%d", port_bay, port_unit);
    return (0);
@@ -849,8 +1014,7 @@ static int cmd_stop_capture_bridge(hypervisor_conn_t *conn, int argc, char *argv
       return (-1);
    }
 
-   free_pcap_capture(iol_nio->capture);
-   iol_nio->capture = NULL;
+   stop_pcap_capture(&iol_nio->capture);
    hypervisor_send_reply(conn, HSC_INFO_OK, 1, "packet capture stopped on port %d/%d", port_bay, port_unit);
    return (0);
 }
@@ -884,7 +1048,7 @@ static int cmd_add_packet_filter(hypervisor_conn_t *conn, int argc, char *argv[]
       return (-1);
    }
 
-   res = add_packet_filter(&iol_nio->packet_filters, argv[3], argv[4], argc-5, &argv[5]);
+   res = add_packet_filter(&iol_nio->packet_filters, &iol_nio->filter_chain, argv[3], argv[4], argc-5, &argv[5]);
    if (!res)
       hypervisor_send_reply(conn, HSC_INFO_OK, 1, "Filter '%s' type '%s' added to bridge '%s'", argv[3], argv[4], argv[0]);
    else
@@ -921,7 +1085,7 @@ static int cmd_delete_packet_filter(hypervisor_conn_t *conn, int argc, char *arg
       return (-1);
    }
 
-   res = delete_packet_filter(&iol_nio->packet_filters, argv[3]);
+   res = delete_packet_filter(&iol_nio->packet_filters, &iol_nio->filter_chain, argv[3]);
    if (!res)
       hypervisor_send_reply(conn, HSC_INFO_OK, 1, "Filter '%s' deleted from bridge '%s'", argv[3], argv[0]);
    else
@@ -957,8 +1121,7 @@ static int cmd_reset_packet_filters(hypervisor_conn_t *conn, int argc, char *arg
       return (-1);
    }
 
-   free_packet_filters(iol_nio->packet_filters);
-   iol_nio->packet_filters = NULL;
+   reset_packet_filters(&iol_nio->packet_filters, &iol_nio->filter_chain);
 
    hypervisor_send_reply(conn, HSC_INFO_OK, 1, "OK");
    return (0);
@@ -975,7 +1138,7 @@ static hypervisor_cmd_t iol_bridge_cmd_array[] = {
    { "rename", 2, 2, cmd_rename_bridge, NULL },
    { "add_nio_udp", 7, 7, cmd_add_nio_udp, NULL },
    { "delete_nio_udp", 3, 3, cmd_delete_nio_udp, NULL },
-   { "start_capture", 4, 5, cmd_start_capture_bridge, NULL },
+   { "start_capture", 4, 13, cmd_start_capture_bridge, NULL },
    { "stop_capture", 3, 3, cmd_stop_capture_bridge, NULL },
    { "add_packet_filter", 4, 15, cmd_add_packet_filter, NULL },
    { "delete_packet_filter", 4, 4, cmd_delete_packet_filter, NULL },
@@ -68,6 +68,7 @@ typedef struct
   struct sockaddr_un iol_sockaddr;
   nio_t *destination_nio;
   packet_filter_t *packet_filters;
+  packet_filter_chain_t *filter_chain;
   unsigned char header[IOL_HDR_SIZE];
   pcap_capture_t *capture;
   pthread_t tid;
@@ -82,6 +83,8 @@ typedef struct iol_bridge {
   struct sockaddr_un bridge_sockaddr;
   pthread_t bridge_tid;
   iol_nio_t *port_table;
+  struct delay_queue *iol_delay_queue;    /* delayed packets to the IOL instances */
+  struct delay_queue *nio_delay_queue;    /* delayed packets to the NIOs */
   struct iol_bridge *next;
 } iol_bridge_t;
 
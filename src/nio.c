@@ -18,16 +18,21 @@
  *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
 
 #include "ubridge.h"
 #include "nio.h"
 #include "pcap_capture.h"
 #include "packet_filter.h"
+#include "nio_uring.h"
+#include "packet_ops.h"
 
 
 nio_t *create_nio(void)
@@ -37,6 +42,8 @@ nio_t *create_nio(void)
    if (!(nio = malloc(sizeof(*nio))))
      return NULL;
    memset(nio, 0, sizeof(*nio));
+   nio->nr_queues = 1;
+   nio->queues[0] = nio;
 
    return nio;
 }
@@ -44,8 +51,11 @@ nio_t *create_nio(void)
 int free_nio(void *data)
 {
    nio_t *nio = data;
+   int i;
 
    if (nio) {
+     for (i = 1; i < nio->nr_queues; i++)
+       free_nio(nio->queues[i]);
      if (nio->desc != NULL)
        free(nio->desc);
      if (nio->free != NULL)
@@ -93,37 +103,243 @@ ssize_t nio_recv(nio_t *nio, void *pkt, size_t max_len)
    return(len);
 }
 
-void dump_packet(FILE *f_output, u_char *pkt, u_int len)
+/*
+ * Send a batch of packets. Returns the number of packets sent, which can be
+ * less than count, or -1 if the first packet could not be sent.
+ */
+int nio_send_batch(nio_t *nio, struct iovec *pkts, int count)
 {
-   u_int x, i = 0, tmp;
+   nio_uring_t *ring;
+   int i;
 
-   while (i < len)
-   {
-      if ((len - i) > 16)
-         x = 16;
-      else x = len - i;
+   if (!nio)
+     return (-1);
 
-      fprintf(f_output, "%4.4x: ", i);
+   /* one submission for the whole burst on the io_uring of the listener thread */
+   if ((ring = nio_uring_thread_ring(nio)) != NULL)
+      return (nio_uring_send_batch(ring, nio, pkts, count));
 
-      for (tmp = 0; tmp < x; tmp++)
-         fprintf(f_output, "%2.2x ",pkt[i + tmp]);
-      for (tmp = x;tmp < 16; tmp++) fprintf(f_output,"   ");
+   if (nio->send_batch != NULL)
+      return (nio->send_batch(nio->dptr, pkts, count));
 
-      for (tmp = 0; tmp < x; tmp++) {
-         char c = pkt[i + tmp];
+   for (i = 0; i < count; i++) {
+      if (nio->send(nio->dptr, pkts[i].iov_base, pkts[i].iov_len) == -1)
+         return (i ? i : -1);
+   }
+   return (count);
+}
 
-         if (((c >= 'A') && (c <= 'Z')) ||
-             ((c >= 'a') && (c <= 'z')) ||
-             ((c >= '0') && (c <= '9')))
-            fprintf(f_output, "%c", c);
-         else
-            fputs(".", f_output);
-      }
+/*
+ * Receive up to count packets, blocking until at least one is available.
+ * The length of each received packet is stored in its iov_len. A NIO may
+ * replace iov_base with a buffer of its own, which stays valid until the
+ * next receive on the NIO, or move it back to push a header into the
+ * NIO_PKT_HEADROOM bytes every buffer has in front of it.
+ */
+int nio_recv_batch(nio_t *nio, struct iovec *pkts, int count)
+{
+   ssize_t len;
+   int received;
+
+   if (!nio)
+     return (-1);
 
-      i += x;
-      fprintf(f_output, "\n");
+   if (nio->recv_batch != NULL) {
+      if ((received = nio->recv_batch(nio->dptr, pkts, count)) <= 0)
+         return (-1);
+      return (received);
    }
 
-   fprintf(f_output, "\n");
+   if ((len = nio->recv(nio->dptr, pkts[0].iov_base, pkts[0].iov_len)) <= 0)
+      return (-1);
+   pkts[0].iov_len = len;
+   return (1);
+}
+
+/* Attach an additional queue to a NIO, the queue is freed with the NIO */
+int nio_add_queue(nio_t *nio, nio_t *queue)
+{
+   if (nio->nr_queues >= NIO_MAX_QUEUES)
+      return (-1);
+
+   nio->queues[nio->nr_queues++] = queue;
+   return (0);
+}
+
+/* File descriptor to wait on for received packets, -1 if there is none */
+int nio_get_fd(nio_t *nio)
+{
+   switch (nio->type) {
+      case NIO_TYPE_UDP:
+         return (nio->u.nio_udp.fd);
+      case NIO_TYPE_TAP:
+         return (nio->u.nio_tap.fd);
+      case NIO_TYPE_LINUX_RAW:
+         return (nio->u.nio_linux_raw.fd);
+      case NIO_TYPE_FUSION_VMNET:
+         return (nio->u.nio_fusion_vmnet.fd);
+      case NIO_TYPE_UNIX:
+         return (nio->u.nio_unix.fd);
+      case NIO_TYPE_AF_XDP:
+         return (nio->u.nio_af_xdp.fd);
+#ifndef CYGWIN
+      case NIO_TYPE_ETHERNET:
+         return (pcap_get_selectable_fd(nio->u.nio_ethernet.pcap_dev));
+#endif
+   }
+   return (-1);
+}
+
+/* Make the receive and send operations of a NIO return EAGAIN instead of blocking */
+int nio_set_nonblock(nio_t *nio)
+{
+   char pcap_errbuf[PCAP_ERRBUF_SIZE];
+   int fd, flags;
+
+   if (nio->type == NIO_TYPE_ETHERNET)
+      return (pcap_setnonblock(nio->u.nio_ethernet.pcap_dev, 1, pcap_errbuf));
+
+   if ((fd = nio_get_fd(nio)) == -1 || (flags = fcntl(fd, F_GETFL)) == -1)
+      return (-1);
+   /* AF_XDP checks it on every empty receive */
+   if (nio->type == NIO_TYPE_AF_XDP)
+      nio->u.nio_af_xdp.nonblock = TRUE;
+   return (fcntl(fd, F_SETFL, flags | O_NONBLOCK));
+}
+
+/*
+ * Wait until a non-blocking NIO can send again, for NIO_TX_WAIT_TIMEOUT
+ * at most so that a full NIO doesn't hold up the other bridges of a
+ * worker thread. Returns -1 with errno set to ETIMEDOUT if it still cannot.
+ */
+int nio_wait_writable(nio_t *nio)
+{
+   struct pollfd pfd;
+   int res;
+
+   if ((pfd.fd = nio_get_fd(nio)) == -1)
+      return (-1);
+   pfd.events = POLLOUT;
+   pfd.revents = 0;
+   if ((res = poll(&pfd, 1, NIO_TX_WAIT_TIMEOUT)) == -1 && errno != EINTR)
+      return (-1);
+   if (res == 0) {
+      errno = ETIMEDOUT;
+      return (-1);
+   }
+   return (0);
+}
+
+static inline u_int nio_hash_mix(u_int hash, const u_char *data, size_t len)
+{
+   size_t i;
+
+   /* FNV-1a */
+   for (i = 0; i < len; i++) {
+      hash ^= data[i];
+      hash *= 16777619;
+   }
+   return (hash);
+}
+
+/*
+ * Compute a hash of the flow a frame belongs to: IP addresses, protocol
+ * and ports when available, the Ethernet header otherwise. Frames of the
+ * same flow always get the same hash.
+ */
+u_int nio_flow_hash(u_char *pkt, size_t len)
+{
+   u_int hash = 2166136261U;
+   size_t offset = 12, l4_offset = 0;
+   u_short ether_type;
+   u_char proto = 0;
+
+   if (len < 14)
+      return (nio_hash_mix(hash, pkt, len));
+
+   ether_type = (pkt[12] << 8) | pkt[13];
+   while ((ether_type == 0x8100 || ether_type == 0x88a8) && len >= offset + 8) {
+      offset += 4;
+      ether_type = (pkt[offset] << 8) | pkt[offset + 1];
+   }
+   offset += 2;
+
+   if (ether_type == 0x0800 && len >= offset + 20) {
+      proto = pkt[offset + 9];
+      hash = nio_hash_mix(hash, &pkt[offset + 12], 8);
+      /* only the first fragment has the ports */
+      if (!(((pkt[offset + 6] << 8) | pkt[offset + 7]) & 0x1fff))
+         l4_offset = offset + (pkt[offset] & 0x0f) * 4;
+   }
+   else if (ether_type == 0x86dd && len >= offset + 40) {
+      proto = pkt[offset + 6];
+      hash = nio_hash_mix(hash, &pkt[offset + 8], 32);
+      l4_offset = offset + 40;
+   }
+   else
+      return (nio_hash_mix(hash, pkt, 14));
+
+   hash = nio_hash_mix(hash, &proto, 1);
+   /* TCP, UDP and SCTP ports */
+   if (l4_offset && (proto == 6 || proto == 17 || proto == 132) && len >= l4_offset + 4)
+      hash = nio_hash_mix(hash, &pkt[l4_offset], 4);
+   return (hash);
+}
+
+#ifdef __linux__
+/* Send a batch of datagrams on a socket with a single sendmmsg() call */
+int nio_sock_send_batch(int fd, struct sockaddr *addr, socklen_t addrlen, struct iovec *pkts, int count)
+{
+   struct mmsghdr msgs[NIO_MAX_BATCH];
+   int i;
+
+   count = m_min(count, NIO_MAX_BATCH);
+   memset(msgs, 0, count * sizeof(struct mmsghdr));
+   for (i = 0; i < count; i++) {
+      msgs[i].msg_hdr.msg_name = addr;
+      msgs[i].msg_hdr.msg_namelen = addrlen;
+      msgs[i].msg_hdr.msg_iov = &pkts[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+   }
+   return (sendmmsg(fd, msgs, count, 0));
+}
+
+/* Receive a batch of datagrams from a socket with a single recvmmsg() call */
+int nio_sock_recv_batch(int fd, struct iovec *pkts, int count)
+{
+   struct mmsghdr msgs[NIO_MAX_BATCH];
+   int i, received;
+
+   count = m_min(count, NIO_MAX_BATCH);
+   memset(msgs, 0, count * sizeof(struct mmsghdr));
+   for (i = 0; i < count; i++) {
+      msgs[i].msg_hdr.msg_iov = &pkts[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+   }
+
+   /* block for the first datagram only, then drain what is already queued */
+   if ((received = recvmmsg(fd, msgs, count, MSG_WAITFORONE, NULL)) > 0) {
+      for (i = 0; i < received; i++)
+         pkts[i].iov_len = msgs[i].msg_len;
+   }
+   return (received);
+}
+#endif
+
+void dump_packet(FILE *f_output, u_char *pkt, u_int len)
+{
+   char lines[64 * PACKET_HEX_LINE_MAX], *p = lines;
+   u_int i;
+
+   /* lines are written in chunks, not byte by byte */
+   for (i = 0; i < len; i += 16) {
+      if (p + PACKET_HEX_LINE_MAX > lines + sizeof(lines)) {
+         fwrite(lines, 1, p - lines, f_output);
+         p = lines;
+      }
+      p += packet_hex_line(p, pkt, i, m_min(len - i, 16));
+   }
+   *p++ = '\n';
+   fwrite(lines, 1, p - lines, f_output);
    fflush(f_output);
 }
@@ -24,12 +24,52 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 #include <pcap.h>
 
 #define m_min(a,b) (((a) < (b)) ? (a) : (b))
+#define m_max(a,b) (((a) > (b)) ? (a) : (b))
 
 #define NIO_MAX_PKT_SIZE    65535
 #define NIO_DEV_MAXLEN      64
+#define NIO_MAX_BATCH       32
+#define NIO_MAX_QUEUES      16
+#define NIO_PKT_HEADROOM    32
+
+/* Longest wait for room to send on a non-blocking NIO, in milliseconds */
+#define NIO_TX_WAIT_TIMEOUT 1
+
+/* Offload information of a frame, same layout as the virtio-net header */
+typedef struct {
+    u_char flags;
+    u_char gso_type;
+    u_short hdr_len;
+    u_short gso_size;
+    u_short csum_start;
+    u_short csum_offset;
+} nio_offload_t;
+
+#define NIO_OFFLOAD_NEEDS_CSUM  0x01
+#define NIO_OFFLOAD_DATA_VALID  0x02
+
+#define NIO_GSO_NONE            0
+#define NIO_GSO_TCPV4           1
+#define NIO_GSO_UDP             3
+#define NIO_GSO_TCPV6           4
+#define NIO_GSO_UDP_L4          5
+#define NIO_GSO_ECN             0x80
+
+/*
+ * NIOs with offload enabled exchange frames with partial checksums and
+ * super-frames. The offload information of each frame of a burst is
+ * stored in the headroom right before the frame data.
+ *
+ * Received frames always have NIO_PKT_HEADROOM bytes in front of them: a
+ * NIO can push a VLAN tag and the bridge an encapsulation header there
+ * instead of moving the frame.
+ */
+#define nio_pkt_offload(pkt)    ((nio_offload_t *)((u_char *)(pkt) - sizeof(nio_offload_t)))
 
 enum {
     NIO_TYPE_UDP = 1,
@@ -38,6 +78,7 @@ enum {
     NIO_TYPE_LINUX_RAW,
     NIO_TYPE_FUSION_VMNET,
     NIO_TYPE_UNIX,
+    NIO_TYPE_AF_XDP,
 };
 
 typedef struct {
@@ -45,6 +86,8 @@ typedef struct {
     int local_port;
     int remote_port;
     char *remote_host;
+    size_t gso_max_frame;       /* largest frame sent with UDP_SEGMENT, 0 if disabled */
+    struct nio_udp_gro *gro;    /* UDP_GRO receive state, NULL if disabled */
 } nio_udp_t;
 
 typedef struct {
@@ -58,6 +101,11 @@ typedef struct {
 typedef struct {
     int fd;
     int dev_id;
+    unsigned char *ring_map;
+    size_t ring_map_size;
+    struct nio_linux_raw_ring *rx_ring;
+    struct nio_linux_raw_ring *tx_ring;
+    u_long rx_dropped;          /* frames of the RX ring truncated by the kernel or too large */
 } nio_linux_raw_t;
 
 typedef struct {
@@ -71,9 +119,21 @@ typedef struct {
 } nio_unix_t;
 
 typedef struct {
+    int fd;
+    int nonblock;       /* set by nio_set_nonblock */
+    u_long tx_dropped;  /* frames too large for the UMEM, without a free frame to copy them to, or facing a full TX ring */
+    struct nio_af_xdp_sock *xsk;
+} nio_af_xdp_t;
+
+typedef struct nio {
     u_int type;
     void *dptr;
     char *desc;
+    int offload;    /* frames carry offload information */
+
+    /* receive/transmit queues, queues[0] is the NIO itself */
+    int nr_queues;
+    struct nio *queues[NIO_MAX_QUEUES];
 
     union {
         nio_udp_t nio_udp;
@@ -82,23 +142,39 @@ typedef struct {
         nio_linux_raw_t nio_linux_raw;
         nio_fusion_vmnet_t nio_fusion_vmnet;
         nio_unix_t nio_unix;
+        nio_af_xdp_t nio_af_xdp;
     } u;
 
     ssize_t (*send)(void *nio, void *pkt, size_t len);
     ssize_t (*recv)(void *nio, void *pkt, size_t len);
+    int (*send_batch)(void *nio, struct iovec *pkts, int count);
+    int (*recv_batch)(void *nio, struct iovec *pkts, int count);
     void (*free)(void *nio);
 
     ssize_t packets_in, packets_out;
     ssize_t bytes_in, bytes_out;
+    ssize_t gso_dropped;        /* super-frames that could not be segmented */
+    ssize_t full_dropped;       /* frames dropped because the transmit queue stayed full */
 
 } nio_t;
 
 nio_t *create_nio(void);
-void add_nio_desc(nio_t *nio, const char *fmt, ...);
+void add_nio_desc(nio_t *nio, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
 int free_nio(void *data);
 
 ssize_t nio_send(nio_t *nio, void *pkt, size_t len);
 ssize_t nio_recv(nio_t *nio, void *pkt, size_t max_len);
+int nio_send_batch(nio_t *nio, struct iovec *pkts, int count);
+int nio_recv_batch(nio_t *nio, struct iovec *pkts, int count);
+int nio_add_queue(nio_t *nio, nio_t *queue);
+int nio_get_fd(nio_t *nio);
+int nio_set_nonblock(nio_t *nio);
+int nio_wait_writable(nio_t *nio);
+u_int nio_flow_hash(u_char *pkt, size_t len);
+#ifdef __linux__
+int nio_sock_send_batch(int fd, struct sockaddr *addr, socklen_t addrlen, struct iovec *pkts, int count);
+int nio_sock_recv_batch(int fd, struct iovec *pkts, int count);
+#endif
 void dump_packet(FILE *f_output, u_char *pkt, u_int len);
 
 #endif /* !NIO_H_ */
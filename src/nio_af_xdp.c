@@ -0,0 +1,686 @@
+/*
+ *   This file is part of ubridge, a program to bridge network interfaces
+ *   to UDP tunnels.
+ *
+ *   Copyright (C) 2026 GNS3 Technologies Inc.
+ *
+ *   ubridge is free software: you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ubridge is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+
+/* PCAP defines its own struct bpf_insn */
+#define bpf_insn ebpf_insn
+#include <linux/bpf.h>
+#undef bpf_insn
+
+#include "ubridge.h"
+#include "nio_af_xdp.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+/* XDP program and socket map, shared by the NIOs bound to queues of the same interface */
+struct nio_af_xdp_prog {
+   int ifindex;
+   int skb_mode;
+   int prog_fd;
+   int map_fd;
+   int link_fd;
+   int refcount;
+   struct nio_af_xdp_prog *next;
+};
+
+static struct nio_af_xdp_prog *prog_list = NULL;
+static packet_pool_t *umem_pool = NULL;
+static pthread_mutex_t prog_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+   return (syscall(__NR_bpf, cmd, attr, sizeof(*attr)));
+}
+
+/* Redirect the frames of each queue to the socket bound to it, the kernel gets the others */
+static int nio_af_xdp_load_program(int map_fd)
+{
+   struct ebpf_insn insns[] = {
+      /* r2 = ctx->rx_queue_index */
+      { BPF_LDX | BPF_MEM | BPF_W, 2, 1, offsetof(struct xdp_md, rx_queue_index), 0 },
+      /* r1 = socket map */
+      { BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, map_fd },
+      { 0, 0, 0, 0, 0 },
+      /* r3 = action if the queue has no socket */
+      { BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS },
+      { BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map },
+      { BPF_JMP | BPF_EXIT, 0, 0, 0, 0 },
+   };
+   static char license[] = "GPL";
+   union bpf_attr attr;
+
+   memset(&attr, 0, sizeof(attr));
+   attr.prog_type = BPF_PROG_TYPE_XDP;
+   attr.insns = (unsigned long)insns;
+   attr.insn_cnt = sizeof(insns) / sizeof(insns[0]);
+   attr.license = (unsigned long)license;
+   return (sys_bpf(BPF_PROG_LOAD, &attr));
+}
+
+/* Attach the program to the interface, it is detached when the link is closed */
+static int nio_af_xdp_attach_program(struct nio_af_xdp_prog *prog, int skb_mode)
+{
+   union bpf_attr attr;
+
+   memset(&attr, 0, sizeof(attr));
+   attr.link_create.prog_fd = prog->prog_fd;
+   attr.link_create.target_ifindex = prog->ifindex;
+   attr.link_create.attach_type = BPF_XDP;
+   attr.link_create.flags = skb_mode ? XDP_FLAGS_SKB_MODE : XDP_FLAGS_DRV_MODE;
+   if ((prog->link_fd = sys_bpf(BPF_LINK_CREATE, &attr)) == -1)
+      return (-1);
+   prog->skb_mode = skb_mode;
+   return (0);
+}
+
+static void nio_af_xdp_put_program(struct nio_af_xdp_prog *prog)
+{
+   struct nio_af_xdp_prog **p;
+
+   pthread_mutex_lock(&prog_lock);
+   if (--prog->refcount == 0) {
+      for (p = &prog_list; *p != NULL; p = &(*p)->next) {
+         if (*p == prog) {
+            *p = prog->next;
+            break;
+         }
+      }
+      if (prog->link_fd != -1)
+         close(prog->link_fd);
+      if (prog->prog_fd != -1)
+         close(prog->prog_fd);
+      if (prog->map_fd != -1)
+         close(prog->map_fd);
+      free(prog);
+   }
+   pthread_mutex_unlock(&prog_lock);
+}
+
+/* Get the program of the interface, loading it in driver mode if possible, generic mode otherwise */
+static struct nio_af_xdp_prog *nio_af_xdp_get_program(int ifindex)
+{
+   struct nio_af_xdp_prog *prog;
+   union bpf_attr attr;
+
+   pthread_mutex_lock(&prog_lock);
+   for (prog = prog_list; prog != NULL; prog = prog->next) {
+      if (prog->ifindex == ifindex) {
+         prog->refcount++;
+         pthread_mutex_unlock(&prog_lock);
+         return (prog);
+      }
+   }
+
+   if (!(prog = calloc(1, sizeof(*prog)))) {
+      fprintf(stderr, "nio_af_xdp_get_program: insufficient memory\n");
+      pthread_mutex_unlock(&prog_lock);
+      return (NULL);
+   }
+   prog->ifindex = ifindex;
+   prog->prog_fd = prog->link_fd = -1;
+   prog->refcount = 1;
+
+   memset(&attr, 0, sizeof(attr));
+   attr.map_type = BPF_MAP_TYPE_XSKMAP;
+   attr.key_size = sizeof(int);
+   attr.value_size = sizeof(int);
+   attr.max_entries = AF_XDP_MAX_QUEUES;
+   if ((prog->map_fd = sys_bpf(BPF_MAP_CREATE, &attr)) == -1) {
+      fprintf(stderr, "nio_af_xdp_get_program: unable to create the socket map: %s\n", strerror(errno));
+      goto error;
+   }
+   if ((prog->prog_fd = nio_af_xdp_load_program(prog->map_fd)) == -1) {
+      fprintf(stderr, "nio_af_xdp_get_program: unable to load the XDP program: %s\n", strerror(errno));
+      goto error;
+   }
+   if (nio_af_xdp_attach_program(prog, FALSE) == -1 && nio_af_xdp_attach_program(prog, TRUE) == -1) {
+      fprintf(stderr, "nio_af_xdp_get_program: unable to attach the XDP program: %s\n", strerror(errno));
+      goto error;
+   }
+
+   prog->next = prog_list;
+   prog_list = prog;
+   pthread_mutex_unlock(&prog_lock);
+   return (prog);
+
+ error:
+   if (prog->prog_fd != -1)
+      close(prog->prog_fd);
+   if (prog->map_fd != -1)
+      close(prog->map_fd);
+   free(prog);
+   pthread_mutex_unlock(&prog_lock);
+   return (NULL);
+}
+
+/* Get the UMEM every socket registers, created on first use and kept for the life of the process */
+static packet_pool_t *nio_af_xdp_get_umem(void)
+{
+   size_t len = (size_t)AF_XDP_UMEM_FRAMES * AF_XDP_FRAME_SIZE;
+   void *region;
+
+   /* the kernel keeps XDP_PACKET_HEADROOM bytes in front of received frames, before the pool headroom */
+   if (packet_pool_headroom + XDP_PACKET_HEADROOM + ETH_FRAME_LEN > AF_XDP_FRAME_SIZE) {
+      fprintf(stderr, "nio_af_xdp_get_umem: a packet headroom of %d bytes leaves no room for a frame in the UMEM\n", packet_pool_headroom);
+      return (NULL);
+   }
+
+   pthread_mutex_lock(&prog_lock);
+   if (umem_pool == NULL) {
+      region = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+      if (region == MAP_FAILED)
+         fprintf(stderr, "nio_af_xdp_get_umem: unable to allocate the UMEM: %s\n", strerror(errno));
+      else if (!(umem_pool = packet_pool_create(region, len, AF_XDP_FRAME_SIZE)))
+         munmap(region, len);
+   }
+   pthread_mutex_unlock(&prog_lock);
+   return (umem_pool);
+}
+
+static int nio_af_xdp_map_ring(int fd, struct nio_af_xdp_ring *ring, struct xdp_ring_offset *off, size_t desc_size, off_t pgoff)
+{
+   ring->map_size = off->desc + AF_XDP_RING_SIZE * desc_size;
+   ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+   if (ring->map == MAP_FAILED) {
+      ring->map = NULL;
+      return (-1);
+   }
+   ring->producer = (u_int *)((u_char *)ring->map + off->producer);
+   ring->consumer = (u_int *)((u_char *)ring->map + off->consumer);
+   ring->flags = (u_int *)((u_char *)ring->map + off->flags);
+   ring->descs = (u_char *)ring->map + off->desc;
+   return (0);
+}
+
+static void nio_af_xdp_unmap_ring(struct nio_af_xdp_ring *ring)
+{
+   if (ring->map != NULL)
+      munmap(ring->map, ring->map_size);
+   ring->map = NULL;
+}
+
+/* Entries the kernel has produced and we have not consumed yet */
+static u_int nio_af_xdp_ring_ready(struct nio_af_xdp_ring *ring)
+{
+   return (__atomic_load_n(ring->producer, __ATOMIC_ACQUIRE) - *ring->consumer);
+}
+
+/* Entries we can produce before the kernel consumes more */
+static u_int nio_af_xdp_ring_free(struct nio_af_xdp_ring *ring)
+{
+   return (AF_XDP_RING_SIZE - (*ring->producer - __atomic_load_n(ring->consumer, __ATOMIC_ACQUIRE)));
+}
+
+/* Index of the frame of the UMEM holding an address */
+static inline u_int nio_af_xdp_frame(u_int64_t addr)
+{
+   return (addr / AF_XDP_FRAME_SIZE);
+}
+
+/* Give buffers of the UMEM to the kernel to receive in, their reference goes with them */
+static void nio_af_xdp_fill(struct nio_af_xdp_sock *xsk, packet_buf_t **bufs, int count)
+{
+   u_int64_t *addrs = xsk->fill.descs;
+   u_int producer = *xsk->fill.producer;
+   u_int64_t addr;
+   int i;
+
+   for (i = 0; i < count; i++) {
+      addr = bufs[i]->start - xsk->umem;
+      xsk->held[nio_af_xdp_frame(addr)]++;
+      addrs[(producer + i) & (AF_XDP_RING_SIZE - 1)] = addr;
+   }
+   xsk->nr_filled += count;
+   __atomic_store_n(xsk->fill.producer, producer + count, __ATOMIC_RELEASE);
+}
+
+/* Keep AF_XDP_FILL_FRAMES frames on the fill ring, as far as the UMEM has free frames */
+static void nio_af_xdp_refill(struct nio_af_xdp_sock *xsk)
+{
+   packet_buf_t *bufs[NIO_MAX_BATCH];
+   int count;
+
+   while (xsk->nr_filled < AF_XDP_FILL_FRAMES) {
+      for (count = 0; count < m_min(NIO_MAX_BATCH, AF_XDP_FILL_FRAMES - xsk->nr_filled); count++) {
+         if (!(bufs[count] = packet_buf_alloc(xsk->pool)))
+            break;
+      }
+      nio_af_xdp_fill(xsk, bufs, count);
+      if (count < NIO_MAX_BATCH)
+         break;
+   }
+}
+
+/* Release the buffers the kernel has transmitted */
+static void nio_af_xdp_complete(struct nio_af_xdp_sock *xsk)
+{
+   u_int64_t *addrs = xsk->completion.descs;
+   u_int consumer = *xsk->completion.consumer;
+   u_int i, ready;
+   u_int64_t addr;
+
+   ready = nio_af_xdp_ring_ready(&xsk->completion);
+   for (i = 0; i < ready; i++) {
+      addr = addrs[(consumer + i) & (AF_XDP_RING_SIZE - 1)];
+      xsk->held[nio_af_xdp_frame(addr)]--;
+      packet_buf_release(&xsk->pool->bufs[nio_af_xdp_frame(addr)]);
+   }
+   __atomic_store_n(xsk->completion.consumer, consumer + ready, __ATOMIC_RELEASE);
+}
+
+static void nio_af_xdp_kick_tx(int fd, struct nio_af_xdp_sock *xsk)
+{
+   if (!(__atomic_load_n(xsk->tx.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP))
+      return;
+   if (sendto(fd, NULL, 0, MSG_DONTWAIT, NULL, 0) == -1 && errno != EAGAIN && errno != EBUSY && errno != ENOBUFS && errno != ENETDOWN)
+      perror("nio_af_xdp_kick_tx: sendto");
+}
+
+static void nio_af_xdp_free(nio_af_xdp_t *nio_af_xdp)
+{
+   struct nio_af_xdp_sock *xsk = nio_af_xdp->xsk;
+   union bpf_attr attr;
+   int i;
+
+   if (xsk != NULL) {
+      if (xsk->prog != NULL) {
+         memset(&attr, 0, sizeof(attr));
+         attr.map_fd = xsk->prog->map_fd;
+         attr.key = (unsigned long)&xsk->queue;
+         sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+      }
+   }
+   if (nio_af_xdp->fd != -1)
+      close(nio_af_xdp->fd);
+   if (xsk != NULL) {
+      nio_af_xdp_unmap_ring(&xsk->fill);
+      nio_af_xdp_unmap_ring(&xsk->completion);
+      nio_af_xdp_unmap_ring(&xsk->rx);
+      nio_af_xdp_unmap_ring(&xsk->tx);
+      /* the kernel is done with the buffers of the socket once it is closed */
+      if (xsk->pool != NULL) {
+         for (i = 0; i < xsk->nr_lent; i++)
+            packet_buf_release(xsk->lent[i]);
+         for (i = 0; i < AF_XDP_UMEM_FRAMES; i++) {
+            while (xsk->held[i] > 0) {
+               xsk->held[i]--;
+               packet_buf_release(&xsk->pool->bufs[i]);
+            }
+         }
+      }
+      if (xsk->prog != NULL)
+         nio_af_xdp_put_program(xsk->prog);
+      pthread_mutex_destroy(&xsk->tx_lock);
+      free(xsk);
+   }
+}
+
+/* Create the socket, its UMEM and rings, and bind it to the queue */
+static int nio_af_xdp_open_socket(struct nio_af_xdp_sock *xsk, int bind_flags)
+{
+   struct xdp_umem_reg umem_reg;
+   struct xdp_mmap_offsets off;
+   struct sockaddr_xdp sxdp;
+   socklen_t optlen;
+   int fd, size = AF_XDP_RING_SIZE;
+
+   if ((fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0)) == -1)
+      return (-1);
+
+   memset(&umem_reg, 0, sizeof(umem_reg));
+   umem_reg.addr = (unsigned long)xsk->umem;
+   umem_reg.len = xsk->pool->region_len;
+   umem_reg.chunk_size = AF_XDP_FRAME_SIZE;
+   /* received frames have the headroom of the packet pool, like the frames copied to it */
+   umem_reg.headroom = packet_pool_headroom;
+   if (setsockopt(fd, SOL_XDP, XDP_UMEM_REG, &umem_reg, sizeof(umem_reg)) == -1 ||
+       setsockopt(fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) == -1 ||
+       setsockopt(fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) == -1 ||
+       setsockopt(fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) == -1 ||
+       setsockopt(fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) == -1)
+      goto error;
+
+   optlen = sizeof(off);
+   if (getsockopt(fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) == -1)
+      goto error;
+   if (nio_af_xdp_map_ring(fd, &xsk->fill, &off.fr, sizeof(u_int64_t), XDP_UMEM_PGOFF_FILL_RING) == -1 ||
+       nio_af_xdp_map_ring(fd, &xsk->completion, &off.cr, sizeof(u_int64_t), XDP_UMEM_PGOFF_COMPLETION_RING) == -1 ||
+       nio_af_xdp_map_ring(fd, &xsk->rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) == -1 ||
+       nio_af_xdp_map_ring(fd, &xsk->tx, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) == -1)
+      goto error;
+
+   memset(&sxdp, 0, sizeof(sxdp));
+   sxdp.sxdp_family = AF_XDP;
+   sxdp.sxdp_ifindex = xsk->ifindex;
+   sxdp.sxdp_queue_id = xsk->queue;
+   sxdp.sxdp_flags = bind_flags | XDP_USE_NEED_WAKEUP;
+   if (bind(fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) == -1)
+      goto error;
+   return (fd);
+
+ error:
+   nio_af_xdp_unmap_ring(&xsk->fill);
+   nio_af_xdp_unmap_ring(&xsk->completion);
+   nio_af_xdp_unmap_ring(&xsk->rx);
+   nio_af_xdp_unmap_ring(&xsk->tx);
+   close(fd);
+   return (-1);
+}
+
+/* Bind a socket in zero-copy mode if the driver supports it, in copy mode otherwise */
+static int nio_af_xdp_bind(nio_af_xdp_t *nio_af_xdp)
+{
+   struct nio_af_xdp_sock *xsk = nio_af_xdp->xsk;
+   struct nio_af_xdp_prog *prog = xsk->prog;
+
+   if (!prog->skb_mode) {
+      if ((nio_af_xdp->fd = nio_af_xdp_open_socket(xsk, XDP_ZEROCOPY)) != -1) {
+         xsk->zero_copy = TRUE;
+         return (0);
+      }
+      if ((nio_af_xdp->fd = nio_af_xdp_open_socket(xsk, XDP_COPY)) != -1)
+         return (0);
+
+      /* the driver runs XDP programs but has no AF_XDP support, use generic mode if we are alone on the interface */
+      if (prog->refcount > 1)
+         return (-1);
+      close(prog->link_fd);
+      if (nio_af_xdp_attach_program(prog, TRUE) == -1) {
+         prog->link_fd = -1;
+         return (-1);
+      }
+   }
+   return ((nio_af_xdp->fd = nio_af_xdp_open_socket(xsk, XDP_COPY)) == -1 ? -1 : 0);
+}
+
+static int nio_af_xdp_recv_batch(nio_af_xdp_t *nio_af_xdp, struct iovec *pkts, int count)
+{
+   struct nio_af_xdp_sock *xsk = nio_af_xdp->xsk;
+   struct xdp_desc *descs = xsk->rx.descs;
+   struct xdp_desc *desc;
+   struct pollfd pfd;
+   packet_buf_t *buf;
+   u_int consumer, ready;
+   int i, filled = 0;
+
+   /*
+    * The frames of the previous burst have been forwarded, they are received
+    * in again unless another socket still has to send them.
+    */
+   for (i = 0; i < xsk->nr_lent; i++) {
+      if ((buf = packet_buf_reclaim(xsk->lent[i])) != NULL)
+         xsk->lent[filled++] = buf;
+      else
+         packet_buf_release(xsk->lent[i]);
+   }
+   nio_af_xdp_fill(xsk, xsk->lent, filled);
+   xsk->nr_lent = 0;
+   nio_af_xdp_refill(xsk);
+
+   while ((ready = nio_af_xdp_ring_ready(&xsk->rx)) == 0) {
+      if (nio_af_xdp->nonblock) {
+         errno = EAGAIN;
+         return (-1);
+      }
+      /* also wakes the kernel up to use the fill ring */
+      pfd.fd = nio_af_xdp->fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+         return (-1);
+   }
+
+   /* the frames are handed to the bridge from the UMEM, without a copy */
+   count = m_min(m_min(count, NIO_MAX_BATCH), (int)ready);
+   consumer = *xsk->rx.consumer;
+   for (i = 0; i < count; i++) {
+      desc = &descs[(consumer + i) & (AF_XDP_RING_SIZE - 1)];
+      pkts[i].iov_base = xsk->umem + desc->addr;
+      pkts[i].iov_len = desc->len;
+      xsk->held[nio_af_xdp_frame(desc->addr)]--;
+      xsk->lent[i] = &xsk->pool->bufs[nio_af_xdp_frame(desc->addr)];
+   }
+   xsk->nr_lent = count;
+   xsk->nr_filled -= count;
+   __atomic_store_n(xsk->rx.consumer, consumer + count, __ATOMIC_RELEASE);
+   return (count);
+}
+
+static ssize_t nio_af_xdp_recv(nio_af_xdp_t *nio_af_xdp, void *pkt, size_t max_len)
+{
+   struct iovec iov;
+
+   if (nio_af_xdp_recv_batch(nio_af_xdp, &iov, 1) == -1)
+      return (-1);
+   memcpy(pkt, iov.iov_base, m_min(iov.iov_len, max_len));
+   return (m_min(iov.iov_len, max_len));
+}
+
+static void nio_af_xdp_unlock(void *data)
+{
+   pthread_mutex_unlock(data);
+}
+
+/*
+ * Buffer of the UMEM to send a frame from, with a reference for the socket.
+ * A frame of the UMEM, received by an AF_XDP NIO, is sent where it is, the
+ * others are copied to a free buffer. Returns NULL if there is none.
+ */
+static packet_buf_t *nio_af_xdp_tx_buf(struct nio_af_xdp_sock *xsk, u_char **pkt, size_t len)
+{
+   packet_buf_t *buf;
+
+   if ((buf = packet_pool_lookup(xsk->pool, *pkt)) != NULL && *pkt + len <= buf->start + xsk->pool->stride) {
+      packet_buf_hold(buf);
+      return (buf);
+   }
+   if ((buf = packet_buf_alloc(xsk->pool)) != NULL) {
+      memcpy(buf->data, *pkt, len);
+      *pkt = buf->data;
+   }
+   return (buf);
+}
+
+/*
+ * Queue a burst on the TX ring, the buffers are released once transmitted.
+ * Returns the number of frames queued, the others are counted in tx_dropped.
+ */
+static int nio_af_xdp_queue(nio_af_xdp_t *nio_af_xdp, struct iovec *pkts, int count)
+{
+   struct nio_af_xdp_sock *xsk = nio_af_xdp->xsk;
+   struct xdp_desc *descs = xsk->tx.descs;
+   struct xdp_desc *desc;
+   struct pollfd pfd;
+   packet_buf_t *buf;
+   u_int producer;
+   u_char *pkt;
+   int i, waited, queued = 0;
+
+   pthread_mutex_lock(&xsk->tx_lock);
+   pthread_cleanup_push(nio_af_xdp_unlock, &xsk->tx_lock);
+
+   producer = *xsk->tx.producer;
+   for (i = 0; i < count; i++) {
+      /* frames larger than a UMEM frame are dropped, as by a link with a smaller MTU */
+      if (pkts[i].iov_len > xsk->pool->size) {
+         __atomic_fetch_add(&nio_af_xdp->tx_dropped, 1, __ATOMIC_RELAXED);
+         continue;
+      }
+
+      nio_af_xdp_complete(xsk);
+      for (waited = 0; nio_af_xdp_ring_free(&xsk->tx) == 0; waited++) {
+         /* wait for the kernel to transmit what is already queued */
+         __atomic_store_n(xsk->tx.producer, producer, __ATOMIC_RELEASE);
+         nio_af_xdp_kick_tx(nio_af_xdp->fd, xsk);
+         nio_af_xdp_complete(xsk);
+         if (nio_af_xdp_ring_free(&xsk->tx) > 0)
+            break;
+         /* a worker thread doesn't wait longer for a ring that stays full */
+         if (nio_af_xdp->nonblock && waited == NIO_TX_WAIT_TIMEOUT)
+            break;
+         pfd.fd = nio_af_xdp->fd;
+         pfd.events = POLLOUT;
+         pfd.revents = 0;
+         poll(&pfd, 1, 1);
+      }
+      if (nio_af_xdp_ring_free(&xsk->tx) == 0) {
+         __atomic_fetch_add(&nio_af_xdp->tx_dropped, count - i, __ATOMIC_RELAXED);
+         break;
+      }
+
+      /* the frame is dropped when every buffer of the UMEM is in use */
+      pkt = pkts[i].iov_base;
+      if (!(buf = nio_af_xdp_tx_buf(xsk, &pkt, pkts[i].iov_len))) {
+         __atomic_fetch_add(&nio_af_xdp->tx_dropped, 1, __ATOMIC_RELAXED);
+         continue;
+      }
+      desc = &descs[producer++ & (AF_XDP_RING_SIZE - 1)];
+      desc->addr = pkt - xsk->umem;
+      desc->len = pkts[i].iov_len;
+      desc->options = 0;
+      xsk->held[nio_af_xdp_frame(desc->addr)]++;
+      queued++;
+   }
+   __atomic_store_n(xsk->tx.producer, producer, __ATOMIC_RELEASE);
+   nio_af_xdp_kick_tx(nio_af_xdp->fd, xsk);
+
+   pthread_cleanup_pop(1);
+   return (queued);
+}
+
+/* The whole burst is consumed, the dropped frames are reported by get_stats */
+static int nio_af_xdp_send_batch(nio_af_xdp_t *nio_af_xdp, struct iovec *pkts, int count)
+{
+   nio_af_xdp_queue(nio_af_xdp, pkts, count);
+   return (count);
+}
+
+/* Returns 0 when the frame is dropped */
+static ssize_t nio_af_xdp_send(nio_af_xdp_t *nio_af_xdp, void *pkt, size_t pkt_len)
+{
+   struct iovec iov;
+
+   iov.iov_base = pkt;
+   iov.iov_len = pkt_len;
+   return (nio_af_xdp_queue(nio_af_xdp, &iov, 1) == 1 ? pkt_len : 0);
+}
+
+/* Create a NIO bound to a queue of a network interface with an AF_XDP socket */
+nio_t *create_nio_af_xdp(char *dev_name, int queue)
+{
+   struct nio_af_xdp_sock *xsk;
+   nio_af_xdp_t *nio_af_xdp;
+   union bpf_attr attr;
+   nio_t *nio;
+
+   if (strlen(dev_name) >= NIO_DEV_MAXLEN) {
+      fprintf(stderr, "create_nio_af_xdp: bad Ethernet device string specified.\n");
+      return NULL;
+   }
+   if (queue < 0 || queue >= AF_XDP_MAX_QUEUES) {
+      fprintf(stderr, "create_nio_af_xdp: queue must be between 0 and %d\n", AF_XDP_MAX_QUEUES - 1);
+      return NULL;
+   }
+
+   if (!(nio = create_nio()))
+      return NULL;
+
+   nio_af_xdp = &nio->u.nio_af_xdp;
+   nio_af_xdp->fd = -1;
+   if (!(xsk = nio_af_xdp->xsk = calloc(1, sizeof(*xsk)))) {
+      fprintf(stderr, "create_nio_af_xdp: insufficient memory\n");
+      free_nio(nio);
+      return NULL;
+   }
+   pthread_mutex_init(&xsk->tx_lock, NULL);
+   xsk->queue = queue;
+   nio->type = NIO_TYPE_AF_XDP;
+   nio->send = (void *)nio_af_xdp_send;
+   nio->recv = (void *)nio_af_xdp_recv;
+   nio->send_batch = (void *)nio_af_xdp_send_batch;
+   nio->recv_batch = (void *)nio_af_xdp_recv_batch;
+   nio->free = (void *)nio_af_xdp_free;
+   nio->dptr = &nio->u.nio_af_xdp;
+
+   if (!(xsk->ifindex = if_nametoindex(dev_name))) {
+      fprintf(stderr, "create_nio_af_xdp: unable to find device %s: %s\n", dev_name, strerror(errno));
+      free_nio(nio);
+      return NULL;
+   }
+
+   if (!(xsk->pool = nio_af_xdp_get_umem())) {
+      free_nio(nio);
+      return NULL;
+   }
+   xsk->umem = xsk->pool->region;
+
+   if (!(xsk->prog = nio_af_xdp_get_program(xsk->ifindex))) {
+      free_nio(nio);
+      return NULL;
+   }
+   if (nio_af_xdp_bind(nio_af_xdp) == -1) {
+      fprintf(stderr, "create_nio_af_xdp: unable to bind to queue %d of %s: %s\n", queue, dev_name, strerror(errno));
+      free_nio(nio);
+      return NULL;
+   }
+
+   nio_af_xdp_refill(xsk);
+   if (xsk->nr_filled == 0) {
+      fprintf(stderr, "create_nio_af_xdp: no free frame left in the UMEM for %s\n", dev_name);
+      free_nio(nio);
+      return NULL;
+   }
+
+   /* the XDP program redirects the frames of the queue to the socket from now on */
+   memset(&attr, 0, sizeof(attr));
+   attr.map_fd = xsk->prog->map_fd;
+   attr.key = (unsigned long)&xsk->queue;
+   attr.value = (unsigned long)&nio_af_xdp->fd;
+   attr.flags = BPF_ANY;
+   if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1) {
+      fprintf(stderr, "create_nio_af_xdp: unable to add the socket to the XDP map: %s\n", strerror(errno));
+      free_nio(nio);
+      return NULL;
+   }
+
+   printf("AF_XDP socket bound to queue %d of %s in %s mode\n", queue, dev_name,
+          xsk->zero_copy ? "zero-copy" : (xsk->prog->skb_mode ? "generic" : "driver copy"));
+   return nio;
+}
@@ -0,0 +1,71 @@
+/*
+ *   This file is part of ubridge, a program to bridge network interfaces
+ *   to UDP tunnels.
+ *
+ *   Copyright (C) 2026 GNS3 Technologies Inc.
+ *
+ *   ubridge is free software: you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ubridge is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NIO_AF_XDP_H_
+#define NIO_AF_XDP_H_
+
+#include <pthread.h>
+#include <linux/if_xdp.h>
+
+#include "nio.h"
+#include "packet_pool.h"
+
+/*
+ * UMEM shared by all the sockets, a packet pool hands its frames out: a
+ * frame received on a socket is sent by another one without a copy.
+ */
+#define AF_XDP_FRAME_SIZE       2048
+#define AF_XDP_UMEM_FRAMES      16384
+/* Frames each socket gives the kernel to receive in */
+#define AF_XDP_FILL_FRAMES      1024
+#define AF_XDP_RING_SIZE        2048
+#define AF_XDP_MAX_QUEUES       64
+
+/* Ring shared with the kernel */
+struct nio_af_xdp_ring {
+    u_int *producer;
+    u_int *consumer;
+    u_int *flags;
+    void *descs;
+    void *map;
+    size_t map_size;
+};
+
+struct nio_af_xdp_sock {
+    int ifindex;
+    int queue;
+    int zero_copy;
+    struct nio_af_xdp_prog *prog;
+    packet_pool_t *pool;                /* frames of the UMEM */
+    unsigned char *umem;
+    struct nio_af_xdp_ring fill;
+    struct nio_af_xdp_ring completion;
+    struct nio_af_xdp_ring rx;
+    struct nio_af_xdp_ring tx;
+    packet_buf_t *lent[NIO_MAX_BATCH];  /* RX frames handed to the bridge, refilled on the next receive */
+    int nr_lent;
+    int nr_filled;                      /* frames on the fill and RX rings */
+    u_short held[AF_XDP_UMEM_FRAMES];   /* references the kernel holds on each frame through the socket */
+    pthread_mutex_t tx_lock;            /* serializes the listener threads sending on the NIO */
+};
+
+nio_t *create_nio_af_xdp(char *dev_name, int queue);
+
+#endif /* !NIO_AF_XDP_H_ */
@@ -112,6 +112,48 @@ static ssize_t nio_ethernet_recv(nio_ethernet_t *nio_ethernet, void *pkt, size_t
    return (rlen);
 }
 
+struct nio_ethernet_batch {
+   struct iovec *pkts;
+   int count;
+};
+
+static void nio_ethernet_batch_handler(u_char *user, const struct pcap_pkthdr *pkt_info, const u_char *pkt_data)
+{
+   struct nio_ethernet_batch *batch = (struct nio_ethernet_batch *)user;
+   struct iovec *iov = &batch->pkts[batch->count++];
+
+   iov->iov_len = m_min(iov->iov_len, pkt_info->caplen);
+   memcpy(iov->iov_base, pkt_data, iov->iov_len);
+}
+
+static int nio_ethernet_recv_batch(nio_ethernet_t *nio_ethernet, struct iovec *pkts, int count)
+{
+   struct nio_ethernet_batch batch;
+   char pcap_errbuf[PCAP_ERRBUF_SIZE];
+   int res;
+
+   batch.pkts = pkts;
+   batch.count = 0;
+
+   /* process up to count packets from a single PCAP buffer */
+   while ((res = pcap_dispatch(nio_ethernet->pcap_dev, count, nio_ethernet_batch_handler, (u_char *)&batch)) == 0) {
+      /* nothing to read in non-blocking mode */
+      if (pcap_getnonblock(nio_ethernet->pcap_dev, pcap_errbuf) == 1) {
+         errno = EAGAIN;
+         return (-1);
+      }
+      /* Timeout elapsed */
+      pthread_testcancel();
+   }
+
+   if (res == -1) {
+      fprintf(stderr, "pcap_dispatch: %s\n", pcap_geterr(nio_ethernet->pcap_dev));
+      return (-1);
+   }
+
+   return (batch.count);
+}
+
 /* Create a new NIO Ethernet (using PCAP) */
 nio_t *create_nio_ethernet(char *dev_name)
 {
@@ -133,6 +175,7 @@ nio_t *create_nio_ethernet(char *dev_name)
    nio->type = NIO_TYPE_ETHERNET;
    nio->send = (void *)nio_ethernet_send;
    nio->recv = (void *)nio_ethernet_recv;
+   nio->recv_batch = (void *)nio_ethernet_recv_batch;
    nio->free = (void *)nio_ethernet_free;
    nio->dptr = &nio->u.nio_ethernet;
    return nio;
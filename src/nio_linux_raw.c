@@ -18,12 +18,16 @@
  *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <netinet/if_ether.h>
 #include <linux/if.h>
 #include <linux/if_packet.h>
@@ -31,6 +35,12 @@
 #include "ubridge.h"
 #include "nio_linux_raw.h"
 
+#ifdef TP_STATUS_VLAN_TPID_VALID
+# define VLAN_TPID(hdr, hv)     (((hv)->tp_vlan_tpid || ((hdr)->tp_status & TP_STATUS_VLAN_TPID_VALID)) ? (hv)->tp_vlan_tpid : ETH_P_8021Q)
+#else
+# define VLAN_TPID(hdr, hv)     ETH_P_8021Q
+#endif
+
 /* Get interface index of specified device */
 static int nio_linux_raw_dev_id(char *device)
 {
@@ -99,8 +109,355 @@ static int nio_linux_raw_open_socket(char *device)
    return (sck);
 }
 
+#ifdef TPACKET3_HDRLEN
+static struct nio_linux_raw_ring *nio_linux_raw_alloc_ring(int version, u_int block_size, u_int block_nr, u_int frame_size, u_int frame_nr)
+{
+   struct nio_linux_raw_ring *ring;
+
+   if (!(ring = malloc(sizeof(*ring)))) {
+      fprintf(stderr, "nio_linux_raw_setup_rings: insufficient memory\n");
+      return (NULL);
+   }
+   memset(ring, 0, sizeof(*ring));
+   pthread_mutex_init(&ring->lock, NULL);
+   ring->version = version;
+   ring->block_size = block_size;
+   ring->block_nr = block_nr;
+   ring->frame_size = frame_size;
+   ring->frame_nr = frame_nr;
+   return (ring);
+}
+
+/*
+ * Setup the memory-mapped rings on the socket. The RX ring uses TPACKET_V3,
+ * a TX ring alone uses TPACKET_V2 which is supported by older kernels.
+ */
+static int nio_linux_raw_setup_rings(nio_linux_raw_t *nio_linux_raw, int rx_ring, int tx_ring)
+{
+   struct tpacket_req3 req;
+   int version = rx_ring ? TPACKET_V3 : TPACKET_V2;
+   int sck = nio_linux_raw->fd;
+   size_t rx_size = 0, tx_size = 0;
+   int val = 1;
+
+   if (setsockopt(sck, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1) {
+      fprintf(stderr, "nio_linux_raw_setup_rings: setsockopt (PACKET_VERSION): %s\n", strerror(errno));
+      return (-1);
+   }
+
+   /* skip malformed frames instead of stopping the transmission, must be set before any ring */
+   if (tx_ring && setsockopt(sck, SOL_PACKET, PACKET_LOSS, &val, sizeof(val)) == -1) {
+      fprintf(stderr, "nio_linux_raw_setup_rings: setsockopt (PACKET_LOSS): %s\n", strerror(errno));
+      return (-1);
+   }
+
+   if (rx_ring) {
+      memset(&req, 0, sizeof(req));
+      req.tp_block_size = RX_RING_BLOCK_SIZE;
+      req.tp_block_nr = RX_RING_BLOCK_NR;
+      req.tp_frame_size = RX_RING_FRAME_SIZE;
+      req.tp_frame_nr = (RX_RING_BLOCK_SIZE / RX_RING_FRAME_SIZE) * RX_RING_BLOCK_NR;
+      req.tp_retire_blk_tov = RX_RING_BLOCK_TIMEOUT;
+      req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
+
+      if (setsockopt(sck, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == -1) {
+         fprintf(stderr, "nio_linux_raw_setup_rings: setsockopt (PACKET_RX_RING): %s\n", strerror(errno));
+         return (-1);
+      }
+      rx_size = (size_t)req.tp_block_size * req.tp_block_nr;
+      if (!(nio_linux_raw->rx_ring = nio_linux_raw_alloc_ring(version, req.tp_block_size, req.tp_block_nr, req.tp_frame_size, req.tp_frame_nr)))
+         return (-1);
+   }
+
+   if (tx_ring) {
+      /* struct tpacket_req is the beginning of struct tpacket_req3 */
+      memset(&req, 0, sizeof(req));
+      req.tp_block_size = TX_RING_BLOCK_SIZE;
+      req.tp_block_nr = (TX_RING_FRAME_SIZE * TX_RING_FRAME_NR) / TX_RING_BLOCK_SIZE;
+      req.tp_frame_size = TX_RING_FRAME_SIZE;
+      req.tp_frame_nr = TX_RING_FRAME_NR;
+
+      if (setsockopt(sck, SOL_PACKET, PACKET_TX_RING, &req, version == TPACKET_V3 ? sizeof(struct tpacket_req3) : sizeof(struct tpacket_req)) == -1) {
+         fprintf(stderr, "nio_linux_raw_setup_rings: setsockopt (PACKET_TX_RING): %s\n", strerror(errno));
+         return (-1);
+      }
+      tx_size = (size_t)req.tp_block_size * req.tp_block_nr;
+      if (!(nio_linux_raw->tx_ring = nio_linux_raw_alloc_ring(version, req.tp_block_size, req.tp_block_nr, req.tp_frame_size, req.tp_frame_nr)))
+         return (-1);
+   }
+
+   /* both rings share one mapping, the TX ring follows the RX ring */
+   nio_linux_raw->ring_map_size = rx_size + tx_size;
+   nio_linux_raw->ring_map = mmap(NULL, nio_linux_raw->ring_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, sck, 0);
+   if (nio_linux_raw->ring_map == MAP_FAILED) {
+      fprintf(stderr, "nio_linux_raw_setup_rings: mmap: %s\n", strerror(errno));
+      nio_linux_raw->ring_map = NULL;
+      return (-1);
+   }
+
+   if (nio_linux_raw->rx_ring)
+      nio_linux_raw->rx_ring->map = nio_linux_raw->ring_map;
+   if (nio_linux_raw->tx_ring)
+      nio_linux_raw->tx_ring->map = nio_linux_raw->ring_map + rx_size;
+   return (0);
+}
+
+/*
+ * Frame of the ring as it is handed to the bridge, the VLAN tag from the
+ * tpacket header is put back by moving the MAC addresses into the frame
+ * header, which the kernel doesn't read back. The frame header leaves more
+ * than NIO_PKT_HEADROOM bytes in front of the frame. Returns NULL if the
+ * kernel truncated the frame or if it is larger than max_len.
+ */
+static u_char *nio_linux_raw_ring_frame(struct tpacket3_hdr *hdr, size_t *len, size_t max_len)
+{
+   u_char *data = (u_char *)hdr + hdr->tp_mac;
+   vlan_tag_t *tag;
+   u_short tpid;
+
+   *len = hdr->tp_snaplen;
+   if (hdr->tp_snaplen < hdr->tp_len)
+      return (NULL);
+
+#if defined(TP_STATUS_VLAN_VALID)
+   if ((hdr->hv1.tp_vlan_tci == 0) && !(hdr->tp_status & TP_STATUS_VLAN_VALID))
+#else
+   if (hdr->hv1.tp_vlan_tci == 0)
+#endif
+      return (*len <= max_len ? data : NULL);
+
+   if (*len < ETH_ALEN * 2 || *len + VLAN_HEADER_LEN > max_len)
+      return (NULL);
+
+   tpid = VLAN_TPID(hdr, &hdr->hv1);
+   data -= VLAN_HEADER_LEN;
+   memmove(data, data + VLAN_HEADER_LEN, ETH_ALEN * 2);
+   tag = (vlan_tag_t *)(data + ETH_ALEN * 2);
+   tag->vlan_tp_id = htons(tpid);
+   tag->vlan_tci = htons(hdr->hv1.tp_vlan_tci);
+   *len += VLAN_HEADER_LEN;
+   return (data);
+}
+
+/* Give the blocks read by the previous call back to the kernel */
+static void nio_linux_raw_ring_release(struct nio_linux_raw_ring *ring)
+{
+   struct tpacket_block_desc *block;
+   u_int i;
+
+   for (; ring->blocks_held > 0; ring->blocks_held--) {
+      i = (ring->current + ring->block_nr - ring->blocks_held) % ring->block_nr;
+      block = (struct tpacket_block_desc *)(ring->map + (size_t)i * ring->block_size);
+      __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+   }
+}
+
+/*
+ * Read frames from the ring, blocking (unless the socket is non-blocking)
+ * until a block is available. The frames are handed out where they are in
+ * the ring, their blocks are given back to the kernel on the next call.
+ * Frames that cannot be forwarded whole are dropped and counted.
+ */
+static int nio_linux_raw_ring_recv_batch(nio_linux_raw_t *nio_linux_raw, struct iovec *pkts, int count)
+{
+   struct nio_linux_raw_ring *ring = nio_linux_raw->rx_ring;
+   struct tpacket_block_desc *block;
+   struct tpacket3_hdr *hdr;
+   struct pollfd pfd;
+   u_char *frame;
+   int received = 0;
+
+   nio_linux_raw_ring_release(ring);
+   while (received < count) {
+      block = (struct tpacket_block_desc *)(ring->map + (size_t)ring->current * ring->block_size);
+
+      if (ring->next_frame == NULL) {
+         if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+            if (received > 0)
+               break;
+
+            /* nothing to read, wait for the kernel to retire a block */
+            if (fcntl(nio_linux_raw->fd, F_GETFL) & O_NONBLOCK) {
+               errno = EAGAIN;
+               return (-1);
+            }
+            pfd.fd = nio_linux_raw->fd;
+            pfd.events = POLLIN | POLLERR;
+            pfd.revents = 0;
+            if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+               return (-1);
+            continue;
+         }
+         ring->next_frame = (unsigned char *)block + block->hdr.bh1.offset_to_first_pkt;
+         ring->frames_left = block->hdr.bh1.num_pkts;
+      }
+
+      if (ring->frames_left > 0) {
+         hdr = (struct tpacket3_hdr *)ring->next_frame;
+         ring->next_frame += hdr->tp_next_offset;
+         ring->frames_left--;
+         if ((frame = nio_linux_raw_ring_frame(hdr, &pkts[received].iov_len, pkts[received].iov_len)) != NULL)
+            pkts[received++].iov_base = frame;
+         else
+            __atomic_fetch_add(&nio_linux_raw->rx_dropped, 1, __ATOMIC_RELAXED);
+      }
+
+      if (ring->frames_left == 0) {
+         /* the block is kept until the frames handed out are forwarded */
+         ring->current = (ring->current + 1) % ring->block_nr;
+         ring->next_frame = NULL;
+         ring->blocks_held++;
+         if (received == 0)
+            nio_linux_raw_ring_release(ring);
+         else if (ring->blocks_held == ring->block_nr - 1)
+            break;
+      }
+   }
+   return (received);
+}
+
+static ssize_t nio_linux_raw_ring_recv(nio_linux_raw_t *nio_linux_raw, void *pkt, size_t max_len)
+{
+   struct iovec iov;
+
+   iov.iov_base = pkt;
+   iov.iov_len = max_len;
+   if (nio_linux_raw_ring_recv_batch(nio_linux_raw, &iov, 1) == -1)
+      return (-1);
+   memcpy(pkt, iov.iov_base, iov.iov_len);
+   return (iov.iov_len);
+}
+#endif
+
+#ifdef TPACKET3_HDRLEN
+/* Ask the kernel to transmit the frames queued in the TX ring */
+static int nio_linux_raw_ring_flush(nio_linux_raw_t *nio_linux_raw)
+{
+   if (send(nio_linux_raw->fd, NULL, 0, MSG_DONTWAIT) == -1 && errno != EAGAIN && errno != ENOBUFS)
+      return (-1);
+   return (0);
+}
+
+/* Wait for a TX ring frame to be released by the kernel, unless the socket is non-blocking */
+static int nio_linux_raw_ring_wait(nio_linux_raw_t *nio_linux_raw)
+{
+   struct pollfd pfd;
+
+   if (fcntl(nio_linux_raw->fd, F_GETFL) & O_NONBLOCK) {
+      errno = EAGAIN;
+      return (-1);
+   }
+   pfd.fd = nio_linux_raw->fd;
+   pfd.events = POLLOUT;
+   pfd.revents = 0;
+   if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+      return (-1);
+   return (0);
+}
+
+static ssize_t nio_linux_raw_send(nio_linux_raw_t *nio_linux_raw, void *pkt, size_t pkt_len);
+
+/* Queue a burst of frames into the TX ring and flush them with a single system call */
+static int nio_linux_raw_ring_queue_frames(nio_linux_raw_t *nio_linux_raw, struct iovec *pkts, int count)
+{
+   struct nio_linux_raw_ring *ring = nio_linux_raw->tx_ring;
+   u_int data_offset, status, *status_ptr, *len_ptr;
+   unsigned char *frame;
+   int i, queued = 0;
+
+   if (ring->version == TPACKET_V3)
+      data_offset = TPACKET3_HDRLEN - sizeof(struct sockaddr_ll);
+   else
+      data_offset = TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+
+   for (i = 0; i < count; i++) {
+      if (pkts[i].iov_len > ring->frame_size - data_offset) {
+         /* too big for a ring frame, send it directly after what is already queued */
+         if (queued && nio_linux_raw_ring_flush(nio_linux_raw) == -1)
+            return (i ? i : -1);
+         queued = 0;
+         if (nio_linux_raw_send(nio_linux_raw, pkts[i].iov_base, pkts[i].iov_len) == -1)
+            return (i ? i : -1);
+         continue;
+      }
+
+      frame = ring->map + (size_t)ring->current * ring->frame_size;
+      if (ring->version == TPACKET_V3) {
+         struct tpacket3_hdr *hdr = (struct tpacket3_hdr *)frame;
+         status_ptr = &hdr->tp_status;
+         len_ptr = &hdr->tp_len;
+         hdr->tp_next_offset = 0;
+      }
+      else {
+         struct tpacket2_hdr *hdr = (struct tpacket2_hdr *)frame;
+         status_ptr = &hdr->tp_status;
+         len_ptr = &hdr->tp_len;
+      }
+
+      while ((status = __atomic_load_n(status_ptr, __ATOMIC_ACQUIRE)) != TP_STATUS_AVAILABLE) {
+         if (status == TP_STATUS_WRONG_FORMAT)
+            break;
+         /* the ring is full: push what is pending and wait for a free frame */
+         if (nio_linux_raw_ring_flush(nio_linux_raw) == -1 || nio_linux_raw_ring_wait(nio_linux_raw) == -1)
+            return (i ? i : -1);
+         queued = 0;
+      }
+
+      memcpy(frame + data_offset, pkts[i].iov_base, pkts[i].iov_len);
+      *len_ptr = pkts[i].iov_len;
+      __atomic_store_n(status_ptr, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+      ring->current = (ring->current + 1) % ring->frame_nr;
+      queued++;
+   }
+
+   if (queued && nio_linux_raw_ring_flush(nio_linux_raw) == -1)
+      return (-1);
+   return (count);
+}
+
+static int nio_linux_raw_ring_send_batch(nio_linux_raw_t *nio_linux_raw, struct iovec *pkts, int count)
+{
+   struct nio_linux_raw_ring *ring = nio_linux_raw->tx_ring;
+   int sent;
+
+   pthread_mutex_lock(&ring->lock);
+   pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock, &ring->lock);
+   sent = nio_linux_raw_ring_queue_frames(nio_linux_raw, pkts, count);
+   pthread_cleanup_pop(1);
+   return (sent);
+}
+
+static ssize_t nio_linux_raw_ring_send(nio_linux_raw_t *nio_linux_raw, void *pkt, size_t pkt_len)
+{
+   struct iovec iov;
+
+   iov.iov_base = pkt;
+   iov.iov_len = pkt_len;
+   if (nio_linux_raw_ring_send_batch(nio_linux_raw, &iov, 1) == -1)
+      return (-1);
+   return (pkt_len);
+}
+#endif
+
 static void nio_linux_raw_free(nio_linux_raw_t *nio_linux_raw)
 {
+   if (nio_linux_raw->ring_map) {
+      munmap(nio_linux_raw->ring_map, nio_linux_raw->ring_map_size);
+      nio_linux_raw->ring_map = NULL;
+   }
+
+   if (nio_linux_raw->rx_ring) {
+      pthread_mutex_destroy(&nio_linux_raw->rx_ring->lock);
+      free(nio_linux_raw->rx_ring);
+      nio_linux_raw->rx_ring = NULL;
+   }
+
+   if (nio_linux_raw->tx_ring) {
+      pthread_mutex_destroy(&nio_linux_raw->tx_ring->lock);
+      free(nio_linux_raw->tx_ring);
+      nio_linux_raw->tx_ring = NULL;
+   }
+
    if (nio_linux_raw->fd != -1)
       close(nio_linux_raw->fd);
 }
@@ -119,26 +476,64 @@ static ssize_t nio_linux_raw_send(nio_linux_raw_t *nio_linux_raw, void *pkt, siz
    return (sendto(nio_linux_raw->fd, pkt, pkt_len, 0,(struct sockaddr *)&sa, sizeof(sa)));
 }
 
-static ssize_t nio_linux_raw_recv(nio_linux_raw_t *nio_linux_raw, void *pkt, size_t max_len)
-{
 #ifdef PACKET_AUXDATA
+typedef union {
+   struct cmsghdr  cmsg;
+   char    buf[CMSG_SPACE(sizeof(struct tpacket_auxdata))];
+} nio_linux_raw_cmsg_t;
 
-#ifdef TP_STATUS_VLAN_TPID_VALID
-# define VLAN_TPID(hdr, hv)     (((hv)->tp_vlan_tpid || ((hdr)->tp_status & TP_STATUS_VLAN_TPID_VALID)) ? (hv)->tp_vlan_tpid : ETH_P_8021Q)
+/*
+ * Reinsert the VLAN tag stripped by the kernel, returns the new packet length.
+ * With push, the MAC addresses move back into the headroom and *pkt is
+ * updated, otherwise the rest of the frame is moved forward.
+ */
+ssize_t nio_linux_raw_restore_vlan(struct msghdr *msg, u_char **pkt, ssize_t received, int push)
+{
+    struct cmsghdr *cmsg;
+
+    /* Code mostly copied from libpcap to reconstruct VLAN header */
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        struct tpacket_auxdata *aux;
+        vlan_tag_t *tag;
+
+        if (cmsg->cmsg_len >= CMSG_LEN(sizeof(struct tpacket_auxdata)) && cmsg->cmsg_level == SOL_PACKET && cmsg->cmsg_type == PACKET_AUXDATA) {
+             aux = (struct tpacket_auxdata *)CMSG_DATA(cmsg);
+#if defined(TP_STATUS_VLAN_VALID)
+             if ((aux->tp_vlan_tci == 0) && !(aux->tp_status & TP_STATUS_VLAN_VALID))
 #else
-# define VLAN_TPID(hdr, hv)     ETH_P_8021Q
+             /* this is ambigious but without the TP_STATUS_VLAN_VALID flag,
+                there is nothing that we can do */
+             if (aux->tp_vlan_tci == 0)
+#endif
+                continue;
+
+             /* VLAN tag found. Shift MAC addresses down and insert VLAN tag */
+             if (push) {
+                memmove(*pkt - VLAN_HEADER_LEN, *pkt, ETH_ALEN * 2);
+                *pkt -= VLAN_HEADER_LEN;
+             }
+             else
+                memmove(*pkt + ETH_ALEN * 2 + VLAN_HEADER_LEN,
+                        *pkt + ETH_ALEN * 2,
+                        received - ETH_ALEN * 2);
+             received += VLAN_HEADER_LEN;
+             tag = (vlan_tag_t *)(*pkt + ETH_ALEN * 2);
+             tag->vlan_tp_id = htons(VLAN_TPID(aux,aux));
+             tag->vlan_tci = htons(aux->tp_vlan_tci);
+         }
+    }
+    return (received);
+}
 #endif
 
+static ssize_t nio_linux_raw_recv(nio_linux_raw_t *nio_linux_raw, void *pkt, size_t max_len)
+{
+#ifdef PACKET_AUXDATA
     ssize_t received;
     struct iovec iov;
-    struct cmsghdr *cmsg;
     struct msghdr msg;
     struct sockaddr from;
-    union {
-      struct cmsghdr  cmsg;
-      char    buf[CMSG_SPACE(sizeof(struct tpacket_auxdata))];
-    } cmsg_buf;
-
+    nio_linux_raw_cmsg_t cmsg_buf;
 
     memset(&msg, 0, sizeof(msg));
     memset(&cmsg_buf, 0, sizeof(cmsg_buf));
@@ -154,43 +549,120 @@ static ssize_t nio_linux_raw_recv(nio_linux_raw_t *nio_linux_raw, void *pkt, siz
     iov.iov_base = pkt;
 
     received = recvmsg(nio_linux_raw->fd, &msg, MSG_TRUNC);
-    if (received > 0) {
+    if (received > 0)
+       received = nio_linux_raw_restore_vlan(&msg, (u_char **)&iov.iov_base, received, FALSE);
+    return (received);
+#else
+    return (recv(nio_linux_raw->fd, pkt, max_len, 0));
+#endif
+}
 
-       /* Code mostly copied from libpcap to reconstruct VLAN header */
-       for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-           struct tpacket_auxdata *aux;
-           vlan_tag_t *tag;
+static int nio_linux_raw_send_batch(nio_linux_raw_t *nio_linux_raw, struct iovec *pkts, int count)
+{
+   struct sockaddr_ll sa;
 
-           if (cmsg->cmsg_len >= CMSG_LEN(sizeof(struct tpacket_auxdata)) && cmsg->cmsg_level == SOL_PACKET && cmsg->cmsg_type == PACKET_AUXDATA) {
-                aux = (struct tpacket_auxdata *)CMSG_DATA(cmsg);
-#if defined(TP_STATUS_VLAN_VALID)
-                if ((aux->tp_vlan_tci == 0) && !(aux->tp_status & TP_STATUS_VLAN_VALID))
+   memset(&sa,0,sizeof(struct sockaddr_ll));
+   sa.sll_family = AF_PACKET;
+   sa.sll_protocol = htons(ETH_P_ALL);
+   sa.sll_hatype = ARPHRD_ETHER;
+   sa.sll_halen = ETH_ALEN;
+   sa.sll_ifindex = nio_linux_raw->dev_id;
+
+   return (nio_sock_send_batch(nio_linux_raw->fd, (struct sockaddr *)&sa, sizeof(sa), pkts, count));
+}
+
+static int nio_linux_raw_recv_batch(nio_linux_raw_t *nio_linux_raw, struct iovec *pkts, int count)
+{
+#ifdef PACKET_AUXDATA
+   struct mmsghdr msgs[NIO_MAX_BATCH];
+   nio_linux_raw_cmsg_t cmsg_bufs[NIO_MAX_BATCH];
+   int i, received;
+
+   count = m_min(count, NIO_MAX_BATCH);
+   memset(msgs, 0, count * sizeof(struct mmsghdr));
+   memset(cmsg_bufs, 0, count * sizeof(nio_linux_raw_cmsg_t));
+   for (i = 0; i < count; i++) {
+      msgs[i].msg_hdr.msg_iov = &pkts[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_control = &cmsg_bufs[i];
+      msgs[i].msg_hdr.msg_controllen = sizeof(nio_linux_raw_cmsg_t);
+   }
+
+   /* block for the first frame only, then drain what is already queued */
+   if ((received = recvmmsg(nio_linux_raw->fd, msgs, count, MSG_WAITFORONE | MSG_TRUNC, NULL)) > 0) {
+      for (i = 0; i < received; i++) {
+         /* truncated frames are reported with their real length and dropped by the bridge */
+         if (msgs[i].msg_len > pkts[i].iov_len)
+            pkts[i].iov_len = msgs[i].msg_len;
+         else  /* the VLAN tag goes into the headroom */
+            pkts[i].iov_len = nio_linux_raw_restore_vlan(&msgs[i].msg_hdr, (u_char **)&pkts[i].iov_base, msgs[i].msg_len, TRUE);
+      }
+   }
+   return (received);
 #else
-                /* this is ambigious but without the TP_STATUS_VLAN_VALID flag,
-                   there is nothing that we can do */
-                if (aux->tp_vlan_tci == 0)
+   return (nio_sock_recv_batch(nio_linux_raw->fd, pkts, count));
 #endif
-                   continue;
+}
 
-                /* VLAN tag found. Shift MAC addresses down and insert VLAN tag */
-                memmove((unsigned char *)pkt + ETH_ALEN * 2 + VLAN_HEADER_LEN,
-                        (unsigned char *)pkt + ETH_ALEN * 2,
-                        received - ETH_ALEN * 2);
-                received += VLAN_HEADER_LEN;
-                tag = (vlan_tag_t *)((unsigned char *)pkt + ETH_ALEN * 2);
-                tag->vlan_tp_id = htons(VLAN_TPID(aux,aux));
-                tag->vlan_tci = htons(aux->tp_vlan_tci);
-            }
-       }
-    }
-    return (received);
-#else
-    return (recv(nio_linux_raw->fd, pkt, max_len, 0));
+#ifdef PACKET_FANOUT
+/* Add the socket to a fanout group, a new group is created if group_id is -1 */
+static int nio_linux_raw_join_fanout(int sck, int group_id, int mode)
+{
+   static int next_group_id = 0;
+   int val;
+
+   if (group_id != -1) {
+      val = group_id | (mode << 16);
+      if (setsockopt(sck, SOL_PACKET, PACKET_FANOUT, &val, sizeof(val)) == -1) {
+         fprintf(stderr, "nio_linux_raw_join_fanout: setsockopt (PACKET_FANOUT): %s\n", strerror(errno));
+         return (-1);
+      }
+      return (group_id);
+   }
+
+#ifdef PACKET_FANOUT_FLAG_UNIQUEID
+   /* let the kernel pick an identifier that is not used by another process */
+   val = (mode | PACKET_FANOUT_FLAG_UNIQUEID) << 16;
+   if (setsockopt(sck, SOL_PACKET, PACKET_FANOUT, &val, sizeof(val)) == 0) {
+      socklen_t len = sizeof(val);
+
+      if (getsockopt(sck, SOL_PACKET, PACKET_FANOUT, &val, &len) == -1) {
+         fprintf(stderr, "nio_linux_raw_join_fanout: getsockopt (PACKET_FANOUT): %s\n", strerror(errno));
+         return (-1);
+      }
+      return (val & 0xffff);
+   }
 #endif
+
+   group_id = (getpid() + next_group_id++) & 0xffff;
+   return (nio_linux_raw_join_fanout(sck, group_id, mode));
 }
+#endif
 
-/* Create a new NIO Linux RAW */
-nio_t *create_nio_linux_raw(char *dev_name)
+/* Parse the fanout option: fanout=<sockets>[:hash|:cpu] */
+static int nio_linux_raw_parse_fanout(char *option, int *fanout, int *fanout_mode)
+{
+   char *end;
+   long val;
+
+   val = strtol(option, &end, 10);
+   if (end == option || val < 1 || val > NIO_MAX_QUEUES)
+      return (-1);
+   *fanout = val;
+
+#ifdef PACKET_FANOUT
+   if (*end == '\0' || !strcmp(end, ":hash"))
+      *fanout_mode = PACKET_FANOUT_HASH;
+   else if (!strcmp(end, ":cpu"))
+      *fanout_mode = PACKET_FANOUT_CPU;
+   else
+      return (-1);
+#endif
+   return (0);
+}
+
+/* Open a RAW socket on the device and wrap it in a NIO */
+static nio_t *nio_linux_raw_create(char *dev_name, int rx_ring, int tx_ring, int qdisc_bypass)
 {
    nio_linux_raw_t *nio_linux_raw;
    nio_t *nio;
@@ -217,8 +689,103 @@ nio_t *create_nio_linux_raw(char *dev_name)
    nio->type = NIO_TYPE_LINUX_RAW;
    nio->send = (void *)nio_linux_raw_send;
    nio->recv = (void *)nio_linux_raw_recv;
+   nio->send_batch = (void *)nio_linux_raw_send_batch;
+   nio->recv_batch = (void *)nio_linux_raw_recv_batch;
    nio->free = (void *)nio_linux_raw_free;
    nio->dptr = &nio->u.nio_linux_raw;
 
+   if (qdisc_bypass) {
+#ifdef PACKET_QDISC_BYPASS
+      /* send frames directly to the driver, without going through the traffic control layer */
+      int val = 1;
+      if (setsockopt(nio_linux_raw->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &val, sizeof(val)) == -1) {
+         fprintf(stderr, "create_nio_linux_raw: setsockopt (PACKET_QDISC_BYPASS): %s\n", strerror(errno));
+         free_nio(nio);
+         return NULL;
+      }
+#else
+      fprintf(stderr, "create_nio_linux_raw: qdisc bypass is not supported on this system\n");
+      free_nio(nio);
+      return NULL;
+#endif
+   }
+
+   if (rx_ring || tx_ring) {
+#ifdef TPACKET3_HDRLEN
+      if (nio_linux_raw_setup_rings(nio_linux_raw, rx_ring, tx_ring) == -1) {
+         free_nio(nio);
+         return NULL;
+      }
+      if (rx_ring) {
+         nio->recv = (void *)nio_linux_raw_ring_recv;
+         nio->recv_batch = (void *)nio_linux_raw_ring_recv_batch;
+      }
+      if (tx_ring) {
+         nio->send = (void *)nio_linux_raw_ring_send;
+         nio->send_batch = (void *)nio_linux_raw_ring_send_batch;
+      }
+#else
+      fprintf(stderr, "create_nio_linux_raw: memory-mapped rings are not supported on this system\n");
+      free_nio(nio);
+      return NULL;
+#endif
+   }
+
+   return nio;
+}
+
+/* Create a new NIO Linux RAW */
+nio_t *create_nio_linux_raw(char *dev_name, int argc, char *argv[])
+{
+   nio_t *nio, *queue;
+   int i, rx_ring = FALSE, tx_ring = FALSE, qdisc_bypass = FALSE;
+   int fanout = 1, fanout_mode = 0, group_id = -1;
+
+   for (i = 0; i < argc; i++) {
+      if (!strcmp(argv[i], "rx_ring"))
+         rx_ring = TRUE;
+      else if (!strcmp(argv[i], "tx_ring"))
+         tx_ring = TRUE;
+      else if (!strcmp(argv[i], "qdisc_bypass"))
+         qdisc_bypass = TRUE;
+      else if (!strncmp(argv[i], "fanout=", 7)) {
+         if (nio_linux_raw_parse_fanout(argv[i] + 7, &fanout, &fanout_mode) == -1) {
+            fprintf(stderr, "create_nio_linux_raw: invalid fanout option '%s'\n", argv[i]);
+            return NULL;
+         }
+      }
+      else {
+         fprintf(stderr, "create_nio_linux_raw: unknown option '%s'\n", argv[i]);
+         return NULL;
+      }
+   }
+
+   if (!(nio = nio_linux_raw_create(dev_name, rx_ring, tx_ring, qdisc_bypass)))
+      return NULL;
+
+   if (fanout > 1) {
+#ifdef PACKET_FANOUT
+      /* one socket per queue, the kernel spreads the received frames over the sockets of the group */
+      if ((group_id = nio_linux_raw_join_fanout(nio->u.nio_linux_raw.fd, -1, fanout_mode)) == -1) {
+         free_nio(nio);
+         return NULL;
+      }
+
+      for (i = 1; i < fanout; i++) {
+         if (!(queue = nio_linux_raw_create(dev_name, rx_ring, tx_ring, qdisc_bypass)) ||
+             nio_linux_raw_join_fanout(queue->u.nio_linux_raw.fd, group_id, fanout_mode) == -1) {
+            free_nio(queue);
+            free_nio(nio);
+            return NULL;
+         }
+         nio_add_queue(nio, queue);
+      }
+#else
+      fprintf(stderr, "create_nio_linux_raw: fanout is not supported on this system\n");
+      free_nio(nio);
+      return NULL;
+#endif
+   }
+
    return nio;
 }
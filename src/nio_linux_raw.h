@@ -21,15 +21,48 @@
 #ifndef NIO_LINUX_RAW_H_
 #define NIO_LINUX_RAW_H_
 
+#include <pthread.h>
+#include <sys/socket.h>
+#include <linux/if_packet.h>
+
 #include "nio.h"
 
 #define VLAN_HEADER_LEN 4
 
+/* TPACKET_V3 RX ring geometry */
+#define RX_RING_BLOCK_SIZE      (1 << 20)
+#define RX_RING_BLOCK_NR        16
+#define RX_RING_FRAME_SIZE      2048
+#define RX_RING_BLOCK_TIMEOUT   1      /* in milliseconds */
+
+/* PACKET_TX_RING geometry */
+#define TX_RING_BLOCK_SIZE      (1 << 16)
+#define TX_RING_FRAME_SIZE      2048
+#define TX_RING_FRAME_NR        256
+
 typedef struct {
     u_int16_t vlan_tp_id;
     u_int16_t vlan_tci;
 } vlan_tag_t;
 
-nio_t *create_nio_linux_raw(char *dev_name);
+/* Memory-mapped PACKET_RX_RING or PACKET_TX_RING */
+struct nio_linux_raw_ring {
+    unsigned char *map;
+    int version;
+    u_int block_size;
+    u_int block_nr;
+    u_int frame_size;
+    u_int frame_nr;
+    u_int current;              /* current block (RX ring) or frame (TX ring) */
+    unsigned char *next_frame;  /* RX ring: next frame to read in the current block, NULL if none */
+    u_int frames_left;          /* RX ring: frames not read yet in the current block */
+    u_int blocks_held;          /* RX ring: blocks read before the current one, not given back yet */
+    pthread_mutex_t lock;       /* TX ring: serializes the listener threads sending on the NIO */
+};
+
+nio_t *create_nio_linux_raw(char *dev_name, int argc, char *argv[]);
+#ifdef PACKET_AUXDATA
+ssize_t nio_linux_raw_restore_vlan(struct msghdr *msg, u_char **pkt, ssize_t received, int push);
+#endif
 
 #endif /* !NIO_LINUX_RAW_H_ */
@@ -35,8 +35,8 @@
 #include "nio_tap.h"
 
 
-/* Open a TAP device */
-static int nio_tap_open(char *tap_devname)
+/* Open a TAP device, or one more queue of a multi-queue TAP device */
+static int nio_tap_open(char *tap_devname, int multi_queue, int vnet_hdr)
 {
 #ifdef __linux__
    struct ifreq ifr;
@@ -49,7 +49,16 @@ static int nio_tap_open(char *tap_devname)
          close(fd);
          return err;
       }
-      if (ifr.ifr_flags | IFF_VNET_HDR) {
+      if (vnet_hdr) {
+         ifr.ifr_flags |= IFF_VNET_HDR;
+         if ((err = ioctl(fd, TUNSETIFF, &ifr)) < 0) {
+            fprintf(stderr, "nio_tap_open: cannot set IFF_VNET_HDR bit.\n");
+            close(fd);
+            return err;
+         }
+         ifr.ifr_flags &= ~IFF_VNET_HDR;
+      }
+      else if (ifr.ifr_flags | IFF_VNET_HDR) {
          ifr.ifr_flags &= ~IFF_VNET_HDR;
          if ((err = ioctl(fd, TUNSETIFF, &ifr)) < 0) {
             fprintf(stderr, "nio_tap_open: cannot clean IFF_VNET_HDR bit.\n");
@@ -57,6 +66,10 @@ static int nio_tap_open(char *tap_devname)
             return err;
          }
       }
+#ifdef IFF_MULTI_QUEUE
+      if (multi_queue)
+         ifr.ifr_flags &= ~IFF_MULTI_QUEUE;
+#endif
       if (ifr.ifr_flags != (IFF_TAP | IFF_NO_PI)) {
          fprintf(stderr, "nio_tap_open: bad TAP device specified (%d).\n",
                  ifr.ifr_flags);
@@ -69,6 +82,13 @@ static int nio_tap_open(char *tap_devname)
 
       memset(&ifr,0,sizeof(ifr));
       ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+      if (vnet_hdr)
+         ifr.ifr_flags |= IFF_VNET_HDR;
+      /* each queue is a file descriptor attached to the same interface */
+#ifdef IFF_MULTI_QUEUE
+      if (multi_queue)
+         ifr.ifr_flags |= IFF_MULTI_QUEUE;
+#endif
       if (*tap_devname)
          strncpy(ifr.ifr_name, tap_devname, IFNAMSIZ);
 
@@ -100,6 +120,64 @@ static int nio_tap_open(char *tap_devname)
 #endif
 }
 
+#if defined(__linux__) && defined(TUNSETVNETHDRSZ)
+#ifndef TUN_F_USO4
+#define TUN_F_USO4      0x20
+#define TUN_F_USO6      0x40
+#endif
+
+/* Exchange frames with a virtio-net header and let the kernel skip segmentation and checksums */
+static int nio_tap_setup_offload(int fd)
+{
+   int hdr_size = sizeof(nio_offload_t);
+
+   if (ioctl(fd, TUNSETVNETHDRSZ, &hdr_size) < 0) {
+      fprintf(stderr, "nio_tap_setup_offload: TUNSETVNETHDRSZ: %s\n", strerror(errno));
+      return (-1);
+   }
+
+   /* UDP super-frames need Linux 6.2 or later */
+   if (ioctl(fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN | TUN_F_USO4 | TUN_F_USO6) < 0 &&
+       ioctl(fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN) < 0) {
+      fprintf(stderr, "nio_tap_setup_offload: TUNSETOFFLOAD: %s\n", strerror(errno));
+      return (-1);
+   }
+   return (0);
+}
+
+/* Send a frame preceded by its offload information */
+static ssize_t nio_tap_vnet_send(nio_tap_t *nio_tap, void *pkt, size_t pkt_len)
+{
+   struct iovec iov[2];
+   ssize_t len;
+
+   iov[0].iov_base = nio_pkt_offload(pkt);
+   iov[0].iov_len = sizeof(nio_offload_t);
+   iov[1].iov_base = pkt;
+   iov[1].iov_len = pkt_len;
+
+   if ((len = writev(nio_tap->fd, iov, 2)) < (ssize_t)sizeof(nio_offload_t))
+      return (-1);
+   return (len - sizeof(nio_offload_t));
+}
+
+/* Receive a frame, its offload information is stored right before it */
+static ssize_t nio_tap_vnet_recv(nio_tap_t *nio_tap, void *pkt, size_t max_len)
+{
+   struct iovec iov[2];
+   ssize_t len;
+
+   iov[0].iov_base = nio_pkt_offload(pkt);
+   iov[0].iov_len = sizeof(nio_offload_t);
+   iov[1].iov_base = pkt;
+   iov[1].iov_len = max_len;
+
+   if ((len = readv(nio_tap->fd, iov, 2)) < (ssize_t)sizeof(nio_offload_t))
+      return (-1);
+   return (len - sizeof(nio_offload_t));
+}
+#endif
+
 static void nio_tap_free(nio_tap_t *nio_tap)
 {
    if (nio_tap->fd != -1)
@@ -124,8 +202,7 @@ static ssize_t nio_tap_recv(nio_tap_t *nio_tap, void *pkt, size_t max_len)
    return (read(nio_tap->fd, pkt, max_len));
 }
 
-/* Create a new NIO TAP */
-nio_t *create_nio_tap(char *tap_name)
+static nio_t *nio_tap_create(char *tap_name, int multi_queue, int vnet_hdr)
 {
    nio_tap_t *nio_tap;
    nio_t *nio;
@@ -142,7 +219,7 @@ nio_t *create_nio_tap(char *tap_name)
    }
 
    memset(nio_tap, 0, sizeof(*nio_tap));
-   nio_tap->fd = nio_tap_open(tap_name);
+   nio_tap->fd = nio_tap_open(tap_name, multi_queue, vnet_hdr);
 
    if (nio_tap->fd == -1) {
       fprintf(stderr,"create_nio_tap: unable to open TAP device %s (%s)\n", tap_name, strerror(errno));
@@ -155,5 +232,67 @@ nio_t *create_nio_tap(char *tap_name)
    nio->recv = (void *)nio_tap_recv;
    nio->free = (void *)nio_tap_free;
    nio->dptr = &nio->u.nio_tap;
+
+#if defined(__linux__) && defined(TUNSETVNETHDRSZ)
+   if (vnet_hdr) {
+      if (nio_tap_setup_offload(nio_tap->fd) == -1) {
+         free_nio(nio);
+         return NULL;
+      }
+      nio->send = (void *)nio_tap_vnet_send;
+      nio->recv = (void *)nio_tap_vnet_recv;
+      nio->offload = TRUE;
+   }
+#endif
+   return nio;
+}
+
+/* Create a new NIO TAP */
+nio_t *create_nio_tap(char *tap_name, int argc, char *argv[])
+{
+   nio_t *nio, *queue;
+   int i, queues = 1, vnet_hdr = FALSE;
+   char *end;
+
+   for (i = 0; i < argc; i++) {
+      if (!strncmp(argv[i], "queues=", 7)) {
+         queues = strtol(argv[i] + 7, &end, 10);
+         if (end == argv[i] + 7 || *end != '\0' || queues < 1 || queues > NIO_MAX_QUEUES) {
+            fprintf(stderr, "create_nio_tap: invalid number of queues '%s'\n", argv[i]);
+            return NULL;
+         }
+      }
+      else if (!strcmp(argv[i], "vnet_hdr"))
+         vnet_hdr = TRUE;
+      else {
+         fprintf(stderr, "create_nio_tap: unknown option '%s'\n", argv[i]);
+         return NULL;
+      }
+   }
+
+#ifndef IFF_MULTI_QUEUE
+   if (queues > 1) {
+      fprintf(stderr, "create_nio_tap: multi-queue TAP devices are not supported on this system\n");
+      return NULL;
+   }
+#endif
+
+#if !defined(__linux__) || !defined(TUNSETVNETHDRSZ)
+   if (vnet_hdr) {
+      fprintf(stderr, "create_nio_tap: offload is not supported on this system\n");
+      return NULL;
+   }
+#endif
+
+   if (!(nio = nio_tap_create(tap_name, queues > 1, vnet_hdr)))
+      return NULL;
+
+   for (i = 1; i < queues; i++) {
+      if (!(queue = nio_tap_create(tap_name, TRUE, vnet_hdr))) {
+         free_nio(nio);
+         return NULL;
+      }
+      nio_add_queue(nio, queue);
+   }
    return nio;
 }
@@ -23,6 +23,6 @@
 
 #include "nio.h"
 
-nio_t *create_nio_tap(char *tap_name);
+nio_t *create_nio_tap(char *tap_name, int argc, char *argv[]);
 
 #endif /* !NIO_TAP_H_ */
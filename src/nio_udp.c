@@ -18,6 +18,7 @@
  *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
@@ -26,6 +27,7 @@
 #include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 
 #include "ubridge.h"
 #include "nio_udp.h"
@@ -116,6 +118,12 @@ static void nio_udp_free(nio_udp_t *nio_udp)
      nio_udp->remote_host = NULL;
    }
 
+   if (nio_udp->gro) {
+     free(nio_udp->gro->buffer);
+     free(nio_udp->gro);
+     nio_udp->gro = NULL;
+   }
+
    if (nio_udp->fd != -1)
      close(nio_udp->fd);
 }
@@ -130,11 +138,176 @@ static ssize_t nio_udp_recv(nio_udp_t *nio_udp, void *pkt, size_t max_len)
    return (recvfrom(nio_udp->fd, pkt, max_len, 0, NULL, NULL));
 }
 
+#ifdef __linux__
+static int nio_udp_send_batch(nio_udp_t *nio_udp, struct iovec *pkts, int count)
+{
+   return (nio_sock_send_batch(nio_udp->fd, NULL, 0, pkts, count));
+}
+
+static int nio_udp_recv_batch(nio_udp_t *nio_udp, struct iovec *pkts, int count)
+{
+   return (nio_sock_recv_batch(nio_udp->fd, pkts, count));
+}
+#endif
+
+#if defined(__linux__) && defined(UDP_SEGMENT)
+/*
+ * Send a burst with UDP_SEGMENT: each run of frames of the same size (the
+ * last one can be shorter) is handed to the kernel as a single datagram
+ * that is segmented on the way out.
+ */
+static int nio_udp_gso_send_batch(nio_udp_t *nio_udp, struct iovec *pkts, int count)
+{
+   struct mmsghdr msgs[NIO_MAX_BATCH];
+   union {
+      char buf[CMSG_SPACE(sizeof(uint16_t))];
+      struct cmsghdr align;
+   } cmsg_bufs[NIO_MAX_BATCH];
+   struct cmsghdr *cmsg;
+   int i, j, nr_msgs, sent, pkts_sent;
+   size_t total;
+
+   count = m_min(count, NIO_MAX_BATCH);
+   memset(msgs, 0, count * sizeof(struct mmsghdr));
+   for (i = 0, nr_msgs = 0; i < count; i = j, nr_msgs++) {
+      j = i + 1;
+      if (pkts[i].iov_len <= nio_udp->gso_max_frame) {
+         total = pkts[i].iov_len;
+         for (; j < count && j - i < UDP_GSO_MAX_SEGMENTS; j++) {
+            if (pkts[j].iov_len > pkts[i].iov_len || total + pkts[j].iov_len > UDP_GSO_MAX_SIZE)
+               break;
+            total += pkts[j].iov_len;
+            if (pkts[j].iov_len < pkts[i].iov_len) {
+               j++;
+               break;
+            }
+         }
+      }
+
+      msgs[nr_msgs].msg_hdr.msg_iov = &pkts[i];
+      msgs[nr_msgs].msg_hdr.msg_iovlen = j - i;
+      if (j - i > 1) {
+         msgs[nr_msgs].msg_hdr.msg_control = cmsg_bufs[nr_msgs].buf;
+         msgs[nr_msgs].msg_hdr.msg_controllen = sizeof(cmsg_bufs[nr_msgs].buf);
+         cmsg = CMSG_FIRSTHDR(&msgs[nr_msgs].msg_hdr);
+         cmsg->cmsg_level = SOL_UDP;
+         cmsg->cmsg_type = UDP_SEGMENT;
+         cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+         *(uint16_t *)CMSG_DATA(cmsg) = pkts[i].iov_len;
+      }
+   }
+
+   if ((sent = sendmmsg(nio_udp->fd, msgs, nr_msgs, 0)) == -1) {
+      if ((errno == EIO || errno == EINVAL) && msgs[0].msg_hdr.msg_iovlen > 1) {
+         /* segmentation is not possible on this path, stop using it */
+         fprintf(stderr, "UDP NIO %d: UDP_SEGMENT failed (%s), disabling it\n", nio_udp->local_port, strerror(errno));
+         nio_udp->gso_max_frame = 0;
+         return (nio_sock_send_batch(nio_udp->fd, NULL, 0, pkts, count));
+      }
+      return (-1);
+   }
+
+   for (i = 0, pkts_sent = 0; i < sent; i++)
+      pkts_sent += msgs[i].msg_hdr.msg_iovlen;
+   return (pkts_sent);
+}
+
+/* Largest frame that can be sent with UDP_SEGMENT without IP fragmentation */
+static size_t nio_udp_gso_max_frame(int fd)
+{
+   struct sockaddr_storage st;
+   socklen_t len = sizeof(st);
+   int mtu;
+
+   if (getsockname(fd, (struct sockaddr *)&st, &len) == -1)
+      return (0);
+
+   len = sizeof(mtu);
+   if (st.ss_family == AF_INET6) {
+      if (getsockopt(fd, IPPROTO_IPV6, IPV6_MTU, &mtu, &len) == -1 || mtu <= 48)
+         return (0);
+      return (mtu - 48);
+   }
+   if (getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &len) == -1 || mtu <= 28)
+      return (0);
+   return (mtu - 28);
+}
+#endif
+
+#if defined(__linux__) && defined(UDP_GRO)
+/* Receive datagrams coalesced by UDP_GRO and split them into frames */
+static int nio_udp_gro_recv_batch(nio_udp_t *nio_udp, struct iovec *pkts, int count)
+{
+   struct nio_udp_gro *gro = nio_udp->gro;
+   struct mmsghdr msgs[NIO_MAX_BATCH];
+   union {
+      char buf[CMSG_SPACE(sizeof(int))];
+      struct cmsghdr align;
+   } cmsg_bufs[NIO_MAX_BATCH];
+   struct cmsghdr *cmsg;
+   size_t len;
+   int i, received, n = 0;
+
+   if (gro->current >= gro->nr_msgs) {
+      /* everything has been handed over, receive more datagrams */
+      memset(msgs, 0, sizeof(msgs));
+      for (i = 0; i < NIO_MAX_BATCH; i++) {
+         gro->msgs[i].iov_base = gro->buffer + i * NIO_MAX_PKT_SIZE;
+         gro->msgs[i].iov_len = NIO_MAX_PKT_SIZE;
+         msgs[i].msg_hdr.msg_iov = &gro->msgs[i];
+         msgs[i].msg_hdr.msg_iovlen = 1;
+         msgs[i].msg_hdr.msg_control = cmsg_bufs[i].buf;
+         msgs[i].msg_hdr.msg_controllen = sizeof(cmsg_bufs[i].buf);
+      }
+
+      if ((received = recvmmsg(nio_udp->fd, msgs, NIO_MAX_BATCH, MSG_WAITFORONE, NULL)) <= 0)
+         return (received);
+
+      for (i = 0; i < received; i++) {
+         gro->msgs[i].iov_len = msgs[i].msg_len;
+         gro->seg_size[i] = msgs[i].msg_len;
+         for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO && *(int *)CMSG_DATA(cmsg) > 0)
+               gro->seg_size[i] = *(int *)CMSG_DATA(cmsg);
+         }
+      }
+      gro->nr_msgs = received;
+      gro->current = 0;
+      gro->offset = 0;
+   }
+
+   while (n < count && gro->current < gro->nr_msgs) {
+      len = m_min(gro->seg_size[gro->current], gro->msgs[gro->current].iov_len - gro->offset);
+      memcpy(pkts[n].iov_base, (u_char *)gro->msgs[gro->current].iov_base + gro->offset, len);
+      pkts[n++].iov_len = len;
+
+      gro->offset += len;
+      if (gro->offset >= gro->msgs[gro->current].iov_len) {
+         gro->current++;
+         gro->offset = 0;
+      }
+   }
+   return (n);
+}
+#endif
+
 /* Create a new NIO UDP */
-nio_t *create_nio_udp(int local_port, char *remote_host, int remote_port)
+nio_t *create_nio_udp(int local_port, char *remote_host, int remote_port, int argc, char *argv[])
 {
    nio_udp_t *nio_udp;
    nio_t *nio;
+   int i, gso = FALSE, gro = FALSE;
+
+   for (i = 0; i < argc; i++) {
+      if (!strcmp(argv[i], "gso"))
+         gso = TRUE;
+      else if (!strcmp(argv[i], "gro"))
+         gro = TRUE;
+      else {
+         fprintf(stderr, "create_nio_udp: unknown option '%s'\n", argv[i]);
+         return NULL;
+      }
+   }
 
    if (!(nio = create_nio()))
       return NULL;
@@ -158,7 +331,48 @@ nio_t *create_nio_udp(int local_port, char *remote_host, int remote_port)
    nio->type = NIO_TYPE_UDP;
    nio->send = (void *)nio_udp_send;
    nio->recv = (void *)nio_udp_recv;
+#ifdef __linux__
+   nio->send_batch = (void *)nio_udp_send_batch;
+   nio->recv_batch = (void *)nio_udp_recv_batch;
+#endif
    nio->free = (void *)nio_udp_free;
    nio->dptr = &nio->u.nio_udp;
+
+   if (gso) {
+#if defined(__linux__) && defined(UDP_SEGMENT)
+      if (!(nio_udp->gso_max_frame = nio_udp_gso_max_frame(nio_udp->fd))) {
+         fprintf(stderr, "create_nio_udp: unable to get the path MTU to %s:%d\n", remote_host, remote_port);
+         free_nio(nio);
+         return NULL;
+      }
+      nio->send_batch = (void *)nio_udp_gso_send_batch;
+#else
+      fprintf(stderr, "create_nio_udp: UDP segmentation offload is not supported on this system\n");
+      free_nio(nio);
+      return NULL;
+#endif
+   }
+
+   if (gro) {
+#if defined(__linux__) && defined(UDP_GRO)
+      int val = 1;
+      if (setsockopt(nio_udp->fd, SOL_UDP, UDP_GRO, &val, sizeof(val)) == -1) {
+         fprintf(stderr, "create_nio_udp: setsockopt (UDP_GRO): %s\n", strerror(errno));
+         free_nio(nio);
+         return NULL;
+      }
+      if (!(nio_udp->gro = calloc(1, sizeof(struct nio_udp_gro))) ||
+          !(nio_udp->gro->buffer = malloc(NIO_MAX_BATCH * NIO_MAX_PKT_SIZE))) {
+         fprintf(stderr, "create_nio_udp: insufficient memory\n");
+         free_nio(nio);
+         return NULL;
+      }
+      nio->recv_batch = (void *)nio_udp_gro_recv_batch;
+#else
+      fprintf(stderr, "create_nio_udp: UDP receive offload is not supported on this system\n");
+      free_nio(nio);
+      return NULL;
+#endif
+   }
    return nio;
 }
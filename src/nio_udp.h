@@ -31,6 +31,20 @@
 # endif
 #endif /* HOST_NAME_MAX */
 
-nio_t *create_nio_udp(int local_port, char *remote_host, int remote_port);
+/* UDP_SEGMENT limits */
+#define UDP_GSO_MAX_SEGMENTS    64
+#define UDP_GSO_MAX_SIZE        65000
+
+/* Datagrams coalesced by UDP_GRO, split back into frames */
+struct nio_udp_gro {
+    unsigned char *buffer;
+    struct iovec msgs[NIO_MAX_BATCH];
+    u_int seg_size[NIO_MAX_BATCH];
+    int nr_msgs;
+    int current;    /* datagram being split */
+    size_t offset;  /* offset of the next frame in the current datagram */
+};
+
+nio_t *create_nio_udp(int local_port, char *remote_host, int remote_port, int argc, char *argv[]);
 
 #endif /* !NIO_UDP_H_ */
@@ -72,6 +72,18 @@ static ssize_t nio_unix_recv(nio_unix_t *nio_unix, void *pkt, size_t max_len)
    return (recvfrom(nio_unix->fd, pkt, max_len, 0, NULL, NULL));
 }
 
+#ifdef __linux__
+static int nio_unix_send_batch(nio_unix_t *nio_unix, struct iovec *pkts, int count)
+{
+   return (nio_sock_send_batch(nio_unix->fd, (struct sockaddr *)&nio_unix->remote_sock, sizeof(nio_unix->remote_sock), pkts, count));
+}
+
+static int nio_unix_recv_batch(nio_unix_t *nio_unix, struct iovec *pkts, int count)
+{
+   return (nio_sock_recv_batch(nio_unix->fd, pkts, count));
+}
+#endif
+
 /* Create a new NIO UNIX */
 nio_t *create_nio_unix(char *local, char *remote)
 {
@@ -107,6 +119,10 @@ nio_t *create_nio_unix(char *local, char *remote)
    nio->type = NIO_TYPE_UNIX;
    nio->send = (void *)nio_unix_send;
    nio->recv = (void *)nio_unix_recv;
+#ifdef __linux__
+   nio->send_batch = (void *)nio_unix_send_batch;
+   nio->recv_batch = (void *)nio_unix_recv_batch;
+#endif
    nio->free = (void *)nio_unix_free;
    nio->dptr = &nio->u.nio_unix;
    return nio;
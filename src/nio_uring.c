@@ -0,0 +1,834 @@
+/*
+ *   This file is part of ubridge, a program to bridge network interfaces
+ *   to UDP tunnels.
+ *
+ *   Copyright (C) 2026 GNS3 Technologies Inc.
+ *
+ *   ubridge is free software: you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ubridge is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "ubridge.h"
+#include "nio_uring.h"
+
+int use_io_uring = 0;
+
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/if_ether.h>
+#include <net/if_arp.h>
+#include <linux/if_packet.h>
+
+#ifdef LINUX_RAW
+#include "nio_linux_raw.h"
+#endif
+
+#define NIO_URING_ENTRIES       64
+
+/* Linux 6.7 opcode, missing from older headers */
+#define NIO_URING_OP_READ_MULTISHOT  49
+
+/* user_data of the completions */
+#define NIO_URING_RX            1ULL
+#define NIO_URING_TX            2ULL   /* plus the index of the packet in the burst */
+
+enum {
+   NIO_URING_NO_RECV = 0,
+   NIO_URING_RECV,
+   NIO_URING_RECVMSG,
+   NIO_URING_READ,
+};
+
+struct nio_uring {
+   int fd;
+
+   /* submission queue */
+   unsigned *sq_head;
+   unsigned *sq_tail;
+   unsigned *sq_mask;
+   unsigned *sq_array;
+   unsigned sq_entries;
+   unsigned to_submit;
+   struct io_uring_sqe *sqes;
+
+   /* completion queue */
+   unsigned *cq_head;
+   unsigned *cq_tail;
+   unsigned *cq_mask;
+   struct io_uring_cqe *cqes;
+
+   void *sq_map;
+   void *cq_map;
+   size_t sq_map_size;
+   size_t cq_map_size;
+   size_t sqes_size;
+
+   /* multishot receive on the receiving NIO */
+   nio_t *rx_nio;
+   int rx_mode;
+   int armed;
+   struct msghdr rx_msg;
+   struct io_uring_buf_ring *buf_ring;
+   packet_pool_t *pool;
+   packet_buf_t *bufs[NIO_URING_BUFFERS];  /* pool buffers the kernel receives in, by buffer ID */
+   int nr_missing;                         /* buffer IDs left without a buffer */
+   size_t buf_offset;      /* where the kernel writes in a buffer, the packet starts at NIO_URING_BUFFER_DATA */
+   u_int buf_len;
+   u_short buf_tail;
+   struct {
+      int bid;
+      int res;
+   } ready[NIO_URING_BUFFERS + 1];  /* completions not handed to the bridge yet */
+   int ready_head;
+   int nr_ready;
+   u_short used[NIO_URING_BUFFERS]; /* buffers of the last burst */
+   int nr_used;
+
+   /* sends of the burst being transmitted */
+   struct msghdr tx_msgs[NIO_MAX_BATCH];
+   struct iovec tx_iov[NIO_MAX_BATCH];
+   struct sockaddr_ll tx_sll;
+   int tx_res[NIO_MAX_BATCH];
+   int tx_pending;
+};
+
+static int read_multishot = FALSE;
+
+/* ring of the listener thread, used to send from that thread */
+static __thread nio_uring_t *thread_ring = NULL;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+   return (syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+   return (syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0));
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+   return (syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+static void nio_uring_unmap(nio_uring_t *ring)
+{
+   if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+      munmap(ring->sqes, ring->sqes_size);
+   if (ring->cq_map != NULL && ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+      munmap(ring->cq_map, ring->cq_map_size);
+   if (ring->sq_map != NULL && ring->sq_map != MAP_FAILED)
+      munmap(ring->sq_map, ring->sq_map_size);
+   if (ring->fd != -1)
+      close(ring->fd);
+}
+
+/* Create the rings shared with the kernel */
+static int nio_uring_setup(nio_uring_t *ring, unsigned entries)
+{
+   struct io_uring_params params;
+   u_char *sq, *cq;
+
+   memset(&params, 0, sizeof(params));
+   params.flags = IORING_SETUP_CQSIZE;
+   params.cq_entries = entries * 4;
+   if ((ring->fd = sys_io_uring_setup(entries, &params)) == -1)
+      return (-1);
+
+   ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+   ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+   if (params.features & IORING_FEAT_SINGLE_MMAP)
+      ring->sq_map_size = ring->cq_map_size = m_max(ring->sq_map_size, ring->cq_map_size);
+
+   ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+   if (ring->sq_map == MAP_FAILED)
+      return (-1);
+   if (params.features & IORING_FEAT_SINGLE_MMAP)
+      ring->cq_map = ring->sq_map;
+   else if ((ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+      return (-1);
+   ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+   if ((ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES)) == MAP_FAILED)
+      return (-1);
+
+   sq = ring->sq_map;
+   ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+   ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+   ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+   ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+   ring->sq_entries = params.sq_entries;
+
+   cq = ring->cq_map;
+   ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+   ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+   ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+   ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+   return (0);
+}
+
+static unsigned nio_uring_sq_space(nio_uring_t *ring)
+{
+   return (ring->sq_entries - (*ring->sq_tail + ring->to_submit - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)));
+}
+
+static struct io_uring_sqe *nio_uring_get_sqe(nio_uring_t *ring)
+{
+   struct io_uring_sqe *sqe;
+   unsigned index;
+
+   if (nio_uring_sq_space(ring) == 0)
+      return (NULL);
+   index = (*ring->sq_tail + ring->to_submit++) & *ring->sq_mask;
+   sqe = &ring->sqes[index];
+   memset(sqe, 0, sizeof(*sqe));
+   ring->sq_array[index] = index;
+   return (sqe);
+}
+
+/* Submit the queued requests and wait for wait_nr completions if asked to */
+static int nio_uring_enter(nio_uring_t *ring, unsigned wait_nr)
+{
+   unsigned to_submit = ring->to_submit;
+
+   if (to_submit)
+      __atomic_store_n(ring->sq_tail, *ring->sq_tail + to_submit, __ATOMIC_RELEASE);
+   ring->to_submit = 0;
+   if (sys_io_uring_enter(ring->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0) == -1 && errno != EINTR)
+      return (-1);
+   return (0);
+}
+
+static u_char *nio_uring_buffer(nio_uring_t *ring, int bid)
+{
+   return (ring->bufs[bid]->data);
+}
+
+/* Give a buffer back to the kernel, visible once published */
+static void nio_uring_add_buffer(nio_uring_t *ring, u_short bid)
+{
+   struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (NIO_URING_BUFFERS - 1)];
+
+   buf->addr = (unsigned long)(nio_uring_buffer(ring, bid) + ring->buf_offset);
+   buf->len = ring->buf_len;
+   buf->bid = bid;
+   ring->buf_tail++;
+}
+
+static void nio_uring_publish_buffers(nio_uring_t *ring)
+{
+   __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Give the buffers of the last burst back to the kernel. A buffer still
+ * held by a delay queue is left to it and replaced by a new one.
+ */
+static void nio_uring_recycle(nio_uring_t *ring)
+{
+   packet_buf_t *buf;
+   int i, bid, added = 0;
+
+   for (i = 0; i < ring->nr_used; i++) {
+      bid = ring->used[i];
+      if ((buf = packet_buf_reclaim(ring->bufs[bid])) == NULL) {
+         packet_buf_release(ring->bufs[bid]);
+         ring->bufs[bid] = NULL;
+         ring->nr_missing++;
+         continue;
+      }
+      ring->bufs[bid] = buf;
+      nio_uring_add_buffer(ring, bid);
+      added++;
+   }
+   ring->nr_used = 0;
+
+   /* buffers that could not be replaced before */
+   for (bid = 0; ring->nr_missing > 0 && bid < NIO_URING_BUFFERS; bid++) {
+      if (ring->bufs[bid] != NULL)
+         continue;
+      if (!(ring->bufs[bid] = packet_buf_alloc(ring->pool)))
+         break;
+      ring->nr_missing--;
+      nio_uring_add_buffer(ring, bid);
+      added++;
+   }
+   if (added)
+      nio_uring_publish_buffers(ring);
+}
+
+static void nio_uring_rx_completion(nio_uring_t *ring, struct io_uring_cqe *cqe)
+{
+   int slot;
+
+   if (!(cqe->flags & IORING_CQE_F_MORE))
+      ring->armed = FALSE;
+
+   /* out of buffers, the receive is armed again after the next burst */
+   if (cqe->res == -ENOBUFS)
+      return;
+
+   if (ring->nr_ready == NIO_URING_BUFFERS + 1) {
+      if (cqe->flags & IORING_CQE_F_BUFFER) {
+         nio_uring_add_buffer(ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+         nio_uring_publish_buffers(ring);
+      }
+      return;
+   }
+   slot = (ring->ready_head + ring->nr_ready++) % (NIO_URING_BUFFERS + 1);
+   ring->ready[slot].bid = (cqe->flags & IORING_CQE_F_BUFFER) ? (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+   ring->ready[slot].res = cqe->res;
+}
+
+/* Process all the completions available */
+static void nio_uring_reap(nio_uring_t *ring)
+{
+   struct io_uring_cqe *cqe;
+   unsigned head, tail;
+
+   head = *ring->cq_head;
+   tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+   for (; head != tail; head++) {
+      cqe = &ring->cqes[head & *ring->cq_mask];
+      if (cqe->user_data == NIO_URING_RX)
+         nio_uring_rx_completion(ring, cqe);
+      else if (cqe->user_data >= NIO_URING_TX && cqe->user_data < NIO_URING_TX + NIO_MAX_BATCH) {
+         ring->tx_res[cqe->user_data - NIO_URING_TX] = cqe->res;
+         ring->tx_pending--;
+      }
+   }
+   __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Queue a multishot receive that keeps posting packets until it runs out of buffers */
+static int nio_uring_arm(nio_uring_t *ring)
+{
+   struct io_uring_sqe *sqe;
+
+   if (!(sqe = nio_uring_get_sqe(ring)))
+      return (-1);
+   sqe->fd = nio_get_fd(ring->rx_nio);
+   sqe->flags = IOSQE_BUFFER_SELECT;
+   sqe->buf_group = 0;
+   sqe->user_data = NIO_URING_RX;
+   switch (ring->rx_mode) {
+      case NIO_URING_RECV:
+         sqe->opcode = IORING_OP_RECV;
+         sqe->ioprio = IORING_RECV_MULTISHOT;
+         break;
+      case NIO_URING_RECVMSG:
+         sqe->opcode = IORING_OP_RECVMSG;
+         sqe->ioprio = IORING_RECV_MULTISHOT;
+         sqe->addr = (unsigned long)&ring->rx_msg;
+         sqe->len = 1;
+         break;
+      case NIO_URING_READ:
+         sqe->opcode = NIO_URING_OP_READ_MULTISHOT;
+         break;
+   }
+   ring->armed = TRUE;
+   return (0);
+}
+
+/* Length of the packet received in a buffer, the packet is moved at NIO_URING_BUFFER_DATA if needed */
+static ssize_t nio_uring_packet_len(nio_uring_t *ring, u_char *buffer, int res)
+{
+   ssize_t len = res;
+
+   switch (ring->rx_mode) {
+      case NIO_URING_READ:
+         /* the offload information comes first */
+         if (ring->rx_nio->offload)
+            len -= sizeof(nio_offload_t);
+         break;
+#if defined(LINUX_RAW) && defined(PACKET_AUXDATA)
+      case NIO_URING_RECVMSG: {
+         struct io_uring_recvmsg_out *out;
+         struct msghdr msg;
+         u_char *data;
+
+         out = (struct io_uring_recvmsg_out *)(buffer + ring->buf_offset);
+         len = m_min(out->payloadlen, res - (NIO_URING_BUFFER_DATA - ring->buf_offset));
+         memset(&msg, 0, sizeof(msg));
+         msg.msg_control = (u_char *)(out + 1) + ring->rx_msg.msg_namelen;
+         msg.msg_controllen = out->controllen;
+         data = buffer + NIO_URING_BUFFER_DATA;
+         /* the control data is right before the frame, the tag cannot go in front of it */
+         if (len > 0)
+            len = nio_linux_raw_restore_vlan(&msg, &data, len, FALSE);
+         break;
+      }
+#endif
+   }
+   return (len);
+}
+
+/*
+ * Receive up to count packets posted by the multishot receive. The packets
+ * stay in the ring buffers until the next call.
+ */
+int nio_uring_recv_batch(nio_uring_t *ring, struct iovec *pkts, int count)
+{
+   struct pollfd pfd;
+   ssize_t len;
+   int bid, res, received = 0;
+
+   /* the previous burst has been sent */
+   nio_uring_recycle(ring);
+
+   while (1) {
+      nio_uring_reap(ring);
+      while (ring->nr_ready > 0 && received < count) {
+         bid = ring->ready[ring->ready_head].bid;
+         res = ring->ready[ring->ready_head].res;
+         if (res < 0 && received > 0)
+            break;
+         ring->ready_head = (ring->ready_head + 1) % (NIO_URING_BUFFERS + 1);
+         ring->nr_ready--;
+         if (res < 0) {
+            errno = -res;
+            return (-1);
+         }
+         if (bid < 0)
+            continue;
+
+         ring->used[ring->nr_used++] = bid;
+         if ((len = nio_uring_packet_len(ring, nio_uring_buffer(ring, bid), res)) <= 0)
+            continue;
+         pkts[received].iov_base = nio_uring_buffer(ring, bid) + NIO_URING_BUFFER_DATA;
+         pkts[received].iov_len = len;
+         received++;
+      }
+      if (received > 0)
+         return (received);
+
+      nio_uring_recycle(ring);
+      if (!ring->armed && nio_uring_arm(ring) == -1)
+         return (-1);
+      if (nio_uring_enter(ring, 0) == -1)
+         return (-1);
+      if (*ring->cq_head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+         continue;
+
+      /* wait for completions, poll() is a cancellation point */
+      pfd.fd = ring->fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+         return (-1);
+   }
+}
+
+int nio_uring_can_recv(nio_uring_t *ring)
+{
+   return (ring->rx_mode != NIO_URING_NO_RECV);
+}
+
+/* Pool buffer a packet of the last burst lies in, to hold it without a copy */
+packet_buf_t *nio_uring_packet_buf(nio_uring_t *ring, const u_char *pkt)
+{
+   int i;
+
+   for (i = 0; i < ring->nr_used; i++) {
+      if (packet_buf_contains(ring->bufs[ring->used[i]], pkt))
+         return (ring->bufs[ring->used[i]]);
+   }
+   return (NULL);
+}
+
+/* Ring to send on the transmitting NIO from the calling thread, NULL if it must use the NIO functions */
+nio_uring_t *nio_uring_thread_ring(nio_t *tx_nio)
+{
+   if (thread_ring == NULL)
+      return (NULL);
+
+   switch (tx_nio->type) {
+      case NIO_TYPE_UDP:
+         if (tx_nio->u.nio_udp.gso_max_frame)
+            return (NULL);
+         break;
+      case NIO_TYPE_LINUX_RAW:
+         if (tx_nio->u.nio_linux_raw.tx_ring)
+            return (NULL);
+         break;
+      case NIO_TYPE_TAP:
+      case NIO_TYPE_UNIX:
+         break;
+      default:
+         return (NULL);
+   }
+   return (thread_ring);
+}
+
+/*
+ * Send a burst with one submission. The sends are linked so they are done in
+ * order and stop at the first failure. Returns the number of packets sent or
+ * -1 if the first one could not be sent.
+ */
+int nio_uring_send_batch(nio_uring_t *ring, nio_t *tx_nio, struct iovec *pkts, int count)
+{
+   struct io_uring_sqe *sqe;
+   int i, fd, sent, state;
+
+   fd = nio_get_fd(tx_nio);
+   count = m_min(count, m_min(NIO_MAX_BATCH, (int)nio_uring_sq_space(ring)));
+   if (count == 0) {
+      errno = EBUSY;
+      return (-1);
+   }
+
+   if (tx_nio->type == NIO_TYPE_LINUX_RAW) {
+      memset(&ring->tx_sll, 0, sizeof(ring->tx_sll));
+      ring->tx_sll.sll_family = AF_PACKET;
+      ring->tx_sll.sll_protocol = htons(ETH_P_ALL);
+      ring->tx_sll.sll_hatype = ARPHRD_ETHER;
+      ring->tx_sll.sll_halen = ETH_ALEN;
+      ring->tx_sll.sll_ifindex = tx_nio->u.nio_linux_raw.dev_id;
+   }
+
+   for (i = 0; i < count; i++) {
+      sqe = nio_uring_get_sqe(ring);
+      sqe->fd = fd;
+      sqe->user_data = NIO_URING_TX + i;
+      if (i < count - 1)
+         sqe->flags = IOSQE_IO_LINK;
+      ring->tx_res[i] = 0;
+
+      switch (tx_nio->type) {
+         case NIO_TYPE_UDP:
+            sqe->opcode = IORING_OP_SEND;
+            sqe->addr = (unsigned long)pkts[i].iov_base;
+            sqe->len = pkts[i].iov_len;
+            break;
+         case NIO_TYPE_TAP:
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->off = -1;
+            sqe->addr = (unsigned long)pkts[i].iov_base;
+            sqe->len = pkts[i].iov_len;
+            /* the offload information is right before the frame */
+            if (tx_nio->offload) {
+               sqe->addr = (unsigned long)nio_pkt_offload(pkts[i].iov_base);
+               sqe->len += sizeof(nio_offload_t);
+            }
+            break;
+         case NIO_TYPE_UNIX:
+         case NIO_TYPE_LINUX_RAW:
+            memset(&ring->tx_msgs[i], 0, sizeof(struct msghdr));
+            ring->tx_iov[i] = pkts[i];
+            ring->tx_msgs[i].msg_iov = &ring->tx_iov[i];
+            ring->tx_msgs[i].msg_iovlen = 1;
+            if (tx_nio->type == NIO_TYPE_UNIX) {
+               ring->tx_msgs[i].msg_name = &tx_nio->u.nio_unix.remote_sock;
+               ring->tx_msgs[i].msg_namelen = sizeof(tx_nio->u.nio_unix.remote_sock);
+            }
+            else {
+               ring->tx_msgs[i].msg_name = &ring->tx_sll;
+               ring->tx_msgs[i].msg_namelen = sizeof(ring->tx_sll);
+            }
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->addr = (unsigned long)&ring->tx_msgs[i];
+            sqe->len = 1;
+            break;
+      }
+   }
+
+   /* the kernel reads the packets until the sends complete */
+   pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+   ring->tx_pending = count;
+   while (ring->tx_pending > 0) {
+      if (nio_uring_enter(ring, ring->tx_pending) == -1) {
+         perror("nio_uring_send_batch: io_uring_enter");
+         break;
+      }
+      nio_uring_reap(ring);
+   }
+   pthread_setcancelstate(state, NULL);
+   if (ring->tx_pending > 0)
+      return (-1);
+
+   for (sent = 0; sent < count && ring->tx_res[sent] >= 0; sent++);
+   if (sent == 0) {
+      errno = -ring->tx_res[0];
+      return (-1);
+   }
+   return (sent);
+}
+
+/* Choose how the packets of the receiving NIO are received, NIO_URING_NO_RECV if they cannot be */
+static int nio_uring_rx_mode(nio_uring_t *ring, nio_t *rx_nio)
+{
+   ring->buf_offset = NIO_URING_BUFFER_DATA;
+   ring->buf_len = NIO_MAX_PKT_SIZE;
+
+   switch (rx_nio->type) {
+      case NIO_TYPE_UDP:
+         if (rx_nio->u.nio_udp.gro)
+            return (NIO_URING_NO_RECV);
+         return (NIO_URING_RECV);
+      case NIO_TYPE_UNIX:
+         return (NIO_URING_RECV);
+      case NIO_TYPE_TAP:
+         if (!read_multishot)
+            return (NIO_URING_NO_RECV);
+         if (rx_nio->offload) {
+            ring->buf_offset -= sizeof(nio_offload_t);
+            ring->buf_len += sizeof(nio_offload_t);
+         }
+         return (NIO_URING_READ);
+      case NIO_TYPE_LINUX_RAW:
+         if (rx_nio->u.nio_linux_raw.rx_ring)
+            return (NIO_URING_NO_RECV);
+#if defined(LINUX_RAW) && defined(PACKET_AUXDATA)
+         /* the auxiliary data tells if the kernel stripped a VLAN tag */
+         ring->rx_msg.msg_namelen = 0;
+         ring->rx_msg.msg_controllen = CMSG_SPACE(sizeof(struct tpacket_auxdata));
+         ring->buf_offset -= sizeof(struct io_uring_recvmsg_out) + ring->rx_msg.msg_controllen;
+         ring->buf_len = NIO_URING_BUFFER_DATA - ring->buf_offset + NIO_MAX_PKT_SIZE - VLAN_HEADER_LEN;
+         return (NIO_URING_RECVMSG);
+#else
+         return (NIO_URING_RECV);
+#endif
+   }
+   return (NIO_URING_NO_RECV);
+}
+
+/*
+ * Register the receive buffers with the kernel. They are taken from the
+ * shared pool, the packets are forwarded or delayed from them as they are.
+ */
+static int nio_uring_setup_buffers(nio_uring_t *ring)
+{
+   struct io_uring_buf_reg reg;
+   int i;
+
+   if (!(ring->pool = packet_pool_get(NIO_URING_BUFFER_DATA + NIO_MAX_PKT_SIZE)))
+      return (-1);
+   for (i = 0; i < NIO_URING_BUFFERS; i++) {
+      if (!(ring->bufs[i] = packet_buf_alloc(ring->pool)))
+         return (-1);
+   }
+
+   if (posix_memalign((void **)&ring->buf_ring, sysconf(_SC_PAGESIZE), NIO_URING_BUFFERS * sizeof(struct io_uring_buf)) != 0) {
+      ring->buf_ring = NULL;
+      return (-1);
+   }
+   memset(ring->buf_ring, 0, NIO_URING_BUFFERS * sizeof(struct io_uring_buf));
+
+   memset(&reg, 0, sizeof(reg));
+   reg.ring_addr = (unsigned long)ring->buf_ring;
+   reg.ring_entries = NIO_URING_BUFFERS;
+   reg.bgid = 0;
+   if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+      return (-1);
+
+   for (i = 0; i < NIO_URING_BUFFERS; i++)
+      nio_uring_add_buffer(ring, i);
+   nio_uring_publish_buffers(ring);
+   return (0);
+}
+
+/*
+ * Create the io_uring of a listener thread receiving on rx_nio. Packets sent
+ * by the calling thread go through it as well.
+ */
+nio_uring_t *nio_uring_create(nio_t *rx_nio)
+{
+   nio_uring_t *ring;
+
+   if (!(ring = calloc(1, sizeof(*ring)))) {
+      fprintf(stderr, "nio_uring_create: insufficient memory\n");
+      return (NULL);
+   }
+   ring->fd = -1;
+   if (nio_uring_setup(ring, NIO_URING_ENTRIES) == -1) {
+      fprintf(stderr, "nio_uring_create: unable to create the ring: %s\n", strerror(errno));
+      nio_uring_free(ring);
+      return (NULL);
+   }
+
+   ring->rx_nio = rx_nio;
+   if ((ring->rx_mode = nio_uring_rx_mode(ring, rx_nio)) != NIO_URING_NO_RECV && nio_uring_setup_buffers(ring) == -1) {
+      /* only send through the ring */
+      fprintf(stderr, "nio_uring_create: unable to set up the receive buffers: %s\n", strerror(errno));
+      ring->rx_mode = NIO_URING_NO_RECV;
+   }
+
+   thread_ring = ring;
+   return (ring);
+}
+
+/* Close a ring and give its receive buffers back */
+static void nio_uring_release(nio_uring_t *ring)
+{
+   struct io_uring_buf_reg reg;
+   int i;
+
+   /* the kernel cannot receive in the buffers once they are unregistered */
+   if (ring->buf_ring != NULL && ring->fd != -1) {
+      memset(&reg, 0, sizeof(reg));
+      sys_io_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+   }
+   nio_uring_unmap(ring);
+   for (i = 0; i < NIO_URING_BUFFERS; i++)
+      packet_buf_free(ring->bufs[i]);
+   free(ring->buf_ring);
+}
+
+void nio_uring_free(void *data)
+{
+   nio_uring_t *ring = data;
+
+   if (ring == NULL)
+      return;
+   if (thread_ring == ring)
+      thread_ring = NULL;
+   nio_uring_release(ring);
+   free(ring);
+}
+
+/*
+ * Check that a provided buffer ring can be registered and that a multishot
+ * receive takes its buffers, by receiving a datagram on a socket pair.
+ */
+static int nio_uring_probe_multishot(nio_uring_t *ring)
+{
+   struct io_uring_sqe *sqe;
+   struct io_uring_cqe *cqe;
+   int fds[2], res = -1;
+
+   if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) == -1)
+      return (-1);
+   ring->buf_offset = NIO_URING_BUFFER_DATA;
+   ring->buf_len = NIO_MAX_PKT_SIZE;
+   if (nio_uring_setup_buffers(ring) == -1 || send(fds[1], "", 1, 0) != 1 || !(sqe = nio_uring_get_sqe(ring)))
+      goto done;
+
+   sqe->opcode = IORING_OP_RECV;
+   sqe->ioprio = IORING_RECV_MULTISHOT;
+   sqe->fd = fds[0];
+   sqe->flags = IOSQE_BUFFER_SELECT;
+   sqe->buf_group = 0;
+   sqe->user_data = NIO_URING_RX;
+   if (nio_uring_enter(ring, 1) == -1 || *ring->cq_head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+      goto done;
+
+   /* kernels without multishot receives reject the request */
+   cqe = &ring->cqes[*ring->cq_head & *ring->cq_mask];
+   if (cqe->res == 1 && (cqe->flags & IORING_CQE_F_BUFFER) && (cqe->flags & IORING_CQE_F_MORE))
+      res = 0;
+
+ done:
+   close(fds[0]);
+   close(fds[1]);
+   return (res);
+}
+
+/* Check that the kernel supports what the rings need, packet I/O falls back to the NIO functions otherwise */
+int nio_uring_init(void)
+{
+   static const int required_ops[] = { IORING_OP_RECV, IORING_OP_RECVMSG, IORING_OP_SEND, IORING_OP_SENDMSG, IORING_OP_WRITE };
+   struct io_uring_probe *probe;
+   nio_uring_t ring;
+   size_t i;
+   int res = 0;
+
+   memset(&ring, 0, sizeof(ring));
+   ring.fd = -1;
+   if (nio_uring_setup(&ring, 4) == -1) {
+      fprintf(stderr, "io_uring is not available (%s), using the default packet I/O\n", strerror(errno));
+      nio_uring_unmap(&ring);
+      use_io_uring = FALSE;
+      return (-1);
+   }
+
+   if (!(probe = calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op))) ||
+       sys_io_uring_register(ring.fd, IORING_REGISTER_PROBE, probe, 256) == -1)
+      res = -1;
+   for (i = 0; res == 0 && i < sizeof(required_ops) / sizeof(required_ops[0]); i++) {
+      if (required_ops[i] > probe->last_op || !(probe->ops[required_ops[i]].flags & IO_URING_OP_SUPPORTED))
+         res = -1;
+   }
+   if (res == 0)
+      read_multishot = NIO_URING_OP_READ_MULTISHOT <= probe->last_op && (probe->ops[NIO_URING_OP_READ_MULTISHOT].flags & IO_URING_OP_SUPPORTED);
+   free(probe);
+   if (res == 0)
+      res = nio_uring_probe_multishot(&ring);
+   nio_uring_release(&ring);
+
+   if (res == -1) {
+      fprintf(stderr, "io_uring is too old for packet I/O, using the default packet I/O\n");
+      use_io_uring = FALSE;
+      return (-1);
+   }
+   printf("Using io_uring for packet I/O%s\n", read_multishot ? "" : " (TAP interfaces receive with the default packet I/O)");
+   return (0);
+}
+
+#else
+
+int nio_uring_init(void)
+{
+   fprintf(stderr, "io_uring is not supported on this system, using the default packet I/O\n");
+   use_io_uring = FALSE;
+   return (-1);
+}
+
+nio_uring_t *nio_uring_create(nio_t *rx_nio)
+{
+   return (NULL);
+}
+
+void nio_uring_free(void *data)
+{
+}
+
+int nio_uring_can_recv(nio_uring_t *ring)
+{
+   return (FALSE);
+}
+
+int nio_uring_recv_batch(nio_uring_t *ring, struct iovec *pkts, int count)
+{
+   errno = ENOSYS;
+   return (-1);
+}
+
+packet_buf_t *nio_uring_packet_buf(nio_uring_t *ring, const u_char *pkt)
+{
+   return (NULL);
+}
+
+nio_uring_t *nio_uring_thread_ring(nio_t *tx_nio)
+{
+   return (NULL);
+}
+
+int nio_uring_send_batch(nio_uring_t *ring, nio_t *tx_nio, struct iovec *pkts, int count)
+{
+   errno = ENOSYS;
+   return (-1);
+}
+
+#endif
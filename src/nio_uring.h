@@ -0,0 +1,57 @@
+/*
+ *   This file is part of ubridge, a program to bridge network interfaces
+ *   to UDP tunnels.
+ *
+ *   Copyright (C) 2026 GNS3 Technologies Inc.
+ *
+ *   ubridge is free software: you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ubridge is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NIO_URING_H_
+#define NIO_URING_H_
+
+#include <sys/uio.h>
+
+#include "nio.h"
+#include "packet_pool.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+/* multishot receives and provided buffer rings */
+#ifdef IORING_RECV_MULTISHOT
+#define HAVE_IO_URING
+#endif
+
+/* receive buffers of a ring */
+#define NIO_URING_BUFFERS       64
+#define NIO_URING_BUFFER_DATA   64     /* room before the packet for the recvmsg header or the offload information */
+
+typedef struct nio_uring nio_uring_t;
+
+extern int use_io_uring;
+
+int nio_uring_init(void);
+nio_uring_t *nio_uring_create(nio_t *rx_nio);
+void nio_uring_free(void *data);
+int nio_uring_can_recv(nio_uring_t *ring);
+int nio_uring_recv_batch(nio_uring_t *ring, struct iovec *pkts, int count);
+packet_buf_t *nio_uring_packet_buf(nio_uring_t *ring, const u_char *pkt);
+nio_uring_t *nio_uring_thread_ring(nio_t *tx_nio);
+int nio_uring_send_batch(nio_uring_t *ring, nio_t *tx_nio, struct iovec *pkts, int count);
+
+#endif /* !NIO_URING_H_ */
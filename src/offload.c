@@ -0,0 +1,331 @@
+/*
+ *   This file is part of ubridge, a program to bridge network interfaces
+ *   to UDP tunnels.
+ *
+ *   Copyright (C) 2026 GNS3 Technologies Inc.
+ *
+ *   ubridge is free software: you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ubridge is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "offload.h"
+#include "packet_ops.h"
+
+#define ETHER_TYPE_IPV4     0x0800
+#define ETHER_TYPE_IPV6     0x86dd
+#define ETHER_TYPE_VLAN     0x8100
+#define ETHER_TYPE_QINQ     0x88a8
+
+#define TCP_FLAG_FIN        0x01
+#define TCP_FLAG_PSH        0x08
+#define TCP_FLAG_CWR        0x80
+
+/* Add data to a ones' complement sum of 16-bit big-endian words */
+u_int checksum_add(const u_char *data, size_t len, u_int sum)
+{
+   sum += packet_checksum(data, len);
+
+   /* keep room for the next additions */
+   while (sum >> 16)
+      sum = (sum & 0xffff) + (sum >> 16);
+   return (sum);
+}
+
+/* Fold a ones' complement sum into an Internet checksum */
+u_short checksum_fold(u_int sum)
+{
+   while (sum >> 16)
+      sum = (sum & 0xffff) + (sum >> 16);
+   return (~sum & 0xffff);
+}
+
+static inline void put_u16(u_char *ptr, u_short val)
+{
+   ptr[0] = val >> 8;
+   ptr[1] = val & 0xff;
+}
+
+static inline u_short get_u16(const u_char *ptr)
+{
+   return ((ptr[0] << 8) | ptr[1]);
+}
+
+/*
+ * Compute the checksum a NIO left to the hardware. The checksum field
+ * already holds the pseudo-header sum, so the checksum covers the frame
+ * from csum_start to its end.
+ */
+void offload_finalize_checksum(u_char *pkt, size_t len, nio_offload_t *offload)
+{
+   size_t field = offload->csum_start + offload->csum_offset;
+   u_short csum;
+
+   if (field + 2 > len)
+      return;
+
+   csum = checksum_fold(checksum_add(pkt + offload->csum_start, len - offload->csum_start, 0));
+   /* a zero UDP checksum means no checksum */
+   if (csum == 0 && offload->csum_offset == 6)
+      csum = 0xffff;
+   put_u16(pkt + field, csum);
+   offload->flags &= ~NIO_OFFLOAD_NEEDS_CSUM;
+}
+
+/* Headers of a super-frame */
+struct gso_headers {
+   size_t l3;           /* IP header */
+   size_t l4;           /* TCP or UDP header */
+   size_t hdr_len;      /* headers copied in front of each segment */
+   int ipv4;
+   u_short ip_id;
+};
+
+/*
+ * Find the IP and transport headers behind the VLAN tags. ipv4 is 1 or 0
+ * for the IP version the GSO type implies, -1 if both are possible.
+ */
+static int gso_find_headers(u_char *pkt, size_t len, nio_offload_t *offload, int ipv4, struct gso_headers *h)
+{
+   u_short ether_type;
+
+   h->l3 = 12;
+   if (len < h->l3 + 2)
+      return (-1);
+   ether_type = get_u16(pkt + h->l3);
+   while ((ether_type == ETHER_TYPE_VLAN || ether_type == ETHER_TYPE_QINQ) && len >= h->l3 + 6) {
+      h->l3 += 4;
+      ether_type = get_u16(pkt + h->l3);
+   }
+   h->l3 += 2;
+
+   if (ether_type == ETHER_TYPE_IPV4 && ipv4 != 0) {
+      if (len < h->l3 + 20)
+         return (-1);
+      h->ipv4 = 1;
+      h->l4 = h->l3 + (pkt[h->l3] & 0x0f) * 4;
+      h->ip_id = get_u16(pkt + h->l3 + 4);
+      if (h->l4 < h->l3 + 20)
+         return (-1);
+   }
+   else if (ether_type == ETHER_TYPE_IPV6 && ipv4 != 1) {
+      if (len < h->l3 + 40)
+         return (-1);
+      h->ipv4 = 0;
+      /* csum_start skips the extension headers */
+      h->l4 = (offload->flags & NIO_OFFLOAD_NEEDS_CSUM) ? offload->csum_start : h->l3 + 40;
+      if (h->l4 < h->l3 + 40)
+         return (-1);
+   }
+   else
+      return (-1);
+   return (0);
+}
+
+/* Set the length, and for IPv4 the ID and checksum, of the IP header of a segment */
+static void gso_set_ip_header(u_char *seg, struct gso_headers *h, size_t ip_len, u_short ip_id)
+{
+   if (h->ipv4) {
+      put_u16(seg + h->l3 + 2, ip_len);
+      put_u16(seg + h->l3 + 4, ip_id);
+      put_u16(seg + h->l3 + 10, 0);
+      put_u16(seg + h->l3 + 10, checksum_fold(checksum_add(seg + h->l3, h->l4 - h->l3, 0)));
+   }
+   else
+      put_u16(seg + h->l3 + 4, ip_len - 40);
+}
+
+/* Pseudo-header sum of a segment */
+static u_int gso_pseudo_header(u_char *seg, struct gso_headers *h, u_char proto, size_t l4_len)
+{
+   u_int sum;
+
+   if (h->ipv4)
+      sum = checksum_add(seg + h->l3 + 12, 8, 0);
+   else
+      sum = checksum_add(seg + h->l3 + 8, 32, 0);
+   return (sum + proto + l4_len);
+}
+
+/* Split a TCP super-frame into segments of at most gso_size bytes of payload */
+static int gso_segment_tcp(u_char *pkt, size_t len, nio_offload_t *offload, struct gso_headers *h, size_t *offset, struct iovec *segs, int max_segs)
+{
+   size_t payload, chunk;
+   u_char *seg;
+   u_int seq;
+   int n;
+
+   if (len < h->l4 + 20)
+      return (-1);
+   h->hdr_len = h->l4 + (pkt[h->l4 + 12] >> 4) * 4;
+   if (h->hdr_len > len || len == h->hdr_len)
+      return (-1);
+   payload = len - h->hdr_len;
+   seq = (get_u16(pkt + h->l4 + 4) << 16) | get_u16(pkt + h->l4 + 6);
+
+   for (n = 0; n < max_segs && *offset < payload; n++) {
+      chunk = m_min(offload->gso_size, payload - *offset);
+      if (h->hdr_len + chunk > segs[n].iov_len)
+         return (-1);
+
+      seg = segs[n].iov_base;
+      memcpy(seg, pkt, h->hdr_len);
+      memcpy(seg + h->hdr_len, pkt + h->hdr_len + *offset, chunk);
+      segs[n].iov_len = h->hdr_len + chunk;
+      gso_set_ip_header(seg, h, h->hdr_len - h->l3 + chunk, h->ip_id + *offset / offload->gso_size);
+
+      put_u16(seg + h->l4 + 4, (seq + *offset) >> 16);
+      put_u16(seg + h->l4 + 6, (seq + *offset) & 0xffff);
+      if (*offset)
+         seg[h->l4 + 13] &= ~TCP_FLAG_CWR;
+      if (*offset + chunk < payload)
+         seg[h->l4 + 13] &= ~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+
+      put_u16(seg + h->l4 + 16, 0);
+      put_u16(seg + h->l4 + 16, checksum_fold(checksum_add(seg + h->l4, h->hdr_len - h->l4 + chunk,
+              gso_pseudo_header(seg, h, IPPROTO_TCP, h->hdr_len - h->l4 + chunk))));
+      *offset += chunk;
+   }
+   return (n);
+}
+
+/* Split a UDP super-frame (UDP_L4) into datagrams of at most gso_size bytes of payload */
+static int gso_segment_udp(u_char *pkt, size_t len, nio_offload_t *offload, struct gso_headers *h, size_t *offset, struct iovec *segs, int max_segs)
+{
+   size_t payload, chunk;
+   u_short csum;
+   u_char *seg;
+   int n;
+
+   h->hdr_len = h->l4 + 8;
+   if (len <= h->hdr_len)
+      return (-1);
+   payload = len - h->hdr_len;
+
+   for (n = 0; n < max_segs && *offset < payload; n++) {
+      chunk = m_min(offload->gso_size, payload - *offset);
+      if (h->hdr_len + chunk > segs[n].iov_len)
+         return (-1);
+
+      seg = segs[n].iov_base;
+      memcpy(seg, pkt, h->hdr_len);
+      memcpy(seg + h->hdr_len, pkt + h->hdr_len + *offset, chunk);
+      segs[n].iov_len = h->hdr_len + chunk;
+      gso_set_ip_header(seg, h, h->hdr_len - h->l3 + chunk, h->ip_id + *offset / offload->gso_size);
+
+      put_u16(seg + h->l4 + 4, 8 + chunk);
+      put_u16(seg + h->l4 + 6, 0);
+      csum = checksum_fold(checksum_add(seg + h->l4, 8 + chunk, gso_pseudo_header(seg, h, IPPROTO_UDP, 8 + chunk)));
+      /* a zero UDP checksum means no checksum */
+      put_u16(seg + h->l4 + 6, csum ? csum : 0xffff);
+      *offset += chunk;
+   }
+   return (n);
+}
+
+/*
+ * Split a UDP datagram (UFO) into IP fragments carrying at most gso_size
+ * bytes of it, rounded down to a multiple of 8. IPv6 fragments get a
+ * fragment header, the datagram must not have extension headers.
+ */
+static int gso_fragment_udp(u_char *pkt, size_t len, nio_offload_t *offload, struct gso_headers *h, size_t *offset, struct iovec *segs, int max_segs)
+{
+   static u_int ipv6_next_id;
+   static __thread u_int ipv6_id;  /* ID of the datagram being split, which can take several calls */
+   size_t payload, chunk, frag_size;
+   u_short frag_off;
+   u_char *seg;
+   int n;
+
+   frag_size = offload->gso_size & ~7;
+   if (frag_size == 0 || len <= h->l4 + 8 || (!h->ipv4 && h->l4 != h->l3 + 40))
+      return (-1);
+   payload = len - h->l4;
+
+   /* the checksum covers the whole datagram, it is computed before it is split */
+   if (*offset == 0 && (offload->flags & NIO_OFFLOAD_NEEDS_CSUM))
+      offload_finalize_checksum(pkt, len, offload);
+   h->hdr_len = h->ipv4 ? h->l4 : h->l4 + 8;
+   if (*offset == 0 && !h->ipv4)
+      ipv6_id = __atomic_add_fetch(&ipv6_next_id, 1, __ATOMIC_RELAXED);
+
+   for (n = 0; n < max_segs && *offset < payload; n++) {
+      chunk = m_min(frag_size, payload - *offset);
+      if (h->hdr_len + chunk > segs[n].iov_len)
+         return (-1);
+
+      seg = segs[n].iov_base;
+      memcpy(seg, pkt, h->l4);
+      memcpy(seg + h->hdr_len, pkt + h->l4 + *offset, chunk);
+      segs[n].iov_len = h->hdr_len + chunk;
+
+      frag_off = *offset / 8;
+      if (h->ipv4) {
+         if (*offset + chunk < payload)
+            frag_off |= 0x2000;
+         put_u16(seg + h->l3 + 6, frag_off);
+         gso_set_ip_header(seg, h, h->hdr_len - h->l3 + chunk, h->ip_id);
+      }
+      else {
+         /* fragment header: next header, reserved, offset and more fragments flag, identification */
+         seg[h->l3 + 6] = IPPROTO_FRAGMENT;
+         seg[h->l4] = IPPROTO_UDP;
+         seg[h->l4 + 1] = 0;
+         put_u16(seg + h->l4 + 2, (frag_off << 3) | (*offset + chunk < payload));
+         put_u16(seg + h->l4 + 4, ipv6_id >> 16);
+         put_u16(seg + h->l4 + 6, ipv6_id & 0xffff);
+         gso_set_ip_header(seg, h, h->hdr_len - h->l3 + chunk, 0);
+      }
+      *offset += chunk;
+   }
+   return (n);
+}
+
+/*
+ * Split a super-frame: TCP segments, UDP datagrams (UDP_L4) or IP
+ * fragments of a UDP datagram (UDP). The segments are built in the
+ * buffers given by segs, starting at the payload offset *offset which is
+ * updated. Returns the number of segments, 0 once the whole payload has
+ * been consumed, or -1 if the frame cannot be segmented.
+ */
+int offload_segment(u_char *pkt, size_t len, nio_offload_t *offload, size_t *offset, struct iovec *segs, int max_segs)
+{
+   struct gso_headers h;
+
+   if (offload->gso_size == 0)
+      return (-1);
+
+   switch (offload->gso_type & ~NIO_GSO_ECN) {
+      case NIO_GSO_TCPV4:
+         if (gso_find_headers(pkt, len, offload, 1, &h) == -1)
+            return (-1);
+         return (gso_segment_tcp(pkt, len, offload, &h, offset, segs, max_segs));
+      case NIO_GSO_TCPV6:
+         if (gso_find_headers(pkt, len, offload, 0, &h) == -1)
+            return (-1);
+         return (gso_segment_tcp(pkt, len, offload, &h, offset, segs, max_segs));
+      case NIO_GSO_UDP_L4:
+         if (gso_find_headers(pkt, len, offload, -1, &h) == -1)
+            return (-1);
+         return (gso_segment_udp(pkt, len, offload, &h, offset, segs, max_segs));
+      case NIO_GSO_UDP:
+         if (gso_find_headers(pkt, len, offload, -1, &h) == -1)
+            return (-1);
+         return (gso_fragment_udp(pkt, len, offload, &h, offset, segs, max_segs));
+   }
+   return (-1);
+}
@@ -0,0 +1,34 @@
+/*
+ *   This file is part of ubridge, a program to bridge network interfaces
+ *   to UDP tunnels.
+ *
+ *   Copyright (C) 2026 GNS3 Technologies Inc.
+ *
+ *   ubridge is free software: you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ubridge is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OFFLOAD_H_
+#define OFFLOAD_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "nio.h"
+
+u_int checksum_add(const u_char *data, size_t len, u_int sum);
+u_short checksum_fold(u_int sum);
+void offload_finalize_checksum(u_char *pkt, size_t len, nio_offload_t *offload);
+int offload_segment(u_char *pkt, size_t len, nio_offload_t *offload, size_t *offset, struct iovec *segs, int max_segs);
+
+#endif /* !OFFLOAD_H_ */
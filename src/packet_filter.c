@@ -19,10 +19,13 @@
  */
 
 #include <string.h>
-#include <time.h>
 #include <pcap.h>
 #include "packet_filter.h"
 #include "pcap_filter.h"
+#include "delay_queue.h"
+#include "prng.h"
+#include "packet_ops.h"
+#include "epoch.h"
 #include "ubridge.h"
 
 
@@ -77,6 +80,22 @@ static int frequency_drop_handler(void *pkt, size_t len, void *opt)
    return (FILTER_ACTION_PASS);
 }
 
+/* Program of the packets dropped, as long as it doesn't depend on their count */
+static struct bpf_program *frequency_drop_program(void *opt)
+{
+   static struct bpf_insn drop_all[] = { BPF_STMT(BPF_RET|BPF_K, 1) };
+   static struct bpf_insn drop_none[] = { BPF_STMT(BPF_RET|BPF_K, 0) };
+   static struct bpf_program drop_all_program = { 1, drop_all };
+   static struct bpf_program drop_none_program = { 1, drop_none };
+   struct frequency_drop_data *data = opt;
+
+   if (data == NULL || data->frequency == 0)
+      return (&drop_none_program);
+   if (data->frequency == -1)
+      return (&drop_all_program);
+   return (NULL);
+}
+
 /* Free resources used by filter */
 static void frequency_drop_free(void **opt)
 {
@@ -90,6 +109,7 @@ static void create_frequency_drop_filter(packet_filter_t *filter)
     filter->type = FILTER_TYPE_FREQUENCY_DROP;
     filter->setup = (void *)frequency_drop_setup;
     filter->handler = (void *)frequency_drop_handler;
+    filter->drop_program = (void *)frequency_drop_program;
     filter->free = (void *)frequency_drop_free;
 }
 
@@ -99,6 +119,7 @@ static void create_frequency_drop_filter(packet_filter_t *filter)
 
 struct packet_loss_data {
    int percentage;
+   prng_t prng;
 };
 
 /* Setup filter */
@@ -106,7 +127,7 @@ static int packet_loss_setup(void **opt, int argc, char *argv[])
 {
    struct packet_loss_data *data = *opt;
 
-   if (argc != 1)
+   if (argc != 1 && argc != 2)
       return (-1);
 
    if (!data) {
@@ -120,7 +141,7 @@ static int packet_loss_setup(void **opt, int argc, char *argv[])
    if (data->percentage < 0 || data->percentage > 100)
       return (-1);
 
-   return (0);
+   return (prng_init(&data->prng, argc == 2 ? argv[1] : NULL));
 }
 
 /* Packet handler: randomly drop packet */
@@ -129,7 +150,7 @@ static int packet_loss_handler(void *pkt, size_t len, void *opt)
    struct packet_loss_data *data = opt;
 
    if (data != NULL) {
-      if (random() % 100 <= data->percentage)
+      if (prng_below(&data->prng, 100) < data->percentage)
          return (FILTER_ACTION_DROP);
    }
    return (FILTER_ACTION_PASS);
@@ -158,6 +179,7 @@ static void create_packet_loss_filter(packet_filter_t *filter)
 struct delay_data {
    int latency;
    int jitter;
+   prng_t prng;
 };
 
 /* Setup filter */
@@ -165,7 +187,7 @@ static int delay_setup(void **opt, int argc, char *argv[])
 {
    struct delay_data *data = *opt;
 
-   if (argc != 1 && argc != 2)
+   if (argc < 1 || argc > 3)
       return (-1);
 
    if (!data) {
@@ -177,29 +199,32 @@ static int delay_setup(void **opt, int argc, char *argv[])
 
    data->latency = atoi(argv[0]);
    data->jitter = 0;
-   if (argc == 2)
+   if (argc >= 2)
       data->jitter = atoi(argv[1]);
-   if (data->latency <= 0 || data->jitter < 0)
+   if (data->latency <= 0 || data->jitter < 0 || data->latency + data->jitter > DELAY_QUEUE_MAX_DELAY)
       return (-1);
-   return (0);
+   return (prng_init(&data->prng, argc == 3 ? argv[2] : NULL));
 }
 
-/* Packet handler: add delay (latency and optionally jitter) */
+/* Packet handler: nothing to do, the packet is held by the delay queue of the bridge */
 static int delay_handler(void *pkt, size_t len, void *opt)
+{
+   return (FILTER_ACTION_PASS);
+}
+
+/* Packet scheduler: add delay (latency and optionally jitter) */
+static int delay_schedule(void *pkt, size_t len, int direction, u_int64_t *departure, void *opt)
 {
    struct delay_data *data = opt;
-   struct timespec ts;
    int delay;
 
    if (data != NULL) {
       delay = data->latency;
       if (data->jitter)
-         delay = (delay - data->jitter) + random() % ((delay + data->jitter + 1) - (delay - data->jitter));
+         delay = (delay - data->jitter) + prng_below(&data->prng, 2 * data->jitter + 1);
       if (delay < 0)
           delay = 0;
-      ts.tv_sec = delay / 1000;
-      ts.tv_nsec = (delay % 1000) * 1000000;
-      nanosleep(&ts, NULL);
+      *departure += delay * DELAY_QUEUE_TICK;
    }
    return (FILTER_ACTION_PASS);
 }
@@ -217,6 +242,7 @@ static void create_delay_filter(packet_filter_t *filter)
     filter->type = FILTER_TYPE_DELAY;
     filter->setup = (void *)delay_setup;
     filter->handler = (void *)delay_handler;
+    filter->schedule = (void *)delay_schedule;
     filter->free = (void *)delay_free;
 }
 
@@ -227,9 +253,10 @@ static void create_delay_filter(packet_filter_t *filter)
 struct corrupt_data {
    int percentage;
    int index;
+   prng_t prng;
 };
 
-static char patterns[] = {
+static u_char patterns[] = {
    0x64,
    0x13,
    0x88,
@@ -245,7 +272,7 @@ static int corrupt_setup(void **opt, int argc, char *argv[])
 {
    struct corrupt_data *data = *opt;
 
-   if (argc != 1)
+   if (argc != 1 && argc != 2)
       return (-1);
 
    if (!data) {
@@ -259,17 +286,14 @@ static int corrupt_setup(void **opt, int argc, char *argv[])
    data->index = 0;
    if (data->percentage < 0 || data->percentage > 100)
       return (-1);
-   return (0);
+   return (prng_init(&data->prng, argc == 2 ? argv[1] : NULL));
 }
 
-static void corrupt_packet(char *pkt, size_t len, void *opt)
+static void corrupt_packet(u_char *pkt, size_t len, void *opt)
 {
    struct corrupt_data *data = opt;
-   int i;
 
-   for (i = 0; i < len; ++i) {
-       pkt[i] ^= patterns[data->index++ & 0x7];
-   }
+   packet_xor_pattern(pkt, len, patterns, __atomic_fetch_add(&data->index, len, __ATOMIC_RELAXED));
 }
 
 /* Packet handler: randomly corrupt packets */
@@ -278,7 +302,7 @@ static int corrupt_handler(void *pkt, size_t len, void *opt)
    struct corrupt_data *data = opt;
    int length;
 
-   if (data != NULL && random() % 100 <= data->percentage) {
+   if (data != NULL && prng_below(&data->prng, 100) < data->percentage) {
       length = len / 4;
       corrupt_packet(pkt + len / 2 - length / 2 + 1, length, opt);
    }
@@ -305,17 +329,11 @@ static void create_corrupt_filter(packet_filter_t *filter)
 /* BPF                                                                      */
 /* ======================================================================== */
 
-struct bpf_data {
-   struct bpf_program fp;
-};
-
 /* Setup filter */
 static int bpf_setup(void **opt, int argc, char *argv[])
 {
-   struct bpf_data *data = *opt;
+   pcap_filter_t *data = *opt;
    int link_type;
-   pcap_t *pcap_dev;
-   char *filter;
 
    if (argc != 1 && argc != 2)
       return (-1);
@@ -327,43 +345,42 @@ static int bpf_setup(void **opt, int argc, char *argv[])
       *opt = data;
    }
 
-   filter = argv[0];
    link_type = DLT_EN10MB;
    if (argc == 2)
       if ((link_type = pcap_datalink_name_to_val(argv[1])) == -1) {
          fprintf(stderr,"Unknown link type %s\n", argv[1]);
          return (-1);
       }
-   pcap_dev = pcap_open_dead(link_type, 65535);
-   if (pcap_compile(pcap_dev, &data->fp, filter, 1, PCAP_NETMASK_UNKNOWN) < 0) {
-       fprintf(stderr, "Cannot compile filter '%s': %s\n", filter, pcap_geterr(pcap_dev));
-       return (-1);
-   }
-   pcap_close(pcap_dev);
-   return (0);
+   return (pcap_filter_compile(data, argv[0], link_type));
 }
 
 /* Packet handler: apply BPF filter */
 static int bpf_handler(void *pkt, size_t len, void *opt)
 {
-   struct bpf_data *data = opt;
-   struct pcap_pkthdr pkthdr;
+   pcap_filter_t *data = opt;
 
-   memset(&pkthdr, 0, sizeof(pkthdr));
-   pkthdr.caplen = len;
-   pkthdr.len = len;
-   if (data != NULL) {
-       if (pcap_offline_filter(&data->fp, &pkthdr, pkt))
-         return (FILTER_ACTION_DROP);
-   }
-   return (FILTER_ACTION_PASS);
+   if (data == NULL)
+      return (FILTER_ACTION_PASS);
+
+   return (pcap_filter_match(data, pkt, len) ? FILTER_ACTION_DROP : FILTER_ACTION_PASS);
+}
+
+static struct bpf_program *bpf_drop_program(void *opt)
+{
+   pcap_filter_t *data = opt;
+
+   return (data != NULL ? &data->fp : NULL);
 }
 
 /* Free resources used by filter */
 static void bpf_free(void **opt)
 {
-   if (*opt)
-      free(*opt);
+   pcap_filter_t *data = *opt;
+
+   if (data) {
+      pcap_filter_free(data);
+      free(data);
+   }
    *opt = NULL;
 }
 
@@ -372,9 +389,175 @@ static void create_bpf_filter(packet_filter_t *filter)
     filter->type = FILTER_TYPE_BPF;
     filter->setup = (void *)bpf_setup;
     filter->handler = (void *)bpf_handler;
+    filter->drop_program = (void *)bpf_drop_program;
     filter->free = (void *)bpf_free;
 }
 
+/* ======================================================================== */
+/* Rate                                                                     */
+/* ======================================================================== */
+
+/* Token bucket of one direction, as a theoretical arrival time (GCRA) */
+struct rate_bucket {
+   pthread_mutex_t lock;
+   u_int64_t tat;        /* time the bucket is full again */
+   u_int64_t last;       /* tick the last held packet leaves at */
+};
+
+struct rate_data {
+   double ns_per_byte;
+   int shape;
+   u_int64_t burst;      /* bucket depth in ns */
+   u_int64_t backlog;    /* longest time a packet is held in ns */
+   struct rate_bucket buckets[2];
+};
+
+/* Parse a positive number with an optional k, m or g multiplier */
+static int rate_parse(const char *str, double *value)
+{
+   char *end;
+   double v;
+
+   v = strtod(str, &end);
+   if (end == str || v <= 0)
+      return (-1);
+   switch (*end) {
+      case 'k': case 'K':
+         v *= 1e3;
+         end++;
+         break;
+      case 'm': case 'M':
+         v *= 1e6;
+         end++;
+         break;
+      case 'g': case 'G':
+         v *= 1e9;
+         end++;
+         break;
+   }
+   if (*end != '\0')
+      return (-1);
+   *value = v;
+   return (0);
+}
+
+/* Setup filter */
+static int rate_setup(void **opt, int argc, char *argv[])
+{
+   struct rate_data *data = *opt;
+   double rate, burst, backlog;
+   int i;
+
+   if (argc < 1 || argc > 4)
+      return (-1);
+
+   if (!data) {
+      if (!(data = malloc(sizeof(*data))))
+         return (-1);
+      memset(data, 0, sizeof(*data));
+      for (i = 0; i < 2; i++)
+         pthread_mutex_init(&data->buckets[i].lock, NULL);
+      *opt = data;
+   }
+
+   /* rate in bits per second */
+   if (rate_parse(argv[0], &rate) == -1)
+      return (-1);
+   data->ns_per_byte = 8e9 / rate;
+
+   data->shape = TRUE;
+   if (argc > 1) {
+      if (!strcmp(argv[1], "police"))
+         data->shape = FALSE;
+      else if (strcmp(argv[1], "shape"))
+         return (-1);
+   }
+
+   /* burst in bytes, 10 ms of traffic and at least 2 full frames by default */
+   burst = m_max(rate / 800, 2 * 1514);
+   if (argc > 2 && rate_parse(argv[2], &burst) == -1)
+      return (-1);
+   data->burst = burst * data->ns_per_byte;
+
+   /* backlog of the shaper in bytes, 100 ms of traffic by default */
+   backlog = rate / 80;
+   if (argc > 3 && rate_parse(argv[3], &backlog) == -1)
+      return (-1);
+   data->backlog = backlog * data->ns_per_byte;
+   if (data->backlog / DELAY_QUEUE_TICK > DELAY_QUEUE_MAX_DELAY)
+      return (-1);
+   return (0);
+}
+
+/* Packet handler: nothing to do, the packet is policed or held by the scheduler */
+static int rate_handler(void *pkt, size_t len, void *opt)
+{
+   return (FILTER_ACTION_PASS);
+}
+
+/* Packet scheduler: police or shape the packets to the rate */
+static int rate_schedule(void *pkt, size_t len, int direction, u_int64_t *departure, void *opt)
+{
+   struct rate_data *data = opt;
+   struct rate_bucket *bucket;
+   u_int64_t arrival, start, tat;
+   int action = FILTER_ACTION_PASS;
+
+   if (data == NULL)
+      return (FILTER_ACTION_PASS);
+
+   bucket = &data->buckets[direction == FILTER_DIRECTION_REVERSE];
+   arrival = *departure;
+
+   pthread_mutex_lock(&bucket->lock);
+   tat = m_max(bucket->tat, arrival);
+   if (!data->shape) {
+      /* drop the packets arriving while the bucket is empty */
+      if (tat > arrival + data->burst)
+         action = FILTER_ACTION_DROP;
+      else
+         bucket->tat = tat + len * data->ns_per_byte;
+   }
+   else {
+      /* hold the packets until the bucket has room, never ahead of the packets already held */
+      start = tat > data->burst ? tat - data->burst : 0;
+      start = m_max(m_max(start, arrival), bucket->last);
+      if (start - arrival > data->backlog)
+         action = FILTER_ACTION_DROP;
+      else {
+         bucket->tat = tat + len * data->ns_per_byte;
+         if (start > arrival)
+            bucket->last = (start + DELAY_QUEUE_TICK - 1) / DELAY_QUEUE_TICK * DELAY_QUEUE_TICK;
+         *departure = start;
+      }
+   }
+   pthread_mutex_unlock(&bucket->lock);
+   return (action);
+}
+
+/* Free resources used by filter */
+static void rate_free(void **opt)
+{
+   struct rate_data *data = *opt;
+   int i;
+
+   if (data) {
+      for (i = 0; i < 2; i++)
+         pthread_mutex_destroy(&data->buckets[i].lock);
+      free(data);
+   }
+   *opt = NULL;
+}
+
+static void create_rate_filter(packet_filter_t *filter)
+{
+    filter->type = FILTER_TYPE_RATE;
+    filter->setup = (void *)rate_setup;
+    filter->handler = (void *)rate_handler;
+    filter->schedule = (void *)rate_schedule;
+    filter->free = (void *)rate_free;
+}
+
 /* ======================================================================== */
 /* Generic functions for filter management                                  */
 /* ======================================================================== */
@@ -391,6 +574,7 @@ static filter_table_t lookup_table[] = {
     { "delay", create_delay_filter },
     { "corrupt", create_corrupt_filter },
     { "bpf", create_bpf_filter},
+    { "rate", create_rate_filter },
 };
 
 static int create_filter(packet_filter_t *filter, char *filter_type)
@@ -421,10 +605,96 @@ packet_filter_t *find_packet_filter(packet_filter_t *packet_filters, char *filte
    return (NULL);
 }
 
-int add_packet_filter(packet_filter_t **packet_filters, char *filter_name, char *filter_type, int argc, char *argv[])
+/* ======================================================================== */
+/* Filter chain snapshots                                                   */
+/* ======================================================================== */
+
+/*
+ * The data plane reads an array compiled from the filter list, published
+ * with an atomic pointer exchange. An old array and the filters removed
+ * with it are freed once no thread is in a read section started before.
+ */
+
+/*
+ * Enter a read section and return the published filter chain, NULL if there
+ * is none. The chain stays valid until packet_filter_chain_exit() which must
+ * only be called when a chain was returned.
+ */
+packet_filter_chain_t *packet_filter_chain_enter(packet_filter_chain_t **chain)
+{
+   packet_filter_chain_t *snapshot;
+
+   if (__atomic_load_n(chain, __ATOMIC_RELAXED) == NULL || epoch_enter() == -1)
+      return (NULL);
+
+   if ((snapshot = __atomic_load_n(chain, __ATOMIC_SEQ_CST)) == NULL)
+      epoch_exit();
+   return (snapshot);
+}
+
+void packet_filter_chain_exit(void)
+{
+   epoch_exit();
+}
+
+/* Compile the filter list, leaving out a filter about to be removed */
+static int compile_packet_filters(packet_filter_t *packet_filters, packet_filter_t *skip, packet_filter_chain_t **chain)
+{
+   packet_filter_chain_t *new_chain;
+   packet_filter_t *filter;
+   int count = 0;
+
+   for (filter = packet_filters; filter != NULL; filter = filter->next) {
+      if (filter != skip)
+         count++;
+   }
+
+   *chain = NULL;
+   if (count == 0)
+      return (0);
+
+   if ((new_chain = malloc(sizeof(*new_chain) + count * sizeof(packet_filter_entry_t))) == NULL)
+      return (-1);
+   new_chain->count = 0;
+   for (filter = packet_filters; filter != NULL; filter = filter->next) {
+      if (filter == skip)
+         continue;
+      new_chain->entries[new_chain->count].handler = filter->handler;
+      new_chain->entries[new_chain->count].schedule = filter->schedule;
+      new_chain->entries[new_chain->count].data = filter->data;
+      new_chain->entries[new_chain->count].name = filter->name;
+      new_chain->count++;
+   }
+   *chain = new_chain;
+   return (0);
+}
+
+/* Publish a new chain, the old one is freed when no thread reads it anymore */
+static void replace_packet_filter_chain(packet_filter_chain_t **chain, packet_filter_chain_t *new_chain)
+{
+   packet_filter_chain_t *old_chain;
+
+   old_chain = __atomic_exchange_n(chain, new_chain, __ATOMIC_SEQ_CST);
+   if (old_chain != NULL) {
+      epoch_synchronize();
+      free(old_chain);
+   }
+}
+
+static void free_packet_filter(packet_filter_t *filter)
+{
+   if (filter->name)
+      free(filter->name);
+   if (filter->free)
+      filter->free(&filter->data);
+   free(filter);
+}
+
+int add_packet_filter(packet_filter_t **packet_filters, packet_filter_chain_t **chain, char *filter_name, char *filter_type, int argc, char *argv[])
 {
+   packet_filter_chain_t *new_chain;
    packet_filter_t *new_filter;
-   void **opt;
+   packet_filter_t **last;
 
    if (find_packet_filter(*packet_filters, filter_name) != NULL)
       return (-1);
@@ -432,63 +702,62 @@ int add_packet_filter(packet_filter_t **packet_filters, char *filter_name, char
    if ((new_filter = malloc(sizeof(*new_filter))) == NULL)
       return (-1);
    memset(new_filter, 0, sizeof(*new_filter));
-   new_filter->name = strdup(filter_name);
-   if ((new_filter->name = strdup(filter_name)) == NULL)
+   if ((new_filter->name = strdup(filter_name)) == NULL) {
+      free(new_filter);
       return (-1);
-   opt = &new_filter->data;
+   }
    new_filter->next = NULL;
 
    if ((create_filter(new_filter, filter_type)) == FALSE) {
       fprintf(stderr,"Filter type '%s' doesn't exist\n", filter_type);
-      if (new_filter->name)
-         free(new_filter->name);
-      free(new_filter);
+      free_packet_filter(new_filter);
       return (-1);
    }
 
-   if (*packet_filters == NULL) {
-      *packet_filters = new_filter;
-   }
-   else {
-      packet_filter_t *current = *packet_filters;
-      while (current->next != NULL)
-            current = current->next;
-      current->next = new_filter;
+   /* the filter is only published once set up */
+   if (new_filter->setup(&new_filter->data, argc, argv) == -1) {
+      free_packet_filter(new_filter);
+      return (-1);
    }
 
-   return (new_filter->setup(opt, argc, argv));
+   for (last = packet_filters; *last != NULL; last = &(*last)->next);
+   *last = new_filter;
+   if (compile_packet_filters(*packet_filters, NULL, &new_chain) == -1) {
+      *last = NULL;
+      free_packet_filter(new_filter);
+      return (-1);
+   }
+   replace_packet_filter_chain(chain, new_chain);
+   return (0);
 }
 
-void free_packet_filters(packet_filter_t *filter)
+/* Unpublish and free all the filters */
+void reset_packet_filters(packet_filter_t **packet_filters, packet_filter_chain_t **chain)
 {
-  packet_filter_t *next;
+  packet_filter_t *filter, *next;
 
-  while (filter != NULL) {
-    if (filter->name)
-       free(filter->name);
+  replace_packet_filter_chain(chain, NULL);
+  for (filter = *packet_filters; filter != NULL; filter = next) {
     next = filter->next;
-    free(filter);
-    filter = next;
+    free_packet_filter(filter);
   }
+  *packet_filters = NULL;
 }
 
-int delete_packet_filter(packet_filter_t **packet_filters, char *filter_name)
+int delete_packet_filter(packet_filter_t **packet_filters, packet_filter_chain_t **chain, char *filter_name)
 {
-   packet_filter_t **head;
+   packet_filter_chain_t *new_chain;
+   packet_filter_t **prev;
    packet_filter_t *filter;
-   packet_filter_t *prev = NULL;
 
-   head = packet_filters;
-   for (filter = *head; filter != NULL; prev = filter, filter = filter->next) {
+   for (prev = packet_filters; (filter = *prev) != NULL; prev = &filter->next) {
       if (!strcmp(filter->name, filter_name)) {
-         if (prev == NULL)
-            *head = filter->next;
-         else
-            prev->next = filter->next;
-         if (filter->name)
-            free(filter->name);
-         filter->free(&filter->data);
-         free(filter);
+         if (compile_packet_filters(*packet_filters, filter, &new_chain) == -1)
+            return (-1);
+         *prev = filter->next;
+         /* readers may still use the filter until the new chain is published */
+         replace_packet_filter_chain(chain, new_chain);
+         free_packet_filter(filter);
          return (0);
       }
    }
@@ -24,12 +24,15 @@
 #include <sys/types.h>
 #include <stdlib.h>
 
+struct bpf_program;
+
 enum {
     FILTER_TYPE_FREQUENCY_DROP = 1,
     FILTER_TYPE_PACKET_LOSS,
     FILTER_TYPE_DELAY,
     FILTER_TYPE_CORRUPT,
     FILTER_TYPE_BPF,
+    FILTER_TYPE_RATE,
 };
 
 enum {
@@ -39,19 +42,45 @@ enum {
    FILTER_ACTION_DUPLICATE,
 };
 
+/* Direction of the packets a filter sees */
+enum {
+   FILTER_DIRECTION_FORWARD = 0,    /* from the source NIO, or to the IOL instance on IOL bridges */
+   FILTER_DIRECTION_REVERSE,
+};
+
 typedef struct packet_filter {
    u_int type;
    char *name;
    void *data;
    int (*setup)(void **opt, int argc, char *argv[]);
    int (*handler)(void *pkt, size_t len, void *opt);
+   /* hold a passing packet by pushing back its *departure (monotonic time in ns), NULL if never */
+   int (*schedule)(void *pkt, size_t len, int direction, u_int64_t *departure, void *opt);
+   /* pcap program returning nonzero for the packets dropped, NULL if the verdict doesn't only depend on the packet */
+   struct bpf_program *(*drop_program)(void *opt);
    void (*free)(void **opt);
    struct packet_filter *next;
 } packet_filter_t;
 
-int add_packet_filter(packet_filter_t **packet_filters, char *filter_name, char *filter_type, int argc, char *argv[]);
+/* Filter of a compiled chain */
+typedef struct packet_filter_entry {
+   int (*handler)(void *pkt, size_t len, void *opt);
+   int (*schedule)(void *pkt, size_t len, int direction, u_int64_t *departure, void *opt);
+   void *data;
+   char *name;
+} packet_filter_entry_t;
+
+/* Immutable array compiled from a filter list, read by the data plane without locking */
+typedef struct packet_filter_chain {
+   int count;
+   packet_filter_entry_t entries[];
+} packet_filter_chain_t;
+
+int add_packet_filter(packet_filter_t **packet_filters, packet_filter_chain_t **chain, char *filter_name, char *filter_type, int argc, char *argv[]);
 packet_filter_t *find_packet_filter(packet_filter_t *packet_filters, char *filter_name);
-int delete_packet_filter(packet_filter_t **packet_filters, char *filter_name);
-void free_packet_filters(packet_filter_t *filter);
+int delete_packet_filter(packet_filter_t **packet_filters, packet_filter_chain_t **chain, char *filter_name);
+void reset_packet_filters(packet_filter_t **packet_filters, packet_filter_chain_t **chain);
+packet_filter_chain_t *packet_filter_chain_enter(packet_filter_chain_t **chain);
+void packet_filter_chain_exit(void);
 
 #endif /* !FILTER_H_ */
@@ -0,0 +1,398 @@
+/*
+ *   This file is part of ubridge, a program to bridge network interfaces
+ *   to UDP tunnels.
+ *
+ *   Copyright (C) 2026 GNS3 Technologies Inc.
+ *
+ *   ubridge is free software: you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ubridge is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "packet_ops.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define PACKET_OPS_SSE2
+#if defined(__GNUC__)
+#define PACKET_OPS_AVX2
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PACKET_OPS_NEON
+#endif
+
+/*
+ * Vector versions of the byte loops run on every packet by the corrupt
+ * filter, the software checksums and the debug dumps. SSE2 and NEON are
+ * always there on x86-64 and aarch64, AVX2 is used when the CPU has it.
+ * Each operation goes through a pointer set on its first call.
+ */
+
+/* ======================================================================== */
+/* Pattern XOR                                                              */
+/* ======================================================================== */
+
+/* The 32 bytes of the pattern are already lined up with the start of the data */
+static void xor_generic(u_char *data, size_t len, const u_char *pattern)
+{
+   size_t i;
+
+   for (i = 0; i < len; i++)
+      data[i] ^= pattern[i & 31];
+}
+
+#ifdef PACKET_OPS_SSE2
+static void xor_sse2(u_char *data, size_t len, const u_char *pattern)
+{
+   __m128i pat = _mm_loadu_si128((const __m128i *)pattern);
+   size_t i;
+
+   for (i = 0; i + 16 <= len; i += 16)
+      _mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(_mm_loadu_si128((__m128i *)(data + i)), pat));
+   xor_generic(data + i, len - i, pattern);
+}
+#endif
+
+#ifdef PACKET_OPS_AVX2
+__attribute__((target("avx2")))
+static void xor_avx2(u_char *data, size_t len, const u_char *pattern)
+{
+   __m256i pat = _mm256_loadu_si256((const __m256i *)pattern);
+   size_t i;
+
+   for (i = 0; i + 32 <= len; i += 32)
+      _mm256_storeu_si256((__m256i *)(data + i), _mm256_xor_si256(_mm256_loadu_si256((__m256i *)(data + i)), pat));
+   xor_sse2(data + i, len - i, pattern);
+}
+#endif
+
+#ifdef PACKET_OPS_NEON
+static void xor_neon(u_char *data, size_t len, const u_char *pattern)
+{
+   uint8x16_t pat = vld1q_u8(pattern);
+   size_t i;
+
+   for (i = 0; i + 16 <= len; i += 16)
+      vst1q_u8(data + i, veorq_u8(vld1q_u8(data + i), pat));
+   xor_generic(data + i, len - i, pattern);
+}
+#endif
+
+/* ======================================================================== */
+/* Checksum                                                                 */
+/* ======================================================================== */
+
+/* Ones' complement sum of the 16-bit big-endian words of the data, folded to 16 bits */
+static u_short checksum_generic(const u_char *data, size_t len)
+{
+   u_int64_t sum = 0;
+   size_t i;
+
+   for (i = 0; i + 1 < len; i += 2)
+      sum += (data[i] << 8) | data[i + 1];
+   if (len & 1)
+      sum += data[len - 1] << 8;
+   while (sum >> 16)
+      sum = (sum & 0xffff) + (sum >> 16);
+   return (sum);
+}
+
+#if defined(PACKET_OPS_SSE2) || defined(PACKET_OPS_NEON)
+/*
+ * The vector versions add little-endian words: a ones' complement sum
+ * doesn't depend on the byte order, the folded sum only has its bytes
+ * swapped.
+ */
+static u_short checksum_finish_le(u_int64_t sum, const u_char *data, size_t len)
+{
+   size_t i;
+
+   for (i = 0; i + 1 < len; i += 2)
+      sum += data[i] | (data[i + 1] << 8);
+   if (len & 1)
+      sum += data[len - 1];
+   while (sum >> 16)
+      sum = (sum & 0xffff) + (sum >> 16);
+   return (((sum >> 8) | (sum << 8)) & 0xffff);
+}
+
+/* 32-bit lanes get at most two words per block, they are emptied before overflowing */
+#define CHECKSUM_MAX_BLOCKS    16384
+#endif
+
+#ifdef PACKET_OPS_SSE2
+static u_short checksum_sse2(const u_char *data, size_t len)
+{
+   __m128i zero = _mm_setzero_si128(), acc, v;
+   u_int32_t lanes[4];
+   u_int64_t sum = 0;
+   size_t i = 0;
+   int blocks;
+
+   while (i + 16 <= len) {
+      acc = zero;
+      for (blocks = 0; blocks < CHECKSUM_MAX_BLOCKS && i + 16 <= len; blocks++, i += 16) {
+         v = _mm_loadu_si128((const __m128i *)(data + i));
+         acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+         acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+      }
+      _mm_storeu_si128((__m128i *)lanes, acc);
+      sum += (u_int64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+   }
+   return (checksum_finish_le(sum, data + i, len - i));
+}
+#endif
+
+#ifdef PACKET_OPS_AVX2
+__attribute__((target("avx2")))
+static u_short checksum_avx2(const u_char *data, size_t len)
+{
+   __m256i zero = _mm256_setzero_si256(), acc, v;
+   u_int32_t lanes[8];
+   u_int64_t sum = 0;
+   size_t i = 0;
+   int blocks, j;
+
+   while (i + 32 <= len) {
+      acc = zero;
+      for (blocks = 0; blocks < CHECKSUM_MAX_BLOCKS && i + 32 <= len; blocks++, i += 32) {
+         v = _mm256_loadu_si256((const __m256i *)(data + i));
+         acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+         acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+      }
+      _mm256_storeu_si256((__m256i *)lanes, acc);
+      for (j = 0; j < 8; j++)
+         sum += lanes[j];
+   }
+   return (checksum_finish_le(sum, data + i, len - i));
+}
+#endif
+
+#ifdef PACKET_OPS_NEON
+static u_short checksum_neon(const u_char *data, size_t len)
+{
+   uint32x4_t acc;
+   u_int64_t sum = 0;
+   size_t i = 0;
+   int blocks;
+
+   while (i + 16 <= len) {
+      acc = vdupq_n_u32(0);
+      for (blocks = 0; blocks < CHECKSUM_MAX_BLOCKS && i + 16 <= len; blocks++, i += 16)
+         acc = vpadalq_u16(acc, vreinterpretq_u16_u8(vld1q_u8(data + i)));
+      sum += vaddlvq_u32(acc);
+   }
+   return (checksum_finish_le(sum, data + i, len - i));
+}
+#endif
+
+/* ======================================================================== */
+/* Hex dump                                                                 */
+/* ======================================================================== */
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static inline int is_dump_char(u_char c)
+{
+   return ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9'));
+}
+
+/* Hex digits and printable characters of a full 16-byte line */
+static void hex16_generic(const u_char *in, char *hex, char *text)
+{
+   int i;
+
+   for (i = 0; i < 16; i++) {
+      hex[i * 2] = hex_digits[in[i] >> 4];
+      hex[i * 2 + 1] = hex_digits[in[i] & 0x0f];
+      text[i] = is_dump_char(in[i]) ? in[i] : '.';
+   }
+}
+
+#ifdef PACKET_OPS_SSE2
+static inline __m128i hex_digits_sse2(__m128i nibbles)
+{
+   /* '0' + n, and 39 more to reach 'a' from 10 on */
+   return (_mm_add_epi8(_mm_add_epi8(nibbles, _mm_set1_epi8('0')),
+                        _mm_and_si128(_mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9)), _mm_set1_epi8(39))));
+}
+
+/* signed compares, bytes from 0x80 on are below every bound */
+static inline __m128i in_range_sse2(__m128i v, char low, char high)
+{
+   return (_mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(low - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8(high + 1))));
+}
+
+static void hex16_sse2(const u_char *in, char *hex, char *text)
+{
+   __m128i v = _mm_loadu_si128((const __m128i *)in);
+   __m128i mask = _mm_set1_epi8(0x0f), high, low, printable;
+
+   high = hex_digits_sse2(_mm_and_si128(_mm_srli_epi16(v, 4), mask));
+   low = hex_digits_sse2(_mm_and_si128(v, mask));
+   _mm_storeu_si128((__m128i *)hex, _mm_unpacklo_epi8(high, low));
+   _mm_storeu_si128((__m128i *)(hex + 16), _mm_unpackhi_epi8(high, low));
+
+   printable = _mm_or_si128(_mm_or_si128(in_range_sse2(v, 'A', 'Z'), in_range_sse2(v, 'a', 'z')), in_range_sse2(v, '0', '9'));
+   _mm_storeu_si128((__m128i *)text, _mm_or_si128(_mm_and_si128(printable, v), _mm_andnot_si128(printable, _mm_set1_epi8('.'))));
+}
+#endif
+
+#ifdef PACKET_OPS_NEON
+static inline uint8x16_t hex_digits_neon(uint8x16_t nibbles)
+{
+   return (vaddq_u8(vaddq_u8(nibbles, vdupq_n_u8('0')), vandq_u8(vcgtq_u8(nibbles, vdupq_n_u8(9)), vdupq_n_u8(39))));
+}
+
+static inline uint8x16_t in_range_neon(uint8x16_t v, u_char low, u_char high)
+{
+   return (vandq_u8(vcgeq_u8(v, vdupq_n_u8(low)), vcleq_u8(v, vdupq_n_u8(high))));
+}
+
+static void hex16_neon(const u_char *in, char *hex, char *text)
+{
+   uint8x16_t v = vld1q_u8(in), high, low, printable;
+
+   high = hex_digits_neon(vshrq_n_u8(v, 4));
+   low = hex_digits_neon(vandq_u8(v, vdupq_n_u8(0x0f)));
+   vst1q_u8((u_char *)hex, vzip1q_u8(high, low));
+   vst1q_u8((u_char *)hex + 16, vzip2q_u8(high, low));
+
+   printable = vorrq_u8(vorrq_u8(in_range_neon(v, 'A', 'Z'), in_range_neon(v, 'a', 'z')), in_range_neon(v, '0', '9'));
+   vst1q_u8((u_char *)text, vbslq_u8(printable, v, vdupq_n_u8('.')));
+}
+#endif
+
+/* ======================================================================== */
+/* Dispatch                                                                 */
+/* ======================================================================== */
+
+static void xor_resolve(u_char *data, size_t len, const u_char *pattern);
+static u_short checksum_resolve(const u_char *data, size_t len);
+static void hex16_resolve(const u_char *in, char *hex, char *text);
+
+static void (*xor_impl)(u_char *data, size_t len, const u_char *pattern) = xor_resolve;
+static u_short (*checksum_impl)(const u_char *data, size_t len) = checksum_resolve;
+static void (*hex16_impl)(const u_char *in, char *hex, char *text) = hex16_resolve;
+
+/* Every thread picks the same functions, a race to set them is harmless */
+static void packet_ops_resolve(void)
+{
+   void (*xor_func)(u_char *data, size_t len, const u_char *pattern) = xor_generic;
+   u_short (*checksum_func)(const u_char *data, size_t len) = checksum_generic;
+   void (*hex16_func)(const u_char *in, char *hex, char *text) = hex16_generic;
+
+#ifdef PACKET_OPS_SSE2
+   xor_func = xor_sse2;
+   checksum_func = checksum_sse2;
+   hex16_func = hex16_sse2;
+#endif
+#ifdef PACKET_OPS_AVX2
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx2")) {
+      xor_func = xor_avx2;
+      checksum_func = checksum_avx2;
+   }
+#endif
+#ifdef PACKET_OPS_NEON
+   xor_func = xor_neon;
+   checksum_func = checksum_neon;
+   hex16_func = hex16_neon;
+#endif
+   __atomic_store_n(&xor_impl, xor_func, __ATOMIC_RELAXED);
+   __atomic_store_n(&checksum_impl, checksum_func, __ATOMIC_RELAXED);
+   __atomic_store_n(&hex16_impl, hex16_func, __ATOMIC_RELAXED);
+}
+
+static void xor_resolve(u_char *data, size_t len, const u_char *pattern)
+{
+   packet_ops_resolve();
+   xor_impl(data, len, pattern);
+}
+
+static u_short checksum_resolve(const u_char *data, size_t len)
+{
+   packet_ops_resolve();
+   return (checksum_impl(data, len));
+}
+
+static void hex16_resolve(const u_char *in, char *hex, char *text)
+{
+   packet_ops_resolve();
+   hex16_impl(in, hex, text);
+}
+
+/* ======================================================================== */
+/* Operations                                                               */
+/* ======================================================================== */
+
+/* XOR data with a repeating 8-byte pattern, starting at byte phase of the pattern */
+void packet_xor_pattern(u_char *data, size_t len, const u_char pattern[8], u_int phase)
+{
+   u_char lined_up[32];
+   int i;
+
+   for (i = 0; i < 32; i++)
+      lined_up[i] = pattern[(phase + i) & 7];
+   __atomic_load_n(&xor_impl, __ATOMIC_RELAXED)(data, len, lined_up);
+}
+
+/* Ones' complement sum of the 16-bit big-endian words of the data, folded to 16 bits */
+u_short packet_checksum(const u_char *data, size_t len)
+{
+   return (__atomic_load_n(&checksum_impl, __ATOMIC_RELAXED)(data, len));
+}
+
+/*
+ * Write the line of a hex dump for count (at most 16) bytes at offset of
+ * a packet: the offset, the bytes in hex and the letters and digits among
+ * them. Returns the length of the line, which ends with a newline.
+ */
+int packet_hex_line(char *out, const u_char *pkt, u_int offset, u_int count)
+{
+   char hex[32], text[16], *p = out;
+   int digits, i;
+
+   for (digits = 4; digits < 8 && (offset >> (digits * 4)); digits++);
+   for (i = digits - 1; i >= 0; i--)
+      *p++ = hex_digits[(offset >> (i * 4)) & 0x0f];
+   *p++ = ':';
+   *p++ = ' ';
+
+   if (count == 16)
+      __atomic_load_n(&hex16_impl, __ATOMIC_RELAXED)(pkt + offset, hex, text);
+   else {
+      for (i = 0; i < count; i++) {
+         hex[i * 2] = hex_digits[pkt[offset + i] >> 4];
+         hex[i * 2 + 1] = hex_digits[pkt[offset + i] & 0x0f];
+         text[i] = is_dump_char(pkt[offset + i]) ? pkt[offset + i] : '.';
+      }
+   }
+   for (i = 0; i < 16; i++) {
+      if (i < count) {
+         *p++ = hex[i * 2];
+         *p++ = hex[i * 2 + 1];
+      }
+      else {
+         *p++ = ' ';
+         *p++ = ' ';
+      }
+      *p++ = ' ';
+   }
+   memcpy(p, text, count);
+   p += count;
+   *p++ = '\n';
+   return (p - out);
+}
@@ -0,0 +1,33 @@
+/*
+ *   This file is part of ubridge, a program to bridge network interfaces
+ *   to UDP tunnels.
+ *
+ *   Copyright (C) 2026 GNS3 Technologies Inc.
+ *
+ *   ubridge is free software: you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ubridge is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PACKET_OPS_H_
+#define PACKET_OPS_H_
+
+#include <sys/types.h>
+
+/* Longest line written by packet_hex_line() */
+#define PACKET_HEX_LINE_MAX    80
+
+void packet_xor_pattern(u_char *data, size_t len, const u_char pattern[8], u_int phase);
+u_short packet_checksum(const u_char *data, size_t len);
+int packet_hex_line(char *out, const u_char *pkt, u_int offset, u_int count);
+
+#endif /* !PACKET_OPS_H_ */
@@ -0,0 +1,215 @@
+/*
+ *   This file is part of ubridge, a program to bridge network interfaces
+ *   to UDP tunnels.
+ *
+ *   Copyright (C) 2026 GNS3 Technologies Inc.
+ *
+ *   ubridge is free software: you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ubridge is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "ubridge.h"
+#include "packet_pool.h"
+
+int packet_pool_headroom = PACKET_POOL_DEFAULT_HEADROOM;
+int packet_pool_hugepages = FALSE;
+
+static packet_pool_t *packet_pool_list = NULL;
+static pthread_mutex_t packet_pool_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Map a slab, backed by huge pages when they are enabled and available */
+static void *packet_pool_map_slab(void)
+{
+   void *slab;
+
+#ifdef MAP_HUGETLB
+   static int warned = FALSE;
+
+   if (packet_pool_hugepages) {
+      slab = mmap(NULL, PACKET_POOL_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (slab != MAP_FAILED)
+         return (slab);
+      if (!warned) {
+         fprintf(stderr, "packet_pool_map_slab: no huge page available (%s), using normal pages\n", strerror(errno));
+         warned = TRUE;
+      }
+   }
+#endif
+   slab = mmap(NULL, PACKET_POOL_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (slab == MAP_FAILED)
+      return (NULL);
+   return (slab);
+}
+
+/* Carve a new slab into buffers, called with the pool locked */
+static int packet_pool_grow(packet_pool_t *pool)
+{
+   packet_buf_t *bufs;
+   u_char *slab;
+   u_int i, n = PACKET_POOL_SLAB_SIZE / pool->stride;
+
+   /* a pool over a region has all its buffers from the start */
+   if (pool->region != NULL)
+      return (-1);
+
+   if (!(slab = packet_pool_map_slab())) {
+      fprintf(stderr, "packet_pool_grow: unable to map a slab: %s\n", strerror(errno));
+      return (-1);
+   }
+   if (!(bufs = calloc(n, sizeof(*bufs)))) {
+      munmap(slab, PACKET_POOL_SLAB_SIZE);
+      return (-1);
+   }
+
+   for (i = 0; i < n; i++) {
+      bufs[i].pool = pool;
+      bufs[i].start = slab + i * pool->stride;
+      bufs[i].next = pool->free_list;
+      pool->free_list = &bufs[i];
+   }
+   return (0);
+}
+
+/* Get the shared pool of buffers holding packets of up to size bytes, it is created on first use */
+packet_pool_t *packet_pool_get(size_t size)
+{
+   packet_pool_t *pool;
+
+   pthread_mutex_lock(&packet_pool_list_lock);
+   for (pool = packet_pool_list; pool != NULL; pool = pool->next) {
+      if (pool->size == size)
+         goto done;
+   }
+
+   if ((pool = malloc(sizeof(*pool))) != NULL) {
+      memset(pool, 0, sizeof(*pool));
+      pool->size = size;
+      pool->stride = (packet_pool_headroom + size + 63) & ~63;
+      pthread_mutex_init(&pool->lock, NULL);
+      pool->next = packet_pool_list;
+      packet_pool_list = pool;
+   }
+
+ done:
+   pthread_mutex_unlock(&packet_pool_list_lock);
+   return (pool);
+}
+
+/*
+ * Create a private pool of the buffers of stride bytes in a region of the
+ * caller, which must outlive the pool. Pools are never destroyed.
+ */
+packet_pool_t *packet_pool_create(void *region, size_t len, size_t stride)
+{
+   packet_pool_t *pool;
+   size_t i, n = len / stride;
+
+   if (stride <= (size_t)packet_pool_headroom || n == 0) {
+      fprintf(stderr, "packet_pool_create: buffers of %zu bytes don't leave room after a headroom of %d bytes\n", stride, packet_pool_headroom);
+      return (NULL);
+   }
+   if (!(pool = malloc(sizeof(*pool))))
+      return (NULL);
+   memset(pool, 0, sizeof(*pool));
+   if (!(pool->bufs = calloc(n, sizeof(*pool->bufs)))) {
+      free(pool);
+      return (NULL);
+   }
+   pool->size = stride - packet_pool_headroom;
+   pool->stride = stride;
+   pool->region = region;
+   pool->region_len = n * stride;
+   pthread_mutex_init(&pool->lock, NULL);
+
+   /* the first buffers are taken first */
+   for (i = n; i-- > 0;) {
+      pool->bufs[i].pool = pool;
+      pool->bufs[i].start = pool->region + i * stride;
+      pool->bufs[i].next = pool->free_list;
+      pool->free_list = &pool->bufs[i];
+   }
+   return (pool);
+}
+
+/* Take an empty buffer from a pool, the caller holds the only reference */
+packet_buf_t *packet_buf_alloc(packet_pool_t *pool)
+{
+   packet_buf_t *buf = NULL;
+
+   pthread_mutex_lock(&pool->lock);
+   if (pool->free_list != NULL || packet_pool_grow(pool) == 0) {
+      buf = pool->free_list;
+      pool->free_list = buf->next;
+   }
+   pthread_mutex_unlock(&pool->lock);
+
+   if (buf != NULL) {
+      buf->next = NULL;
+      buf->refcnt = 1;
+      packet_buf_reset(buf);
+   }
+   return (buf);
+}
+
+/* Take another reference on a buffer, to share a packet without copying it */
+void packet_buf_hold(packet_buf_t *buf)
+{
+   __atomic_add_fetch(&buf->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+/* Release a reference, the buffer returns to its pool with the last one */
+void packet_buf_release(packet_buf_t *buf)
+{
+   packet_pool_t *pool = buf->pool;
+
+   if (__atomic_sub_fetch(&buf->refcnt, 1, __ATOMIC_ACQ_REL) != 0)
+      return;
+
+   pthread_mutex_lock(&pool->lock);
+   buf->next = pool->free_list;
+   pool->free_list = buf;
+   pthread_mutex_unlock(&pool->lock);
+}
+
+/* Release a buffer that may be NULL, for use as a cleanup handler */
+void packet_buf_free(void *data)
+{
+   if (data != NULL)
+      packet_buf_release(data);
+}
+
+/*
+ * Get a buffer to receive the next packet in place of one the caller is
+ * done with. The same buffer is returned when nobody else holds it,
+ * otherwise it is left to the other holders and a new one is allocated.
+ */
+packet_buf_t *packet_buf_reclaim(packet_buf_t *buf)
+{
+   packet_buf_t *new_buf;
+
+   if (__atomic_load_n(&buf->refcnt, __ATOMIC_ACQUIRE) == 1) {
+      packet_buf_reset(buf);
+      return (buf);
+   }
+
+   if ((new_buf = packet_buf_alloc(buf->pool)) == NULL)
+      return (NULL);
+   packet_buf_release(buf);
+   return (new_buf);
+}
@@ -0,0 +1,121 @@
+/*
+ *   This file is part of ubridge, a program to bridge network interfaces
+ *   to UDP tunnels.
+ *
+ *   Copyright (C) 2026 GNS3 Technologies Inc.
+ *
+ *   ubridge is free software: you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ubridge is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PACKET_POOL_H_
+#define PACKET_POOL_H_
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#define PACKET_POOL_DEFAULT_HEADROOM  64
+#define PACKET_POOL_MAX_HEADROOM      4096
+#define PACKET_POOL_SLAB_SIZE         (2 * 1024 * 1024)
+
+/*
+ * Packet buffer taken from a pool. The packet starts at data and can grow
+ * into the headroom in front of it, so headers are pushed and popped
+ * without moving the packet. The buffer goes back to its pool when the
+ * last reference is released.
+ */
+typedef struct packet_buf {
+    struct packet_pool *pool;
+    struct packet_buf *next;    /* free list */
+    int refcnt;
+    u_char *start;              /* start of the headroom */
+    u_char *data;
+    size_t len;
+} packet_buf_t;
+
+/*
+ * Pool of buffers of the same size carved from large slabs, or from a
+ * region of the caller the pool doesn't grow past (memory shared with the
+ * kernel for instance).
+ */
+typedef struct packet_pool {
+    size_t size;                /* largest packet a buffer can hold without using the headroom */
+    size_t stride;
+    packet_buf_t *free_list;
+    pthread_mutex_t lock;
+    u_char *region;             /* NULL for a pool of slabs */
+    size_t region_len;
+    packet_buf_t *bufs;         /* buffers of the region, in order */
+    struct packet_pool *next;
+} packet_pool_t;
+
+extern int packet_pool_headroom;
+extern int packet_pool_hugepages;
+
+packet_pool_t *packet_pool_get(size_t size);
+packet_pool_t *packet_pool_create(void *region, size_t len, size_t stride);
+packet_buf_t *packet_buf_alloc(packet_pool_t *pool);
+void packet_buf_hold(packet_buf_t *buf);
+void packet_buf_release(packet_buf_t *buf);
+void packet_buf_free(void *data);
+packet_buf_t *packet_buf_reclaim(packet_buf_t *buf);
+
+/* Buffer of a pool over a region holding a packet, NULL if the packet lies elsewhere */
+static inline packet_buf_t *packet_pool_lookup(packet_pool_t *pool, const u_char *pkt)
+{
+   if (pkt < pool->region || pkt >= pool->region + pool->region_len)
+      return (NULL);
+   return (&pool->bufs[(pkt - pool->region) / pool->stride]);
+}
+
+/* Empty the buffer, the packet starts right after the headroom */
+static inline u_char *packet_buf_reset(packet_buf_t *buf)
+{
+   buf->data = buf->start + packet_pool_headroom;
+   buf->len = 0;
+   return (buf->data);
+}
+
+/* Room left for the packet from its current start */
+static inline size_t packet_buf_room(packet_buf_t *buf)
+{
+   return (buf->pool->size + packet_pool_headroom - (buf->data - buf->start));
+}
+
+/* Tell whether a packet lies in the buffer */
+static inline int packet_buf_contains(packet_buf_t *buf, const u_char *pkt)
+{
+   return (pkt >= buf->start && pkt < buf->start + buf->pool->stride);
+}
+
+/* Prepend a header of len bytes, returns NULL if the headroom is too small */
+static inline u_char *packet_buf_push(packet_buf_t *buf, size_t len)
+{
+   if ((size_t)(buf->data - buf->start) < len)
+      return (NULL);
+   buf->data -= len;
+   buf->len += len;
+   return (buf->data);
+}
+
+/* Remove a header of len bytes, returns NULL if the packet is too short */
+static inline u_char *packet_buf_pull(packet_buf_t *buf, size_t len)
+{
+   if (buf->len < len)
+      return (NULL);
+   buf->data += len;
+   buf->len -= len;
+   return (buf->data);
+}
+
+#endif /* !PACKET_POOL_H_ */
@@ -20,6 +20,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "parse.h"
 #include "nio_udp.h"
@@ -31,6 +32,7 @@
 
 #ifdef LINUX_RAW
 #include "nio_linux_raw.h"
+#include "nio_af_xdp.h"
 #endif
 
 #ifdef __APPLE__
@@ -53,7 +55,7 @@ static nio_t *create_udp_tunnel(const char *params)
      return NULL;
   }
 
-  nio = create_nio_udp(atoi(local_port), remote_host, atoi(remote_port));
+  nio = create_nio_udp(atoi(local_port), remote_host, atoi(remote_port), 0, NULL);
   if (!nio)
     fprintf(stderr, "unable to create UDP NIO\n");
   return nio;
@@ -94,7 +96,7 @@ static nio_t *open_tap_device(const char *dev_name)
   nio_t *nio;
 
   printf("Opening TAP device %s\n", dev_name);
-  nio = create_nio_tap((char *)dev_name);
+  nio = create_nio_tap((char *)dev_name, 0, NULL);
   if (!nio)
     fprintf(stderr, "unable to open TAP device\n");
   return nio;
@@ -106,11 +108,22 @@ static nio_t *open_linux_raw(const char *dev_name)
   nio_t *nio;
 
   printf("Opening Linux RAW device %s\n", dev_name);
-  nio = create_nio_linux_raw((char *)dev_name);
+  nio = create_nio_linux_raw((char *)dev_name, 0, NULL);
   if (!nio)
     fprintf(stderr, "unable to open RAW device\n");
   return nio;
 }
+
+static nio_t *open_af_xdp(const char *dev_name)
+{
+  nio_t *nio;
+
+  printf("Opening AF_XDP socket on device %s\n", dev_name);
+  nio = create_nio_af_xdp((char *)dev_name, 0);
+  if (!nio)
+    fprintf(stderr, "unable to open AF_XDP socket\n");
+  return nio;
+}
 #endif
 
 #ifdef __APPLE__
@@ -150,16 +163,56 @@ static bridge_t *add_bridge(bridge_t **head)
    return bridge;
 }
 
+/* INI entries of the capture options, and the matching options of start_capture */
+static const char *capture_ini_options[][2] = {
+    { "pcap_buffer", "buffer" },
+    { "pcap_full", "full" },
+    { "pcap_filesize", "filesize" },
+    { "pcap_duration", "duration" },
+    { "pcap_files", "files" },
+    { "pcap_format", "format" },
+    { "pcap_snaplen", "snaplen" },
+    { "pcap_capture_filter", "filter" },
+};
+
+#define NR_CAPTURE_OPTIONS  (sizeof(capture_ini_options) / sizeof(capture_ini_options[0]))
+
 static void parse_capture(dictionary *ubridge_config, const char *bridge_name, bridge_t *bridge)
 {
     const char *pcap_file = NULL;
     const char *pcap_linktype = "EN10MB";
+    const char *value;
+    char *options[NR_CAPTURE_OPTIONS];
+    pcap_capture_options_t capture_options;
+    int i, nr_options = 0;
+    size_t len;
 
     getstr(ubridge_config, bridge_name, "pcap_protocol", &pcap_linktype);
+    /* options are name=value strings, sized to fit filter expressions and file names */
+    for (i = 0; i < NR_CAPTURE_OPTIONS; i++) {
+        if (getstr(ubridge_config, bridge_name, capture_ini_options[i][0], &value)) {
+            len = strlen(capture_ini_options[i][1]) + strlen(value) + 2;
+            if (!(options[nr_options] = malloc(len))) {
+                fprintf(stderr, "parse_capture: insufficient memory, capture not started\n");
+                goto out;
+            }
+            snprintf(options[nr_options++], len, "%s=%s", capture_ini_options[i][1], value);
+        }
+    }
     if (getstr(ubridge_config, bridge_name, "pcap_file", &pcap_file)) {
         printf("Starting packet capture to %s with protocol %s\n", pcap_file, pcap_linktype);
-        bridge->capture = create_pcap_capture(pcap_file, pcap_linktype);
+        if (pcap_capture_parse_options(&capture_options, nr_options, options) == -1)
+           fprintf(stderr, "invalid packet capture options, capture not started\n");
+        else {
+           pcap_capture_add_nio_interface(&capture_options, bridge_name, "source", bridge->source_nio);
+           pcap_capture_add_nio_interface(&capture_options, bridge_name, "destination", bridge->destination_nio);
+           bridge->capture = create_pcap_capture(pcap_file, pcap_linktype, &capture_options);
+        }
     }
+
+ out:
+    for (i = 0; i < nr_options; i++)
+        free(options[i]);
 }
 
 static void parse_filter(dictionary *ubridge_config, const char *bridge_name, bridge_t *bridge)
@@ -209,6 +262,8 @@ int parse_config(char *filename, bridge_t **bridges)
 #ifdef LINUX_RAW
         else if (getstr(ubridge_config, bridge_name, "source_linux_raw", &value))
            source_nio = open_linux_raw(value);
+        else if (getstr(ubridge_config, bridge_name, "source_af_xdp", &value))
+           source_nio = open_af_xdp(value);
 #endif
 #ifdef __APPLE__
         else if (getstr(ubridge_config, bridge_name, "source_fusion_vmnet", &value))
@@ -228,6 +283,8 @@ int parse_config(char *filename, bridge_t **bridges)
 #ifdef LINUX_RAW
         else if (getstr(ubridge_config, bridge_name, "destination_linux_raw", &value))
            source_nio = open_linux_raw(value);
+        else if (getstr(ubridge_config, bridge_name, "destination_af_xdp", &value))
+           destination_nio = open_af_xdp(value);
 #endif
 #ifdef __APPLE__
         else if (getstr(ubridge_config, bridge_name, "destination_fusion_vmnet", &value))
@@ -18,87 +18,1118 @@
  *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
-#include <sys/socket.h>
-#include <netdb.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/time.h>
 
 #include "ubridge.h"
 #include "pcap_capture.h"
+#include "pcapng.h"
+#include "pcap_filter.h"
+#include "epoch.h"
 
+#define PCAP_MAGIC              0xa1b2c3d4
+#define PCAP_VERSION_MAJOR      2
+#define PCAP_VERSION_MINOR      4
+
+/* Link types of the file format that aren't the DLT_ value of the platform */
+#define LINKTYPE_ATM_RFC1483    100
+#define LINKTYPE_RAW            101
+
+enum {
+   CAPTURE_RECORD_FREE = 0,      /* not written yet, ends the records ready for the writer */
+   CAPTURE_RECORD_READY,
+   CAPTURE_RECORD_PADDING,       /* end of the ring, a record doesn't wrap around */
+};
+
+/* Frame in the ring, records are aligned on 8 bytes */
+typedef struct capture_record {
+   u_int32_t size;               /* of the record with the frame and its padding */
+   u_int32_t state;
+   u_int64_t timestamp;          /* in ns since the Epoch */
+   u_int32_t caplen;
+   u_int32_t len;
+   u_int32_t interface;
+   u_int32_t reserved;
+} capture_record_t;
+
+#define CAPTURE_RECORD_ALIGN(size)    (((size) + 7) & ~7)
+
+/* Trigger of a flight recorder, it fires once */
+enum {
+   CAPTURE_TRIGGER_ARMED = 0,
+   CAPTURE_TRIGGER_FIRED,        /* the writer thread dumps the history */
+   CAPTURE_TRIGGER_DONE,
+};
+
+struct pcap_file_header_v24 {
+   u_int32_t magic;
+   u_int16_t version_major;
+   u_int16_t version_minor;
+   int32_t thiszone;
+   u_int32_t sigfigs;
+   u_int32_t snaplen;
+   u_int32_t linktype;
+};
+
+struct pcap_record_header {
+   u_int32_t ts_sec;
+   u_int32_t ts_usec;
+   u_int32_t caplen;
+   u_int32_t len;
+};
+
+/* Parse a size in bytes with an optional k, m or g suffix */
+static int parse_size(const char *str, size_t *size)
+{
+   char *end;
+   unsigned long long value;
+
+   errno = 0;
+   value = strtoull(str, &end, 10);
+   if (errno || end == str)
+      return (-1);
+   switch (*end) {
+      case 'k': case 'K':
+         value <<= 10;
+         end++;
+         break;
+      case 'm': case 'M':
+         value <<= 20;
+         end++;
+         break;
+      case 'g': case 'G':
+         value <<= 30;
+         end++;
+         break;
+   }
+   if (*end != '\0')
+      return (-1);
+   *size = value;
+   return (0);
+}
+
+/*
+ * Parse the options of a capture:
+ *   buffer=<size>        size of the ring, with a k, m or g suffix
+ *   full=drop|block      drop the frames or wait when the ring is full
+ *   filesize=<size>      start a new file when the file reaches the size
+ *   duration=<seconds>   start a new file after the duration
+ *   files=<count>        delete the oldest files past the count
+ *   format=pcap|pcapng   file format, pcap by default
+ *   snaplen=<bytes>      capture the first bytes of the frames only
+ *   snaplen=headers      capture the frames up to the end of their L4 header
+ *   filter=<expression>  only capture the frames matching a pcap filter
+ *   trigger=<expression> flight recorder, dump the history on the first frame matching a pcap filter
+ *   dump=<file>          flight recorder, file the trigger dumps the history to
+ */
+int pcap_capture_parse_options(pcap_capture_options_t *options, int argc, char *argv[])
+{
+   size_t size;
+   int i, value;
+
+   memset(options, 0, sizeof(*options));
+   options->buffer_size = PCAP_CAPTURE_DEFAULT_BUFFER;
+   options->full_policy = PCAP_CAPTURE_FULL_DROP;
+   options->snaplen = PCAP_CAPTURE_MAX_SNAPLEN;
+
+   for (i = 0; i < argc; i++) {
+      if (!strncmp(argv[i], "buffer=", 7)) {
+         if (parse_size(argv[i] + 7, &options->buffer_size) == -1 || options->buffer_size < PCAP_CAPTURE_MIN_BUFFER ||
+             options->buffer_size > ((size_t)1 << 31)) {
+            fprintf(stderr, "pcap_capture_parse_options: invalid buffer size '%s'\n", argv[i] + 7);
+            return (-1);
+         }
+      }
+      else if (!strcmp(argv[i], "full=drop"))
+         options->full_policy = PCAP_CAPTURE_FULL_DROP;
+      else if (!strcmp(argv[i], "full=block"))
+         options->full_policy = PCAP_CAPTURE_FULL_BLOCK;
+      else if (!strcmp(argv[i], "format=pcap"))
+         options->format = PCAP_CAPTURE_FORMAT_PCAP;
+      else if (!strcmp(argv[i], "format=pcapng"))
+         options->format = PCAP_CAPTURE_FORMAT_PCAPNG;
+      else if (!strncmp(argv[i], "filter=", 7)) {
+         if (argv[i][7] == '\0') {
+            fprintf(stderr, "pcap_capture_parse_options: empty filter\n");
+            return (-1);
+         }
+         options->filter = argv[i] + 7;
+      }
+      else if (!strncmp(argv[i], "trigger=", 8)) {
+         if (argv[i][8] == '\0') {
+            fprintf(stderr, "pcap_capture_parse_options: empty trigger\n");
+            return (-1);
+         }
+         options->trigger = argv[i] + 8;
+      }
+      else if (!strncmp(argv[i], "dump=", 5)) {
+         if (argv[i][5] == '\0') {
+            fprintf(stderr, "pcap_capture_parse_options: empty dump file\n");
+            return (-1);
+         }
+         options->dump_file = argv[i] + 5;
+      }
+      else if (!strcmp(argv[i], "snaplen=headers"))
+         options->headers_only = TRUE;
+      else if (!strncmp(argv[i], "snaplen=", 8)) {
+         if ((value = atoi(argv[i] + 8)) <= 0 || value > PCAP_CAPTURE_MAX_SNAPLEN) {
+            fprintf(stderr, "pcap_capture_parse_options: invalid snaplen '%s'\n", argv[i] + 8);
+            return (-1);
+         }
+         options->snaplen = value;
+      }
+      else if (!strncmp(argv[i], "filesize=", 9)) {
+         if (parse_size(argv[i] + 9, &size) == -1 || size < PCAP_CAPTURE_MIN_FILE_SIZE) {
+            fprintf(stderr, "pcap_capture_parse_options: invalid file size '%s'\n", argv[i] + 9);
+            return (-1);
+         }
+         options->file_size = size;
+      }
+      else if (!strncmp(argv[i], "duration=", 9)) {
+         if ((value = atoi(argv[i] + 9)) <= 0) {
+            fprintf(stderr, "pcap_capture_parse_options: invalid duration '%s'\n", argv[i] + 9);
+            return (-1);
+         }
+         options->duration = value;
+      }
+      else if (!strncmp(argv[i], "files=", 6)) {
+         if ((value = atoi(argv[i] + 6)) <= 0) {
+            fprintf(stderr, "pcap_capture_parse_options: invalid file count '%s'\n", argv[i] + 6);
+            return (-1);
+         }
+         options->max_files = value;
+      }
+      else {
+         fprintf(stderr, "pcap_capture_parse_options: unknown option '%s'\n", argv[i]);
+         return (-1);
+      }
+   }
+   if (options->max_files && !PCAP_CAPTURE_ROTATES(options)) {
+      fprintf(stderr, "pcap_capture_parse_options: a file count needs a file size or a duration\n");
+      return (-1);
+   }
+   if (options->trigger && !options->dump_file) {
+      fprintf(stderr, "pcap_capture_parse_options: a trigger needs a dump file\n");
+      return (-1);
+   }
+   return (0);
+}
+
+/* Name an interface of the capture, returns the interface or -1 if there are too many */
+int pcap_capture_add_interface(pcap_capture_options_t *options, const char *fmt, ...)
+{
+   va_list argptr;
+
+   if (options->nr_interfaces >= PCAP_CAPTURE_MAX_INTERFACES)
+      return (-1);
+
+   va_start(argptr, fmt);
+   vsnprintf(options->interfaces[options->nr_interfaces], PCAP_CAPTURE_IF_NAME_LEN, fmt, argptr);
+   va_end(argptr);
+   return (options->nr_interfaces++);
+}
+
+/* Name an interface after the NIO receiving its frames, which can be NULL */
+int pcap_capture_add_nio_interface(pcap_capture_options_t *options, const char *owner, const char *role, nio_t *nio)
+{
+   if (nio != NULL && nio->desc != NULL)
+      return (pcap_capture_add_interface(options, "%s %s %s", owner, role, nio->desc));
+   return (pcap_capture_add_interface(options, "%s %s", owner, role));
+}
+
+static u_int32_t pcap_file_linktype(int link_type)
+{
+#ifdef DLT_ATM_RFC1483
+   if (link_type == DLT_ATM_RFC1483)
+      return (LINKTYPE_ATM_RFC1483);
+#endif
+#ifdef DLT_RAW
+   if (link_type == DLT_RAW)
+      return (LINKTYPE_RAW);
+#endif
+   return (link_type);
+}
+
+static u_int64_t capture_timestamp(void)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_REALTIME, &now);
+   return ((u_int64_t)now.tv_sec * 1000000000 + now.tv_nsec);
+}
+
+static int capture_write(int fd, const u_char *data, size_t len)
+{
+   ssize_t written;
+
+   while (len > 0) {
+      if ((written = write(fd, data, len)) == -1) {
+         if (errno == EINTR)
+            continue;
+         return (-1);
+      }
+      data += written;
+      len -= written;
+   }
+   return (0);
+}
+
+/* ======================================================================== */
+/* Capture files                                                            */
+/* ======================================================================== */
+
+/* Write the header of a file, the output buffer of the writer thread is empty */
+static int write_file_header(pcap_capture_t *capture)
+{
+   struct pcap_file_header_v24 header;
+   size_t len = 0;
+   int i;
+
+   if (capture->options.format == PCAP_CAPTURE_FORMAT_PCAPNG) {
+      len = pcapng_section_header(capture->out, "ubridge " VERSION);
+      for (i = 0; i < capture->options.nr_interfaces; i++)
+         len += pcapng_interface_description(capture->out + len, pcap_file_linktype(capture->link_type), capture->snaplen,
+                                             capture->options.interfaces[i]);
+   }
+   else {
+      memset(&header, 0, sizeof(header));
+      header.magic = PCAP_MAGIC;
+      header.version_major = PCAP_VERSION_MAJOR;
+      header.version_minor = PCAP_VERSION_MINOR;
+      header.snaplen = capture->snaplen;
+      header.linktype = pcap_file_linktype(capture->link_type);
+      memcpy(capture->out, &header, sizeof(header));
+      len = sizeof(header);
+   }
+   capture->file_bytes = len;
+   return (capture_write(capture->fd, capture->out, len));
+}
+
+/*
+ * Name of a file of the capture: the file name given when the capture
+ * doesn't rotate, the file name with the index before the extension
+ * otherwise (capture.pcap gives capture_00000.pcap, capture_00001.pcap...)
+ */
+static void capture_file_name(pcap_capture_t *capture, u_int64_t index, char *name, size_t size)
+{
+   char *base, *ext;
+
+   if (!PCAP_CAPTURE_ROTATES(&capture->options)) {
+      snprintf(name, size, "%s", capture->filename);
+      return;
+   }
+   base = (base = strrchr(capture->filename, '/')) ? base + 1 : capture->filename;
+   if ((ext = strrchr(base, '.')) == NULL || ext == base)
+      ext = base + strlen(base);
+   snprintf(name, size, "%.*s_%05llu%s", (int)(ext - capture->filename), capture->filename, (unsigned long long)index, ext);
+}
+
+static int open_capture_file(pcap_capture_t *capture)
+{
+   char name[PATH_MAX];
+
+   capture_file_name(capture, capture->file_index, name, sizeof(name));
+   if ((capture->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1 || write_file_header(capture) == -1) {
+      fprintf(stderr,"unable to open file %s: %s\n", name, strerror(errno));
+      return (-1);
+   }
+#ifdef __linux__
+   /* contiguous files on a busy disk, the preallocation isn't part of the file size */
+   if (capture->options.file_size)
+      fallocate(capture->fd, FALLOC_FL_KEEP_SIZE, 0, capture->options.file_size);
+#endif
+   capture->file_frames = 0;
+
+   if (capture->options.max_files && capture->file_index >= capture->options.max_files) {
+      capture_file_name(capture, capture->file_index - capture->options.max_files, name, sizeof(name));
+      if (unlink(name) == -1 && errno != ENOENT)
+         fprintf(stderr,"unable to delete file %s: %s\n", name, strerror(errno));
+   }
+   return (0);
+}
+
+static void close_capture_file(pcap_capture_t *capture)
+{
+   if (capture->fd != -1) {
+#ifdef __linux__
+      /* give back what was preallocated past the end of the file */
+      if (capture->options.file_size && !capture->write_error && ftruncate(capture->fd, capture->file_bytes) == -1)
+         fprintf(stderr, "capture to '%s': ftruncate failed: %s\n", capture->filename, strerror(errno));
+#endif
+      close(capture->fd);
+      capture->fd = -1;
+   }
+}
+
+/* ======================================================================== */
+/* Writer thread                                                            */
+/* ======================================================================== */
+
+
+static void capture_flush(pcap_capture_t *capture)
+{
+   if (capture->out_len > 0 && !capture->write_error && capture_write(capture->fd, capture->out, capture->out_len) == -1) {
+      fprintf(stderr, "capture to '%s' failed: %s, frames are dropped\n", capture->filename, strerror(errno));
+      capture->write_error = TRUE;
+   }
+   capture->out_len = 0;
+}
+
+/* Bytes a frame takes in the file */
+static size_t capture_frame_size(pcap_capture_t *capture, capture_record_t *record)
+{
+   if (capture->options.format == PCAP_CAPTURE_FORMAT_PCAPNG)
+      return (PCAPNG_EPB_SIZE(record->caplen));
+   return (sizeof(struct pcap_record_header) + record->caplen);
+}
+
+/* Bytes written when a file is closed */
+static size_t capture_trailer_size(pcap_capture_t *capture)
+{
+   if (capture->options.format == PCAP_CAPTURE_FORMAT_PCAPNG)
+      return (capture->options.nr_interfaces * PCAPNG_ISB_SIZE);
+   return (0);
+}
+
+/* Room in the output buffer, written to the file first if it's too full */
+static u_char *capture_reserve_output(pcap_capture_t *capture, size_t size)
+{
+   if (capture->out_len + size > PCAP_CAPTURE_WRITE_SIZE)
+      capture_flush(capture);
+   return (capture->out + capture->out_len);
+}
+
+/* The statistics of the interfaces end a pcapng file */
+static void capture_file_trailer(pcap_capture_t *capture)
+{
+   pcapng_interface_stats_t stats;
+   pcap_capture_interface_t *interface;
+   u_char *out;
+   size_t size;
+   int i;
+
+   if (capture->options.format != PCAP_CAPTURE_FORMAT_PCAPNG || capture->write_error)
+      return;
+
+   stats.start = capture->start;
+   stats.end = capture_timestamp();
+   for (i = 0; i < capture->options.nr_interfaces; i++) {
+      interface = &capture->interfaces[i];
+      stats.received = __atomic_load_n(&interface->received, __ATOMIC_RELAXED);
+      stats.if_dropped = __atomic_load_n(&interface->filtered, __ATOMIC_RELAXED);
+      stats.filter_accepted = __atomic_load_n(&interface->accepted, __ATOMIC_RELAXED);
+      stats.os_dropped = __atomic_load_n(&interface->dropped, __ATOMIC_RELAXED);
+      stats.delivered = interface->captured;
+      out = capture_reserve_output(capture, PCAPNG_ISB_SIZE);
+      size = pcapng_interface_statistics(out, i, stats.end, &stats);
+      capture->out_len += size;
+      capture->file_bytes += size;
+   }
+}
+
+/* The writer thread starts a new file before a frame past a limit of the file */
+static int capture_rotation_due(pcap_capture_t *capture, capture_record_t *record)
+{
+   if (capture->options.file_size &&
+       capture->file_bytes + capture_frame_size(capture, record) + capture_trailer_size(capture) > capture->options.file_size)
+      return (TRUE);
+   if (capture->options.duration && record->timestamp - capture->file_start >= capture->options.duration * 1000000000ULL)
+      return (TRUE);
+   return (FALSE);
+}
+
+static void capture_count_drop(pcap_capture_t *capture, u_int interface)
+{
+   __atomic_add_fetch(&capture->interfaces[interface].dropped, 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&capture->dropped, 1, __ATOMIC_RELAXED);
+}
+
+/* Format a frame in the output buffer */
+static void capture_output_frame(pcap_capture_t *capture, capture_record_t *record)
+{
+   struct pcap_record_header header;
+   size_t size;
+   u_char *out;
+
+   size = capture_frame_size(capture, record);
+   out = capture_reserve_output(capture, size);
+   if (capture->options.format == PCAP_CAPTURE_FORMAT_PCAPNG) {
+      /* frames are captured as received by a NIO */
+      pcapng_enhanced_packet(out, record->interface, record->timestamp, record + 1, record->caplen, record->len, PCAPNG_EPB_INBOUND);
+   }
+   else {
+      header.ts_sec = record->timestamp / 1000000000;
+      header.ts_usec = (record->timestamp % 1000000000) / 1000;
+      header.caplen = record->caplen;
+      header.len = record->len;
+      memcpy(out, &header, sizeof(header));
+      memcpy(out + sizeof(header), record + 1, record->caplen);
+   }
+   capture->out_len += size;
+   capture->file_bytes += size;
+}
+
+static void capture_output(pcap_capture_t *capture, capture_record_t *record)
+{
+   if (capture->write_error) {
+      capture_count_drop(capture, record->interface);
+      return;
+   }
+   if (capture->file_frames > 0 && capture_rotation_due(capture, record)) {
+      capture_file_trailer(capture);
+      capture_flush(capture);
+      close_capture_file(capture);
+      capture->file_index++;
+      if (open_capture_file(capture) == -1) {
+         fprintf(stderr, "capture to '%s' failed, frames are dropped\n", capture->filename);
+         capture->write_error = TRUE;
+         capture_count_drop(capture, record->interface);
+         return;
+      }
+   }
+   if (capture->file_frames++ == 0)
+      capture->file_start = record->timestamp;
+
+   capture_output_frame(capture, record);
+   capture->interfaces[record->interface].captured++;
+   capture->captured++;
+}
+
+/* ======================================================================== */
+/* Flight recorder                                                          */
+/* ======================================================================== */
+
+/* Forget the oldest frame of the history */
+static void capture_forget(pcap_capture_t *capture)
+{
+   capture_record_t *oldest = (capture_record_t *)(capture->history + capture->history_tail);
+
+   if (oldest->state == CAPTURE_RECORD_READY)
+      capture->history_frames--;
+   capture->history_used -= oldest->size;
+   if ((capture->history_tail += oldest->size) == capture->history_size)
+      capture->history_tail = 0;
+}
+
+/* Keep a frame in the history, the oldest frames make room for it */
+static void capture_remember(pcap_capture_t *capture, capture_record_t *record)
+{
+   capture_record_t *padding;
+   size_t gap = 0;
+
+   /* records don't wrap around, the end of the history is padding */
+   if (capture->history_head + record->size > capture->history_size)
+      gap = capture->history_size - capture->history_head;
+   while (capture->history_used + gap + record->size > capture->history_size)
+      capture_forget(capture);
+
+   if (gap) {
+      padding = (capture_record_t *)(capture->history + capture->history_head);
+      padding->size = gap;
+      padding->state = CAPTURE_RECORD_PADDING;
+      capture->history_used += gap;
+      capture->history_head = 0;
+   }
+   memcpy(capture->history + capture->history_head, record, record->size);
+   capture->history_used += record->size;
+   if ((capture->history_head += record->size) == capture->history_size)
+      capture->history_head = 0;
+
+   capture->history_frames++;
+   capture->interfaces[record->interface].captured++;
+   capture->captured++;
+}
+
+/* Write the history to a file, from the oldest frame, the history is kept */
+static int capture_dump(pcap_capture_t *capture, const char *filename)
+{
+   capture_record_t *record;
+   size_t position, remaining;
+   char *name;
+
+   /* the file written is the one errors are reported for */
+   if (!(name = strdup(filename))) {
+      fprintf(stderr, "not enough memory to dump flight recorder\n");
+      return (-1);
+   }
+   free(capture->filename);
+   capture->filename = name;
+   capture->write_error = FALSE;
+
+   if ((capture->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1 || write_file_header(capture) == -1) {
+      fprintf(stderr,"unable to open file %s: %s\n", filename, strerror(errno));
+      close_capture_file(capture);
+      return (-1);
+   }
+   position = capture->history_tail;
+   for (remaining = capture->history_used; remaining > 0; remaining -= record->size) {
+      record = (capture_record_t *)(capture->history + position);
+      if (record->state == CAPTURE_RECORD_READY)
+         capture_output_frame(capture, record);
+      if ((position += record->size) == capture->history_size)
+         position = 0;
+   }
+   capture_file_trailer(capture);
+   capture_flush(capture);
+   close_capture_file(capture);
+   if (capture->write_error)
+      return (-1);
+
+   printf("Flight recorder dumped %llu frames to '%s'\n", (unsigned long long)capture->history_frames, filename);
+   return (0);
+}
+
+/* Dumps requested to the writer thread, returns TRUE if there was one */
+static int capture_dump_pending(pcap_capture_t *capture)
+{
+   const char *filename;
+   int result;
+
+   if (__atomic_load_n(&capture->trigger_state, __ATOMIC_ACQUIRE) == CAPTURE_TRIGGER_FIRED) {
+      capture_dump(capture, capture->trigger_file);
+      __atomic_store_n(&capture->trigger_state, CAPTURE_TRIGGER_DONE, __ATOMIC_RELAXED);
+      return (TRUE);
+   }
+
+   pthread_mutex_lock(&capture->lock);
+   filename = capture->dump_file;
+   pthread_mutex_unlock(&capture->lock);
+   if (filename == NULL)
+      return (FALSE);
+
+   result = capture_dump(capture, filename);
+   pthread_mutex_lock(&capture->lock);
+   capture->dump_result = result;
+   capture->dump_file = NULL;
+   pthread_cond_broadcast(&capture->dumped);
+   pthread_mutex_unlock(&capture->lock);
+   return (TRUE);
+}
+
+/* Dump the history of a flight recorder to a file, waits for the writer thread */
+int pcap_capture_dump(pcap_capture_t *capture, const char *filename)
+{
+   int result;
+
+   if (capture->history == NULL)
+      return (-1);
+
+   pthread_mutex_lock(&capture->lock);
+   while (capture->dump_file != NULL)
+      pthread_cond_wait(&capture->dumped, &capture->lock);
+   capture->dump_file = filename;
+   pthread_cond_signal(&capture->wakeup);
+   while (capture->dump_file != NULL)
+      pthread_cond_wait(&capture->dumped, &capture->lock);
+   result = capture->dump_result;
+   pthread_mutex_unlock(&capture->lock);
+   return (result);
+}
+
+/* Write the records ready in the ring, returns their number */
+static int capture_drain(pcap_capture_t *capture)
+{
+   capture_record_t *record;
+   u_int64_t tail = capture->tail;
+   u_int32_t state, size;
+   int count = 0;
+
+   for (;;) {
+      record = (capture_record_t *)(capture->ring + (tail & (capture->ring_size - 1)));
+      if ((state = __atomic_load_n(&record->state, __ATOMIC_ACQUIRE)) == CAPTURE_RECORD_FREE)
+         break;
+      if (state == CAPTURE_RECORD_READY) {
+         if (capture->history != NULL)
+            capture_remember(capture, record);
+         else
+            capture_output(capture, record);
+         count++;
+      }
+      /* records start anywhere, the ring must read as free once released */
+      size = record->size;
+      memset(record, 0, size);
+      tail += size;
+      __atomic_store_n(&capture->tail, tail, __ATOMIC_RELEASE);
+   }
+   return (count);
+}
+
+static void *capture_writer(void *data)
+{
+   pcap_capture_t *capture = data;
+   struct timespec deadline;
+   int stopping;
+
+   for (;;) {
+      if (capture_drain(capture) > 0)
+         continue;
+
+      /* the link is quiet, what was drained goes to the file */
+      capture_flush(capture);
+      if (capture->history != NULL && capture_dump_pending(capture))
+         continue;
+      pthread_mutex_lock(&capture->lock);
+      if (!capture->stopping && capture->dump_file == NULL) {
+         clock_gettime(CLOCK_REALTIME, &deadline);
+         deadline.tv_nsec += PCAP_CAPTURE_FLUSH_INTERVAL * 1000000;
+         if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+         }
+         capture->waiting = TRUE;
+         pthread_cond_timedwait(&capture->wakeup, &capture->lock, &deadline);
+         capture->waiting = FALSE;
+      }
+      stopping = capture->stopping;
+      pthread_mutex_unlock(&capture->lock);
+
+      /* no thread writes to the ring anymore once stopping, a flight recorder has nothing left to write */
+      if (stopping && capture->history != NULL)
+         break;
+      if (stopping) {
+         capture_drain(capture);
+         capture_file_trailer(capture);
+         capture_flush(capture);
+         break;
+      }
+   }
+   return (NULL);
+}
+
+static void capture_wakeup(pcap_capture_t *capture)
+{
+   if (__atomic_load_n(&capture->waiting, __ATOMIC_RELAXED)) {
+      pthread_mutex_lock(&capture->lock);
+      pthread_cond_signal(&capture->wakeup);
+      pthread_mutex_unlock(&capture->lock);
+   }
+}
+
+/* ======================================================================== */
+/* Capture management                                                       */
+/* ======================================================================== */
+
+static void release_pcap_capture(pcap_capture_t *capture)
+{
+   close_capture_file(capture);
+   if (capture->filter != NULL) {
+      pcap_filter_free(capture->filter);
+      free(capture->filter);
+   }
+   if (capture->trigger != NULL) {
+      pcap_filter_free(capture->trigger);
+      free(capture->trigger);
+   }
+   free(capture->trigger_file);
+   free(capture->history);
+   free(capture->ring);
+   free(capture->out);
+   free(capture->filename);
+   pthread_cond_destroy(&capture->dumped);
+   pthread_cond_destroy(&capture->wakeup);
+   pthread_mutex_destroy(&capture->lock);
+   free(capture);
+}
+
+/* Stop the writer thread and free a capture no thread captures to anymore */
 void free_pcap_capture(pcap_capture_t *capture)
 {
    if (capture != NULL) {
+      pthread_mutex_lock(&capture->lock);
+      capture->stopping = TRUE;
+      pthread_cond_signal(&capture->wakeup);
+      pthread_mutex_unlock(&capture->lock);
+      pthread_join(capture->writer, NULL);
 
-      if (capture->dumper)
-         pcap_dump_close(capture->dumper);
+      if (capture->dropped && capture->history != NULL)
+         printf("Flight recorder stopped, %llu frames recorded and %llu dropped\n",
+                (unsigned long long)capture->captured, (unsigned long long)capture->dropped);
+      else if (capture->dropped)
+         printf("Capture to '%s' stopped, %llu frames written and %llu dropped\n", capture->filename,
+                (unsigned long long)capture->captured, (unsigned long long)capture->dropped);
+      release_pcap_capture(capture);
+   }
+}
 
-      if (capture->fd)
-         pcap_close(capture->fd);
+/* Stop a capture the forwarding threads may still be writing to */
+void stop_pcap_capture(pcap_capture_t **capture)
+{
+   pcap_capture_t *old_capture;
 
-      pthread_mutex_destroy(&capture->lock);
-      free(capture);
+   if ((old_capture = __atomic_exchange_n(capture, NULL, __ATOMIC_SEQ_CST)) != NULL) {
+      epoch_synchronize();
+      free_pcap_capture(old_capture);
    }
 }
 
-/* Create a new PCAP capture */
-pcap_capture_t *create_pcap_capture(const char *filename, const char *pcap_linktype)
+/* Compile an expression of the capture, the expression belongs to the caller */
+static struct pcap_filter *capture_compile(const char *expression, int link_type)
+{
+   struct pcap_filter *filter;
+
+   if (!(filter = malloc(sizeof(*filter)))) {
+      fprintf(stderr,"not enough memory to setup pcap capture\n");
+      return (NULL);
+   }
+   if (pcap_filter_compile(filter, expression, link_type) == -1) {
+      free(filter);
+      return (NULL);
+   }
+   return (filter);
+}
+
+/*
+ * Create a new PCAP capture, options can be NULL for the defaults. A flight
+ * recorder has no file name, its history size is set in the options.
+ */
+pcap_capture_t *create_pcap_capture(const char *filename, const char *pcap_linktype, pcap_capture_options_t *options)
 {
-   int link_type;
    pcap_capture_t *capture;
+   int link_type;
 
    if (!(capture = malloc(sizeof(*capture)))) {
       fprintf(stderr,"not enough memory to setup pcap capture\n");
       return (NULL);
    }
+   memset(capture, 0, sizeof(*capture));
+   capture->fd = -1;
+   pthread_mutex_init(&capture->lock, NULL);
+   pthread_cond_init(&capture->wakeup, NULL);
+   pthread_cond_init(&capture->dumped, NULL);
 
-   if (pthread_mutex_init(&capture->lock, NULL)) {
-      fprintf(stderr,"pthread_mutex_init failure (file %s)\n", filename);
-      return (NULL);
+   if (options != NULL)
+      capture->options = *options;
+   else
+      pcap_capture_parse_options(&capture->options, 0, NULL);
+   if (capture->options.nr_interfaces == 0)
+      pcap_capture_add_interface(&capture->options, "%s", "capture");
+   capture->start = capture_timestamp();
+
+   if (capture->options.history_size && PCAP_CAPTURE_ROTATES(&capture->options)) {
+      fprintf(stderr,"a flight recorder doesn't rotate files\n");
+      goto capture_err;
+   }
+   if (!capture->options.history_size && (capture->options.trigger || capture->options.dump_file)) {
+      fprintf(stderr,"a trigger needs a flight recorder\n");
+      goto capture_err;
    }
 
    if (!pcap_linktype || (link_type = pcap_datalink_name_to_val(pcap_linktype)) == -1) {
       fprintf(stderr,"unknown link type %s, assuming Ethernet.\n", pcap_linktype);
       link_type = DLT_EN10MB;
    }
+   capture->link_type = link_type;
+   capture->snaplen = capture->options.snaplen;
 
-   /* Open a dead pcap descriptor */
-   if (!(capture->fd = pcap_open_dead(link_type, 65535))) {
-      fprintf(stderr, "pcap_open_dead failure\n");
-      goto pcap_open_err;
+   if (capture->options.filter != NULL && !(capture->filter = capture_compile(capture->options.filter, link_type)))
+      goto capture_err;
+   if (capture->options.trigger != NULL && !(capture->trigger = capture_compile(capture->options.trigger, link_type)))
+      goto capture_err;
+   if (capture->options.dump_file != NULL && !(capture->trigger_file = strdup(capture->options.dump_file))) {
+      fprintf(stderr,"not enough memory to setup pcap capture\n");
+      goto capture_err;
+   }
+   capture->options.filter = NULL;
+   capture->options.trigger = NULL;
+   capture->options.dump_file = NULL;
+
+   /* the ring size is a power of 2 so that positions wrap around with a mask */
+   for (capture->ring_size = PCAP_CAPTURE_MIN_BUFFER; capture->ring_size < capture->options.buffer_size; capture->ring_size <<= 1);
+   if ((filename != NULL && !(capture->filename = strdup(filename))) || !(capture->ring = calloc(1, capture->ring_size)) ||
+       !(capture->out = malloc(PCAP_CAPTURE_WRITE_SIZE))) {
+      fprintf(stderr,"not enough memory to setup pcap capture\n");
+      goto capture_err;
    }
 
-   /* Open the output file */
-   if (!(capture->dumper = pcap_dump_open(capture->fd, filename))) {
-      fprintf(stderr,"pcap_dump_open failure (file %s)\n", filename);
-      goto pcap_dump_err;
+   if (capture->options.history_size) {
+      /* the history is written now so that recording never faults pages in */
+      capture->history_size = CAPTURE_RECORD_ALIGN(m_max(capture->options.history_size, PCAP_CAPTURE_MIN_HISTORY));
+      if (!(capture->history = malloc(capture->history_size))) {
+         fprintf(stderr,"not enough memory for a flight recorder of %zu bytes\n", capture->history_size);
+         goto capture_err;
+      }
+      memset(capture->history, 0, capture->history_size);
    }
+   /* Open the output file, the writer thread opens the next ones */
+   else if (open_capture_file(capture) == -1)
+      goto capture_err;
 
-   printf("Capturing to file '%s'\n", filename);
+   if (pthread_create(&capture->writer, NULL, capture_writer, capture) != 0) {
+      fprintf(stderr,"unable to create the writer thread of the capture\n");
+      goto capture_err;
+   }
+
+   if (capture->history != NULL)
+      printf("Flight recorder of %zu bytes started\n", capture->history_size);
+   else if (PCAP_CAPTURE_ROTATES(&capture->options))
+      printf("Capturing to files '%s' with rotation\n", filename);
+   else
+      printf("Capturing to file '%s'\n", filename);
    return (capture);
 
-   pcap_dump_err:
-      pcap_close(capture->fd);
-   pcap_open_err:
-      pthread_mutex_destroy(&capture->lock);
+   capture_err:
+      release_pcap_capture(capture);
    return (NULL);
 }
 
+/* Create a flight recorder keeping the last frames in a history of the size, in bytes */
+pcap_capture_t *create_flight_recorder(size_t size, const char *pcap_linktype, pcap_capture_options_t *options)
+{
+   pcap_capture_options_t recorder_options;
+
+   if (options != NULL)
+      recorder_options = *options;
+   else
+      pcap_capture_parse_options(&recorder_options, 0, NULL);
+   recorder_options.history_size = size;
+   return (create_pcap_capture(NULL, pcap_linktype, &recorder_options));
+}
+
+/* ======================================================================== */
+/* Forwarding threads                                                       */
+/* ======================================================================== */
+
+/*
+ * Length of the headers of a frame, up to the end of its L4 header. Frames
+ * with headers that aren't known are cut at PCAP_CAPTURE_HEADERS_SNAPLEN,
+ * fragments without a L4 header after their IP header.
+ */
+static size_t capture_headers_len(int link_type, const u_char *pkt, size_t len)
+{
+   size_t offset = 0;
+   u_short ether_type, fragment;
+   u_char proto;
+
+   if (link_type == DLT_EN10MB) {
+      if (len < 14)
+         return (len);
+      offset = 12;
+      ether_type = (pkt[12] << 8) | pkt[13];
+      while ((ether_type == 0x8100 || ether_type == 0x88a8 || ether_type == 0x9100) && len >= offset + 8) {
+         offset += 4;
+         ether_type = (pkt[offset] << 8) | pkt[offset + 1];
+      }
+      offset += 2;
+   }
+#ifdef DLT_RAW
+   else if (link_type == DLT_RAW && len > 0)
+      ether_type = (pkt[0] >> 4) == 6 ? 0x86dd : 0x0800;
+#endif
+   else
+      return (m_min(len, PCAP_CAPTURE_HEADERS_SNAPLEN));
+
+   if (ether_type == 0x0800) {
+      if (len < offset + 20)
+         return (len);
+      proto = pkt[offset + 9];
+      fragment = ((pkt[offset + 6] << 8) | pkt[offset + 7]) & 0x1fff;
+      offset += (pkt[offset] & 0x0f) * 4;
+      if (fragment)
+         return (m_min(len, offset));
+   }
+   else if (ether_type == 0x86dd) {
+      if (len < offset + 40)
+         return (len);
+      proto = pkt[offset + 6];
+      offset += 40;
+      /* extension headers, up to the L4 header */
+      while (proto == 0 || proto == 43 || proto == 44 || proto == 51 || proto == 60) {
+         if (len < offset + 8)
+            return (len);
+         if (proto == 44) {
+            fragment = ((pkt[offset + 2] << 8) | pkt[offset + 3]) & 0xfff8;
+            proto = pkt[offset];
+            offset += 8;
+            if (fragment)
+               return (m_min(len, offset));
+         }
+         else if (proto == 51) {
+            proto = pkt[offset];
+            offset += (pkt[offset + 1] + 2) * 4;
+         }
+         else {
+            proto = pkt[offset];
+            offset += (pkt[offset + 1] + 1) * 8;
+         }
+      }
+   }
+   else
+      return (m_min(len, PCAP_CAPTURE_HEADERS_SNAPLEN));
+
+   switch (proto) {
+      case 6:     /* TCP, with its options */
+         offset += (len >= offset + 13) ? (pkt[offset + 12] >> 4) * 4 : 20;
+         break;
+      case 1:     /* ICMP */
+      case 17:    /* UDP */
+      case 58:    /* ICMPv6 */
+      case 136:   /* UDP-Lite */
+         offset += 8;
+         break;
+      case 132:   /* SCTP, common header */
+         offset += 12;
+         break;
+   }
+   return (m_min(len, offset));
+}
+
+/* Reserve a record in the ring, NULL if it is full */
+static capture_record_t *capture_reserve(pcap_capture_t *capture, u_int32_t size)
+{
+   capture_record_t *padding;
+   u_int64_t head, offset, gap;
+
+   head = __atomic_load_n(&capture->head, __ATOMIC_RELAXED);
+   do {
+      offset = head & (capture->ring_size - 1);
+      gap = (offset + size > capture->ring_size) ? capture->ring_size - offset : 0;
+      if (head + gap + size - __atomic_load_n(&capture->tail, __ATOMIC_ACQUIRE) > capture->ring_size)
+         return (NULL);
+   } while (!__atomic_compare_exchange_n(&capture->head, &head, head + gap + size, FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+   if (gap) {
+      padding = (capture_record_t *)(capture->ring + offset);
+      padding->size = gap;
+      __atomic_store_n(&padding->state, CAPTURE_RECORD_PADDING, __ATOMIC_RELEASE);
+      offset = 0;
+   }
+   return ((capture_record_t *)(capture->ring + offset));
+}
+
+static void capture_frame(pcap_capture_t *capture, u_int interface, u_int64_t timestamp, void *pkt, size_t len)
+{
+   capture_record_t *record;
+   u_int32_t caplen, size;
+
+   caplen = m_min(len, capture->snaplen);
+   if (capture->options.headers_only)
+      caplen = capture_headers_len(capture->link_type, pkt, caplen);
+   size = CAPTURE_RECORD_ALIGN(sizeof(*record) + caplen);
+   while ((record = capture_reserve(capture, size)) == NULL) {
+      capture_wakeup(capture);
+      if (capture->options.full_policy == PCAP_CAPTURE_FULL_DROP) {
+         capture_count_drop(capture, interface);
+         return;
+      }
+      sched_yield();
+   }
+
+   record->size = size;
+   record->timestamp = timestamp;
+   record->caplen = caplen;
+   record->len = len;
+   record->interface = interface;
+   /*
+    * The frame is copied rather than held by reference: the record is
+    * reserved in the ring before the frame is known to fit, only caplen
+    * bytes are kept, and a flight recorder keeps records long after the
+    * burst buffer has been reused for the next receive.
+    */
+   memcpy(record + 1, pkt, caplen);
+   __atomic_store_n(&record->state, CAPTURE_RECORD_READY, __ATOMIC_RELEASE);
+
+   /* the writer thread sleeps while the ring fills up, until it is half full */
+   if (__atomic_load_n(&capture->head, __ATOMIC_RELAXED) - __atomic_load_n(&capture->tail, __ATOMIC_RELAXED) > capture->ring_size / 2)
+      capture_wakeup(capture);
+}
+
+static pcap_capture_t *capture_enter(pcap_capture_t **capture)
+{
+   pcap_capture_t *active;
+
+   if (__atomic_load_n(capture, __ATOMIC_RELAXED) == NULL || epoch_enter() == -1)
+      return (NULL);
+   if ((active = __atomic_load_n(capture, __ATOMIC_SEQ_CST)) == NULL)
+      epoch_exit();
+   return (active);
+}
+
+/* Interface of the frames, the first one if the capture has less */
+static inline u_int capture_interface(pcap_capture_t *capture, int interface)
+{
+   return ((interface >= 0 && interface < capture->options.nr_interfaces) ? interface : 0);
+}
+
+/* Returns TRUE if a frame fires the trigger of a flight recorder */
+static inline int capture_trigger_match(pcap_capture_t *capture, void *pkt, size_t len)
+{
+   return (capture->trigger != NULL && __atomic_load_n(&capture->trigger_state, __ATOMIC_RELAXED) == CAPTURE_TRIGGER_ARMED &&
+           pcap_filter_match(capture->trigger, pkt, len));
+}
+
+/* The writer thread dumps the history, the frame firing the trigger is already in the ring */
+static void capture_fire_trigger(pcap_capture_t *capture)
+{
+   __atomic_store_n(&capture->trigger_state, CAPTURE_TRIGGER_FIRED, __ATOMIC_RELEASE);
+   capture_wakeup(capture);
+}
+
 /* Packet handler: write packets to a file in CAP format */
-void pcap_capture_packet(pcap_capture_t *capture, void *pkt, size_t len)
+void pcap_capture_packet(pcap_capture_t **capture, int interface, void *pkt, size_t len)
 {
-   struct pcap_pkthdr pkt_hdr;
+   pcap_capture_t *active;
+   u_int i;
 
-   if (capture != NULL) {
-      gettimeofday(&pkt_hdr.ts,0);
-      pkt_hdr.caplen = m_min(len, (u_int)pcap_snapshot(capture->fd));
-      pkt_hdr.len = len;
+   if ((active = capture_enter(capture)) != NULL) {
+      i = capture_interface(active, interface);
+      __atomic_add_fetch(&active->interfaces[i].received, 1, __ATOMIC_RELAXED);
+      if (active->filter == NULL || pcap_filter_match(active->filter, pkt, len)) {
+         __atomic_add_fetch(&active->interfaces[i].accepted, 1, __ATOMIC_RELAXED);
+         capture_frame(active, i, capture_timestamp(), pkt, len);
+      }
+      if (capture_trigger_match(active, pkt, len))
+         capture_fire_trigger(active);
+      epoch_exit();
+   }
+}
 
-      /* thread safe dump */
-      pthread_mutex_lock(&capture->lock);
-      pcap_dump((u_char *)capture->dumper, &pkt_hdr, pkt);
-      pcap_dump_flush(capture->dumper);
-      pthread_mutex_unlock(&capture->lock);
+/* Packet handler: write a burst of packets to a file in CAP format */
+void pcap_capture_batch(pcap_capture_t **capture, int interface, struct iovec *pkts, int count)
+{
+   pcap_capture_t *active;
+   u_int64_t timestamp;
+   int j, accepted = 0, fired = FALSE;
+   u_int i;
+
+   if (count > 0 && (active = capture_enter(capture)) != NULL) {
+      i = capture_interface(active, interface);
+      __atomic_add_fetch(&active->interfaces[i].received, count, __ATOMIC_RELAXED);
+      timestamp = capture_timestamp();
+      for (j = 0; j < count; j++) {
+         /* a frame costs a filter run instead of a copy and a write when it doesn't match */
+         if (active->filter == NULL || pcap_filter_match(active->filter, pkts[j].iov_base, pkts[j].iov_len)) {
+            capture_frame(active, i, timestamp, pkts[j].iov_base, pkts[j].iov_len);
+            accepted++;
+         }
+         if (!fired && capture_trigger_match(active, pkts[j].iov_base, pkts[j].iov_len))
+            fired = TRUE;
+      }
+      if (accepted)
+         __atomic_add_fetch(&active->interfaces[i].accepted, accepted, __ATOMIC_RELAXED);
+      if (fired)
+         capture_fire_trigger(active);
+      epoch_exit();
+   }
+}
+
+/* Count frames received on an interface and dropped before the capture */
+void pcap_capture_filtered(pcap_capture_t **capture, int interface, int count)
+{
+   pcap_capture_t *active;
+   u_int i;
+
+   if (count > 0 && (active = capture_enter(capture)) != NULL) {
+      i = capture_interface(active, interface);
+      __atomic_add_fetch(&active->interfaces[i].received, count, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&active->interfaces[i].filtered, count, __ATOMIC_RELAXED);
+      epoch_exit();
    }
 }
@@ -21,10 +21,135 @@
 #ifndef PCAP_CAPTURE_H_
 #define PCAP_CAPTURE_H_
 
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <pthread.h>
+
 #include "nio.h"
 
-pcap_capture_t *create_pcap_capture(const char *filename, const char *pcap_linktype);
+/* Ring the forwarding threads copy captured frames to, in bytes */
+#define PCAP_CAPTURE_DEFAULT_BUFFER    (4 * 1024 * 1024)
+#define PCAP_CAPTURE_MIN_BUFFER        (256 * 1024)
+/* Output buffer of the writer thread, written at once */
+#define PCAP_CAPTURE_WRITE_SIZE        (1024 * 1024)
+/* Longest time a frame waits in the ring when the link is quiet, in ms */
+#define PCAP_CAPTURE_FLUSH_INTERVAL    10
+/* Smallest file size a capture rotates at, in bytes */
+#define PCAP_CAPTURE_MIN_FILE_SIZE     (64 * 1024)
+/* Longest part of a frame captured */
+#define PCAP_CAPTURE_MAX_SNAPLEN       65535
+/* Part of the frames captured in headers only mode when their headers aren't known */
+#define PCAP_CAPTURE_HEADERS_SNAPLEN   128
+/* Smallest history of a flight recorder, in bytes */
+#define PCAP_CAPTURE_MIN_HISTORY       (1024 * 1024)
+/* Interfaces of a capture, frames of a bridge are captured per direction */
+#define PCAP_CAPTURE_MAX_INTERFACES    2
+#define PCAP_CAPTURE_IF_NAME_LEN       128
+
+enum {
+   PCAP_CAPTURE_FORMAT_PCAP = 0,
+   PCAP_CAPTURE_FORMAT_PCAPNG,      /* an interface per direction, ns timestamps and statistics */
+};
+
+/* What the forwarding threads do when the ring is full */
+enum {
+   PCAP_CAPTURE_FULL_DROP = 0,      /* the frame isn't captured */
+   PCAP_CAPTURE_FULL_BLOCK,         /* wait for the writer thread, slowing down the link */
+};
+
+typedef struct pcap_capture_options {
+   size_t buffer_size;
+   int full_policy;
+   /* rotation, a new file is started when either limit is reached, 0 for none */
+   u_int64_t file_size;             /* in bytes */
+   u_int duration;                  /* in seconds */
+   u_int max_files;                 /* oldest files are deleted past this count */
+   int format;
+   u_int snaplen;
+   int headers_only;                /* frames are truncated after their L4 header */
+   const char *filter;              /* expression of the frames captured, only read by create_pcap_capture() */
+   /* flight recorder, the last frames are kept in memory and written to a file on demand */
+   size_t history_size;             /* in bytes, 0 for a capture to a file */
+   const char *trigger;             /* expression of a frame dumping the history once */
+   const char *dump_file;           /* written when the trigger fires */
+   /* names of the interfaces in pcapng files, one unnamed interface if none */
+   int nr_interfaces;
+   char interfaces[PCAP_CAPTURE_MAX_INTERFACES][PCAP_CAPTURE_IF_NAME_LEN];
+} pcap_capture_options_t;
+
+/* Frames of an interface, counted since the capture started */
+typedef struct pcap_capture_interface {
+   u_int64_t received __attribute__((aligned(64)));   /* by the forwarding threads */
+   u_int64_t filtered;              /* dropped by the packet filters before the capture */
+   u_int64_t accepted;              /* matching the filter of the capture */
+   u_int64_t dropped;               /* not captured */
+   u_int64_t captured;              /* written by the writer thread */
+} pcap_capture_interface_t;
+
+#define PCAP_CAPTURE_ROTATES(options)  ((options)->file_size || (options)->duration)
+
+/*
+ * Capture written by a thread of its own: the forwarding threads reserve
+ * records in a ring with an atomic compare and swap and mark them ready
+ * once copied, the writer thread turns the records into large writes.
+ */
+struct pcap_capture {
+   char *filename;
+   int fd;
+   int link_type;
+   u_int snaplen;
+   pcap_capture_options_t options;
+   u_int64_t start;                 /* in ns since the Epoch */
+   struct pcap_filter *filter;      /* frames captured, NULL for all */
+   pcap_capture_interface_t interfaces[PCAP_CAPTURE_MAX_INTERFACES];
+
+   u_char *ring;
+   size_t ring_size;                /* power of 2 */
+   u_int64_t head __attribute__((aligned(64)));     /* reserved by the forwarding threads */
+   u_int64_t tail __attribute__((aligned(64)));     /* released by the writer thread */
+   u_int64_t dropped __attribute__((aligned(64)));  /* frames not written */
+   u_int64_t captured;                              /* frames written */
+
+   pthread_t writer;
+   pthread_mutex_t lock;
+   pthread_cond_t wakeup;
+   int waiting;                     /* the writer thread sleeps until woken up or the interval ends */
+   int stopping;
+   int write_error;
+   u_char *out;
+   size_t out_len;
+
+   /* flight recorder, the history is only used by the writer thread */
+   u_char *history;
+   size_t history_size;
+   size_t history_head;             /* where the next frame is kept */
+   size_t history_tail;             /* oldest frame */
+   size_t history_used;             /* in bytes, with the padding at the end */
+   u_int64_t history_frames;
+   struct pcap_filter *trigger;
+   char *trigger_file;
+   int trigger_state;               /* set by the forwarding threads when the trigger fires */
+   const char *dump_file;           /* dump requested to the writer thread */
+   int dump_result;
+   pthread_cond_t dumped;
+
+   /* current file, only used by the writer thread once started */
+   u_int64_t file_index;
+   u_int64_t file_bytes;
+   u_int64_t file_start;            /* timestamp of the first frame, in ns */
+   u_int64_t file_frames;
+};
+
+int pcap_capture_parse_options(pcap_capture_options_t *options, int argc, char *argv[]);
+pcap_capture_t *create_pcap_capture(const char *filename, const char *pcap_linktype, pcap_capture_options_t *options);
+pcap_capture_t *create_flight_recorder(size_t size, const char *pcap_linktype, pcap_capture_options_t *options);
+int pcap_capture_dump(pcap_capture_t *capture, const char *filename);
 void free_pcap_capture(pcap_capture_t *pcap_capture);
-void pcap_capture_packet(pcap_capture_t *capture, void *pkt, size_t len);
+void stop_pcap_capture(pcap_capture_t **capture);
+int pcap_capture_add_interface(pcap_capture_options_t *options, const char *fmt, ...);
+int pcap_capture_add_nio_interface(pcap_capture_options_t *options, const char *owner, const char *role, nio_t *nio);
+void pcap_capture_packet(pcap_capture_t **capture, int interface, void *pkt, size_t len);
+void pcap_capture_batch(pcap_capture_t **capture, int interface, struct iovec *pkts, int count);
+void pcap_capture_filtered(pcap_capture_t **capture, int interface, int count);
 
 #endif /* !PCAP_CAPTURE_H_ */
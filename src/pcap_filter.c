@@ -44,3 +44,30 @@ int set_pcap_filter(nio_ethernet_t *nio_ethernet, const char *filter)
 	 pcap_freecode(&fp);
 	 return (0);
 }
+
+/* Compile a filter expression, translated to native code when possible (see make check) */
+int pcap_filter_compile(pcap_filter_t *filter, const char *expression, int link_type)
+{
+   pcap_t *pcap_dev;
+
+   memset(filter, 0, sizeof(*filter));
+   pcap_dev = pcap_open_dead(link_type, 65535);
+   if (pcap_compile(pcap_dev, &filter->fp, expression, 1, PCAP_NETMASK_UNKNOWN) < 0) {
+      fprintf(stderr, "Cannot compile filter '%s': %s\n", expression, pcap_geterr(pcap_dev));
+      pcap_close(pcap_dev);
+      return (-1);
+   }
+   pcap_close(pcap_dev);
+
+   filter->jit = bpf_jit_compile(&filter->fp);
+   if (debug_level > 0)
+      printf("Filter '%s' runs %s\n", expression, filter->jit != NULL ? "as native code" : "in the BPF interpreter");
+   return (0);
+}
+
+void pcap_filter_free(pcap_filter_t *filter)
+{
+   bpf_jit_free(filter->jit);
+   filter->jit = NULL;
+   pcap_freecode(&filter->fp);
+}
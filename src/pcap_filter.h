@@ -21,9 +21,34 @@
 #ifndef PCAP_FILTER_H_
 #define PCAP_FILTER_H_
 
+#include <string.h>
+
 #include "nio.h"
+#include "bpf_jit.h"
+
+/* Filter expression compiled for a link type, run as native code when possible */
+typedef struct pcap_filter {
+   struct bpf_program fp;
+   bpf_jit_t *jit;          /* native code of the program, NULL to use the interpreter */
+} pcap_filter_t;
 
 int set_pcap_filter(nio_ethernet_t *nio_ethernet, const char *filter);
+int pcap_filter_compile(pcap_filter_t *filter, const char *expression, int link_type);
+void pcap_filter_free(pcap_filter_t *filter);
+
+/* Returns nonzero if the packet matches the filter */
+static inline u_int pcap_filter_match(pcap_filter_t *filter, const u_char *pkt, u_int len)
+{
+   struct pcap_pkthdr pkthdr;
+
+   if (filter->jit != NULL)
+      return (filter->jit->func(pkt, len));
+
+   memset(&pkthdr, 0, sizeof(pkthdr));
+   pkthdr.caplen = len;
+   pkthdr.len = len;
+   return (pcap_offline_filter(&filter->fp, &pkthdr, pkt));
+}
 
 #if !defined(PCAP_NETMASK_UNKNOWN)
 /*
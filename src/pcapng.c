@@ -0,0 +1,171 @@
+/*
+ *   This file is part of ubridge, a program to bridge network interfaces
+ *   to UDP tunnels.
+ *
+ *   Copyright (C) 2026 GNS3 Technologies Inc.
+ *
+ *   ubridge is free software: you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ubridge is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "ubridge.h"
+#include "pcapng.h"
+
+/*
+ * pcapng blocks are written in the byte order of the host, readers find it
+ * from the byte order magic of the section header block.
+ */
+#define PCAPNG_BLOCK_SHB                0x0a0d0d0a
+#define PCAPNG_BLOCK_IDB                0x00000001
+#define PCAPNG_BLOCK_ISB                0x00000005
+#define PCAPNG_BLOCK_EPB                0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC         0x1a2b3c4d
+
+#define PCAPNG_OPT_ENDOFOPT             0
+#define PCAPNG_OPT_SHB_USERAPPL         4
+#define PCAPNG_OPT_IF_NAME              2
+#define PCAPNG_OPT_IF_TSRESOL           9
+#define PCAPNG_OPT_EPB_FLAGS            2
+#define PCAPNG_OPT_ISB_STARTTIME        2
+#define PCAPNG_OPT_ISB_ENDTIME          3
+#define PCAPNG_OPT_ISB_IFRECV           4
+#define PCAPNG_OPT_ISB_IFDROP           5
+#define PCAPNG_OPT_ISB_FILTERACCEPT     6
+#define PCAPNG_OPT_ISB_OSDROP           7
+#define PCAPNG_OPT_ISB_USRDELIV         8
+
+/* if_tsresol: timestamps are in units of 10^-9 s */
+#define PCAPNG_TSRESOL_NSEC             9
+
+static inline u_char *put16(u_char *p, u_int16_t value)
+{
+   memcpy(p, &value, sizeof(value));
+   return (p + sizeof(value));
+}
+
+static inline u_char *put32(u_char *p, u_int32_t value)
+{
+   memcpy(p, &value, sizeof(value));
+   return (p + sizeof(value));
+}
+
+/* Timestamps are split in their high and low 32 bits */
+static inline u_char *put_timestamp(u_char *p, u_int64_t value)
+{
+   p = put32(p, value >> 32);
+   return (put32(p, value & 0xffffffff));
+}
+
+static u_char *put_data(u_char *p, const void *data, size_t len)
+{
+   memcpy(p, data, len);
+   memset(p + len, 0, PCAPNG_PAD(len) - len);
+   return (p + PCAPNG_PAD(len));
+}
+
+static u_char *put_option(u_char *p, u_int16_t code, const void *data, u_int16_t len)
+{
+   p = put16(p, code);
+   p = put16(p, len);
+   return (put_data(p, data, len));
+}
+
+static u_char *put_option64(u_char *p, u_int16_t code, u_int64_t value)
+{
+   return (put_option(p, code, &value, sizeof(value)));
+}
+
+static u_char *put_option_timestamp(u_char *p, u_int16_t code, u_int64_t value)
+{
+   p = put16(p, code);
+   p = put16(p, 8);
+   return (put_timestamp(p, value));
+}
+
+/* Write the block type, leaving room for the length set by end_block() */
+static u_char *begin_block(u_char *out, u_int32_t type)
+{
+   put32(out, type);
+   return (out + 8);
+}
+
+static size_t end_block(u_char *out, u_char *p)
+{
+   u_int32_t len;
+
+   p = put16(p, PCAPNG_OPT_ENDOFOPT);
+   p = put16(p, 0);
+   len = p + 4 - out;
+   put32(p, len);
+   put32(out + 4, len);
+   return (len);
+}
+
+size_t pcapng_section_header(u_char *out, const char *application)
+{
+   u_char *p = begin_block(out, PCAPNG_BLOCK_SHB);
+
+   p = put32(p, PCAPNG_BYTE_ORDER_MAGIC);
+   p = put16(p, 1);
+   p = put16(p, 0);
+   /* the section length isn't known while streaming */
+   p = put32(p, 0xffffffff);
+   p = put32(p, 0xffffffff);
+   p = put_option(p, PCAPNG_OPT_SHB_USERAPPL, application, strlen(application));
+   return (end_block(out, p));
+}
+
+size_t pcapng_interface_description(u_char *out, u_int16_t link_type, u_int32_t snaplen, const char *name)
+{
+   u_char *p = begin_block(out, PCAPNG_BLOCK_IDB);
+   u_char tsresol = PCAPNG_TSRESOL_NSEC;
+
+   p = put16(p, link_type);
+   p = put16(p, 0);
+   p = put32(p, snaplen);
+   p = put_option(p, PCAPNG_OPT_IF_NAME, name, strlen(name));
+   p = put_option(p, PCAPNG_OPT_IF_TSRESOL, &tsresol, sizeof(tsresol));
+   return (end_block(out, p));
+}
+
+size_t pcapng_enhanced_packet(u_char *out, u_int32_t interface, u_int64_t timestamp, const void *data,
+                              u_int32_t caplen, u_int32_t len, u_int32_t flags)
+{
+   u_char *p = begin_block(out, PCAPNG_BLOCK_EPB);
+
+   p = put32(p, interface);
+   p = put_timestamp(p, timestamp);
+   p = put32(p, caplen);
+   p = put32(p, len);
+   p = put_data(p, data, caplen);
+   p = put_option(p, PCAPNG_OPT_EPB_FLAGS, &flags, sizeof(flags));
+   return (end_block(out, p));
+}
+
+size_t pcapng_interface_statistics(u_char *out, u_int32_t interface, u_int64_t timestamp, const pcapng_interface_stats_t *stats)
+{
+   u_char *p = begin_block(out, PCAPNG_BLOCK_ISB);
+
+   p = put32(p, interface);
+   p = put_timestamp(p, timestamp);
+   p = put_option_timestamp(p, PCAPNG_OPT_ISB_STARTTIME, stats->start);
+   p = put_option_timestamp(p, PCAPNG_OPT_ISB_ENDTIME, stats->end);
+   p = put_option64(p, PCAPNG_OPT_ISB_IFRECV, stats->received);
+   p = put_option64(p, PCAPNG_OPT_ISB_IFDROP, stats->if_dropped);
+   p = put_option64(p, PCAPNG_OPT_ISB_FILTERACCEPT, stats->filter_accepted);
+   p = put_option64(p, PCAPNG_OPT_ISB_OSDROP, stats->os_dropped);
+   p = put_option64(p, PCAPNG_OPT_ISB_USRDELIV, stats->delivered);
+   return (end_block(out, p));
+}
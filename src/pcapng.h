@@ -0,0 +1,60 @@
+/*
+ *   This file is part of ubridge, a program to bridge network interfaces
+ *   to UDP tunnels.
+ *
+ *   Copyright (C) 2026 GNS3 Technologies Inc.
+ *
+ *   ubridge is free software: you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ubridge is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PCAPNG_H_
+#define PCAPNG_H_
+
+#include <sys/types.h>
+
+/* Blocks are padded to 32 bits */
+#define PCAPNG_PAD(len)                 (((len) + 3) & ~3)
+
+/* Enhanced packet block with the flags option, and its frame */
+#define PCAPNG_EPB_SIZE(caplen)         (28 + PCAPNG_PAD(caplen) + 12 + 4)
+/* Interface statistics block with the start and end times and the 5 counters */
+#define PCAPNG_ISB_SIZE                 (20 + 7 * 12 + 4 + 4)
+#define PCAPNG_SHB_MAX_SIZE(appl_len)   (24 + 4 + PCAPNG_PAD(appl_len) + 4 + 4)
+#define PCAPNG_IDB_MAX_SIZE(name_len)   (16 + 4 + PCAPNG_PAD(name_len) + 8 + 4 + 4)
+
+/* Direction of a frame, in the flags of an enhanced packet block */
+#define PCAPNG_EPB_INBOUND              0x1
+#define PCAPNG_EPB_OUTBOUND             0x2
+
+typedef struct pcapng_interface_stats {
+   u_int64_t start;                 /* timestamps, in ns */
+   u_int64_t end;
+   u_int64_t received;
+   u_int64_t if_dropped;            /* by the interface, before the capture */
+   u_int64_t filter_accepted;       /* matching the filter of the capture */
+   u_int64_t os_dropped;            /* by the capture, the buffer was full */
+   u_int64_t delivered;             /* written to the file */
+} pcapng_interface_stats_t;
+
+/*
+ * Encode a block to out, which has room for it, and return its size.
+ * Timestamps are in ns, interfaces are described with a ns resolution.
+ */
+size_t pcapng_section_header(u_char *out, const char *application);
+size_t pcapng_interface_description(u_char *out, u_int16_t link_type, u_int32_t snaplen, const char *name);
+size_t pcapng_enhanced_packet(u_char *out, u_int32_t interface, u_int64_t timestamp, const void *data,
+                              u_int32_t caplen, u_int32_t len, u_int32_t flags);
+size_t pcapng_interface_statistics(u_char *out, u_int32_t interface, u_int64_t timestamp, const pcapng_interface_stats_t *stats);
+
+#endif /* !PCAPNG_H_ */
@@ -0,0 +1,100 @@
+/*
+ *   This file is part of ubridge, a program to bridge network interfaces
+ *   to UDP tunnels.
+ *
+ *   Copyright (C) 2026 GNS3 Technologies Inc.
+ *
+ *   ubridge is free software: you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ubridge is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "prng.h"
+
+#define PRNG_GOLDEN_GAMMA    0x9e3779b97f4a7c15ULL
+
+static inline u_int64_t rotl(u_int64_t x, int k)
+{
+   return ((x << k) | (x >> (64 - k)));
+}
+
+static inline u_int64_t splitmix64_mix(u_int64_t z)
+{
+   z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+   z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+   return (z ^ (z >> 31));
+}
+
+/* xoshiro256** state of the calling thread, seeded on first use */
+static u_int64_t thread_next(void)
+{
+   static __thread u_int64_t s[4];
+   static __thread int seeded = 0;
+   struct timespec now;
+   u_int64_t result, t, z;
+   int i;
+
+   if (!seeded) {
+      clock_gettime(CLOCK_REALTIME, &now);
+      z = (u_int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+      z ^= (u_int64_t)(uintptr_t)pthread_self() * PRNG_GOLDEN_GAMMA;
+      for (i = 0; i < 4; i++) {
+         z += PRNG_GOLDEN_GAMMA;
+         s[i] = splitmix64_mix(z);
+      }
+      seeded = 1;
+   }
+
+   result = rotl(s[1] * 5, 7) * 9;
+   t = s[1] << 17;
+   s[2] ^= s[0];
+   s[3] ^= s[1];
+   s[1] ^= s[2];
+   s[0] ^= s[3];
+   s[2] ^= t;
+   s[3] = rotl(s[3], 45);
+   return (result);
+}
+
+/* Set up a generator, seeded if seed isn't NULL. Returns -1 if the seed isn't a number */
+int prng_init(prng_t *prng, char *seed)
+{
+   char *end;
+
+   memset(prng, 0, sizeof(*prng));
+   if (seed == NULL)
+      return (0);
+
+   errno = 0;
+   prng->state = strtoull(seed, &end, 0);
+   if (errno || end == seed || *end != '\0') {
+      fprintf(stderr, "Invalid seed '%s'\n", seed);
+      return (-1);
+   }
+   prng->seeded = 1;
+   return (0);
+}
+
+u_int64_t prng_next(prng_t *prng)
+{
+   if (!prng->seeded)
+      return (thread_next());
+   return (splitmix64_mix(__atomic_add_fetch(&prng->state, PRNG_GOLDEN_GAMMA, __ATOMIC_RELAXED)));
+}
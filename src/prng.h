@@ -0,0 +1,46 @@
+/*
+ *   This file is part of ubridge, a program to bridge network interfaces
+ *   to UDP tunnels.
+ *
+ *   Copyright (C) 2026 GNS3 Technologies Inc.
+ *
+ *   ubridge is free software: you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ubridge is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PRNG_H_
+#define PRNG_H_
+
+#include <sys/types.h>
+
+/*
+ * Random numbers for the impairment filters. An unseeded generator draws
+ * from a xoshiro256** state of the calling thread, so threads never share
+ * anything. A seeded generator is a splitmix64 stream advanced with one
+ * atomic addition, which gives the same sequence of draws on every run.
+ */
+typedef struct prng {
+   int seeded;
+   u_int64_t state;
+} prng_t;
+
+int prng_init(prng_t *prng, char *seed);
+u_int64_t prng_next(prng_t *prng);
+
+/* Random number in [0, bound[ */
+static inline u_int32_t prng_below(prng_t *prng, u_int32_t bound)
+{
+   return (((prng_next(prng) >> 32) * bound) >> 32);
+}
+
+#endif /* !PRNG_H_ */
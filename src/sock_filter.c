@@ -0,0 +1,366 @@
+/*
+ *   This file is part of ubridge, a program to bridge network interfaces
+ *   to UDP tunnels.
+ *
+ *   Copyright (C) 2026 GNS3 Technologies Inc.
+ *
+ *   ubridge is free software: you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ubridge is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <pcap.h>
+
+#include "ubridge.h"
+#include "sock_filter.h"
+
+/*
+ * Packets dropped by the leading filters of a bridge never need to reach
+ * ubridge: the pcap programs of these filters are rewritten into a single
+ * classic BPF program attached to the receiving sockets of the NIOs, the
+ * filters keep running in userspace for the packets the kernel lets through.
+ */
+
+/* struct sock_fprog of linux/filter.h, which conflicts with the pcap headers */
+struct sock_filter_prog {
+   unsigned short len;
+   struct bpf_insn *filter;
+};
+
+#ifndef SKF_AD_OFF
+#define SKF_AD_OFF                 (-0x1000)
+#endif
+#ifndef SKF_AD_VLAN_TAG_PRESENT
+#define SKF_AD_VLAN_TAG_PRESENT    48
+#endif
+
+/* no packet is that long, and the kernel gives a special meaning to larger offsets */
+#define SOCK_FILTER_MAX_OFFSET     0x7fffffff
+#define SOCK_FILTER_ACCEPT         0xffffffff
+
+typedef struct {
+   struct bpf_insn *insns;    /* NULL while placing the instructions */
+   u_int count;
+} sock_filter_buf_t;
+
+static void sock_filter_emit(sock_filter_buf_t *buf, u_short code, u_int jt, u_int jf, u_int k)
+{
+   if (buf->insns != NULL && buf->count < SOCK_FILTER_MAX_INSNS) {
+      buf->insns[buf->count].code = code;
+      buf->insns[buf->count].jt = jt;
+      buf->insns[buf->count].jf = jf;
+      buf->insns[buf->count].k = k;
+   }
+   buf->count++;
+}
+
+/* Offset of a jump emitted next to the target instruction */
+#define sock_filter_jump(buf, target)    ((target) - ((buf)->count + 1))
+
+/* Memory word a program doesn't use, -1 if there is none */
+static int sock_filter_scratch(const struct bpf_program *fp)
+{
+   u_int used = 0, i;
+   int word;
+
+   for (i = 0; i < fp->bf_len; i++) {
+      switch (fp->bf_insns[i].code) {
+         case BPF_ST:
+         case BPF_STX:
+         case BPF_LD|BPF_MEM:
+         case BPF_LDX|BPF_MEM:
+            if (fp->bf_insns[i].k < BPF_MEMWORDS)
+               used |= 1 << fp->bf_insns[i].k;
+      }
+   }
+   for (word = BPF_MEMWORDS - 1; word >= 0; word--)
+      if (!(used & (1 << word)))
+         return (word);
+   return (-1);
+}
+
+static u_int sock_filter_load_size(u_short code)
+{
+   switch (BPF_SIZE(code)) {
+      case BPF_W:
+         return (4);
+      case BPF_H:
+         return (2);
+   }
+   return (1);
+}
+
+/*
+ * Append a pcap program, found at place[], that sees the packet at offset
+ * bytes into what the socket filter sees. As with pcap_offline_filter(),
+ * a nonzero result drops the packet while zero or a load past the end of
+ * the packet moves on to the next program, at place[bf_len]. The kernel
+ * would drop the packet on such a load, so each one is bounds checked.
+ */
+static int sock_filter_translate(sock_filter_buf_t *buf, const struct bpf_program *fp, u_int offset, int scratch, u_int *place)
+{
+   struct bpf_insn *insn;
+   u_int pc, size, jt, jf, next;
+
+   next = place[fp->bf_len];
+   for (pc = 0; pc < fp->bf_len; pc++) {
+      insn = &fp->bf_insns[pc];
+      if (buf->insns == NULL)
+         place[pc] = buf->count;
+
+      switch (insn->code) {
+         case BPF_LD|BPF_W|BPF_ABS:
+         case BPF_LD|BPF_H|BPF_ABS:
+         case BPF_LD|BPF_B|BPF_ABS:
+            size = sock_filter_load_size(insn->code);
+            if (insn->k > SOCK_FILTER_MAX_OFFSET - offset - size) {
+               sock_filter_emit(buf, BPF_JMP|BPF_JA, 0, 0, sock_filter_jump(buf, next));
+               break;
+            }
+            sock_filter_emit(buf, BPF_LD|BPF_W|BPF_LEN, 0, 0, 0);
+            sock_filter_emit(buf, BPF_JMP|BPF_JGE|BPF_K, 1, 0, insn->k + offset + size);
+            sock_filter_emit(buf, BPF_JMP|BPF_JA, 0, 0, sock_filter_jump(buf, next));
+            sock_filter_emit(buf, insn->code, 0, 0, insn->k + offset);
+            break;
+
+         case BPF_LD|BPF_W|BPF_IND:
+         case BPF_LD|BPF_H|BPF_IND:
+         case BPF_LD|BPF_B|BPF_IND:
+            size = sock_filter_load_size(insn->code);
+            if (insn->k > SOCK_FILTER_MAX_OFFSET - offset - size) {
+               sock_filter_emit(buf, BPF_JMP|BPF_JA, 0, 0, sock_filter_jump(buf, next));
+               break;
+            }
+            /* X <= len && len - X >= k + size, without overflowing */
+            sock_filter_emit(buf, BPF_LD|BPF_W|BPF_LEN, 0, 0, 0);
+            sock_filter_emit(buf, BPF_JMP|BPF_JGE|BPF_X, 0, 2, 0);
+            sock_filter_emit(buf, BPF_ALU|BPF_SUB|BPF_X, 0, 0, 0);
+            sock_filter_emit(buf, BPF_JMP|BPF_JGE|BPF_K, 1, 0, insn->k + offset + size);
+            sock_filter_emit(buf, BPF_JMP|BPF_JA, 0, 0, sock_filter_jump(buf, next));
+            sock_filter_emit(buf, insn->code, 0, 0, insn->k + offset);
+            break;
+
+         case BPF_LDX|BPF_B|BPF_MSH:
+            if (scratch == -1)
+               return (-1);
+            if (insn->k > SOCK_FILTER_MAX_OFFSET - offset - 1) {
+               sock_filter_emit(buf, BPF_JMP|BPF_JA, 0, 0, sock_filter_jump(buf, next));
+               break;
+            }
+            sock_filter_emit(buf, BPF_ST, 0, 0, scratch);
+            sock_filter_emit(buf, BPF_LD|BPF_W|BPF_LEN, 0, 0, 0);
+            sock_filter_emit(buf, BPF_JMP|BPF_JGE|BPF_K, 1, 0, insn->k + offset + 1);
+            sock_filter_emit(buf, BPF_JMP|BPF_JA, 0, 0, sock_filter_jump(buf, next));
+            sock_filter_emit(buf, BPF_LD|BPF_MEM, 0, 0, scratch);
+            sock_filter_emit(buf, insn->code, 0, 0, insn->k + offset);
+            break;
+
+         case BPF_LD|BPF_W|BPF_LEN:
+            sock_filter_emit(buf, insn->code, 0, 0, 0);
+            if (offset)
+               sock_filter_emit(buf, BPF_ALU|BPF_SUB|BPF_K, 0, 0, offset);
+            break;
+
+         case BPF_LDX|BPF_W|BPF_LEN:
+            if (!offset) {
+               sock_filter_emit(buf, insn->code, 0, 0, 0);
+               break;
+            }
+            if (scratch == -1)
+               return (-1);
+            sock_filter_emit(buf, BPF_ST, 0, 0, scratch);
+            sock_filter_emit(buf, BPF_LD|BPF_W|BPF_LEN, 0, 0, 0);
+            sock_filter_emit(buf, BPF_ALU|BPF_SUB|BPF_K, 0, 0, offset);
+            sock_filter_emit(buf, BPF_MISC|BPF_TAX, 0, 0, 0);
+            sock_filter_emit(buf, BPF_LD|BPF_MEM, 0, 0, scratch);
+            break;
+
+         /* the kernel drops the packet on a division by zero, libpcap returns 0 */
+         case BPF_ALU|BPF_DIV|BPF_X:
+         case BPF_ALU|BPF_MOD|BPF_X:
+            if (scratch == -1)
+               return (-1);
+            sock_filter_emit(buf, BPF_ST, 0, 0, scratch);
+            sock_filter_emit(buf, BPF_MISC|BPF_TXA, 0, 0, 0);
+            sock_filter_emit(buf, BPF_JMP|BPF_JEQ|BPF_K, 0, 1, 0);
+            sock_filter_emit(buf, BPF_JMP|BPF_JA, 0, 0, sock_filter_jump(buf, next));
+            sock_filter_emit(buf, BPF_LD|BPF_MEM, 0, 0, scratch);
+            sock_filter_emit(buf, insn->code, 0, 0, 0);
+            break;
+
+         /* the kernel masks the shift count, libpcap gives 0 from 32 on */
+         case BPF_ALU|BPF_LSH|BPF_X:
+         case BPF_ALU|BPF_RSH|BPF_X:
+            return (-1);
+
+         case BPF_RET|BPF_K:
+            if (insn->k)
+               sock_filter_emit(buf, BPF_RET|BPF_K, 0, 0, 0);
+            else
+               sock_filter_emit(buf, BPF_JMP|BPF_JA, 0, 0, sock_filter_jump(buf, next));
+            break;
+
+         case BPF_RET|BPF_A:
+            sock_filter_emit(buf, BPF_JMP|BPF_JEQ|BPF_K, 0, 1, 0);
+            sock_filter_emit(buf, BPF_JMP|BPF_JA, 0, 0, sock_filter_jump(buf, next));
+            sock_filter_emit(buf, BPF_RET|BPF_K, 0, 0, 0);
+            break;
+
+         case BPF_JMP|BPF_JA:
+            if (insn->k >= fp->bf_len - pc - 1)
+               return (-1);
+            sock_filter_emit(buf, insn->code, 0, 0, sock_filter_jump(buf, place[pc + 1 + insn->k]));
+            break;
+
+         case BPF_LD|BPF_IMM:
+         case BPF_LDX|BPF_W|BPF_IMM:
+         case BPF_LD|BPF_MEM:
+         case BPF_LDX|BPF_W|BPF_MEM:
+         case BPF_ST:
+         case BPF_STX:
+         case BPF_MISC|BPF_TAX:
+         case BPF_MISC|BPF_TXA:
+            sock_filter_emit(buf, insn->code, insn->jt, insn->jf, insn->k);
+            break;
+
+         default:
+            if (BPF_CLASS(insn->code) == BPF_ALU) {
+               sock_filter_emit(buf, insn->code, 0, 0, insn->k);
+               break;
+            }
+            if (BPF_CLASS(insn->code) != BPF_JMP)
+               return (-1);
+            if (insn->jt >= fp->bf_len - pc - 1 || insn->jf >= fp->bf_len - pc - 1)
+               return (-1);
+            /* conditional jumps have 8 bit offsets, which the checks can push out of range */
+            jt = sock_filter_jump(buf, place[pc + 1 + insn->jt]);
+            jf = sock_filter_jump(buf, place[pc + 1 + insn->jf]);
+            if (buf->insns != NULL && (jt > 255 || jf > 255))
+               return (-1);
+            sock_filter_emit(buf, insn->code, jt, jf, insn->k);
+      }
+   }
+   if (buf->insns == NULL)
+      place[pc] = buf->count;
+   return (0);
+}
+
+static int sock_filter_append(sock_filter_buf_t *buf, const struct bpf_program *fp, u_int offset)
+{
+   sock_filter_buf_t placing;
+   u_int *place;
+   int scratch, res;
+
+   if (fp->bf_len == 0 || !(place = calloc(fp->bf_len + 1, sizeof(u_int))))
+      return (-1);
+
+   /* a first pass places the instructions, the second one emits them */
+   scratch = sock_filter_scratch(fp);
+   placing.insns = NULL;
+   placing.count = buf->count;
+   if ((res = sock_filter_translate(&placing, fp, offset, scratch, place)) == 0) {
+      if (placing.count >= SOCK_FILTER_MAX_INSNS)
+         res = -1;
+      else
+         res = sock_filter_translate(buf, fp, offset, scratch, place);
+   }
+   free(place);
+   return (res);
+}
+
+static void sock_filter_set(nio_t *nio, struct sock_filter_prog *prog)
+{
+   int i, fd, unused = 0;
+
+   for (i = 0; i < nio->nr_queues; i++) {
+      if ((fd = nio_get_fd(nio->queues[i])) == -1)
+         continue;
+      if (prog != NULL) {
+         if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, prog, sizeof(*prog)) == -1)
+            fprintf(stderr, "sock_filter_update: unable to attach the socket filter: %s\n", strerror(errno));
+      }
+      else if (setsockopt(fd, SOL_SOCKET, SO_DETACH_FILTER, &unused, sizeof(unused)) == -1 && errno != ENOENT)
+         fprintf(stderr, "sock_filter_update: unable to detach the socket filter: %s\n", strerror(errno));
+   }
+}
+
+/*
+ * Make the receiving sockets of a NIO drop what the leading filters of a
+ * list drop, as long as the verdict of these filters only depends on the
+ * packet. The socket filter is removed if there is no such filter.
+ */
+int sock_filter_update(nio_t *nio, packet_filter_t *packet_filters)
+{
+   struct sock_filter_prog prog;
+   sock_filter_buf_t buf;
+   struct bpf_program *fp;
+   packet_filter_t *filter;
+   u_int offset, count;
+   int nr_filters = 0;
+
+   switch (nio->type) {
+      case NIO_TYPE_UDP:
+         /* a single verdict would apply to all the frames UDP_GRO coalesces */
+         if (nio->u.nio_udp.gro != NULL)
+            return (0);
+         /* the socket filter sees the UDP header */
+         offset = 8;
+         break;
+      case NIO_TYPE_UNIX:
+      case NIO_TYPE_LINUX_RAW:
+         offset = 0;
+         break;
+      default:
+         return (0);
+   }
+
+   if (!(buf.insns = malloc(SOCK_FILTER_MAX_INSNS * sizeof(struct bpf_insn)))) {
+      fprintf(stderr, "sock_filter_update: insufficient memory\n");
+      return (-1);
+   }
+   buf.count = 0;
+
+   if (nio->type == NIO_TYPE_LINUX_RAW) {
+      /* the kernel strips VLAN tags, tagged frames are left to the filters once the tag is back */
+      sock_filter_emit(&buf, BPF_LD|BPF_W|BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_VLAN_TAG_PRESENT);
+      sock_filter_emit(&buf, BPF_JMP|BPF_JEQ|BPF_K, 1, 0, 0);
+      sock_filter_emit(&buf, BPF_RET|BPF_K, 0, 0, SOCK_FILTER_ACCEPT);
+   }
+
+   for (filter = packet_filters; filter != NULL; filter = filter->next) {
+      if (filter->drop_program == NULL || (fp = filter->drop_program(filter->data)) == NULL)
+         break;
+      count = buf.count;
+      if (sock_filter_append(&buf, fp, offset) == -1 || buf.count >= SOCK_FILTER_MAX_INSNS) {
+         buf.count = count;
+         break;
+      }
+      nr_filters++;
+   }
+   sock_filter_emit(&buf, BPF_RET|BPF_K, 0, 0, SOCK_FILTER_ACCEPT);
+
+   if (nr_filters) {
+      prog.len = buf.count;
+      prog.filter = buf.insns;
+      sock_filter_set(nio, &prog);
+      if (debug_level > 0)
+         printf("%d leading filter(s) of '%s' run in the kernel (%u instructions)\n", nr_filters, nio->desc ? nio->desc : "NIO", buf.count);
+   }
+   else
+      sock_filter_set(nio, NULL);
+   free(buf.insns);
+   return (nr_filters);
+}
@@ -0,0 +1,32 @@
+/*
+ *   This file is part of ubridge, a program to bridge network interfaces
+ *   to UDP tunnels.
+ *
+ *   Copyright (C) 2026 GNS3 Technologies Inc.
+ *
+ *   ubridge is free software: you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ubridge is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SOCK_FILTER_H_
+#define SOCK_FILTER_H_
+
+#include "nio.h"
+#include "packet_filter.h"
+
+/* Largest program the kernel accepts (BPF_MAXINSNS) */
+#define SOCK_FILTER_MAX_INSNS    4096
+
+int sock_filter_update(nio_t *nio, packet_filter_t *packet_filters);
+
+#endif /* !SOCK_FILTER_H_ */
@@ -34,11 +34,18 @@
 #include "ubridge.h"
 #include "parse.h"
 #include "pcap_capture.h"
+#include "offload.h"
+#include "worker_pool.h"
+#include "nio_uring.h"
 #include "packet_filter.h"
+#include "delay_queue.h"
 #include "hypervisor.h"
 #ifdef __linux__
 #include "hypervisor_iol_bridge.h"
 #endif
+#ifdef LINUX_RAW
+#include "sock_filter.h"
+#endif
 
 char *config_file = CONFIG_FILE;
 pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
@@ -46,116 +53,488 @@ bridge_t *bridge_list = NULL;
 int debug_level = 0;
 int hypervisor_mode = 0;
 
-static int bridge_nios(nio_t *rx_nio, nio_t *tx_nio, bridge_t *bridge)
+static int send_queue_packets(nio_t *tx_nio, nio_t *tx_queue, struct iovec *pkts, int count)
 {
-  ssize_t bytes_received, bytes_sent;
-  unsigned char pkt[NIO_MAX_PKT_SIZE];
-  int drop_packet;
-
-  while (1) {
-
-    /* receive from the receiving NIO */
-    drop_packet = FALSE;
-    bytes_received = nio_recv(rx_nio, &pkt, NIO_MAX_PKT_SIZE);
-    if (bytes_received == -1) {
-        perror("recv");
-        if (errno == ECONNREFUSED || errno == ENETDOWN)
+  int i, sent, waited = FALSE;
+  size_t bytes_sent;
+
+  i = 0;
+  while (i < count) {
+    /* send what we received to the transmitting NIO */
+    sent = nio_send_batch(tx_queue, &pkts[i], count - i);
+    if (sent == -1) {
+        /*
+         * The transmit queue of a non-blocking NIO is full, wait once for some
+         * room. Some sockets are writable while their peer is full, so the queue
+         * is still full if nothing can be sent right after the wait.
+         */
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+           if (!waited) {
+              waited = TRUE;
+              if (nio_wait_writable(tx_queue) == 0)
+                 continue;
+              if (errno != ETIMEDOUT)
+                 return -1;
+           }
+           /* the rest of the burst is dropped as by a congested link */
+           __atomic_fetch_add(&tx_nio->full_dropped, count - i, __ATOMIC_RELAXED);
+           if (debug_level > 0)
+              printf("Dropped %d frames, the transmit queue is full\n", count - i);
+           return 0;
+        }
+
+        perror("send");
+
+        /* EINVAL can be caused by sending to a blackhole route, this happens if a NIC link status changes */
+        if (errno == ECONNREFUSED || errno == ENETDOWN || errno == EINVAL) {
+           i++;
            continue;
+        }
+
+        /* The linux TAP driver returns EIO if the device is not up.
+           From the ubridge side this is not an error, so we should ignore it. */
+        if (tx_nio->type == NIO_TYPE_TAP && errno == EIO) {
+           i++;
+           continue;
+        }
+
         return -1;
     }
 
-    if (bytes_received > NIO_MAX_PKT_SIZE) {
-        fprintf(stderr, "received frame is %zd bytes (maximum is %d bytes)\n", bytes_received, NIO_MAX_PKT_SIZE);
+    waited = FALSE;
+
+    /* the counters are shared by the listeners of all the queues */
+    __atomic_fetch_add(&tx_nio->packets_out, sent, __ATOMIC_RELAXED);
+    bytes_sent = 0;
+    while (sent--)
+       bytes_sent += pkts[i++].iov_len;
+    __atomic_fetch_add(&tx_nio->bytes_out, bytes_sent, __ATOMIC_RELAXED);
+  }
+  return 0;
+}
+
+static int send_packets(nio_t *tx_nio, struct iovec *pkts, int count)
+{
+  struct iovec queue_pkts[NIO_MAX_BATCH];
+  u_int queue_of[NIO_MAX_BATCH];
+  int i, q, n;
+
+  if (tx_nio->nr_queues == 1)
+     return send_queue_packets(tx_nio, tx_nio, pkts, count);
+
+  /* spread the burst over the queues, all the packets of a flow go to the same queue to keep them in order */
+  for (i = 0; i < count; i++)
+     queue_of[i] = nio_flow_hash(pkts[i].iov_base, pkts[i].iov_len) % tx_nio->nr_queues;
+
+  for (q = 0; q < tx_nio->nr_queues; q++) {
+     n = 0;
+     for (i = 0; i < count; i++) {
+        if (queue_of[i] == q)
+           queue_pkts[n++] = pkts[i];
+     }
+     if (n && send_queue_packets(tx_nio, tx_nio->queues[q], queue_pkts, n) == -1)
+        return -1;
+  }
+  return 0;
+}
+
+/*
+ * Send a burst of frames with offload information to a NIO that cannot take
+ * them: checksums are computed and super-frames are segmented in software.
+ */
+static int send_offloaded_packets(nio_t *tx_nio, struct iovec *pkts, int count, packet_buf_t **seg_bufs)
+{
+  struct iovec segs[NIO_MAX_BATCH];
+  nio_offload_t *offload;
+  size_t offset;
+  int i, n, first = 0;
+
+  for (i = 0; i < count; i++) {
+     offload = nio_pkt_offload(pkts[i].iov_base);
+     if (offload->gso_type != NIO_GSO_NONE) {
+        /* send the frames queued before the super-frame, then its segments */
+        if (i > first && send_packets(tx_nio, &pkts[first], i - first) == -1)
+           return -1;
+        first = i;
+
+        offset = 0;
+        do {
+           for (n = 0; n < NIO_MAX_BATCH; n++) {
+              segs[n].iov_base = seg_bufs[n]->data;
+              segs[n].iov_len = NIO_MAX_PKT_SIZE;
+           }
+           n = offload_segment(pkts[i].iov_base, pkts[i].iov_len, offload, &offset, segs, NIO_MAX_BATCH);
+           if (n > 0 && send_packets(tx_nio, segs, n) == -1)
+              return -1;
+        } while (n > 0);
+
+        /* a super-frame that cannot be segmented is dropped, not sent oversized */
+        if (n == -1) {
+           __atomic_fetch_add(&tx_nio->gso_dropped, 1, __ATOMIC_RELAXED);
+           if (debug_level > 0)
+              printf("Dropped a super-frame of %zu bytes (GSO type %u) that cannot be segmented\n", pkts[i].iov_len, offload->gso_type);
+        }
+        first = i + 1;
         continue;
-    }
+     }
+     if (offload->flags & NIO_OFFLOAD_NEEDS_CSUM)
+        offload_finalize_checksum(pkts[i].iov_base, pkts[i].iov_len, offload);
+  }
+
+  if (count > first)
+     return send_packets(tx_nio, &pkts[first], count - first);
+  return 0;
+}
+
+/*
+ * Run a burst through the packet filters, dropped packets are removed from
+ * the burst and the departure of the others can be pushed back.
+ */
+static int filter_packets(bridge_t *bridge, packet_filter_chain_t *chain, int direction, struct iovec *pkts, u_int64_t *departures, int count)
+{
+  packet_filter_entry_t *filter;
+  int i, kept;
+
+  for (filter = chain->entries; filter != chain->entries + chain->count && count > 0; filter++) {
+     kept = 0;
+     for (i = 0; i < count; i++) {
+        departures[kept] = departures[i];
+        if (filter->handler(pkts[i].iov_base, pkts[i].iov_len, filter->data) == FILTER_ACTION_DROP ||
+            (filter->schedule != NULL && filter->schedule(pkts[i].iov_base, pkts[i].iov_len, direction, &departures[kept], filter->data) == FILTER_ACTION_DROP)) {
+           if (debug_level > 0)
+              printf("Packet dropped by packet filter '%s' on bridge '%s'\n", filter->name, bridge->name);
+           continue;
+        }
+        pkts[kept++] = pkts[i];
+     }
+     count = kept;
+  }
+  return count;
+}
+
+/*
+ * Hand the packets held by a filter to the delay queue of the bridge.
+ * Returns the number of packets left in the burst to send at once.
+ */
+static int delay_packets(nio_listener_t *listener, burst_buffer_t *buffer, struct iovec *pkts, u_int64_t *departures, u_int64_t now, int count)
+{
+  bridge_t *bridge = listener->bridge;
+  packet_buf_t *buf;
+  int i, j, kept = 0;
+
+  for (i = 0; i < count; i++) {
+     if (departures[i] <= now) {
+        pkts[kept++] = pkts[i];
+        continue;
+     }
+
+     /* a packet received in a buffer of the burst is held without a copy */
+     buf = NULL;
+     for (j = 0; j < NIO_MAX_BATCH && buf == NULL; j++) {
+        if (packet_buf_contains(buffer->pkts[j], pkts[i].iov_base))
+           buf = buffer->pkts[j];
+     }
+     if (buf == NULL && listener->uring)
+        buf = nio_uring_packet_buf(listener->uring, pkts[i].iov_base);
+     if (delay_queue_add(bridge->delay_queue, listener, pkts[i].iov_base, pkts[i].iov_len, buf, departures[i]) == -1 && debug_level > 0)
+        printf("Packet dropped by the delay queue of bridge '%s'\n", bridge->name);
+  }
+  return kept;
+}
+
+/* Send packets received by a listener to its transmitting NIO */
+static int forward_packets(nio_listener_t *listener, struct iovec *pkts, int count, burst_buffer_t *buffer, int with_segments)
+{
+  nio_t *rx_nio = listener->rx_nio;
+  nio_t *tx_nio = listener->tx_nio;
+  int i;
+
+  /* frames without offload information are complete */
+  if (!rx_nio->offload && tx_nio->offload) {
+     for (i = 0; i < count; i++)
+        memset(nio_pkt_offload(pkts[i].iov_base), 0, sizeof(nio_offload_t));
+  }
+
+  if (rx_nio->offload && !tx_nio->offload && with_segments)
+     return send_offloaded_packets(tx_nio, pkts, count, buffer->segs);
+  return send_packets(tx_nio, pkts, count);
+}
+
+/*
+ * Send the packets released by the delay queue of a bridge, called from the
+ * delay thread. data is the segmentation buffer of the bridge, NULL when no
+ * direction goes from an NIO with offload to one without.
+ */
+static int send_delayed_packets(void *data, void *ctx, struct iovec *pkts, int count)
+{
+  burst_buffer_t *seg_buffer = data;
+
+  return forward_packets(ctx, pkts, count, seg_buffer, seg_buffer != NULL);
+}
+
+/* Take the packet buffers of a burst from the shared pool */
+burst_buffer_t *alloc_burst_buffer(int with_segments)
+{
+  burst_buffer_t *buffer;
+  packet_pool_t *pool;
+  int i;
+
+  if (!(pool = packet_pool_get(NIO_MAX_PKT_SIZE)) || !(buffer = malloc(sizeof(*buffer))))
+     return NULL;
+  memset(buffer, 0, sizeof(*buffer));
 
-    rx_nio->packets_in++;
-    rx_nio->bytes_in += bytes_received;
+  for (i = 0; i < NIO_MAX_BATCH; i++) {
+     if (!(buffer->pkts[i] = packet_buf_alloc(pool)))
+        goto fail;
+     /* super-frames are segmented after the burst when the transmitting NIO has no offload */
+     if (with_segments && !(buffer->segs[i] = packet_buf_alloc(pool)))
+        goto fail;
+  }
+  return buffer;
+
+ fail:
+  free_burst_buffer(buffer);
+  return NULL;
+}
+
+/* Give the packet buffers of a burst back to the pool */
+void free_burst_buffer(void *data)
+{
+  burst_buffer_t *buffer = data;
+  int i;
+
+  for (i = 0; i < NIO_MAX_BATCH; i++) {
+     packet_buf_free(buffer->pkts[i]);
+     packet_buf_free(buffer->segs[i]);
+  }
+  free(buffer);
+}
+
+/*
+ * Receive a burst on one queue of the receiving NIO and forward it to the
+ * transmitting NIO. Returns the number of packets received, 0 if there was
+ * nothing to receive, or -1 on error.
+ */
+int bridge_burst(nio_listener_t *listener, burst_buffer_t *buffer, int with_segments)
+{
+  bridge_t *bridge = listener->bridge;
+  nio_t *rx_nio = listener->rx_nio;
+  struct iovec pkts[NIO_MAX_BATCH];
+  u_int64_t departures[NIO_MAX_BATCH], now;
+  packet_filter_chain_t *chain;
+  size_t bytes_received;
+  int i, count, received, direction, filtered;
+
+  /* receive a burst of packets from the receiving NIO */
+  if (listener->uring && nio_uring_can_recv(listener->uring))
+     received = nio_uring_recv_batch(listener->uring, pkts, NIO_MAX_BATCH);
+  else {
+     for (i = 0; i < NIO_MAX_BATCH; i++) {
+        /* a buffer still shared with someone else is replaced by a new one */
+        if (!(buffer->pkts[i] = packet_buf_reclaim(buffer->pkts[i])))
+           return -1;
+        pkts[i].iov_base = buffer->pkts[i]->data;
+        pkts[i].iov_len = NIO_MAX_PKT_SIZE;
+     }
+     received = nio_recv_batch(rx_nio->queues[listener->queue], pkts, NIO_MAX_BATCH);
+  }
+  if (received == -1) {
+      /* nothing left to read on a non-blocking NIO */
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+         return 0;
+      perror("recv");
+      if (errno == ECONNREFUSED || errno == ENETDOWN)
+         return 0;
+      return -1;
+  }
+
+  count = 0;
+  bytes_received = 0;
+  for (i = 0; i < received; i++) {
+    if (pkts[i].iov_len > NIO_MAX_PKT_SIZE) {
+        fprintf(stderr, "received frame is %zu bytes (maximum is %d bytes)\n", pkts[i].iov_len, NIO_MAX_PKT_SIZE);
+        continue;
+    }
 
     if (debug_level > 0) {
         if (rx_nio == bridge->source_nio)
-           printf("Received %zd bytes on bridge '%s' (source NIO)\n", bytes_received, bridge->name);
+           printf("Received %zu bytes on bridge '%s' (source NIO)\n", pkts[i].iov_len, bridge->name);
         else
-           printf("Received %zd bytes on bridge '%s' (destination NIO)\n", bytes_received, bridge->name);
+           printf("Received %zu bytes on bridge '%s' (destination NIO)\n", pkts[i].iov_len, bridge->name);
         if (debug_level > 1)
-            dump_packet(stdout, pkt, bytes_received);
+            dump_packet(stdout, pkts[i].iov_base, pkts[i].iov_len);
     }
 
-    /* filter the packet if there is a filter configured */
-    if (bridge->packet_filters != NULL) {
-         packet_filter_t *filter = bridge->packet_filters;
-         packet_filter_t *next;
-         while (filter != NULL) {
-             if (filter->handler(pkt, bytes_received, filter->data) == FILTER_ACTION_DROP) {
-                 if (debug_level > 0)
-                    printf("Packet dropped by packet filter '%s' on bridge '%s'\n", filter->name, bridge->name);
-                 drop_packet = TRUE;
-                 break;
-             }
-             next = filter->next;
-             filter = next;
-         }
-     }
+    bytes_received += pkts[i].iov_len;
+    pkts[count++] = pkts[i];
+  }
 
-    if (drop_packet == TRUE)
-       continue;
+  __atomic_fetch_add(&rx_nio->packets_in, count, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&rx_nio->bytes_in, bytes_received, __ATOMIC_RELAXED);
+
+  /* filter the burst if there is a filter configured, the clock is read once for the burst */
+  now = 0;
+  filtered = 0;
+  direction = rx_nio == bridge->source_nio ? FILTER_DIRECTION_FORWARD : FILTER_DIRECTION_REVERSE;
+  if ((chain = packet_filter_chain_enter(&bridge->filter_chain)) != NULL) {
+     now = delay_queue_now();
+     for (i = 0; i < count; i++)
+        departures[i] = now;
+     filtered = count;
+     count = filter_packets(bridge, chain, direction, pkts, departures, count);
+     filtered -= count;
+     packet_filter_chain_exit();
+  }
 
-    /* dump the packet to a PCAP file if capture is activated */
-    pcap_capture_packet(bridge->capture, pkt, bytes_received);
+  /* dump the burst to a PCAP file if capture is activated, the capture has an interface per direction */
+  pcap_capture_filtered(&bridge->capture, direction, filtered);
+  pcap_capture_batch(&bridge->capture, direction, pkts, count);
+  pcap_capture_filtered(&bridge->recorder, direction, filtered);
+  pcap_capture_batch(&bridge->recorder, direction, pkts, count);
 
-    /* send what we received to the transmitting NIO */
-    bytes_sent = nio_send(tx_nio, pkt, bytes_received);
-    if (bytes_sent == -1) {
-        perror("send");
+  /* packets held by a filter are sent later by the delay thread */
+  if (now != 0 && bridge->delay_queue != NULL)
+     count = delay_packets(listener, buffer, pkts, departures, now, count);
 
-        /* EINVAL can be caused by sending to a blackhole route, this happens if a NIC link status changes */
-        if (errno == ECONNREFUSED || errno == ENETDOWN || errno == EINVAL)
-           continue;
+  /* send the rest of the burst to the transmitting NIO */
+  if (count > 0 && forward_packets(listener, pkts, count, buffer, with_segments) == -1)
+     return -1;
+  return received;
+}
 
-        /* The linux TAP driver returns EIO if the device is not up.
-           From the ubridge side this is not an error, so we should ignore it. */
-        if (tx_nio->type == NIO_TYPE_TAP && errno == EIO)
-            continue;
+static int bridge_nios(nio_listener_t *listener)
+{
+  burst_buffer_t *buffer;
+  int with_segments, res;
 
-        return -1;
-    }
+  with_segments = listener->rx_nio->offload && !listener->tx_nio->offload;
+  if (!(buffer = alloc_burst_buffer(with_segments)))
+     return -1;
+  pthread_cleanup_push(free_burst_buffer, buffer);
 
-    tx_nio->packets_out++;
-    tx_nio->bytes_out += bytes_sent;
-  }
-  return 0;
+  if (use_io_uring)
+     listener->uring = nio_uring_create(listener->rx_nio->queues[listener->queue]);
+  pthread_cleanup_push(nio_uring_free, listener->uring);
+
+  while ((res = bridge_burst(listener, buffer, with_segments)) != -1)
+     ;
+
+  pthread_cleanup_pop(1);
+  pthread_cleanup_pop(1);
+  return res;
 }
 
-/* Source NIO thread */
-void *source_nio_listener(void *data)
+/* NIO listener thread */
+void *nio_listener(void *data)
 {
-  bridge_t *bridge = data;
+  nio_listener_t *listener = data;
+  bridge_t *bridge = listener->bridge;
+  const char *side = (listener->rx_nio == bridge->source_nio) ? "Source" : "Destination";
+  char queue[32] = "";
+
+  if (listener->rx_nio->nr_queues > 1)
+    snprintf(queue, sizeof(queue), " (queue %d)", listener->queue);
 
-  printf("Source NIO listener thread for %s has started\n", bridge->name);
+  printf("%s NIO listener thread for %s%s has started\n", side, bridge->name, queue);
   if (bridge->source_nio && bridge->destination_nio)
-    /* bridges from the source NIO to the destination NIO */
-    if (bridge_nios(bridge->source_nio, bridge->destination_nio, bridge) == -1) {
-        fprintf(stderr, "Source NIO listener thread for %s has stopped because of an error: %s \n", bridge->name, strerror(errno));
+    /* bridges one queue of the receiving NIO to the transmitting NIO */
+    if (bridge_nios(listener) == -1) {
+        fprintf(stderr, "%s NIO listener thread for %s%s has stopped because of an error: %s \n", side, bridge->name, queue, strerror(errno));
         exit(EXIT_FAILURE);
     }
-  printf("Source NIO listener thread for %s has stopped\n", bridge->name);
+  printf("%s NIO listener thread for %s%s has stopped\n", side, bridge->name, queue);
   pthread_exit(NULL);
 }
 
-/* Destination NIO thread */
-void *destination_nio_listener(void *data)
+/* Start one listener thread for each queue of the source and destination NIOs */
+int create_bridge_threads(bridge_t *bridge)
 {
-  bridge_t *bridge = data;
+  nio_listener_t *listener;
+  burst_buffer_t *seg_buffer = NULL;
+  int i, s;
+
+  bridge->nr_listeners = bridge->source_nio->nr_queues + bridge->destination_nio->nr_queues;
+  if (!(bridge->listeners = calloc(bridge->nr_listeners, sizeof(nio_listener_t)))) {
+     bridge->nr_listeners = 0;
+     fprintf(stderr, "create_bridge_threads: insufficient memory\n");
+     return -1;
+  }
+  /* the delayed super-frames are segmented in the delay thread */
+  if (bridge->source_nio->offload != bridge->destination_nio->offload && !(seg_buffer = alloc_burst_buffer(TRUE))) {
+     fprintf(stderr, "create_bridge_threads: unable to allocate the segmentation buffer\n");
+     bridge->nr_listeners = 0;
+     cancel_bridge_threads(bridge);
+     return -1;
+  }
+  if (!(bridge->delay_queue = delay_queue_create(send_delayed_packets, seg_buffer, seg_buffer ? free_burst_buffer : NULL))) {
+     fprintf(stderr, "create_bridge_threads: unable to create the delay queue\n");
+     if (seg_buffer)
+        free_burst_buffer(seg_buffer);
+     bridge->nr_listeners = 0;
+     cancel_bridge_threads(bridge);
+     return -1;
+  }
 
-  printf("Destination NIO listener thread for %s has started\n", bridge->name);
-  if (bridge->source_nio && bridge->destination_nio)
-      /* bridges from the destination NIO to the source NIO */
-      if (bridge_nios(bridge->destination_nio, bridge->source_nio, bridge) == -1) {
-         fprintf(stderr, "Destination NIO listener thread for %s has stopped because of an error: %s \n", bridge->name, strerror(errno));
-         exit(EXIT_FAILURE);
-      }
-  printf("Destination NIO listener thread for %s has stopped\n", bridge->name);
-  pthread_exit(NULL);
+#ifdef LINUX_RAW
+  /* what the leading filters drop doesn't have to reach the listeners */
+  sock_filter_update(bridge->source_nio, bridge->packet_filters);
+  sock_filter_update(bridge->destination_nio, bridge->packet_filters);
+#endif
+
+  for (i = 0; i < bridge->nr_listeners; i++) {
+     listener = &bridge->listeners[i];
+     listener->bridge = bridge;
+     if (i < bridge->source_nio->nr_queues) {
+        listener->rx_nio = bridge->source_nio;
+        listener->tx_nio = bridge->destination_nio;
+        listener->queue = i;
+     }
+     else {
+        listener->rx_nio = bridge->destination_nio;
+        listener->tx_nio = bridge->source_nio;
+        listener->queue = i - bridge->source_nio->nr_queues;
+     }
+
+     /* the listener is serviced by a worker thread of the pool, or has its own thread */
+     if (nr_workers > 0) {
+        if (worker_pool_add_listener(listener) == -1) {
+           bridge->nr_listeners = i;
+           cancel_bridge_threads(bridge);
+           return -1;
+        }
+        continue;
+     }
+
+     s = pthread_create(&listener->tid, NULL, &nio_listener, listener);
+     if (s != 0) {
+        errno = s;
+        perror("create_bridge_threads: pthread_create");
+        bridge->nr_listeners = i;
+        cancel_bridge_threads(bridge);
+        return -1;
+     }
+  }
+  return 0;
+}
+
+void cancel_bridge_threads(bridge_t *bridge)
+{
+  int i;
+
+  for (i = 0; i < bridge->nr_listeners; i++) {
+     if (nr_workers > 0) {
+        worker_pool_remove_listener(&bridge->listeners[i]);
+        continue;
+     }
+     pthread_cancel(bridge->listeners[i].tid);
+     pthread_join(bridge->listeners[i].tid, NULL);
+  }
+  /* the delayed packets refer to the listeners */
+  delay_queue_free(bridge->delay_queue);
+  bridge->delay_queue = NULL;
+  free(bridge->listeners);
+  bridge->listeners = NULL;
+  bridge->nr_listeners = 0;
 }
 
 static void free_bridges(bridge_t *bridge)
@@ -165,14 +544,12 @@ static void free_bridges(bridge_t *bridge)
   while (bridge != NULL) {
     if (bridge->name)
        free(bridge->name);
-    pthread_cancel(bridge->source_tid);
-    pthread_join(bridge->source_tid, NULL);
-    pthread_cancel(bridge->destination_tid);
-    pthread_join(bridge->destination_tid, NULL);
+    cancel_bridge_threads(bridge);
     free_nio(bridge->source_nio);
     free_nio(bridge->destination_nio);
     free_pcap_capture(bridge->capture);
-    free_packet_filters(bridge->packet_filters);
+    free_pcap_capture(bridge->recorder);
+    reset_packet_filters(&bridge->packet_filters, &bridge->filter_chain);
     next = bridge->next;
     free(bridge);
     bridge = next;
@@ -200,11 +577,14 @@ static void free_iol_bridges(iol_bridge_t *bridge)
         if (bridge->port_table[i].destination_nio != NULL) {
            pthread_cancel(bridge->port_table[i].tid);
            pthread_join(bridge->port_table[i].tid, NULL);
+           delay_queue_flush(bridge->nio_delay_queue, &bridge->port_table[i]);
            free_pcap_capture(bridge->port_table[i].capture);
-           free_packet_filters(bridge->port_table[i].packet_filters);
+           reset_packet_filters(&bridge->port_table[i].packet_filters, &bridge->port_table[i].filter_chain);
            free_nio(bridge->port_table[i].destination_nio);
         }
     }
+    delay_queue_free(bridge->iol_delay_queue);
+    delay_queue_free(bridge->nio_delay_queue);
     free(bridge->port_table);
     next = bridge->next;
     free(bridge);
@@ -215,15 +595,9 @@ static void free_iol_bridges(iol_bridge_t *bridge)
 
 static void create_threads(bridge_t *bridge)
 {
-    int s;
-
     while (bridge != NULL) {
-       s = pthread_create(&(bridge->source_tid), NULL, &source_nio_listener, bridge);
-       if (s != 0)
-         handle_error_en(s, "pthread_create");
-       s = pthread_create(&(bridge->destination_tid), NULL, &destination_nio_listener, bridge);
-       if (s != 0)
-         handle_error_en(s, "pthread_create");
+       if (create_bridge_threads(bridge) == -1)
+         exit(EXIT_FAILURE);
        bridge = bridge->next;
     }
 }
@@ -293,6 +667,8 @@ static void ubridge(char *hypervisor_ip_address, int hypervisor_tcp_port)
        sigaction(SIGINT, &act, NULL);
        sigaction(SIGPIPE, &act, NULL);
 
+      if (nr_workers > 0 && start_worker_pool(nr_workers) == -1)
+         exit(EXIT_FAILURE);
       run_hypervisor(hypervisor_ip_address, hypervisor_tcp_port);
       free_bridges(bridge_list);
 #ifdef __linux__
@@ -312,6 +688,10 @@ static void ubridge(char *hypervisor_ip_address, int hypervisor_tcp_port)
 #endif
       pthread_sigmask(SIG_BLOCK, &sigset, NULL);
 
+      /* the workers inherit the blocked signals */
+      if (nr_workers > 0 && start_worker_pool(nr_workers) == -1)
+         exit(EXIT_FAILURE);
+
       while (1) {
          if (!parse_config(config_file, &bridge_list))
             break;
@@ -364,9 +744,14 @@ static void print_usage(const char *program_name)
          "  -H [<ip_address>:]<tcp_port> : Run in hypervisor mode\n"
          "  -e                           : Display all available network devices and exit\n"
          "  -d <level>                   : Debug level\n"
+         "  -w <workers>                 : Forward packets with a pool of worker threads (Linux only)\n"
+         "  -u                           : Use io_uring for packet I/O when the kernel supports it (Linux only)\n"
+         "  -b <bytes>                   : Headroom reserved in front of packets in buffers (default: %d)\n"
+         "  -g                           : Back packet buffers with huge pages when available (Linux only)\n"
          "  -v                           : Print version and exit\n",
          program_name,
-         CONFIG_FILE);
+         CONFIG_FILE,
+         PACKET_POOL_DEFAULT_HEADROOM);
 }
 
 int main(int argc, char **argv)
@@ -380,7 +765,7 @@ int main(int argc, char **argv)
   setvbuf(stdout, NULL, _IOLBF, 0);
   setvbuf(stderr, NULL, _IOLBF, 0);
 
-  while ((opt = getopt(argc, argv, "hved:f:H:")) != -1) {
+  while ((opt = getopt(argc, argv, "hved:f:H:w:ub:g")) != -1) {
     switch (opt) {
       case 'H':
         hypervisor_mode = 1;
@@ -414,12 +799,34 @@ int main(int argc, char **argv)
         break;
 	  case 'f':
         config_file = optarg;
+        break;
+	  case 'w':
+        nr_workers = atoi(optarg);
+        if (nr_workers < 1 || nr_workers > WORKER_POOL_MAX_WORKERS) {
+           fprintf(stderr, "Number of workers must be between 1 and %d\n", WORKER_POOL_MAX_WORKERS);
+           exit(EXIT_FAILURE);
+        }
+        break;
+	  case 'u':
+        use_io_uring = TRUE;
+        break;
+	  case 'b':
+        packet_pool_headroom = atoi(optarg);
+        if (packet_pool_headroom < NIO_PKT_HEADROOM || packet_pool_headroom > PACKET_POOL_MAX_HEADROOM) {
+           fprintf(stderr, "Packet headroom must be between %d and %d bytes\n", NIO_PKT_HEADROOM, PACKET_POOL_MAX_HEADROOM);
+           exit(EXIT_FAILURE);
+        }
+        break;
+	  case 'g':
+        packet_pool_hugepages = TRUE;
         break;
       default:
         exit(EXIT_FAILURE);
 	}
   }
   printf("uBridge version %s running with %s\n", VERSION, pcap_lib_version());
+  if (use_io_uring)
+     nio_uring_init();
   ubridge(hypervisor_ip_address, hypervisor_tcp_port);
   return (EXIT_SUCCESS);
 }
@@ -34,6 +34,7 @@
 
 #include "nio.h"
 #include "packet_filter.h"
+#include "packet_pool.h"
 
 #define NAME          "ubridge"
 #define VERSION       "0.9.19"
@@ -53,21 +54,48 @@
 #define perror(msg) \
         do { int en = errno; perror(msg); errno = en; } while (0)
 
+typedef struct pcap_capture pcap_capture_t;
+
+/* Packet buffers a listener receives its bursts in */
 typedef struct {
-    pcap_t *fd;
-    pcap_dumper_t *dumper;
-    pthread_mutex_t lock;
-} pcap_capture_t;
+  packet_buf_t *pkts[NIO_MAX_BATCH];
+  packet_buf_t *segs[NIO_MAX_BATCH];    /* segments of super-frames, only when segmenting */
+} burst_buffer_t;
+
+/* Listener bridging one queue of a NIO to the other NIO, in its own thread or in a worker */
+typedef struct nio_listener {
+  struct bridge *bridge;
+  nio_t *rx_nio;
+  nio_t *tx_nio;
+  int queue;
+  pthread_t tid;
+  struct nio_uring *uring;    /* io_uring of the listener thread, NULL if not used */
+
+  /* worker pool */
+  struct worker *worker;
+  struct worker *migrate_to;
+  int removing;
+  u_long packets;
+  u_long last_packets;
+  u_long rate;
+  struct nio_listener *next;
+  struct nio_listener *ready_next;  /* next listener with frames left to forward */
+  int ready;
+  u_int serviced;                   /* last round of its worker it was serviced in */
+} nio_listener_t;
 
 typedef struct bridge {
   char *name;
   int running;
-  pthread_t source_tid;
-  pthread_t destination_tid;
+  nio_listener_t *listeners;
+  int nr_listeners;
   nio_t *source_nio;
   nio_t *destination_nio;
   pcap_capture_t *capture;
+  pcap_capture_t *recorder;           /* flight recorder, frames are kept in memory until dumped */
   packet_filter_t *packet_filters;
+  packet_filter_chain_t *filter_chain;  /* snapshot of the filters read by the bridge threads */
+  struct delay_queue *delay_queue;    /* packets held by a delay filter */
   struct bridge *next;
 } bridge_t;
 
@@ -76,7 +104,11 @@ extern pthread_mutex_t global_lock;
 extern int debug_level;
 
 void ubridge_reset();
-void *source_nio_listener(void *data);
-void *destination_nio_listener(void *data);
+burst_buffer_t *alloc_burst_buffer(int with_segments);
+void free_burst_buffer(void *data);
+int bridge_burst(nio_listener_t *listener, burst_buffer_t *buffer, int with_segments);
+void *nio_listener(void *data);
+int create_bridge_threads(bridge_t *bridge);
+void cancel_bridge_threads(bridge_t *bridge);
 
 #endif /* !UBRIDGE_H_ */
@@ -0,0 +1,413 @@
+/*
+ *   This file is part of ubridge, a program to bridge network interfaces
+ *   to UDP tunnels.
+ *
+ *   Copyright (C) 2026 GNS3 Technologies Inc.
+ *
+ *   ubridge is free software: you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ubridge is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#include "ubridge.h"
+#include "worker_pool.h"
+
+/* 0 means each listener runs in its own thread */
+int nr_workers = 0;
+
+#ifdef __linux__
+
+/* Bursts forwarded from one listener before the worker services the next one */
+#define WORKER_BURST_BUDGET      8
+#define WORKER_MAX_EVENTS        64
+
+/* How long a removal waits for the worker before signalling it again, in milliseconds */
+#define WORKER_REMOVE_RETRY      100
+
+/* Rebalance when the busiest worker forwards more than twice the packets of the idlest one */
+#define WORKER_BALANCE_INTERVAL  1
+#define WORKER_MIN_IMBALANCE     1000
+
+static worker_t *workers;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+static void unlink_listener(worker_t *worker, nio_listener_t *listener)
+{
+   nio_listener_t **l;
+
+   for (l = &worker->listeners; *l != NULL; l = &(*l)->next) {
+      if (*l == listener) {
+         *l = listener->next;
+         worker->nr_listeners--;
+         break;
+      }
+   }
+}
+
+static void link_listener(worker_t *worker, nio_listener_t *listener)
+{
+   listener->worker = worker;
+   listener->next = worker->listeners;
+   worker->listeners = listener;
+   worker->nr_listeners++;
+}
+
+static int watch_listener(worker_t *worker, nio_listener_t *listener)
+{
+   struct epoll_event event;
+
+   memset(&event, 0, sizeof(event));
+   event.events = EPOLLIN;
+   event.data.ptr = listener;
+   return (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, nio_get_fd(listener->rx_nio->queues[listener->queue]), &event));
+}
+
+static void unwatch_listener(worker_t *worker, nio_listener_t *listener)
+{
+   epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, nio_get_fd(listener->rx_nio->queues[listener->queue]), NULL);
+}
+
+/* Take a listener off the ready list of its worker */
+static void unready_listener(worker_t *worker, nio_listener_t *listener)
+{
+   nio_listener_t **l;
+
+   if (!listener->ready)
+      return;
+   for (l = &worker->ready; *l != NULL; l = &(*l)->ready_next) {
+      if (*l == listener) {
+         *l = listener->ready_next;
+         listener->ready = FALSE;
+         break;
+      }
+   }
+}
+
+static void notify_worker(worker_t *worker)
+{
+   uint64_t value = 1;
+
+   __atomic_store_n(&worker->pending, TRUE, __ATOMIC_RELEASE);
+   if (write(worker->event_fd, &value, sizeof(value)) == -1)
+      perror("notify_worker: write");
+}
+
+/*
+ * Remove or migrate the listeners that were flagged while the worker was
+ * forwarding. This is done by the worker itself, so a listener is never
+ * serviced by two workers at once.
+ */
+static void process_pending_requests(worker_t *worker)
+{
+   nio_listener_t *listener, *next;
+   worker_t *target;
+
+   pthread_mutex_lock(&pool_lock);
+   worker->pending = FALSE;
+   for (listener = worker->listeners; listener != NULL; listener = next) {
+      next = listener->next;
+      if (listener->removing) {
+         unready_listener(worker, listener);
+         unwatch_listener(worker, listener);
+         unlink_listener(worker, listener);
+         listener->worker = NULL;
+      }
+      else if ((target = listener->migrate_to) != NULL) {
+         listener->migrate_to = NULL;
+         /* the frames left would wait for the next event on the other worker */
+         if (listener->ready)
+            continue;
+         unwatch_listener(worker, listener);
+         unlink_listener(worker, listener);
+         link_listener(target, listener);
+         if (watch_listener(target, listener) == -1)
+            perror("process_pending_requests: epoll_ctl");
+         worker->load -= listener->rate;
+         target->load += listener->rate;
+      }
+   }
+   pthread_cond_broadcast(&pool_cond);
+   pthread_mutex_unlock(&pool_lock);
+}
+
+/* Forward what is ready, within a budget so other listeners are not starved */
+static void service_listener(worker_t *worker, nio_listener_t *listener)
+{
+   int burst, res = 0;
+
+   if (listener->serviced == worker->round)
+      return;
+   listener->serviced = worker->round;
+
+   for (burst = 0; burst < WORKER_BURST_BUDGET; burst++) {
+      if ((res = bridge_burst(listener, worker->buffer, TRUE)) <= 0)
+         break;
+      __atomic_fetch_add(&listener->packets, res, __ATOMIC_RELAXED);
+   }
+   if (res == -1) {
+      fprintf(stderr, "Worker %d has stopped forwarding for %s because of an error: %s\n", worker->id, listener->bridge->name, strerror(errno));
+      exit(EXIT_FAILURE);
+   }
+
+   /* frames may be left in the NIO itself (UDP GRO), no event would announce them */
+   if (burst == WORKER_BURST_BUDGET && !listener->ready) {
+      listener->ready = TRUE;
+      listener->ready_next = worker->ready;
+      worker->ready = listener;
+   }
+}
+
+static void *worker_thread(void *data)
+{
+   worker_t *worker = data;
+   struct epoll_event events[WORKER_MAX_EVENTS];
+   nio_listener_t *listener, *next;
+   uint64_t value;
+   int i, nfds;
+
+   while (1) {
+      /* don't sleep while listeners have frames left */
+      if ((nfds = epoll_wait(worker->epoll_fd, events, WORKER_MAX_EVENTS, worker->ready ? 0 : -1)) == -1) {
+         if (errno == EINTR)
+            continue;
+         perror("worker_thread: epoll_wait");
+         exit(EXIT_FAILURE);
+      }
+
+      worker->round++;
+      listener = worker->ready;
+      worker->ready = NULL;
+      for (; listener != NULL; listener = next) {
+         next = listener->ready_next;
+         listener->ready = FALSE;
+         service_listener(worker, listener);
+      }
+
+      for (i = 0; i < nfds; i++) {
+         if ((listener = events[i].data.ptr) == NULL) {
+            if (read(worker->event_fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+               perror("worker_thread: read");
+            continue;
+         }
+         service_listener(worker, listener);
+      }
+
+      if (__atomic_load_n(&worker->pending, __ATOMIC_ACQUIRE))
+         process_pending_requests(worker);
+   }
+   return NULL;
+}
+
+/* Periodically move a listener from the busiest worker to the idlest one */
+static void *balancer_thread(void *data)
+{
+   worker_t *busiest, *idlest;
+   nio_listener_t *listener, *candidate;
+   u_long packets, gap;
+   int i;
+
+   while (1) {
+      sleep(WORKER_BALANCE_INTERVAL);
+
+      pthread_mutex_lock(&pool_lock);
+      busiest = idlest = &workers[0];
+      for (i = 0; i < nr_workers; i++) {
+         workers[i].load = 0;
+         for (listener = workers[i].listeners; listener != NULL; listener = listener->next) {
+            packets = __atomic_load_n(&listener->packets, __ATOMIC_RELAXED);
+            listener->rate = (packets - listener->last_packets) / WORKER_BALANCE_INTERVAL;
+            listener->last_packets = packets;
+            workers[i].load += listener->rate;
+         }
+         if (workers[i].load > busiest->load)
+            busiest = &workers[i];
+         if (workers[i].load < idlest->load)
+            idlest = &workers[i];
+      }
+
+      if (busiest->nr_listeners >= 2 && !busiest->pending && busiest->load > 2 * idlest->load + WORKER_MIN_IMBALANCE) {
+         /* the busiest listener that does not simply move the imbalance to the idlest worker */
+         gap = busiest->load - idlest->load;
+         candidate = NULL;
+         for (listener = busiest->listeners; listener != NULL; listener = listener->next) {
+            if (listener->removing || listener->rate == 0 || listener->rate > gap / 2)
+               continue;
+            if (candidate == NULL || listener->rate > candidate->rate)
+               candidate = listener;
+         }
+         if (candidate) {
+            if (debug_level > 0)
+               printf("Moving a listener of %s from worker %d to worker %d\n", candidate->bridge->name, busiest->id, idlest->id);
+            candidate->migrate_to = idlest;
+            notify_worker(busiest);
+         }
+      }
+      pthread_mutex_unlock(&pool_lock);
+   }
+   return NULL;
+}
+
+/* Start the worker threads and the thread balancing the listeners between them */
+int start_worker_pool(int workers_count)
+{
+   struct epoll_event event;
+   pthread_t balancer_tid;
+   worker_t *worker;
+   int i, s;
+
+   if (!(workers = calloc(workers_count, sizeof(worker_t)))) {
+      fprintf(stderr, "start_worker_pool: insufficient memory\n");
+      return -1;
+   }
+
+   for (i = 0; i < workers_count; i++) {
+      worker = &workers[i];
+      worker->id = i;
+      if (!(worker->buffer = alloc_burst_buffer(TRUE))) {
+         fprintf(stderr, "start_worker_pool: insufficient memory\n");
+         return -1;
+      }
+      if ((worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+         perror("start_worker_pool: epoll_create1");
+         return -1;
+      }
+      if ((worker->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+         perror("start_worker_pool: eventfd");
+         return -1;
+      }
+      memset(&event, 0, sizeof(event));
+      event.events = EPOLLIN;
+      event.data.ptr = NULL;
+      if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->event_fd, &event) == -1) {
+         perror("start_worker_pool: epoll_ctl");
+         return -1;
+      }
+      if ((s = pthread_create(&worker->tid, NULL, &worker_thread, worker)) != 0) {
+         errno = s;
+         perror("start_worker_pool: pthread_create");
+         return -1;
+      }
+   }
+   nr_workers = workers_count;
+
+   if (nr_workers > 1 && (s = pthread_create(&balancer_tid, NULL, &balancer_thread, NULL)) != 0) {
+      errno = s;
+      perror("start_worker_pool: pthread_create");
+      return -1;
+   }
+   printf("Started %d worker threads\n", nr_workers);
+   return 0;
+}
+
+/* Give a listener to the least loaded worker */
+int worker_pool_add_listener(nio_listener_t *listener)
+{
+   nio_t *rx_queue = listener->rx_nio->queues[listener->queue];
+   worker_t *worker;
+   int i;
+
+   if (nio_get_fd(rx_queue) == -1) {
+      fprintf(stderr, "worker_pool_add_listener: %s cannot be serviced by a worker\n", rx_queue->desc ? rx_queue->desc : "NIO");
+      return -1;
+   }
+   if (nio_set_nonblock(rx_queue) == -1) {
+      fprintf(stderr, "worker_pool_add_listener: cannot set %s in non-blocking mode\n", rx_queue->desc ? rx_queue->desc : "NIO");
+      return -1;
+   }
+
+   pthread_mutex_lock(&pool_lock);
+   worker = &workers[0];
+   for (i = 1; i < nr_workers; i++) {
+      if (workers[i].load < worker->load || (workers[i].load == worker->load && workers[i].nr_listeners < worker->nr_listeners))
+         worker = &workers[i];
+   }
+
+   listener->migrate_to = NULL;
+   listener->removing = FALSE;
+   listener->ready = FALSE;
+   listener->serviced = 0;
+   listener->packets = listener->last_packets = listener->rate = 0;
+   link_listener(worker, listener);
+   if (watch_listener(worker, listener) == -1) {
+      perror("worker_pool_add_listener: epoll_ctl");
+      unlink_listener(worker, listener);
+      listener->worker = NULL;
+      pthread_mutex_unlock(&pool_lock);
+      return -1;
+   }
+   pthread_mutex_unlock(&pool_lock);
+   return 0;
+}
+
+/*
+ * Take a listener away from its worker, waits until the worker has let it
+ * go. Workers never block on a NIO, so this takes at most a few bursts; the
+ * worker is signalled again in case it missed the request.
+ */
+void worker_pool_remove_listener(nio_listener_t *listener)
+{
+   struct timespec deadline;
+   int retries = 0;
+
+   pthread_mutex_lock(&pool_lock);
+   if (listener->worker != NULL) {
+      listener->removing = TRUE;
+      notify_worker(listener->worker);
+      while (listener->worker != NULL) {
+         clock_gettime(CLOCK_REALTIME, &deadline);
+         deadline.tv_nsec += WORKER_REMOVE_RETRY * 1000000L;
+         if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+         }
+         if (pthread_cond_timedwait(&pool_cond, &pool_lock, &deadline) != ETIMEDOUT || listener->worker == NULL)
+            continue;
+         if (++retries == 1000 / WORKER_REMOVE_RETRY)
+            fprintf(stderr, "worker_pool_remove_listener: worker %d is slow to release a listener of %s\n", listener->worker->id, listener->bridge->name);
+         notify_worker(listener->worker);
+      }
+   }
+   pthread_mutex_unlock(&pool_lock);
+}
+
+#else
+
+int start_worker_pool(int workers_count)
+{
+   fprintf(stderr, "start_worker_pool: worker threads are only supported on Linux\n");
+   return -1;
+}
+
+int worker_pool_add_listener(nio_listener_t *listener)
+{
+   return -1;
+}
+
+void worker_pool_remove_listener(nio_listener_t *listener)
+{
+}
+
+#endif
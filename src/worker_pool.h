@@ -0,0 +1,50 @@
+/*
+ *   This file is part of ubridge, a program to bridge network interfaces
+ *   to UDP tunnels.
+ *
+ *   Copyright (C) 2026 GNS3 Technologies Inc.
+ *
+ *   ubridge is free software: you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ubridge is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WORKER_POOL_H_
+#define WORKER_POOL_H_
+
+#include <pthread.h>
+
+#include "ubridge.h"
+
+#define WORKER_POOL_MAX_WORKERS  64
+
+typedef struct worker {
+    int id;
+    pthread_t tid;
+    int epoll_fd;
+    int event_fd;         /* wakes the worker up to process pending requests */
+    int pending;
+    burst_buffer_t *buffer;
+    nio_listener_t *listeners;
+    int nr_listeners;
+    nio_listener_t *ready;  /* listeners whose budget ran out, serviced again without waiting */
+    u_int round;
+    u_long load;          /* packets per second forwarded by the worker */
+} worker_t;
+
+extern int nr_workers;
+
+int start_worker_pool(int workers);
+int worker_pool_add_listener(nio_listener_t *listener);
+void worker_pool_remove_listener(nio_listener_t *listener);
+
+#endif /* !WORKER_POOL_H_ */
@@ -0,0 +1,333 @@
+/*
+ *   This file is part of ubridge, a program to bridge network interfaces
+ *   to UDP tunnels.
+ *
+ *   Copyright (C) 2026 GNS3 Technologies Inc.
+ *
+ *   ubridge is free software: you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   ubridge is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Differential test of the BPF translator: random programs and compiled
+ * filter expressions run over random frames both as native code and with
+ * pcap_offline_filter(), and must give the same verdict on every frame.
+ *
+ * Usage: bpf_jit_check [seed [programs]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/bpf_jit.h"
+#include "../src/prng.h"
+
+/* Not defined by older libpcap versions */
+#ifndef BPF_MOD
+#define BPF_MOD   0x90
+#endif
+#ifndef BPF_XOR
+#define BPF_XOR   0xa0
+#endif
+
+#define CHECK_PROGRAMS       20000    /* random programs */
+#define CHECK_PROGRAM_FRAMES 64       /* frames each random program runs over */
+#define CHECK_FILTER_FRAMES  20000    /* frames each expression runs over */
+#define CHECK_MAX_INSNS      48       /* instructions of a random program, after the scratch memory setup */
+#define CHECK_FRAME_SIZE     256
+
+#ifdef BPF_JIT_SUPPORTED
+
+/* Ethernet frames the random frames are made of, before truncations and mutations */
+static const u_char sample_frames[][78] = {
+   /* IPv4 TCP SYN */
+   { 0x00,0x50,0x79,0x66,0x68,0x00, 0x00,0x50,0x79,0x66,0x68,0x01, 0x08,0x00,
+     0x45,0x00,0x00,0x3c,0x1c,0x46,0x40,0x00,0x40,0x06,0x00,0x00, 10,0,0,1, 10,0,0,2,
+     0xc3,0x50,0x00,0x50,0x00,0x00,0x00,0x01,0x00,0x00,0x00,0x00,0xa0,0x02,0x72,0x10,0x00,0x00,0x00,0x00,
+     0x02,0x04,0x05,0xb4,0x04,0x02,0x08,0x0a,0x00,0x00,0x00,0x01,0x00,0x00,0x00,0x00,0x01,0x03,0x03,0x07 },
+   /* IPv4 UDP DNS */
+   { 0xff,0xff,0xff,0xff,0xff,0xff, 0x00,0x50,0x79,0x66,0x68,0x02, 0x08,0x00,
+     0x45,0x00,0x00,0x40,0x00,0x00,0x20,0x00,0x40,0x11,0x00,0x00, 192,168,1,1, 8,8,8,8,
+     0xd4,0x31,0x00,0x35,0x00,0x2c,0x00,0x00, 0x12,0x34,0x01,0x00,0x00,0x01 },
+   /* IPv4 ICMP echo request, second fragment of options */
+   { 0x00,0x50,0x79,0x66,0x68,0x01, 0x00,0x50,0x79,0x66,0x68,0x00, 0x08,0x00,
+     0x46,0x00,0x00,0x54,0xab,0xcd,0x00,0x00,0x40,0x01,0x00,0x00, 10,0,0,2, 10,0,0,1, 0x01,0x01,0x01,0x00,
+     0x08,0x00,0xf7,0xff,0x00,0x01,0x00,0x01 },
+   /* IPv6 TCP */
+   { 0x33,0x33,0x00,0x00,0x00,0x01, 0x00,0x50,0x79,0x66,0x68,0x03, 0x86,0xdd,
+     0x60,0x00,0x00,0x00,0x00,0x14,0x06,0x40, 0xfe,0x80,0,0,0,0,0,0,0,0,0,0,0,0,0,1, 0xfe,0x80,0,0,0,0,0,0,0,0,0,0,0,0,0,2,
+     0x00,0x16,0xd4,0x31,0x00,0x00,0x00,0x01 },
+   /* ARP request */
+   { 0xff,0xff,0xff,0xff,0xff,0xff, 0x00,0x50,0x79,0x66,0x68,0x00, 0x08,0x06,
+     0x00,0x01,0x08,0x00,0x06,0x04,0x00,0x01, 0x00,0x50,0x79,0x66,0x68,0x00, 10,0,0,1, 0,0,0,0,0,0, 10,0,0,2 },
+   /* 802.1Q IPv4 UDP */
+   { 0x00,0x50,0x79,0x66,0x68,0x00, 0x00,0x50,0x79,0x66,0x68,0x01, 0x81,0x00,0x00,0x64, 0x08,0x00,
+     0x45,0x00,0x00,0x1c,0x00,0x00,0x00,0x00,0x40,0x11,0x00,0x00, 10,0,100,1, 10,0,100,2,
+     0x00,0x35,0xd4,0x31,0x00,0x08,0x00,0x00 },
+};
+
+#define NR_SAMPLE_FRAMES   (sizeof(sample_frames) / sizeof(sample_frames[0]))
+
+/* Expressions compiled by libpcap, covering the addressing modes its code generator uses */
+static const char *check_filters[] = {
+   "ip", "ip6", "arp", "tcp", "udp", "icmp",
+   "tcp port 80", "udp port 53", "ip6 and tcp port 22", "portrange 1-1024",
+   "host 10.0.0.1", "net 192.168.0.0/16", "ether broadcast", "ether host 00:50:79:66:68:00",
+   "vlan 100", "vlan and udp", "len > 64", "ip[2:2] > 60", "ip[6:2] & 0x1fff != 0",
+   "tcp[tcpflags] & tcp-syn != 0", "icmp[icmptype] == 8",
+   "tcp[((tcp[12:1] & 0xf0) >> 2):4] = 0x47455420",
+};
+
+/* Opcodes of the random programs, every one the translator handles */
+static const u_short check_opcodes[] = {
+   BPF_LD|BPF_W|BPF_ABS, BPF_LD|BPF_H|BPF_ABS, BPF_LD|BPF_B|BPF_ABS,
+   BPF_LD|BPF_W|BPF_IND, BPF_LD|BPF_H|BPF_IND, BPF_LD|BPF_B|BPF_IND,
+   BPF_LD|BPF_W|BPF_LEN, BPF_LD|BPF_IMM, BPF_LD|BPF_MEM,
+   BPF_LDX|BPF_W|BPF_IMM, BPF_LDX|BPF_W|BPF_LEN, BPF_LDX|BPF_W|BPF_MEM, BPF_LDX|BPF_MSH|BPF_B,
+   BPF_ST, BPF_STX,
+   BPF_ALU|BPF_ADD|BPF_K, BPF_ALU|BPF_SUB|BPF_K, BPF_ALU|BPF_MUL|BPF_K, BPF_ALU|BPF_DIV|BPF_K,
+   BPF_ALU|BPF_MOD|BPF_K, BPF_ALU|BPF_OR|BPF_K, BPF_ALU|BPF_AND|BPF_K, BPF_ALU|BPF_XOR|BPF_K,
+   BPF_ALU|BPF_LSH|BPF_K, BPF_ALU|BPF_RSH|BPF_K,
+   BPF_ALU|BPF_ADD|BPF_X, BPF_ALU|BPF_SUB|BPF_X, BPF_ALU|BPF_MUL|BPF_X, BPF_ALU|BPF_DIV|BPF_X,
+   BPF_ALU|BPF_MOD|BPF_X, BPF_ALU|BPF_OR|BPF_X, BPF_ALU|BPF_AND|BPF_X, BPF_ALU|BPF_XOR|BPF_X,
+   BPF_ALU|BPF_LSH|BPF_X, BPF_ALU|BPF_RSH|BPF_X, BPF_ALU|BPF_NEG,
+   BPF_JMP|BPF_JA,
+   BPF_JMP|BPF_JEQ|BPF_K, BPF_JMP|BPF_JGT|BPF_K, BPF_JMP|BPF_JGE|BPF_K, BPF_JMP|BPF_JSET|BPF_K,
+   BPF_JMP|BPF_JEQ|BPF_X, BPF_JMP|BPF_JGT|BPF_X, BPF_JMP|BPF_JGE|BPF_X, BPF_JMP|BPF_JSET|BPF_X,
+   BPF_RET|BPF_K, BPF_RET|BPF_A,
+   BPF_MISC|BPF_TAX, BPF_MISC|BPF_TXA,
+};
+
+#define NR_CHECK_OPCODES   (sizeof(check_opcodes) / sizeof(check_opcodes[0]))
+
+/* Offset of a packet load: in the headers, around the end of the frame, or wrapping around */
+static u_int random_offset(prng_t *prng)
+{
+   switch (prng_below(prng, 4)) {
+      case 0:
+         return (prng_below(prng, 64));
+      case 1:
+         return (prng_below(prng, CHECK_FRAME_SIZE + 8));
+      case 2:
+         return (-prng_below(prng, 8) - 1);
+      default:
+         return (prng_next(prng));
+   }
+}
+
+/* Constant of an ALU operation or a comparison */
+static u_int random_value(prng_t *prng)
+{
+   switch (prng_below(prng, 4)) {
+      case 0:
+         return (prng_below(prng, 16));
+      case 1:
+         return (prng_below(prng, 256));
+      case 2:
+         return (prng_below(prng, 2) ? 0x0800 : 0x86dd);
+      default:
+         return (prng_next(prng));
+   }
+}
+
+static void random_insn(prng_t *prng, struct bpf_insn *insn, u_int max_jump)
+{
+   memset(insn, 0, sizeof(*insn));
+   insn->code = check_opcodes[prng_below(prng, NR_CHECK_OPCODES)];
+
+   switch (BPF_CLASS(insn->code)) {
+      case BPF_LD:
+      case BPF_LDX:
+         if (BPF_MODE(insn->code) == BPF_MEM)
+            insn->k = prng_below(prng, BPF_MEMWORDS);
+         else if (BPF_MODE(insn->code) == BPF_IMM)
+            insn->k = random_value(prng);
+         else
+            insn->k = random_offset(prng);
+         break;
+      case BPF_ST:
+      case BPF_STX:
+         insn->k = prng_below(prng, BPF_MEMWORDS);
+         break;
+      case BPF_ALU:
+         if (BPF_OP(insn->code) == BPF_LSH || BPF_OP(insn->code) == BPF_RSH)
+            insn->k = prng_below(prng, 32);
+         else if (BPF_OP(insn->code) == BPF_DIV || BPF_OP(insn->code) == BPF_MOD)
+            insn->k = random_value(prng) | 1;
+         else
+            insn->k = random_value(prng);
+         break;
+      case BPF_JMP:
+         if (BPF_OP(insn->code) == BPF_JA)
+            insn->k = prng_below(prng, max_jump + 1);
+         else {
+            insn->k = random_value(prng);
+            insn->jt = prng_below(prng, max_jump + 1);
+            insn->jf = prng_below(prng, max_jump + 1);
+         }
+         break;
+      case BPF_RET:
+         insn->k = random_value(prng);
+         break;
+   }
+}
+
+/* Random program, it ends with "ret a" and its jumps stay in the program */
+static u_int random_program(prng_t *prng, struct bpf_insn *insns)
+{
+   u_int len, i;
+
+   /* the scratch memory isn't cleared by pcap_offline_filter() */
+   for (i = 0; i < BPF_MEMWORDS; i++) {
+      memset(&insns[2 * i], 0, 2 * sizeof(*insns));
+      insns[2 * i].code = BPF_LD|BPF_IMM;
+      insns[2 * i].k = random_value(prng);
+      insns[2 * i + 1].code = BPF_ST;
+      insns[2 * i + 1].k = i;
+   }
+
+   len = 2 * BPF_MEMWORDS + 1 + prng_below(prng, CHECK_MAX_INSNS) + 1;
+   for (i = 2 * BPF_MEMWORDS; i < len - 1; i++)
+      random_insn(prng, &insns[i], len - i - 2);
+   memset(&insns[len - 1], 0, sizeof(*insns));
+   insns[len - 1].code = BPF_RET|BPF_A;
+   return (len);
+}
+
+/* Random frame: a sample one with a few bytes changed, truncated or padded, or only random bytes */
+static u_int random_frame(prng_t *prng, u_char *pkt)
+{
+   u_int len, i, n;
+
+   n = prng_below(prng, NR_SAMPLE_FRAMES + 1);
+   if (n == NR_SAMPLE_FRAMES) {
+      len = prng_below(prng, CHECK_FRAME_SIZE + 1);
+      for (i = 0; i < len; i++)
+         pkt[i] = prng_next(prng);
+      return (len);
+   }
+
+   memset(pkt, 0, CHECK_FRAME_SIZE);
+   memcpy(pkt, sample_frames[n], sizeof(sample_frames[n]));
+   for (i = prng_below(prng, 4); i > 0; i--)
+      pkt[prng_below(prng, prng_below(prng, 2) ? 64 : CHECK_FRAME_SIZE)] = prng_next(prng);
+
+   switch (prng_below(prng, 4)) {
+      case 0:
+         return (prng_below(prng, sizeof(sample_frames[n]) + 1));
+      case 1:
+         return (prng_below(prng, CHECK_FRAME_SIZE + 1));
+      default:
+         return (sizeof(sample_frames[n]));
+   }
+}
+
+/* Show the program in the format of tcpdump -ddd and the frame it failed on, if any */
+static void dump_failure(const struct bpf_program *fp, const u_char *pkt, u_int len)
+{
+   u_int i;
+
+   fprintf(stderr, "program: %u", fp->bf_len);
+   for (i = 0; i < fp->bf_len; i++)
+      fprintf(stderr, ",%u %u %u %u", fp->bf_insns[i].code, fp->bf_insns[i].jt, fp->bf_insns[i].jf, fp->bf_insns[i].k);
+   if (pkt == NULL) {
+      fprintf(stderr, "\n");
+      return;
+   }
+   fprintf(stderr, "\nframe (%u bytes):", len);
+   for (i = 0; i < len; i++)
+      fprintf(stderr, "%s%02x", i % 16 ? " " : "\n  ", pkt[i]);
+   fprintf(stderr, "\n");
+}
+
+/* Run a program over random frames, returns -1 on the first verdict that differs */
+static int check_program(prng_t *prng, const struct bpf_program *fp, const char *name, int nr_frames)
+{
+   u_char pkt[CHECK_FRAME_SIZE];
+   struct pcap_pkthdr pkthdr;
+   u_int expected, verdict;
+   bpf_jit_t *jit;
+   int i;
+
+   if ((jit = bpf_jit_compile(fp)) == NULL) {
+      fprintf(stderr, "%s: not translated\n", name);
+      dump_failure(fp, NULL, 0);
+      return (-1);
+   }
+
+   memset(&pkthdr, 0, sizeof(pkthdr));
+   for (i = 0; i < nr_frames; i++) {
+      pkthdr.caplen = pkthdr.len = random_frame(prng, pkt);
+      expected = pcap_offline_filter(fp, &pkthdr, pkt);
+      verdict = jit->func(pkt, pkthdr.caplen);
+      if (verdict != expected) {
+         fprintf(stderr, "%s: native code returns %u, libpcap returns %u\n", name, verdict, expected);
+         dump_failure(fp, pkt, pkthdr.caplen);
+         bpf_jit_free(jit);
+         return (-1);
+      }
+   }
+   bpf_jit_free(jit);
+   return (0);
+}
+
+int main(int argc, char *argv[])
+{
+   struct bpf_insn insns[2 * BPF_MEMWORDS + CHECK_MAX_INSNS + 2];
+   struct bpf_program fp;
+   char name[64];
+   pcap_t *pcap_dev;
+   int nr_programs, failures = 0;
+   u_int i;
+   prng_t prng;
+
+   if (prng_init(&prng, argc > 1 ? argv[1] : "1") == -1)
+      return (EXIT_FAILURE);
+   nr_programs = argc > 2 ? atoi(argv[2]) : CHECK_PROGRAMS;
+
+   for (i = 0; i < (u_int)nr_programs; i++) {
+      fp.bf_insns = insns;
+      fp.bf_len = random_program(&prng, insns);
+      snprintf(name, sizeof(name), "random program %u", i);
+      if (check_program(&prng, &fp, name, CHECK_PROGRAM_FRAMES) == -1)
+         failures++;
+   }
+
+   pcap_dev = pcap_open_dead(DLT_EN10MB, 65535);
+   for (i = 0; i < sizeof(check_filters) / sizeof(check_filters[0]); i++) {
+      if (pcap_compile(pcap_dev, &fp, check_filters[i], 1, PCAP_NETMASK_UNKNOWN) < 0) {
+         fprintf(stderr, "Cannot compile filter '%s': %s\n", check_filters[i], pcap_geterr(pcap_dev));
+         failures++;
+         continue;
+      }
+      if (check_program(&prng, &fp, check_filters[i], CHECK_FILTER_FRAMES) == -1)
+         failures++;
+      pcap_freecode(&fp);
+   }
+   pcap_close(pcap_dev);
+
+   printf("bpf_jit_check: %d random programs and %u filters, %d failed (seed %s)\n",
+          nr_programs, i, failures, argc > 1 ? argv[1] : "1");
+   return (failures ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+#else
+
+int main(int argc, char *argv[])
+{
+   printf("bpf_jit_check: BPF programs are not translated on this platform, skipped\n");
+   return (EXIT_SUCCESS);
+}
+
+#endif